@@ -23,35 +23,165 @@
 #include <ncurses.h>
 #include <mpg123.h>
 #include <portaudio.h>
+
+#if !defined(TW_NO_FFTW) && __has_include(<fftw3.h>)
+  #include <fftw3.h>
+  #define TW_HAVE_FFTW 1
+#else
+  #define TW_HAVE_FFTW 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define TW_HAVE_NEON 1
+#else
+  #define TW_HAVE_NEON 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+  #define TW_HAVE_SSE2 1
+#else
+  #define TW_HAVE_SSE2 0
+#endif
+
+// The track caches are mmap'd files shared between instances.
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+// POSIX shared memory for the analysis tap; Android's libc has no shm_open.
+#if !defined(__ANDROID__)
+  #define TW_HAVE_SHM 1
+#else
+  #define TW_HAVE_SHM 0
+#endif
 #include <unistd.h>
 #include <cstdio>
 #include <cmath>
 #include <csignal>
-#include <fftw3.h>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
 #include <chrono>
+#include <new>
+#include <cstring>
+#include <cctype>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <type_traits>
+#include <random>
+#include <queue>
+#include <complex>
+#include <clocale>
+#include <ctime>
+#include <langinfo.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 
 #define BUFFER_SIZE 8192
 #define FRAMES_PER_BUFFER 512
 #define FFT_SIZE 1024
-
-enum VisualizationMode { WAVEFORM = 1, SPECTRUM = 2 };
+#define CQT_FIRST_NOTE 36   // piano roll starts at MIDI C2
+#define CQT_NOTES 72        // six octaves, one bin per semitone
+#define PATH_BUF_SIZE 4096
+
+enum VisualizationMode { WAVEFORM = 1, SPECTRUM = 2, SPECTROGRAM = 3, PIANO_ROLL = 4 };
+enum SpectrumBackend { BACKEND_FFTW = 1, BACKEND_FIXED = 2 };
+
+// Counts every C++ heap allocation in the process, and per thread. Cheap
+// enough to leave on; --check-alloc uses it to prove the steady-state
+// playback path allocates nothing.
+static std::atomic<unsigned long long> allocCount(0);
+static thread_local unsigned long long threadAllocCount = 0;
+static std::atomic<unsigned long long> engineAllocCount(0);   // play_file()'s thread, published once a block
+
+// The operators are kept out of line. Inlined, GCC sees malloc() at one end
+// and free() or operator delete at the other, and -Wmismatched-new-delete
+// fires at every new/delete pair in the program.
+__attribute__((noinline)) void* operator new(std::size_t n) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    threadAllocCount++;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void* operator new[](std::size_t n) { return operator new(n); }
+__attribute__((noinline)) void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    threadAllocCount++;
+    return std::malloc(n ? n : 1);
+}
+__attribute__((noinline)) void* operator new[](std::size_t n, const std::nothrow_t& t) noexcept { return operator new(n, t); }
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
 
 static int clampi(int v, int lo, int hi) { return (v < lo) ? lo : ((v > hi) ? hi : v); }
 
-static std::string ellipsize_middle(const std::string& s, int maxw) {
-    if (maxw <= 0) return "";
-    if ((int)s.size() <= maxw) return s;
-    if (maxw <= 3) return s.substr(0, maxw);
+// Integer log2 in Q16.16: exponent from the leading bit, mantissa from a
+// linear fit corrected by a 16-entry table of log2(1 + x) - x. Max error is
+// about 0.001.
+static inline uint32_t ilog2_q16(uint32_t v) {
+    static const uint16_t corr[17] = { 0, 1636, 2944, 3960, 4714, 5231, 5533, 5640, 5568, 5332,
+                                       4944, 4416, 3759, 2981, 2090, 1094, 0 };
+    if (v == 0) return 0;
+    int e = 31 - __builtin_clz(v);
+    uint32_t m = (e >= 16) ? (v >> (e - 16)) : (v << (16 - e));  // 1.16
+    uint32_t frac = m & 0xFFFF;
+    uint32_t idx = frac >> 12, w = frac & 0xFFF;
+    uint32_t c = (corr[idx] * (4096 - w) + corr[idx + 1] * w) >> 12;
+    return ((uint32_t)e << 16) + frac + c;
+}
+
+// Buffer variants of the ellipsize helpers: the UI draws every frame, so they
+// write into caller-owned storage instead of building temporary strings.
+// Both return the number of bytes written (excluding the terminator).
+static int ellipsize_middle_buf(char* out, size_t cap, const char* s, int len, int maxw) {
+    if (!out || cap == 0) return 0;
+    maxw = std::min(maxw, (int)cap - 1);
+    if (maxw <= 0) { out[0] = '\0'; return 0; }
+    if (len <= maxw) {
+        std::memcpy(out, s, (size_t)len);
+        out[len] = '\0';
+        return len;
+    }
+    if (maxw <= 3) {
+        std::memcpy(out, s, (size_t)maxw);
+        out[maxw] = '\0';
+        return maxw;
+    }
     int left = (maxw - 3) / 2;
     int right = maxw - 3 - left;
-    return s.substr(0, left) + "..." + s.substr((int)s.size() - right);
+    std::memcpy(out, s, (size_t)left);
+    std::memcpy(out + left, "...", 3);
+    std::memcpy(out + left + 3, s + len - right, (size_t)right);
+    out[maxw] = '\0';
+    return maxw;
 }
 
-static std::string ellipsize_end(const std::string& s, int maxw) {
-    if (maxw <= 0) return "";
-    if ((int)s.size() <= maxw) return s;
-    if (maxw <= 3) return s.substr(0, maxw);
-    return s.substr(0, maxw - 3) + "...";
+static int ellipsize_end_buf(char* out, size_t cap, const char* s, int len, int maxw) {
+    if (!out || cap == 0) return 0;
+    maxw = std::min(maxw, (int)cap - 1);
+    if (maxw <= 0) { out[0] = '\0'; return 0; }
+    if (len <= maxw) {
+        std::memcpy(out, s, (size_t)len);
+        out[len] = '\0';
+        return len;
+    }
+    int keep = (maxw <= 3) ? maxw : maxw - 3;
+    std::memcpy(out, s, (size_t)keep);
+    if (maxw > 3) std::memcpy(out + keep, "...", 3);
+    out[maxw] = '\0';
+    return maxw;
 }
 
 static void safe_waddnstr(WINDOW* w, int y, int x, const std::string& s, int n) {
@@ -60,46 +190,543 @@ static void safe_waddnstr(WINDOW* w, int y, int x, const std::string& s, int n)
 }
 
 std::atomic<bool> shouldQuit(false);
-std::atomic<bool> stopTrack(false);
 std::atomic<bool> isPlaying(false);
 std::atomic<bool> isPaused(false);
-std::atomic<int>  seekCommand(0);
 std::atomic<VisualizationMode> visMode(WAVEFORM);
+// Set by the UI when any visible pane needs magnitudes; the engine then runs
+// one FFT per block that every pane shares.
+std::atomic<bool> spectrumWanted(false);
+std::atomic<bool> notesWanted(false);
+std::atomic<SpectrumBackend> spectrumBackend(TW_HAVE_FFTW ? BACKEND_FFTW : BACKEND_FIXED);
+
+// Output volume in dB, from 0 down to VOLUME_MIN_DB. The engine's gain
+// stage applies it to everything written, previews included.
+#define VOLUME_STEP_DB 2
+#define VOLUME_MIN_DB -60
+std::atomic<int> volumeDb(0);
+
+// A queued track: a whole file, or a stretch of one cut by a CUE sheet or
+// chapter. Times are seconds into the file; endSec < 0 plays to the end.
+struct QueueItem {
+    std::string path;
+    std::string title;          // shown instead of the file name when set
+    double startSec = 0.0;
+    double endSec = -1.0;
+};
 
 std::mutex playlistMutex;
-std::deque<std::string> playlist;
+std::deque<QueueItem> playlist;
+// Bumped whenever the UI replaces or clears the queue, so the engine only
+// carries on into a queued virtual track the listener still wants.
+unsigned playlistEpoch = 0;
 std::condition_variable playlistCV;
+// Bumped by the engine, under playlistMutex, each time it takes an item to
+// play (or starts a preview on its own). Track-scoped commands name the
+// track they were sent to, so a stop reaches a track that is still opening
+// and never the one after it.
+std::atomic<unsigned> engineTrack(0);
+
+// UI -> audio engine control. Producers (UI thread, signal handler paths)
+// push typed, timestamped commands; the engine drains them at block
+// boundaries, and when it goes idle. Bounded MPSC ring in the style of
+// Vyukov's queue: each slot's sequence number tells producers whether it
+// is free and the consumer whether it is filled, so neither side takes a
+// lock.
+enum CommandType { CMD_TOGGLE_PAUSE = 1, CMD_SEEK = 2, CMD_STOP = 3, CMD_SET_DEVICE = 4, CMD_STOP_PREVIEW = 5 };
+
+struct Command {
+    CommandType type = CMD_STOP;
+    int arg = 0;
+    unsigned track = 0;    // engineTrack when sent
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+template <size_t N>
+class CommandQueue {
+    static_assert((N & (N - 1)) == 0, "CommandQueue size must be a power of two");
+
+public:
+    CommandQueue() {
+        for (size_t i = 0; i < N; i++) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const Command& c) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& s = slots_[pos & (N - 1)];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.cmd = c;
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-std::mutex pauseMutex;
-std::condition_variable pauseCV;
+    // Single consumer only.
+    bool pop(Command& out) {
+        Slot& s = slots_[tail_ & (N - 1)];
+        if (s.seq.load(std::memory_order_acquire) != tail_ + 1) return false;
+        out = s.cmd;
+        s.seq.store(tail_ + N, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+
+    bool empty() const {
+        return slots_[tail_ & (N - 1)].seq.load(std::memory_order_acquire) != tail_ + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        Command cmd;
+    };
+    Slot slots_[N];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) size_t tail_ = 0;
+};
+
+CommandQueue<256> commandQueue;
+std::mutex commandMutex;              // only pairs with commandCV for the paused wait
+std::condition_variable commandCV;
+std::atomic<unsigned> commandsCoalesced(0);   // sent while the ring was full
+
+// Queue-to-apply latency of engine commands, in microseconds.
+std::atomic<long> cmdLatencyLastUs(0);
+std::atomic<long> cmdLatencyMaxUs(0);
+
+// The same latencies binned four buckets to the octave, so a percentile
+// read back is within a quarter of the true value. The last bucket starts
+// at about two minutes.
+#define LATENCY_BUCKETS 104
+std::atomic<unsigned> cmdLatencyHist[LATENCY_BUCKETS];
+
+static int latency_bucket(long us) {
+    if (us < 4) return (int)std::max(0L, us);
+    int msb = 63 - __builtin_clzll((unsigned long long)us);
+    int b = 4 + (msb - 2) * 4 + (int)((us >> (msb - 2)) & 3);
+    return std::min(b, LATENCY_BUCKETS - 1);
+}
+
+static long latency_bucket_floor(int b) {
+    if (b < 4) return b;
+    return (long)(4 + (b - 4) % 4) << ((b - 4) / 4);
+}
+
+// What the engine should do after draining the queue once. Seeks are
+// summed, pause toggles cancel in pairs, and the last device choice wins.
+// Track-scoped commands sent to an earlier track are stale and dropped; a
+// device choice outlives tracks.
+struct CommandBatch {
+    bool stop = false;
+    bool togglePause = false;
+    int seekSec = 0;
+    int device = -1;
+    bool stopPreview = false;
+};
+
+static void fold_command(CommandBatch& b, CommandType type, int arg) {
+    switch (type) {
+        case CMD_TOGGLE_PAUSE: b.togglePause = !b.togglePause; break;
+        case CMD_SEEK:         b.seekSec += arg; break;
+        case CMD_STOP:         b.stop = true; break;
+        case CMD_SET_DEVICE:   b.device = arg; break;
+        case CMD_STOP_PREVIEW: b.stopPreview = true; break;
+    }
+}
+
+// Where commands go while the ring is full (the engine is opening or
+// scanning a track and not draining), so that none is lost. They are folded
+// on the way in, for the newest track sent to, and drain_commands() takes
+// the batch after the ring. Once it holds anything every command goes here
+// until it is taken, which keeps them in order.
+struct CommandOverflow {
+    std::mutex m;
+    std::atomic<bool> pending{false};
+    CommandBatch batch;
+    unsigned track = 0;
+    unsigned count = 0;
+    std::chrono::steady_clock::time_point since;
+};
+
+static CommandOverflow commandOverflow;
+
+static bool commands_waiting() {
+    return !commandQueue.empty() || commandOverflow.pending.load();
+}
+
+static void overflow_command(const Command& c) {
+    std::lock_guard<std::mutex> lk(commandOverflow.m);
+    CommandOverflow& o = commandOverflow;
+    if (!o.pending.load()) {
+        o.batch = CommandBatch();
+        o.track = c.track;
+        o.count = 0;
+        o.since = c.queuedAt;
+    } else if (c.type != CMD_SET_DEVICE && c.track != o.track) {
+        // Tracks only move forward, so what was folded for an earlier one
+        // is stale; the device choice is kept.
+        int device = o.batch.device;
+        o.batch = CommandBatch();
+        o.batch.device = device;
+        o.track = c.track;
+    }
+    fold_command(o.batch, c.type, c.arg);
+    o.count++;
+    o.pending.store(true);
+    commandsCoalesced.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Sends to the track the engine holds now, or to `track` when the caller
+// read engineTrack earlier (under playlistMutex, before changing the queue).
+static void send_command(CommandType type, int arg = 0, unsigned track = engineTrack.load()) {
+    Command c;
+    c.type = type;
+    c.arg = arg;
+    c.track = track;
+    c.queuedAt = std::chrono::steady_clock::now();
+    if (commandOverflow.pending.load() || !commandQueue.push(c)) overflow_command(c);
+    { std::lock_guard<std::mutex> lk(commandMutex); }
+    commandCV.notify_all();
+    // Wakes an idle engine so the queue is drained there too.
+    { std::lock_guard<std::mutex> lk(playlistMutex); }
+    playlistCV.notify_one();
+}
+
+static void record_command_latency(long us, unsigned n) {
+    cmdLatencyLastUs.store(us, std::memory_order_relaxed);
+    cmdLatencyHist[latency_bucket(us)].fetch_add(n, std::memory_order_relaxed);
+    if (us > cmdLatencyMaxUs.load(std::memory_order_relaxed)) cmdLatencyMaxUs.store(us, std::memory_order_relaxed);
+}
+
+static CommandBatch drain_commands() {
+    CommandBatch b;
+    Command c;
+    auto now = std::chrono::steady_clock::now();
+    unsigned track = engineTrack.load();
+    while (commandQueue.pop(c)) {
+        if (c.track != track && c.type != CMD_SET_DEVICE) continue;
+        fold_command(b, c.type, c.arg);
+        record_command_latency((long)std::chrono::duration_cast<std::chrono::microseconds>(now - c.queuedAt).count(), 1);
+    }
+    if (!commandOverflow.pending.load()) return b;
+
+    std::lock_guard<std::mutex> lk(commandOverflow.m);
+    CommandOverflow& o = commandOverflow;
+    if (o.batch.device >= 0) b.device = o.batch.device;
+    if (o.track == track) {
+        b.stop = b.stop || o.batch.stop;
+        b.togglePause = b.togglePause != o.batch.togglePause;
+        b.seekSec += o.batch.seekSec;
+        b.stopPreview = b.stopPreview || o.batch.stopPreview;
+    }
+    record_command_latency((long)std::chrono::duration_cast<std::chrono::microseconds>(now - o.since).count(), o.count);
+    o.pending.store(false);
+    return b;
+}
 
 std::atomic<bool> needResize(false);
 
 WINDOW* navWin  = nullptr;
 WINDOW* infoWin = nullptr;
-WINDOW* waveWin = nullptr;
+
+// A visualizer pane. PANE_VIS follows visMode (keys 1-4); the others are
+// pinned to one view so a wide layout can show several at once.
+enum PaneKind { PANE_BROWSER, PANE_INFO, PANE_VIS, PANE_WAVE, PANE_SPEC, PANE_GRAM, PANE_ROLL };
+
+struct VisPane {
+    WINDOW* win = nullptr;
+    PaneKind kind = PANE_VIS;
+    // Spectrogram or piano-roll history: plotW columns of plotH intensity
+    // levels, written as a ring at gramHead. Reset when the pane changes
+    // size or view.
+    std::vector<uint8_t> gram;
+    int gramW = 0, gramH = 0, gramHead = 0;
+    unsigned long gramSeq = 0;
+    VisualizationMode gramMode = SPECTROGRAM;
+};
+
+std::vector<VisPane> visPanes;
 WINDOW* statusWin = nullptr;
 
-int totalH = 0, totalW = 0, halfH = 0, halfW = 0;
 int listOffset = 0;
 
+// Tempo of the playing track as the UI sees it. The engine anchors the beat
+// grid to the wall clock: beats are heard at anchorNs + k * periodNs.
+struct BeatClock {
+    float bpm = 0.0f;        // 0 while analysing, < 0 when no tempo was found
+    float speed = 0.0f;      // how fast the offline analysis ran, x real time
+    long long anchorNs = 0;
+    long long periodNs = 0;
+};
+
+// Stereo level meters for the Now Playing strip, in dBFS. The display
+// fields come first; the rest is ballistic state owned by meter_block().
+struct Meters {
+    int channels = 0;                  // 0 until a block has been measured
+    float vuDb[2] = {}, ppmDb[2] = {}, holdDb[2] = {};
+    bool clip[2] = {};
+    float corr = 0.0f;                 // -1 out of phase .. +1 mono
+    double vuMs[2] = {}, holdLeft[2] = {}, clipLeft[2] = {};
+    double cross[3] = {};              // smoothed LL, RR, LR
+};
+
 struct RenderState {
     std::string file;
+    std::string title;              // virtual track name, else empty
     double curSec = 0.0;
     double totalSec = 0.0;
     VisualizationMode mode = WAVEFORM;
     bool paused = false;
+    unsigned long frameSeq = 0;
+    char device[64] = "";
     std::vector<int16_t> mono;
     std::vector<double> magnitudes;
+    std::vector<float> notes;       // CQT_NOTES levels, empty when not computed
+    BeatClock beat;
+    Meters meters;
 };
 
 std::mutex renderMutex;
 RenderState renderState;
 std::atomic<bool> renderDirty(false);
 
+// Process-wide work-stealing pool for background jobs (directory scans,
+// tag reads, analysis). Jobs are queued on one of three priority lanes.
+// Foreground workers serve the interactive and prefetch lanes; bulk jobs
+// only ever run on background workers, which drop to nice 19 and idle I/O
+// priority so they cannot compete with playback or input. Each worker owns
+// a deque per lane: it pops its own newest job and steals the oldest job
+// from its peers when it runs dry.
+enum JobLane { LANE_INTERACTIVE = 0, LANE_PREFETCH = 1, LANE_BULK = 2, LANE_COUNT = 3 };
+
+class CancelToken {
+public:
+    CancelToken() : flag_(std::make_shared<std::atomic<bool>>(false)) {}
+    void cancel() const { flag_->store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return flag_->load(std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag_;
+};
+
+struct LaneStats {
+    std::atomic<int> queued{0};
+    std::atomic<int> running{0};
+    std::atomic<unsigned long> completed{0};
+    std::atomic<unsigned long> cancelled{0};
+};
+
+class WorkerPool {
+public:
+    void start(unsigned foreground, unsigned background) {
+        fgCount_ = std::max(1u, foreground);
+        unsigned total = fgCount_ + std::max(1u, background);
+        queues_.reserve(total);
+        for (unsigned i = 0; i < total; i++) queues_.emplace_back(new WorkerQueues());
+        for (unsigned i = 0; i < total; i++) threads_.emplace_back([this, i] { worker_main(i); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(sleepMutex_);
+            stopping_ = true;
+        }
+        for (auto& cv : wake_) cv.notify_all();
+        for (auto& t : threads_) if (t.joinable()) t.join();
+        threads_.clear();
+        queues_.clear();
+    }
+
+    void submit(JobLane lane, const CancelToken& token, std::function<void()> fn) {
+        if (queues_.empty()) return;
+        int cls = lane_class(lane);
+        unsigned first = (cls == 0) ? 0 : fgCount_;
+        unsigned count = (cls == 0) ? fgCount_ : (unsigned)queues_.size() - fgCount_;
+        unsigned target = (self_ >= (int)first && self_ < (int)(first + count))
+                              ? (unsigned)self_ : first + (next_[cls].fetch_add(1) % count);
+        {
+            std::lock_guard<std::mutex> lk(queues_[target]->m);
+            queues_[target]->lanes[lane].push_back(PoolJob{ std::move(fn), token });
+        }
+        stats_[lane].queued.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lk(sleepMutex_);
+            pending_[cls]++;
+        }
+        wake_[cls].notify_one();
+    }
+
+    const LaneStats& stats(JobLane lane) const { return stats_[lane]; }
+
+private:
+    struct PoolJob {
+        std::function<void()> fn;
+        CancelToken token;
+    };
+    struct WorkerQueues {
+        std::mutex m;
+        std::deque<PoolJob> lanes[LANE_COUNT];
+    };
+
+    static int lane_class(JobLane lane) { return lane == LANE_BULK ? 1 : 0; }
+
+    bool take(unsigned self, JobLane lane, PoolJob& out) {
+        unsigned first = (lane_class(lane) == 0) ? 0 : fgCount_;
+        unsigned count = (lane_class(lane) == 0) ? fgCount_ : (unsigned)queues_.size() - fgCount_;
+        for (unsigned k = 0; k < count; k++) {
+            unsigned victim = first + ((self - first + k) % count);
+            WorkerQueues& q = *queues_[victim];
+            std::lock_guard<std::mutex> lk(q.m);
+            auto& dq = q.lanes[lane];
+            if (dq.empty()) continue;
+            if (victim == self) { out = std::move(dq.back()); dq.pop_back(); }
+            else { out = std::move(dq.front()); dq.pop_front(); }
+            return true;
+        }
+        return false;
+    }
+
+    static void lower_thread_priority() {
+#ifdef __linux__
+        pid_t tid = (pid_t)syscall(SYS_gettid);
+        setpriority(PRIO_PROCESS, (id_t)tid, 19);
+  #ifdef SYS_ioprio_set
+        const int IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13;
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int)tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+  #endif
+#endif
+    }
+
+    void worker_main(unsigned self) {
+        self_ = (int)self;
+        int cls = (self < fgCount_) ? 0 : 1;
+        if (cls == 1) lower_thread_priority();
+        static const JobLane fgLanes[] = { LANE_INTERACTIVE, LANE_PREFETCH };
+        static const JobLane bgLanes[] = { LANE_BULK };
+        const JobLane* lanes = (cls == 0) ? fgLanes : bgLanes;
+        int laneCount = (cls == 0) ? 2 : 1;
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(sleepMutex_);
+                wake_[cls].wait(lk, [&] { return stopping_ || pending_[cls] > 0; });
+                if (stopping_) return;
+                pending_[cls]--;
+            }
+
+            // A pending count guarantees a job exists somewhere in our class,
+            // but a peer may be mid-steal; retry until we get it.
+            PoolJob job;
+            JobLane lane = lanes[0];
+            for (bool got = false; !got;) {
+                for (int l = 0; l < laneCount && !got; l++) {
+                    lane = lanes[l];
+                    got = take(self, lane, job);
+                }
+                if (!got) std::this_thread::yield();
+            }
+
+            LaneStats& st = stats_[lane];
+            st.queued.fetch_sub(1);
+            if (job.token.cancelled()) { st.cancelled.fetch_add(1); continue; }
+            st.running.fetch_add(1);
+            job.fn();
+            st.running.fetch_sub(1);
+            st.completed.fetch_add(1);
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkerQueues>> queues_;
+    std::vector<std::thread> threads_;
+    unsigned fgCount_ = 1;
+    std::atomic<unsigned> next_[2] = {};
+    std::mutex sleepMutex_;
+    std::condition_variable wake_[2];
+    int pending_[2] = { 0, 0 };
+    bool stopping_ = false;
+    LaneStats stats_[LANE_COUNT];
+    static thread_local int self_;
+};
+
+thread_local int WorkerPool::self_ = -1;
+
+WorkerPool workerPool;
+
+// Startup instrumentation, all relative to process start except first
+// sound, which is measured from the key press that queued the track.
+static const auto processStart = std::chrono::steady_clock::now();
+std::atomic<long> firstFrameMs(-1);
+std::atomic<long> audioReadyMs(-1);
+std::atomic<long> firstSoundUs(-1);
+std::atomic<long long> playRequestNs(0);
+
+// Output device in use and the gap measured by the last hot switch.
+std::atomic<int> activeDevice(paNoDevice);
+std::atomic<long> deviceSwitchGapUs(-1);
+
+// Format of the track being played, 0 when idle. Previews are decoded to it
+// so they can be mixed in as is.
+std::atomic<long> engineRate(0);
+std::atomic<int> engineChannels(0);
+
+// Set while a preview sounds. Preview start is measured from the key press
+// to the first block the preview is mixed into.
+std::atomic<bool> previewActive(false);
+std::atomic<long long> previewRequestNs(0);
+std::atomic<long> previewStartUs(-1);
+
+static long long steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Allocations the UI thread itself made in its last main-loop frame, shown
+// live in the status bar; steady-state drawing should keep it at 0. Work on
+// the engine and worker threads is not counted.
+static std::atomic<unsigned long long> uiFrameAllocs(0);
+
+// Status bar text is rebuilt only when one of its inputs changes.
+struct StatusBarCache {
+    bool valid = false;
+    int qsz = -1;
+    bool playing = false;
+    bool paused = false;
+    VisualizationMode mode = WAVEFORM;
+    unsigned dirGen = 0;
+    int width = -1;
+    bool repaint = false;
+    unsigned long long frameAllocs = 0;
+    int jobs[LANE_COUNT] = { -1, -1, -1 };
+    bool dupeRunning = false;
+    size_t dupeDone = 0;
+    size_t dupeTotal = 0;
+    bool radio = false;
+    size_t radioIndexed = 0;
+    bool exportRunning = false;
+    size_t exportDone = 0;
+    size_t exportTotal = 0;
+    int exportSpeed = 0;
+    int syncPeers = -1;
+    char left[256];
+    char right[64 + PATH_BUF_SIZE];
+    int lmax = 0;
+    int rlen = 0;
+};
+
+static StatusBarCache statusCache;
+
 static void close_tui() {
     if (statusWin) { delwin(statusWin); statusWin = nullptr; }
-    if (waveWin) { delwin(waveWin); waveWin = nullptr; }
+    for (auto& p : visPanes) if (p.win) delwin(p.win);
+    visPanes.clear();
     if (infoWin) { delwin(infoWin); infoWin = nullptr; }
     if (navWin)  { delwin(navWin);  navWin  = nullptr; }
     endwin();
@@ -114,73 +741,300 @@ static void draw_border(WINDOW* w, int colorPair, bool bold) {
     if (bold) wattroff(w, A_BOLD);
 }
 
-static void draw_title(WINDOW* w, const std::string& title, int colorPair) {
+static void draw_title(WINDOW* w, const char* title, int colorPair) {
     if (!w) return;
     int h, ww;
     getmaxyx(w, h, ww);
-    std::string t = " " + title + " ";
+    (void)h;
     int x = 2;
     int maxw = ww - 4;
     if (maxw <= 0) return;
-    t = ellipsize_end(t, maxw);
+    char raw[128], t[128];
+    int n = std::snprintf(raw, sizeof(raw), " %s ", title);
+    n = clampi(n, 0, (int)sizeof(raw) - 1);
+    ellipsize_end_buf(t, sizeof(t), raw, n, maxw);
     wattron(w, COLOR_PAIR(colorPair) | A_BOLD);
-    mvwaddnstr(w, 0, x, t.c_str(), maxw);
+    mvwaddnstr(w, 0, x, t, maxw);
     wattroff(w, COLOR_PAIR(colorPair) | A_BOLD);
 }
 
-static void handle_resize() {
-    int h = 0, w = 0;
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0 || ws.ws_col == 0) {
-        getmaxyx(stdscr, h, w);
+// Pane geometry for one terminal size. Computed once per size; windows are
+// then resized and moved in place rather than recreated.
+struct PaneRect {
+    int y = 0, x = 0, h = 0, w = 0;
+    bool operator==(const PaneRect& o) const { return y == o.y && x == o.x && h == o.h && w == o.w; }
+};
+
+struct Layout {
+    int termH = 0, termW = 0;
+    PaneRect nav, info, status;
+    std::vector<std::pair<PaneKind, PaneRect>> vis;
+};
+
+static Layout currentLayout;
+
+// Declarative layout: rows(...) stacks children vertically, cols(...) places
+// them side by side, and leaves name a pane. Any node may carry a :weight.
+//   rows(cols(browser,info),cols(wave,spec,gram))
+// "auto" picks the three-visualizer layout on wide terminals.
+struct LayoutNode {
+    bool split = false;
+    bool horizontal = false;
+    int weight = 1;
+    PaneKind kind = PANE_VIS;
+    std::vector<LayoutNode> kids;
+};
+
+#define LAYOUT_NARROW "rows(cols(browser,info),vis)"
+#define LAYOUT_WIDE   "rows(cols(browser,info),cols(wave,spec,gram))"
+#define LAYOUT_WIDE_MIN_COLS 160
+#define LAYOUT_MIN_PANE 3       // a border and one line, however small the weight
+
+static std::string layoutSpec = "auto";
+
+static bool parse_layout_node(const std::string& s, size_t& i, LayoutNode& out, std::string& err) {
+    size_t start = i;
+    while (i < s.size() && (std::isalnum((unsigned char)s[i]) || s[i] == '_')) i++;
+    std::string name = s.substr(start, i - start);
+    if (name.empty()) { err = "expected pane or split at offset " + std::to_string(start); return false; }
+
+    if (name == "rows" || name == "cols") {
+        out.split = true;
+        out.horizontal = (name == "cols");
+        if (i >= s.size() || s[i] != '(') { err = "expected '(' after " + name; return false; }
+        i++;
+        for (;;) {
+            LayoutNode kid;
+            if (!parse_layout_node(s, i, kid, err)) return false;
+            out.kids.push_back(std::move(kid));
+            if (i < s.size() && s[i] == ',') { i++; continue; }
+            if (i < s.size() && s[i] == ')') { i++; break; }
+            err = "expected ',' or ')' in " + name;
+            return false;
+        }
     } else {
-        h = ws.ws_row;
-        w = ws.ws_col;
+        static const std::pair<const char*, PaneKind> names[] = {
+            { "browser", PANE_BROWSER }, { "info", PANE_INFO }, { "vis", PANE_VIS },
+            { "wave", PANE_WAVE }, { "spec", PANE_SPEC }, { "gram", PANE_GRAM },
+            { "roll", PANE_ROLL },
+        };
+        bool found = false;
+        for (auto& n : names) if (name == n.first) { out.kind = n.second; found = true; }
+        if (!found) { err = "unknown pane '" + name + "'"; return false; }
     }
 
-    totalH = h;
-    totalW = w;
-    if (totalH < 12 || totalW < 30) return;
+    if (i < s.size() && s[i] == ':') {
+        i++;
+        int wgt = 0;
+        while (i < s.size() && std::isdigit((unsigned char)s[i])) wgt = wgt * 10 + (s[i++] - '0');
+        if (wgt <= 0) { err = "bad weight"; return false; }
+        out.weight = wgt;
+    }
+    return true;
+}
 
-    halfH = totalH / 2;
-    halfW = totalW / 2;
+static void count_panes(const LayoutNode& n, int& browsers, int& infos, int& vis) {
+    if (n.split) { for (auto& k : n.kids) count_panes(k, browsers, infos, vis); return; }
+    if (n.kind == PANE_BROWSER) browsers++;
+    else if (n.kind == PANE_INFO) infos++;
+    else vis++;
+}
 
-    resizeterm(totalH, totalW);
-    clear();
-    refresh();
+static bool parse_layout(const std::string& spec, LayoutNode& out, std::string& err) {
+    std::string s;
+    for (char c : spec) if (!std::isspace((unsigned char)c)) s += c;
+    size_t i = 0;
+    out = LayoutNode();
+    if (!parse_layout_node(s, i, out, err)) return false;
+    if (i != s.size()) { err = "trailing characters"; return false; }
+    int browsers = 0, infos = 0, vis = 0;
+    count_panes(out, browsers, infos, vis);
+    if (browsers != 1 || infos != 1) { err = "layout needs exactly one browser and one info pane"; return false; }
+    if (vis == 0) { err = "layout needs at least one visualizer pane"; return false; }
+    return true;
+}
 
-    if (statusWin) { delwin(statusWin); statusWin = nullptr; }
-    if (navWin)  { delwin(navWin);  navWin  = nullptr; }
-    if (infoWin) { delwin(infoWin); infoWin = nullptr; }
-    if (waveWin) { delwin(waveWin); waveWin = nullptr; }
+static void place_layout_node(const LayoutNode& n, const PaneRect& r, Layout& L) {
+    if (!n.split) {
+        if (n.kind == PANE_BROWSER) L.nav = r;
+        else if (n.kind == PANE_INFO) L.info = r;
+        else L.vis.push_back({ n.kind, r });
+        return;
+    }
+    int total = 0;
+    for (auto& k : n.kids) total += k.weight;
+    // Every child gets LAYOUT_MIN_PANE (or an even share when there is not
+    // room for that) and the rest is split by weight.
+    int span = n.horizontal ? r.w : r.h;
+    int count = (int)n.kids.size();
+    int minLen = clampi(span / count, 1, LAYOUT_MIN_PANE);
+    int spare = std::max(0, span - minLen * count);
+    int pos = 0;
+    for (size_t i = 0; i < n.kids.size(); i++) {
+        int len = (i + 1 == n.kids.size()) ? span - pos : minLen + spare * n.kids[i].weight / std::max(1, total);
+        PaneRect kr = n.horizontal ? PaneRect{ r.y, r.x + pos, r.h, len } : PaneRect{ r.y + pos, r.x, len, r.w };
+        place_layout_node(n.kids[i], kr, L);
+        pos += len;
+    }
+}
 
+static Layout compute_layout(int h, int w) {
+    std::string spec = layoutSpec;
+    if (spec == "auto") spec = (w >= LAYOUT_WIDE_MIN_COLS) ? LAYOUT_WIDE : LAYOUT_NARROW;
+
+    LayoutNode root;
+    std::string err;
+    if (!parse_layout(spec, root, err)) parse_layout(LAYOUT_NARROW, root, err);
+
+    Layout L;
+    L.termH = h;
+    L.termW = w;
     int statusH = 1;
-    int topH = halfH;
-    int bottomH = totalH - topH - statusH;
-    if (bottomH < 3) bottomH = 3;
+    L.status = { h - statusH, 0, statusH, w };
+    place_layout_node(root, PaneRect{ 0, 0, h - statusH, w }, L);
+
+    // A spec with more panes across than the terminal has cells leaves some
+    // empty, which newwin() would take as full screen.
+    bool empty = L.nav.h < 1 || L.nav.w < 1 || L.info.h < 1 || L.info.w < 1;
+    for (auto& v : L.vis) empty = empty || v.second.h < 1 || v.second.w < 1;
+    if (empty) {
+        parse_layout(LAYOUT_NARROW, root, err);
+        L.vis.clear();
+        place_layout_node(root, PaneRect{ 0, 0, h - statusH, w }, L);
+    }
+    return L;
+}
+
+static bool pane_wants_spectrum(PaneKind k, VisualizationMode m) {
+    return k == PANE_SPEC || k == PANE_GRAM || k == PANE_ROLL || (k == PANE_VIS && m != WAVEFORM);
+}
+
+static bool pane_wants_notes(PaneKind k, VisualizationMode m) {
+    return k == PANE_ROLL || (k == PANE_VIS && m == PIANO_ROLL);
+}
+
+static void update_spectrum_wanted() {
+    VisualizationMode m = visMode.load();
+    bool want = false, notes = false;
+    for (auto& p : visPanes) {
+        want = want || pane_wants_spectrum(p.kind, m);
+        notes = notes || pane_wants_notes(p.kind, m);
+    }
+    spectrumWanted.store(want);
+    notesWanted.store(notes);
+}
+
+// Set by --stress to resize the layout without a real terminal resize.
+static int forcedRows = 0, forcedCols = 0;
+
+static void query_terminal_size(int& h, int& w) {
+    struct winsize ws;
+    if (forcedRows > 0) {
+        h = forcedRows;
+        w = forcedCols;
+    } else if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0 || ws.ws_col == 0) {
+        getmaxyx(stdscr, h, w);
+    } else {
+        h = ws.ws_row;
+        w = ws.ws_col;
+    }
+}
 
-    navWin  = newwin(topH, halfW, 0, 0);
-    infoWin = newwin(topH, totalW - halfW, 0, halfW);
-    waveWin = newwin(bottomH, totalW, topH, 0);
-    statusWin = newwin(statusH, totalW, totalH - statusH, 0);
+// Creates the window on first use, otherwise resizes then moves it. Shrinking
+// first keeps the move inside the (already resized) screen.
+static void place_window(WINDOW*& win, const PaneRect& r) {
+    if (!win) {
+        win = newwin(r.h, r.w, r.y, r.x);
+        return;
+    }
+    int curY, curX, curH, curW;
+    getbegyx(win, curY, curX);
+    getmaxyx(win, curH, curW);
+    if (curH != r.h || curW != r.w) wresize(win, r.h, r.w);
+    if (curY != r.y || curX != r.x) mvwin(win, r.y, r.x);
+}
 
-    werase(navWin); werase(infoWin); werase(waveWin); werase(statusWin);
+static void paint_frames() {
+    werase(navWin); werase(infoWin); werase(statusWin);
     draw_border(navWin, 2, false);
     draw_border(infoWin, 2, false);
-    draw_border(waveWin, 2, false);
-
     draw_title(navWin, "Browser", 1);
     draw_title(infoWin, "Now Playing", 1);
-    draw_title(waveWin, "Visualizer", 1);
+    for (auto& p : visPanes) {
+        werase(p.win);
+        draw_border(p.win, 2, false);
+        draw_title(p.win, "Visualizer", 1);
+    }
 
-    wrefresh(navWin);
-    wrefresh(infoWin);
-    wrefresh(waveWin);
-    wrefresh(statusWin);
+    // Flush stdscr first: resizeterm() leaves it touched, and getch() would
+    // otherwise repaint it blank over the panes on its next implicit refresh.
+    wnoutrefresh(stdscr);
+    wnoutrefresh(navWin);
+    wnoutrefresh(infoWin);
+    for (auto& p : visPanes) wnoutrefresh(p.win);
+    wnoutrefresh(statusWin);
+    doupdate();
+}
+
+// Applies the layout for the current terminal size. Returns false when the
+// size is unchanged or too small, in which case nothing is touched.
+static bool apply_layout(bool force = false) {
+    int h = 0, w = 0;
+    query_terminal_size(h, w);
+    if (h < 12 || w < 30) return false;
+    if (!force && h == currentLayout.termH && w == currentLayout.termW && navWin) return false;
+
+    Layout L = compute_layout(h, w);
+    if (h != LINES || w != COLS) resizeterm(h, w);
+
+    place_window(navWin, L.nav);
+    place_window(infoWin, L.info);
+    place_window(statusWin, L.status);
+
+    // Visualizer panes are matched by position; only a change in their count
+    // creates or deletes windows.
+    while (visPanes.size() > L.vis.size()) {
+        if (visPanes.back().win) delwin(visPanes.back().win);
+        visPanes.pop_back();
+    }
+    visPanes.resize(L.vis.size());
+    for (size_t i = 0; i < L.vis.size(); i++) {
+        visPanes[i].kind = L.vis[i].first;
+        place_window(visPanes[i].win, L.vis[i].second);
+    }
+    update_spectrum_wanted();
+
+    // Text caches key on their own pane width; the status bar only needs a
+    // repaint because its window contents were just resized.
+    statusCache.repaint = true;
+    currentLayout = L;
+
+    paint_frames();
+    return true;
 }
 
-static void init_tui() {
-    initscr();
+// Set from the locale at startup; sparklines fall back to ASCII levels.
+static bool sparkUtf8 = false;
+
+// Colours available for album art: 1 << 24 on direct-colour terminals
+// (TERM=xterm-direct), 256 for the xterm palette, 0 to show none.
+static int artColors = 0;
+
+// Headless, the screen is drawn to /dev/null; --stress uses this when
+// stdout is not a terminal.
+static void init_tui(bool headless = false) {
+    std::setlocale(LC_CTYPE, "");
+    sparkUtf8 = std::strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+    if (!headless) {
+        initscr();
+    } else {
+        const char* term = std::getenv("TERM");
+        FILE* out = std::fopen("/dev/null", "w");
+        if (!out || !newterm(term && *term ? term : "xterm-256color", out, stdin)) {
+            std::cerr << "Error: cannot open a headless screen.\n";
+            std::exit(1);
+        }
+    }
     cbreak();
     noecho();
     curs_set(0);
@@ -202,664 +1056,8259 @@ static void init_tui() {
     init_pair(4, COLOR_GREEN,  -1);
     init_pair(5, COLOR_MAGENTA,-1);
     init_pair(6, COLOR_RED,    -1);
+#ifdef NCURSES_EXT_COLORS
+    artColors = COLORS >= (1 << 24) ? (1 << 24) : (COLORS >= 256 ? 256 : 0);
+#else
+    artColors = COLORS >= 256 ? 256 : 0;
+#endif
 
     mousemask(0, nullptr);
 
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0 || ws.ws_col == 0) {
-        getmaxyx(stdscr, totalH, totalW);
-    } else {
-        totalH = ws.ws_row;
-        totalW = ws.ws_col;
-    }
-
-    if (totalH < 12 || totalW < 30) {
+    int h = 0, w = 0;
+    query_terminal_size(h, w);
+    if (h < 12 || w < 30) {
         endwin();
         std::cerr << "Error: Terminal window too small.\n";
         std::exit(1);
     }
 
-    halfH = totalH / 2;
-    halfW = totalW / 2;
+    refresh();
+    apply_layout();
+}
 
-    int statusH = 1;
-    int topH = halfH;
-    int bottomH = totalH - topH - statusH;
-    if (bottomH < 3) bottomH = 3;
+// A stretch of one audio file played as a track of its own, from a CUE sheet
+// or an ID3v2 chapter. Times are seconds from the start of the file and are
+// turned into sample frames once the decoder reports the rate; endSec < 0
+// runs to the end of the file.
+struct CutTrack {
+    int number = 0;            // 1-based; 0 for a plain entry
+    std::string title;
+    double startSec = 0.0;
+    double endSec = -1.0;
+};
 
-    navWin  = newwin(topH, halfW, 0, 0);
-    infoWin = newwin(topH, totalW - halfW, 0, halfW);
-    waveWin = newwin(bottomH, totalW, topH, 0);
-    statusWin = newwin(statusH, totalW, totalH - statusH, 0);
+// A browser row: a directory entry, or one virtual track of the file in
+// entry. A split file's tracks follow its own row.
+struct BrowserEntry {
+    fs::directory_entry entry;
+    CutTrack cut;
 
-    werase(navWin); werase(infoWin); werase(waveWin); werase(statusWin);
+    bool is_directory() const { return entry.is_directory(); }
+    const fs::path& path() const { return entry.path(); }
+    bool is_cut() const { return cut.number > 0; }
+};
 
-    draw_border(navWin, 2, false);
-    draw_border(infoWin, 2, false);
-    draw_border(waveWin, 2, false);
+// Directories first, then by name; a file's virtual tracks follow it in order.
+static bool entry_name_less(const BrowserEntry& a, const BrowserEntry& b) {
+    bool ad = a.is_directory();
+    bool bd = b.is_directory();
+    if (ad != bd) return ad > bd;
+    std::string an = a.path().filename().string(), bn = b.path().filename().string();
+    if (an != bn) return an < bn;
+    return a.cut.number < b.cut.number;
+}
 
-    draw_title(navWin, "Browser", 1);
-    draw_title(infoWin, "Now Playing", 1);
-    draw_title(waveWin, "Visualizer", 1);
+static bool is_mp3_path(const fs::path& p) {
+    std::string ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".mp3";
+}
 
-    refresh();
-    wrefresh(navWin);
-    wrefresh(infoWin);
-    wrefresh(waveWin);
-    wrefresh(statusWin);
+// A playable MP3 row of its own (not one of its virtual tracks).
+static bool is_mp3_entry(const BrowserEntry& e) {
+    return !e.is_cut() && !e.is_directory() && is_mp3_path(e.path());
 }
 
-static std::vector<fs::directory_entry> list_directory(const fs::path& p) {
-    std::vector<fs::directory_entry> entries;
-    try {
-        for (auto& x : fs::directory_iterator(p)) entries.push_back(x);
-    } catch (const std::exception& e) {
-        std::cerr << "Error accessing directory: " << e.what() << "\n";
+// Next CUE token: a quoted string or a run of non-blanks.
+static std::string cue_token(const std::string& line, size_t& i) {
+    while (i < line.size() && std::isspace((unsigned char)line[i])) i++;
+    std::string out;
+    if (i < line.size() && line[i] == '"') {
+        size_t close = line.find('"', i + 1);
+        if (close == std::string::npos) close = line.size();
+        out = line.substr(i + 1, close - i - 1);
+        i = std::min(line.size(), close + 1);
+        return out;
     }
+    while (i < line.size() && !std::isspace((unsigned char)line[i])) out += line[i++];
+    return out;
+}
 
-    std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
-        bool ad = a.is_directory();
-        bool bd = b.is_directory();
-        if (ad != bd) return ad > bd;
-        return a.path().filename().string() < b.path().filename().string();
-    });
-
-    return entries;
+// Parses a CUE sheet into per-file track lists, keyed by the audio file's
+// path. A FILE that does not exist is matched to an MP3 with the same stem,
+// since sheets often still name the WAV they were ripped to. Tracks start
+// at INDEX 01, so any pregap stays with the track before.
+static void parse_cue_sheet(const fs::path& cue, std::unordered_map<std::string, std::vector<CutTrack>>& out) {
+    std::FILE* f = std::fopen(cue.c_str(), "r");
+    if (!f) return;
+    std::string file, line;
+    std::vector<CutTrack>* tracks = nullptr;
+    CutTrack* cur = nullptr;
+    char buf[1024];
+    while (std::fgets(buf, sizeof(buf), f)) {
+        line = buf;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+        size_t i = 0;
+        if (line.compare(0, 3, "\xEF\xBB\xBF") == 0) i = 3;
+        std::string cmd = cue_token(line, i);
+        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+        if (cmd == "FILE") {
+            fs::path audio = cue.parent_path() / cue_token(line, i);
+            std::error_code ec;
+            if (!fs::exists(audio, ec)) audio.replace_extension(".mp3");
+            tracks = is_mp3_path(audio) && fs::exists(audio, ec) ? &out[audio.string()] : nullptr;
+            cur = nullptr;
+        } else if (cmd == "TRACK" && tracks) {
+            tracks->emplace_back();
+            cur = &tracks->back();
+            cur->number = std::atoi(cue_token(line, i).c_str());
+            cur->startSec = -1.0;
+        } else if (cmd == "TITLE" && cur) {
+            cur->title = cue_token(line, i);
+        } else if (cmd == "INDEX" && cur && std::atoi(cue_token(line, i).c_str()) == 1) {
+            int mm = 0, ss = 0, ff = 0;
+            if (std::sscanf(cue_token(line, i).c_str(), "%d:%d:%d", &mm, &ss, &ff) == 3)
+                cur->startSec = mm * 60.0 + ss + ff / 75.0;
+        }
+    }
+    std::fclose(f);
+
+    for (auto& kv : out) {
+        std::vector<CutTrack>& t = kv.second;
+        t.erase(std::remove_if(t.begin(), t.end(), [](const CutTrack& c) { return c.startSec < 0.0; }), t.end());
+        std::sort(t.begin(), t.end(), [](const CutTrack& a, const CutTrack& b) { return a.startSec < b.startSec; });
+        for (size_t k = 0; k < t.size(); k++) {
+            t[k].number = (int)k + 1;
+            t[k].endSec = k + 1 < t.size() ? t[k + 1].startSec : -1.0;
+        }
+    }
 }
 
-static void format_time(double sec, char* buf, size_t bufsize) {
-    long t = static_cast<long>(sec);
-    if (t < 0) t = 0;
-    long mm = t / 60, ss = t % 60;
-    std::snprintf(buf, bufsize, "%02ld:%02ld", mm, ss);
+static uint32_t be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
 }
 
-static void draw_status_bar(const fs::path& currentDir) {
-    if (!statusWin) return;
+static uint32_t syncsafe32(const unsigned char* p) {
+    return ((uint32_t)(p[0] & 0x7F) << 21) | ((uint32_t)(p[1] & 0x7F) << 14) | ((uint32_t)(p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
 
-    werase(statusWin);
+static void append_utf8(std::string& s, uint32_t cp) {
+    if (cp < 0x80) s += (char)cp;
+    else if (cp < 0x800) { s += (char)(0xC0 | (cp >> 6)); s += (char)(0x80 | (cp & 0x3F)); }
+    else if (cp < 0x10000) { s += (char)(0xE0 | (cp >> 12)); s += (char)(0x80 | ((cp >> 6) & 0x3F)); s += (char)(0x80 | (cp & 0x3F)); }
+    else { s += (char)(0xF0 | (cp >> 18)); s += (char)(0x80 | ((cp >> 12) & 0x3F)); s += (char)(0x80 | ((cp >> 6) & 0x3F)); s += (char)(0x80 | (cp & 0x3F)); }
+}
 
-    int qsz = 0;
-    {
-        std::lock_guard<std::mutex> lk(playlistMutex);
-        qsz = (int)playlist.size();
+// An ID3v2 text frame body (encoding byte, then text) as UTF-8.
+static std::string id3_text(const unsigned char* p, size_t n) {
+    std::string s;
+    if (n == 0) return s;
+    int enc = p[0];
+    p++;
+    n--;
+    if (enc == 0 || enc == 3) {
+        for (size_t i = 0; i < n && p[i]; i++) {
+            if (enc == 0) append_utf8(s, p[i]);
+            else s += (char)p[i];
+        }
+        return s;
     }
+    bool bigEndian = enc == 2;
+    size_t i = 0;
+    if (enc == 1 && n >= 2) {
+        bigEndian = p[0] == 0xFE && p[1] == 0xFF;
+        i = 2;
+    }
+    for (; i + 1 < n; i += 2) {
+        uint32_t u = bigEndian ? (p[i] << 8 | p[i + 1]) : (p[i + 1] << 8 | p[i]);
+        if (u == 0) break;
+        if (u >= 0xD800 && u < 0xDC00 && i + 3 < n) {
+            uint32_t lo = bigEndian ? (p[i + 2] << 8 | p[i + 3]) : (p[i + 3] << 8 | p[i + 2]);
+            u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+            i += 2;
+        }
+        append_utf8(s, u);
+    }
+    return s;
+}
 
-    bool playing = isPlaying.load();
-    bool paused = isPaused.load();
-    VisualizationMode m = visMode.load();
-
-    std::string left = " q:quit  Enter:open/add  a:queue mp3  s:skip  x:stop  p:pause  1/2:mode  \u2190/\u2192:seek ";
-    std::string right;
+// Walks the frames of an ID3v2.3/2.4 tag with seeks, so large frames are
+// only read by a visitor that wants them. fn gets the frame ID, its size,
+// the tag version and the file positioned at the frame body; returning false
+// stops the walk. Tags using whole-tag unsynchronisation are skipped.
+static void id3_each_frame(const fs::path& p, const std::function<bool(const unsigned char* id, uint32_t size, int version, std::FILE* f)>& fn) {
+    std::FILE* f = std::fopen(p.c_str(), "rb");
+    if (!f) return;
+    unsigned char h[10];
+    if (std::fread(h, 1, 10, f) != 10 || std::memcmp(h, "ID3", 3) != 0 || (h[3] != 3 && h[3] != 4) || (h[5] & 0x80)) {
+        std::fclose(f);
+        return;
+    }
+    const int version = h[3];
+    const long tagEnd = 10 + (long)syncsafe32(h + 6);
+    long pos = 10;
+    if (h[5] & 0x40) {
+        unsigned char ext[4];
+        if (std::fread(ext, 1, 4, f) != 4) { std::fclose(f); return; }
+        pos += version == 4 ? (long)syncsafe32(ext) : 4 + (long)be32(ext);
+    }
 
-    std::string dir = currentDir.string();
-    right += "  Dir: " + dir;
-    right += "  Queue: " + std::to_string(qsz);
-    right += "  Mode: " + std::string((m == WAVEFORM) ? "Wave" : "Spec");
-    right += "  State: " + std::string(!playing ? "Idle" : (paused ? "Paused" : "Play"));
+    while (pos + 10 <= tagEnd && std::fseek(f, pos, SEEK_SET) == 0 && std::fread(h, 1, 10, f) == 10) {
+        if (h[0] == 0) break;   // padding
+        uint32_t size = version == 4 ? syncsafe32(h + 4) : be32(h + 4);
+        pos += 10 + (long)size;
+        if (pos > tagEnd || !fn(h, size, version, f)) break;
+    }
+    std::fclose(f);
+}
 
-    int h, w;
-    getmaxyx(statusWin, h, w);
+// Reads ID3v2 CHAP frames; cover art and other large frames are skipped.
+static std::vector<CutTrack> read_id3_chapters(const fs::path& p) {
+    std::vector<CutTrack> chapters;
+    std::vector<unsigned char> body;
+    id3_each_frame(p, [&](const unsigned char* id, uint32_t size, int version, std::FILE* f) {
+        if (std::memcmp(id, "CHAP", 4) != 0 || size < 18 || size > (1u << 20)) return true;
+        body.resize(size);
+        if (std::fread(body.data(), 1, size, f) != size) return false;
+
+        size_t at = 0;
+        while (at < size && body[at]) at++;   // element ID
+        at++;
+        if (at + 16 > size) return true;
+        CutTrack c;
+        c.startSec = be32(&body[at]) / 1000.0;
+        c.endSec = be32(&body[at + 4]) / 1000.0;
+        at += 16;
+        while (at + 10 <= size) {   // embedded frames; TIT2 is the title
+            uint32_t sub = version == 4 ? syncsafe32(&body[at + 4]) : be32(&body[at + 4]);
+            if (at + 10 + sub > size) break;
+            if (std::memcmp(&body[at], "TIT2", 4) == 0) c.title = id3_text(&body[at + 10], sub);
+            at += 10 + sub;
+        }
+        chapters.push_back(c);
+        return true;
+    });
 
-    int avail = w;
-    std::string r = ellipsize_middle(right, clampi(avail / 2, 10, avail));
-    int rlen = (int)r.size();
-    int lmax = w - rlen - 1;
-    if (lmax < 0) lmax = 0;
+    std::sort(chapters.begin(), chapters.end(), [](const CutTrack& a, const CutTrack& b) { return a.startSec < b.startSec; });
+    for (size_t k = 0; k < chapters.size(); k++) chapters[k].number = (int)k + 1;
+    return chapters;
+}
 
-    std::string l = ellipsize_end(left, lmax);
+// The picture in an ID3v2 APIC frame, preferring the front cover (type 3)
+// when a tag carries several.
+static bool read_id3_picture(const fs::path& p, std::vector<unsigned char>& out) {
+    out.clear();
+    id3_each_frame(p, [&](const unsigned char* id, uint32_t size, int, std::FILE* f) {
+        if (std::memcmp(id, "APIC", 4) != 0 || size < 4 || size > (16u << 20)) return true;
+        std::vector<unsigned char> body(size);
+        if (std::fread(body.data(), 1, size, f) != size) return false;
+        int enc = body[0];
+        size_t at = 1;
+        while (at < size && body[at]) at++;   // MIME type
+        at++;
+        if (at >= size) return true;
+        int type = body[at++];
+        if (enc == 1 || enc == 2) {           // description, UTF-16
+            while (at + 1 < size && (body[at] || body[at + 1])) at += 2;
+            at += 2;
+        } else {
+            while (at < size && body[at]) at++;
+            at++;
+        }
+        if (at >= size) return true;
+        if (out.empty() || type == 3) out.assign(body.begin() + at, body.end());
+        return type != 3;
+    });
+    return !out.empty();
+}
 
-    wattron(statusWin, A_REVERSE);
-    if (playing) wattron(statusWin, COLOR_PAIR(paused ? 3 : 4));
-    else wattron(statusWin, COLOR_PAIR(5));
+// Cover art for a track: its own APIC picture, else folder.jpg, cover.jpg,
+// front.jpg or album.jpg (any case, .jpg or .jpeg) next to it.
+static bool find_cover(const fs::path& track, std::vector<unsigned char>& out) {
+    if (read_id3_picture(track, out)) return true;
+    static const char* const names[] = { "folder", "cover", "front", "album" };
+    fs::path best;
+    int bestRank = 4;
+    std::error_code ec;
+    for (fs::directory_iterator it(track.parent_path(), ec), end; !ec && it != end; it.increment(ec)) {
+        std::string stem = it->path().stem().string(), ext = it->path().extension().string();
+        std::transform(stem.begin(), stem.end(), stem.begin(), ::tolower);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext != ".jpg" && ext != ".jpeg") continue;
+        for (int r = 0; r < bestRank; r++) {
+            if (stem == names[r]) { best = it->path(); bestRank = r; break; }
+        }
+    }
+    if (best.empty()) return false;
+    std::FILE* f = std::fopen(best.c_str(), "rb");
+    if (!f) return false;
+    out.clear();
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0 && out.size() < (16u << 20)) out.insert(out.end(), buf, buf + n);
+    std::fclose(f);
+    return !out.empty();
+}
 
-    mvwaddnstr(statusWin, 0, 0, l.c_str(), lmax);
-    if (rlen > 0) {
-        mvwaddnstr(statusWin, 0, w - rlen, r.c_str(), rlen);
+static std::vector<BrowserEntry> list_directory(const fs::path& p, const CancelToken* cancel = nullptr) {
+    std::vector<BrowserEntry> entries;
+    std::unordered_map<std::string, std::vector<CutTrack>> cuts;
+    try {
+        for (auto& x : fs::directory_iterator(p)) {
+            if (cancel && cancel->cancelled()) return entries;
+            entries.push_back({ x, CutTrack() });
+            std::string ext = x.path().extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (ext == ".cue" && !x.is_directory()) parse_cue_sheet(x.path(), cuts);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error accessing directory: " << e.what() << "\n";
     }
 
-    wattroff(statusWin, COLOR_PAIR(paused ? 3 : 4));
-    wattroff(statusWin, COLOR_PAIR(5));
-    wattroff(statusWin, A_REVERSE);
+    // A CUE sheet wins over chapters embedded in the same file.
+    size_t plain = entries.size();
+    for (size_t i = 0; i < plain; i++) {
+        if (cancel && cancel->cancelled()) return entries;
+        if (!is_mp3_entry(entries[i])) continue;
+        auto it = cuts.find(entries[i].path().string());
+        std::vector<CutTrack> tracks = it != cuts.end() ? it->second : read_id3_chapters(entries[i].path());
+        if (tracks.size() < 2) continue;
+        for (auto& t : tracks) entries.push_back({ entries[i].entry, t });
+    }
 
-    wrefresh(statusWin);
+    std::sort(entries.begin(), entries.end(), entry_name_less);
+    return entries;
 }
 
-static void draw_info(const std::string& filepath, double currentSec, double totalSec, VisualizationMode mode, bool paused) {
-    if (!infoWin) return;
+// Directory scans run on the pool's interactive lane so a slow or huge
+// directory never stalls input. Only the newest request may publish; a new
+// request cancels the one before it.
+
+struct ListingSlot {
+    std::mutex m;
+    unsigned id = 0;
+    bool ready = false;
+    fs::path path;
+    std::vector<BrowserEntry> entries;
+    CancelToken token;
+};
 
-    werase(infoWin);
-    draw_border(infoWin, 2, false);
-    draw_title(infoWin, "Now Playing", 1);
+static ListingSlot listingSlot;
+
+static void request_listing(const fs::path& p) {
+    std::lock_guard<std::mutex> lk(listingSlot.m);
+    listingSlot.token.cancel();
+    listingSlot.token = CancelToken();
+    listingSlot.ready = false;
+    unsigned id = ++listingSlot.id;
+    CancelToken tok = listingSlot.token;
+    workerPool.submit(LANE_INTERACTIVE, tok, [p, id, tok] {
+        auto entries = list_directory(p, &tok);
+        if (tok.cancelled()) return;
+        std::lock_guard<std::mutex> lk(listingSlot.m);
+        if (id != listingSlot.id) return;
+        listingSlot.path = p;
+        listingSlot.entries = std::move(entries);
+        listingSlot.ready = true;
+    });
+}
 
-    int h, w;
-    getmaxyx(infoWin, h, w);
-    int innerW = w - 4;
-    if (innerW < 10 || h < 6) { wrefresh(infoWin); return; }
+static bool take_listing(std::vector<BrowserEntry>& out) {
+    std::lock_guard<std::mutex> lk(listingSlot.m);
+    if (!listingSlot.ready) return false;
+    listingSlot.ready = false;
+    out.swap(listingSlot.entries);
+    listingSlot.entries.clear();
+    return true;
+}
 
-    std::string title = "Idle";
-    if (!filepath.empty()) {
-        fs::path p(filepath);
-        title = p.filename().string();
-    }
+// Per-file background analysis (browser sparklines, tempo) with a disk
+// cache. Requests are queued per path and run on the bulk lane a few at a
+// time; front-of-queue requests (visible rows, the playing track) jump
+// ahead of whole-directory ones. Results are keyed by path, mtime and size
+// and kept in a SharedTrackIndex under the user's cache directory, so every
+// running instance serves them from the same pages.
+enum TrackJobState { TJ_QUEUED, TJ_RUNNING, TJ_READY, TJ_FAILED };
+
+template <typename T>
+struct TrackResult {
+    TrackJobState state = TJ_QUEUED;
+    bool promoted = false;
+    int64_t mtime = 0;
+    uint64_t size = 0;
+    T value{};
+};
 
-    std::string state = paused ? "PAUSED" : (isPlaying.load() ? "PLAYING" : "IDLE");
-    int statePair = paused ? 3 : (isPlaying.load() ? 4 : 5);
+static bool file_stamp(const std::string& path, int64_t& mtime, uint64_t& size) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return false;
+    mtime = (int64_t)st.st_mtime;
+    size = (uint64_t)st.st_size;
+    return true;
+}
 
-    wattron(infoWin, COLOR_PAIR(statePair) | A_BOLD);
-    mvwaddnstr(infoWin, 1, 2, state.c_str(), innerW);
-    wattroff(infoWin, COLOR_PAIR(statePair) | A_BOLD);
+static fs::path track_cache_path(const char* name) {
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    fs::path base = (xdg && *xdg) ? fs::path(xdg) : fs::path(home ? home : ".") / ".cache";
+    return base / "terminalwave" / name;
+}
 
-    std::string tline = ellipsize_end(title, innerW);
-    wattron(infoWin, COLOR_PAIR(2) | A_BOLD);
-    mvwaddnstr(infoWin, 2, 2, tline.c_str(), innerW);
-    wattroff(infoWin, COLOR_PAIR(2) | A_BOLD);
+// Track caches are shared by every instance on the host: one mmap'd file
+// per store, read without locks and written by one process at a time under
+// flock(). The file holds a header, an open-addressing table of slots and an
+// append-only record area. A writer appends a record, publishes the new end,
+// then points the path's slot at it, so a reader that sees the slot also
+// sees the record; published records are never modified. When the table or
+// the record area fills up, the writer builds a larger, compacted copy,
+// renames it over the file and marks the old one retired. Readers notice on
+// their next lookup and map the new generation; until then their old
+// mapping stays valid.
+#define SHARED_INDEX_VERSION 1
+#define SHARED_INDEX_SLOTS 4096               // initial table size, a power of two
+#define SHARED_INDEX_BYTES (256u << 10)       // minimum record area
+#define SHARED_INDEX_OFFSET_BITS 48           // a slot is offset | path hash tag << 48
+
+struct SharedIndexHeader {
+    char magic[4];                        // "TWIX"
+    char store[4];                        // the store's own magic
+    uint32_t version;                     // SHARED_INDEX_VERSION
+    uint32_t storeVersion;
+    uint32_t valueSize;
+    uint32_t slots;                       // table size, a power of two
+    uint64_t capacity;                    // file size in bytes
+    uint64_t generation;                  // rebuilds since the file was created
+    std::atomic<uint64_t> used;           // end of the published records
+    std::atomic<uint32_t> live;           // occupied slots
+    std::atomic<uint32_t> retired;        // set once a newer file replaced this one
+    uint8_t reserved[8];
+};
 
-    char cb[16], tb[16];
-    format_time(currentSec, cb, sizeof(cb));
-    format_time(totalSec, tb, sizeof(tb));
-    std::string timeLine = std::string(cb) + " / " + std::string(tb);
+// Followed by the path and the value, each padded to 8 bytes.
+struct SharedIndexRecord {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t pathLen;
+    uint32_t reserved;
+};
 
-    double progress = (totalSec > 0.0) ? (currentSec / totalSec) : 0.0;
-    if (progress < 0.0) progress = 0.0;
-    if (progress > 1.0) progress = 1.0;
+static_assert(sizeof(SharedIndexHeader) == 64, "shared index header layout");
+static_assert(sizeof(SharedIndexRecord) == 24, "shared index record layout");
+
+class SharedTrackIndex {
+public:
+    SharedTrackIndex(const char* magic, uint32_t version, uint32_t valueSize)
+        : magic_(magic), version_(version), valueSize_(valueSize) {}
+    ~SharedTrackIndex() { close(); }
+
+    // Maps the index at p, creating it or replacing an unusable file.
+    bool open(const fs::path& p) {
+        close();
+        path_ = p;
+        if (!lock_current()) return false;
+        unlock();
+        return true;
+    }
 
-    int barW = innerW;
-    if (barW < 10) barW = 10;
-    int filled = (int)std::round(progress * (double)barW);
-    filled = clampi(filled, 0, barW);
+    void close() {
+        if (hdr_) munmap(hdr_, mapped_);
+        if (fd_ >= 0) ::close(fd_);
+        hdr_ = nullptr;
+        mapped_ = 0;
+        fd_ = -1;
+    }
 
-    int barY = 4;
-    if (barY < h - 2) {
-        wattron(infoWin, COLOR_PAIR(3));
-        mvwaddnstr(infoWin, barY - 1, 2, timeLine.c_str(), innerW);
-        wattroff(infoWin, COLOR_PAIR(3));
+    // Copies the value stored for path when its stamp matches. Never locks.
+    bool find(const std::string& path, int64_t mtime, uint64_t size, void* value) {
+        if (!hdr_) return false;
+        if (hdr_->retired.load(std::memory_order_acquire)) follow();
+        uint64_t h = hash(path);
+        const SharedIndexRecord* r = record(slots()[probe(path, h)].load(std::memory_order_acquire));
+        if (!r || r->mtime != mtime || r->size != size) return false;
+        std::memcpy(value, payload(r), valueSize_);
+        return true;
+    }
 
-        for (int i = 0; i < barW; i++) {
-            if (i < filled) wattron(infoWin, COLOR_PAIR(4) | A_BOLD);
-            else wattron(infoWin, COLOR_PAIR(2));
-            mvwaddch(infoWin, barY, 2 + i, (i < filled) ? '=' : '-');
-            if (i < filled) wattroff(infoWin, COLOR_PAIR(4) | A_BOLD);
-            else wattroff(infoWin, COLOR_PAIR(2));
+    // Stores a value for path, unless another instance already stored the
+    // same one.
+    bool put(const std::string& path, int64_t mtime, uint64_t size, const void* value) {
+        if (path_.empty() || path.empty() || !lock_current()) return false;
+        uint64_t h = hash(path), need = record_size(path.size());
+        uint32_t i = probe(path, h);
+        uint64_t cur = slots()[i].load(std::memory_order_relaxed);
+        const SharedIndexRecord* old = record(cur);
+        if (old && old->mtime == mtime && old->size == size && std::memcmp(payload(old), value, valueSize_) == 0) {
+            unlock();
+            return true;
+        }
+        uint32_t live = hdr_->live.load(std::memory_order_relaxed);
+        if (hdr_->used.load(std::memory_order_relaxed) + need > hdr_->capacity ||
+            (!cur && (uint64_t)(live + 1) * 2 > hdr_->slots)) {
+            uint32_t n = hdr_->slots;
+            while ((uint64_t)(live + 1) * 2 > n) n *= 2;
+            if (!rebuild(n, need)) {
+                unlock();
+                return false;
+            }
+            i = probe(path, h);
+            cur = slots()[i].load(std::memory_order_relaxed);
         }
 
-        std::string modeLine = std::string("Visualizer: ") + ((mode == WAVEFORM) ? "Waveform" : "Spectrum");
-        wattron(infoWin, COLOR_PAIR(5));
-        mvwaddnstr(infoWin, barY + 1, 2, modeLine.c_str(), innerW);
-        wattroff(infoWin, COLOR_PAIR(5));
+        uint64_t at = hdr_->used.load(std::memory_order_relaxed);
+        char* base = reinterpret_cast<char*>(hdr_);
+        SharedIndexRecord r = { mtime, size, (uint32_t)path.size(), 0 };
+        std::memcpy(base + at, &r, sizeof(r));
+        std::memcpy(base + at + sizeof(r), path.data(), path.size());
+        std::memcpy(base + at + sizeof(r) + align8(path.size()), value, valueSize_);
+        hdr_->used.store(at + need, std::memory_order_release);
+        slots()[i].store(at | (h >> SHARED_INDEX_OFFSET_BITS << SHARED_INDEX_OFFSET_BITS), std::memory_order_release);
+        if (!cur) hdr_->live.fetch_add(1, std::memory_order_relaxed);
+        unlock();
+        return true;
     }
 
-    wrefresh(infoWin);
-}
-
-static void draw_scrollbar(WINDOW* w, int contentTopY, int contentBottomY, int totalItems, int firstIndex, int visibleItems) {
-    if (!w) return;
-    int h, ww;
-    getmaxyx(w, h, ww);
-    if (ww < 3) return;
-    if (totalItems <= visibleItems || visibleItems <= 0) return;
+    uint32_t live() const { return hdr_ ? hdr_->live.load(std::memory_order_relaxed) : 0; }
+    uint64_t generation() const { return hdr_ ? hdr_->generation : 0; }
+    size_t mapped() const { return mapped_; }
+
+private:
+    static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+    size_t record_size(size_t pathLen) const { return sizeof(SharedIndexRecord) + align8(pathLen) + align8(valueSize_); }
+    static uint64_t hash(const std::string& s) {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
 
-    int sbX = ww - 2;
-    int sbTop = contentTopY;
-    int sbBottom = contentBottomY;
-    int sbH = sbBottom - sbTop + 1;
-    if (sbH <= 0) return;
+    std::atomic<uint64_t>* slots() const {
+        return reinterpret_cast<std::atomic<uint64_t>*>(reinterpret_cast<char*>(hdr_) + sizeof(SharedIndexHeader));
+    }
+    uint64_t data_start(uint32_t n) const { return sizeof(SharedIndexHeader) + (uint64_t)n * sizeof(uint64_t); }
+
+    // The record a slot points at, or null for an empty or damaged slot.
+    const SharedIndexRecord* record(uint64_t slot) const {
+        uint64_t at = slot & ((1ull << SHARED_INDEX_OFFSET_BITS) - 1);
+        if (!slot || at < data_start(hdr_->slots) || (at & 7) || at + sizeof(SharedIndexRecord) > hdr_->capacity) return nullptr;
+        const SharedIndexRecord* r = reinterpret_cast<const SharedIndexRecord*>(reinterpret_cast<const char*>(hdr_) + at);
+        if (at + record_size(r->pathLen) > hdr_->capacity) return nullptr;
+        return r;
+    }
+    const void* payload(const SharedIndexRecord* r) const {
+        return reinterpret_cast<const char*>(r + 1) + align8(r->pathLen);
+    }
 
-    double fracTop = (double)firstIndex / (double)std::max(1, totalItems);
-    double fracVis = (double)visibleItems / (double)std::max(1, totalItems);
+    // The slot holding path, or the empty slot where it would go. The table
+    // is never more than half full, so the walk ends.
+    uint32_t probe(const std::string& path, uint64_t h) const {
+        uint32_t mask = hdr_->slots - 1;
+        uint64_t tag = h >> SHARED_INDEX_OFFSET_BITS;
+        for (uint32_t i = (uint32_t)h & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+            uint64_t s = slots()[i].load(std::memory_order_acquire);
+            if (!s) return i;
+            if (s >> SHARED_INDEX_OFFSET_BITS != tag) continue;
+            const SharedIndexRecord* r = record(s);
+            if (r && r->pathLen == path.size() && std::memcmp(r + 1, path.data(), path.size()) == 0) return i;
+        }
+        return 0;
+    }
 
-    int thumbH = clampi((int)std::round(fracVis * sbH), 1, sbH);
-    int thumbY = sbTop + clampi((int)std::round(fracTop * sbH), 0, sbH - thumbH);
+    // Maps fd if it is an index for this store.
+    SharedIndexHeader* map_file(int fd, uint64_t size) const {
+        if (size < sizeof(SharedIndexHeader)) return nullptr;
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        const SharedIndexHeader* h = static_cast<const SharedIndexHeader*>(mem);
+        bool ok = std::memcmp(h->magic, "TWIX", 4) == 0 && std::memcmp(h->store, magic_, 4) == 0 &&
+                  h->version == SHARED_INDEX_VERSION && h->storeVersion == version_ && h->valueSize == valueSize_ &&
+                  h->slots >= 2 && (h->slots & (h->slots - 1)) == 0 && h->capacity == size &&
+                  data_start(h->slots) <= size && h->used.load() >= data_start(h->slots) && h->used.load() <= size;
+        if (!ok) {
+            munmap(mem, size);
+            return nullptr;
+        }
+        return static_cast<SharedIndexHeader*>(mem);
+    }
 
-    wattron(w, COLOR_PAIR(2));
-    for (int y = sbTop; y <= sbBottom; y++) mvwaddch(w, y, sbX, ACS_VLINE);
-    wattroff(w, COLOR_PAIR(2));
+    // Maps the file that replaced ours, without taking the lock. A renamed
+    // file is always complete.
+    void follow() {
+        int fd = ::open(path_.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        SharedIndexHeader* h = fd >= 0 && fstat(fd, &st) == 0 ? map_file(fd, (uint64_t)st.st_size) : nullptr;
+        if (!h) {
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        close();
+        fd_ = fd;
+        hdr_ = h;
+        mapped_ = (size_t)st.st_size;
+    }
 
-    wattron(w, COLOR_PAIR(1) | A_BOLD);
-    for (int y = thumbY; y < thumbY + thumbH; y++) mvwaddch(w, y, sbX, ' ');
-    wattroff(w, COLOR_PAIR(1) | A_BOLD);
-}
+    // Takes the writer lock on the file now at path_, following renames by
+    // other instances, and starts a fresh file when it is missing or not a
+    // usable index.
+    bool lock_current() {
+        for (int attempt = 0; attempt < 8; attempt++) {
+            if (fd_ < 0) {
+                fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+                if (fd_ < 0) return false;
+            }
+            struct stat ours, named;
+            if (flock(fd_, LOCK_EX) != 0 || fstat(fd_, &ours) != 0) {
+                close();
+                return false;
+            }
+            if (::stat(path_.c_str(), &named) != 0 || ours.st_ino != named.st_ino || ours.st_dev != named.st_dev) {
+                close();
+                continue;
+            }
+            if (!hdr_ && (hdr_ = map_file(fd_, (uint64_t)ours.st_size))) mapped_ = (size_t)ours.st_size;
+            if (hdr_ || rebuild(SHARED_INDEX_SLOTS, 0)) return true;
+            close();
+            return false;
+        }
+        return false;
+    }
 
-static void draw_navigation(const fs::path& current, const std::vector<fs::directory_entry>& dirList, int highlight) {
-    if (!navWin) return;
+    void unlock() {
+        if (fd_ >= 0) flock(fd_, LOCK_UN);
+    }
 
-    werase(navWin);
-    draw_border(navWin, 2, false);
+    // Writes a compacted copy with n slots and room for extra more bytes,
+    // locks it, renames it over path_ and retires the current file. Called
+    // with the lock held.
+    bool rebuild(uint32_t n, uint64_t extra) {
+        uint64_t liveBytes = 0;
+        if (hdr_) {
+            for (uint32_t i = 0; i < hdr_->slots; i++) {
+                if (const SharedIndexRecord* r = record(slots()[i].load(std::memory_order_relaxed))) liveBytes += record_size(r->pathLen);
+            }
+        }
+        uint64_t capacity = data_start(n) + std::max<uint64_t>(SHARED_INDEX_BYTES, 2 * (liveBytes + extra));
+        capacity = (capacity + 4095) & ~(uint64_t)4095;
+
+        fs::path tmp = path_;
+        tmp += ".tmp" + std::to_string(getpid());
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        // Reserve the blocks now: a store into a hole on a full disk would
+        // be a SIGBUS rather than an error.
+        void* mem = posix_fallocate(fd, 0, (off_t)capacity) == 0
+                        ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (mem == MAP_FAILED) {
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+        }
 
-    std::string title = "Browser";
-    draw_title(navWin, title, 1);
+        SharedIndexHeader* h = static_cast<SharedIndexHeader*>(mem);
+        std::memcpy(h->store, magic_, 4);
+        h->version = SHARED_INDEX_VERSION;
+        h->storeVersion = version_;
+        h->valueSize = valueSize_;
+        h->slots = n;
+        h->capacity = capacity;
+        h->generation = hdr_ ? hdr_->generation + 1 : 0;
+        uint64_t at = data_start(n);
+        uint32_t live = 0;
+        auto* to = reinterpret_cast<std::atomic<uint64_t>*>(static_cast<char*>(mem) + sizeof(SharedIndexHeader));
+        for (uint32_t i = 0; hdr_ && i < hdr_->slots; i++) {
+            uint64_t s = slots()[i].load(std::memory_order_relaxed);
+            const SharedIndexRecord* r = record(s);
+            if (!r) continue;
+            size_t bytes = record_size(r->pathLen);
+            std::memcpy(static_cast<char*>(mem) + at, r, bytes);
+            uint64_t tag = s >> SHARED_INDEX_OFFSET_BITS;
+            uint32_t j = (uint32_t)hash(std::string(reinterpret_cast<const char*>(r + 1), r->pathLen)) & (n - 1);
+            while (to[j].load(std::memory_order_relaxed)) j = (j + 1) & (n - 1);
+            to[j].store(at | tag << SHARED_INDEX_OFFSET_BITS, std::memory_order_relaxed);
+            at += bytes;
+            live++;
+        }
+        h->used.store(at, std::memory_order_relaxed);
+        h->live.store(live, std::memory_order_relaxed);
+        std::memcpy(h->magic, "TWIX", 4);
+
+        if (flock(fd, LOCK_EX) != 0 || ::rename(tmp.c_str(), path_.c_str()) != 0) {
+            munmap(mem, capacity);
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        if (hdr_) hdr_->retired.store(1, std::memory_order_release);
+        close();
+        fd_ = fd;
+        hdr_ = h;
+        mapped_ = capacity;
+        return true;
+    }
 
-    int navH, navW;
-    getmaxyx(navWin, navH, navW);
-    int innerH = navH - 2;
-    int innerW = navW - 4;
-    if (innerH <= 0 || innerW <= 0) { wrefresh(navWin); return; }
+    const char* magic_;
+    uint32_t version_;
+    uint32_t valueSize_;
+    fs::path path_;
+    int fd_ = -1;
+    SharedIndexHeader* hdr_ = nullptr;
+    size_t mapped_ = 0;
+};
 
-    int headerY = 1;
-    std::string dirLine = ellipsize_middle(current.string(), innerW);
-    wattron(navWin, COLOR_PAIR(5));
-    mvwaddnstr(navWin, headerY, 2, dirLine.c_str(), innerW);
-    wattroff(navWin, COLOR_PAIR(5));
+template <typename T>
+class TrackJobs {
+    static_assert(std::is_trivially_copyable<T>::value, "TrackJobs results are stored as raw bytes");
+
+public:
+    using Compute = bool (*)(const std::string& path, const CancelToken& tok, T& out);
+    using Ready = void (*)(const std::string& path, const T& value);
+
+    TrackJobs(const char* cacheName, const char* magic, uint32_t version, int maxJobs, Compute compute)
+        : cacheName_(cacheName), maxJobs_(maxJobs), compute_(compute), index_(magic, version, sizeof(T)) {}
+
+    // Queues paths not seen yet. With front set they go ahead of the queue,
+    // each at most once, so repeated requests do not grow it.
+    void want(const std::vector<std::string>& paths, bool front) {
+        std::lock_guard<std::mutex> lk(m_);
+        for (size_t k = 0; k < paths.size(); k++) {
+            // Front requests are pushed last first to keep their order.
+            const std::string& p = front ? paths[paths.size() - 1 - k] : paths[k];
+            auto ins = entries_.emplace(p, TrackResult<T>());
+            TrackResult<T>& r = ins.first->second;
+            if (!ins.second && (r.state != TJ_QUEUED || !front || r.promoted)) continue;
+            if (front) {
+                r.promoted = true;
+                wanted_.push_front(p);
+            } else {
+                wanted_.push_back(p);
+            }
+        }
+        pump();
+    }
 
-    int contentTop = 3;
-    int contentBottom = navH - 2;
-    int linesForItems = contentBottom - contentTop + 1;
-    if (linesForItems < 1) { wrefresh(navWin); return; }
+    // Forgets queued requests (the directory changed). Running jobs finish
+    // and keep their results.
+    void drop_queued() {
+        std::lock_guard<std::mutex> lk(m_);
+        wanted_.clear();
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.state == TJ_QUEUED) it = entries_.erase(it);
+            else ++it;
+        }
+    }
 
-    int totalItems = (int)dirList.size() + 1;
-    highlight = clampi(highlight, 0, std::max(0, totalItems - 1));
+    // Bumped whenever a result lands.
+    unsigned generation() const { return gen_.load(); }
 
-    if (highlight < listOffset) listOffset = highlight;
-    if (highlight >= listOffset + linesForItems) listOffset = highlight - linesForItems + 1;
-    listOffset = clampi(listOffset, 0, std::max(0, totalItems - linesForItems));
+    // Called on the worker, unlocked, with each successful result. Set it
+    // before the first want().
+    void on_ready(Ready fn) { ready_ = fn; }
 
-    int nameW = innerW - 6;
-    if (nameW < 8) nameW = innerW;
+    // How finished jobs were served, since start.
+    struct Counts { unsigned long computed, cached, failed; };
+    Counts counts() {
+        std::lock_guard<std::mutex> lk(m_);
+        return { computed_, cached_, failed_ };
+    }
 
-    for (int row = 0; row < linesForItems; row++) {
-        int idx = listOffset + row;
-        if (idx >= totalItems) break;
+    // Lookups hold the lock across find(); results stay valid while held.
+    std::mutex& mutex() { return m_; }
+    const TrackResult<T>* find(const std::string& path) const {
+        auto it = entries_.find(path);
+        return it == entries_.end() ? nullptr : &it->second;
+    }
 
-        int y = contentTop + row;
-        bool selected = (idx == highlight);
+    void shutdown() {
+        token_.cancel();
+        std::lock_guard<std::mutex> lk(indexMutex_);
+        index_.close();
+    }
 
-        if (selected) wattron(navWin, A_REVERSE | A_BOLD);
+private:
+    // Starts queued work up to maxJobs_ at a time. Locked.
+    void pump() {
+        while (running_ < maxJobs_ && !wanted_.empty()) {
+            std::string path = std::move(wanted_.front());
+            wanted_.pop_front();
+            auto it = entries_.find(path);
+            if (it == entries_.end() || it->second.state != TJ_QUEUED) continue;
+            it->second.state = TJ_RUNNING;
+            running_++;
+            workerPool.submit(LANE_BULK, token_, [this, path] { run(path); });
+        }
+    }
 
-        if (idx == 0) {
-            wattron(navWin, COLOR_PAIR(3) | (selected ? A_REVERSE : 0));
-            mvwaddnstr(navWin, y, 2, " ..", innerW);
-            wattroff(navWin, COLOR_PAIR(3) | (selected ? A_REVERSE : 0));
-        } else {
-            int realIndex = idx - 1;
-            auto& e = dirList[realIndex];
-            bool isDir = e.is_directory();
-            std::string nm = e.path().filename().string();
-            std::string icon = isDir ? " [D] " : " [F] ";
-            std::string line = icon + nm + (isDir ? "/" : "");
-            line = ellipsize_end(line, innerW);
-
-            int pair = isDir ? 1 : 2;
-            wattron(navWin, COLOR_PAIR(pair) | (selected ? A_REVERSE : 0));
-            mvwaddnstr(navWin, y, 2, line.c_str(), innerW);
-            wattroff(navWin, COLOR_PAIR(pair) | (selected ? A_REVERSE : 0));
+    void run(const std::string& path) {
+        TrackResult<T> r;
+        bool stamped = file_stamp(path, r.mtime, r.size);
+        bool cached = false;
+        {
+            std::lock_guard<std::mutex> lk(indexMutex_);
+            if (!loaded_) open_index();
+            cached = stamped && index_.find(path, r.mtime, r.size, &r.value);
+        }
+        bool ok = cached || (stamped && compute_(path, token_, r.value));
+        if (ok && !cached && !token_.cancelled()) {
+            std::lock_guard<std::mutex> lk(indexMutex_);
+            index_.put(path, r.mtime, r.size, &r.value);
         }
 
-        if (selected) wattroff(navWin, A_REVERSE | A_BOLD);
+        std::unique_lock<std::mutex> lk(m_);
+        running_--;
+        if (token_.cancelled()) return;
+        r.state = ok ? TJ_READY : TJ_FAILED;
+        entries_[path] = r;
+        (ok ? (cached ? cached_ : computed_) : failed_)++;
+        gen_.fetch_add(1);
+        pump();
+        lk.unlock();
+        if (ok && ready_) ready_(path, r.value);
     }
 
-    draw_scrollbar(navWin, contentTop, contentBottom, totalItems, listOffset, linesForItems);
+    // Under indexMutex_.
+    void open_index() {
+        loaded_ = true;
+        if (token_.cancelled()) return;
+        fs::path p = track_cache_path(cacheName_);
+        std::error_code ec;
+        fs::create_directories(p.parent_path(), ec);
+        index_.open(p);
+    }
 
-    wrefresh(navWin);
-}
+    const char* cacheName_;
+    int maxJobs_;
+    Compute compute_;
+    Ready ready_ = nullptr;
+
+    // m_ guards the in-memory state the UI reads on every redraw, so it is
+    // never held across the on-disk index: opening, growing or locking that
+    // can wait on the disk or on another instance.
+    std::mutex m_;
+    std::unordered_map<std::string, TrackResult<T>> entries_;
+    std::deque<std::string> wanted_;
+    int running_ = 0;
+    unsigned long computed_ = 0, cached_ = 0, failed_ = 0;
+
+    std::mutex indexMutex_;   // index_ and loaded_; workers only
+    SharedTrackIndex index_;
+    bool loaded_ = false;
+    CancelToken token_;   // cancelled at shutdown only
+    std::atomic<unsigned> gen_{0};
+};
 
-static void draw_visualization(const std::vector<int16_t>& mono, const std::vector<double>& mags, VisualizationMode mode) {
-    if (!waveWin) return;
+// Browser sparklines: OVERVIEW_POINTS peak values per MP3.
+#define OVERVIEW_POINTS 32
 
-    int h, w;
-    getmaxyx(waveWin, h, w);
-    if (h < 5 || w < 20) {
-        werase(waveWin);
-        draw_border(waveWin, 2, false);
-        draw_title(waveWin, "Visualizer", 1);
-        wrefresh(waveWin);
-        return;
+struct OverviewPeaks {
+    uint8_t peaks[OVERVIEW_POINTS];
+};
+
+// Peak envelope of a whole file. mpg123 mixes to mono and decodes at a
+// quarter of the rate, which is plenty for a few dozen points.
+static bool compute_overview(const std::string& path, const CancelToken& tok, OverviewPeaks& out) {
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_FORCE_MONO | MPG123_QUIET, 0.0);
+    mpg123_param(mh, MPG123_DOWN_SAMPLE, 2, 0.0);
+
+    long rate;
+    int channels, encoding;
+    bool ok = mpg123_open(mh, path.c_str()) == MPG123_OK && mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK;
+    std::vector<uint16_t> chunkPeaks;
+    if (ok) {
+        mpg123_format_none(mh);
+        mpg123_format(mh, rate, MPG123_MONO, MPG123_ENC_SIGNED_16);
+        int16_t buf[2048];
+        size_t done = 0;
+        while (!tok.cancelled()) {
+            int ret = mpg123_read(mh, reinterpret_cast<unsigned char*>(buf), sizeof(buf), &done);
+            int peak = 0;
+            for (size_t i = 0; i < done / sizeof(int16_t); i++) peak = std::max(peak, std::abs((int)buf[i]));
+            if (done) chunkPeaks.push_back((uint16_t)std::min(peak, 32767));
+            if (ret != MPG123_OK && ret != MPG123_NEW_FORMAT) break;
+        }
+        ok = !tok.cancelled() && !chunkPeaks.empty();
+    }
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    if (!ok) return false;
+
+    size_t n = chunkPeaks.size();
+    for (size_t p = 0; p < OVERVIEW_POINTS; p++) {
+        size_t a = p * n / OVERVIEW_POINTS, b = std::max(a + 1, (p + 1) * n / OVERVIEW_POINTS);
+        uint16_t m = 0;
+        for (size_t i = a; i < b && i < n; i++) m = std::max(m, chunkPeaks[i]);
+        out.peaks[p] = (uint8_t)(m >> 7);
     }
+    return true;
+}
 
-    werase(waveWin);
-    draw_border(waveWin, 2, false);
+static TrackJobs<OverviewPeaks> overviews("overviews.bin", "TWOV", 2, 2, compute_overview);
 
-    std::string vt = std::string("Visualizer - ") + ((mode == WAVEFORM) ? "Waveform" : "Spectrum");
-    draw_title(waveWin, vt, 1);
+// Tempo and beat grid per track (compute_beats() lives with the FFT code).
+struct BeatGrid {
+    float bpm;          // 0 when no steady tempo was found
+    float firstBeat;    // seconds
+    float period;       // seconds
+    float confidence;   // autocorrelation peak over onset energy
+    float speed;        // analysis speed, x real time
+};
 
-    int plotTop = 2;
-    int plotBottom = h - 2;
-    int plotLeft = 1;
-    int plotRight = w - 2;
+static bool compute_beats(const std::string& path, const CancelToken& tok, BeatGrid& out);
+static TrackJobs<BeatGrid> beatTracks("beats.bin", "TWBT", 1, 2, compute_beats);
+
+// Acoustic fingerprint per track for duplicate detection (the code lives
+// with the FFT code). Bit (s, b) is set when the log-energy difference
+// between bands b and b + 1 grew from segment s to s + 1, which survives
+// re-encoding, bitrate and gain changes. A floor relative to each segment's
+// level keeps near-empty bands from contributing coin flips.
+#define FP_SEGMENTS 64
+#define FP_BANDS 17
+#define FP_WORDS (FP_SEGMENTS * (FP_BANDS - 1) / 32)
+#define FP_SECONDS 32
+#define FP_FLOOR 0.05   // band energy floor, fraction of the segment mean
+
+struct Fingerprint {
+    uint32_t bits[FP_WORDS];
+    float seconds;   // whole track, from the decoder's length estimate
+};
 
-    int plotH = plotBottom - plotTop + 1;
-    int plotW = plotRight - plotLeft + 1;
-    if (plotH <= 0 || plotW <= 0) { wrefresh(waveWin); return; }
+static bool compute_fingerprint(const std::string& path, const CancelToken& tok, Fingerprint& out);
+static TrackJobs<Fingerprint> fingerprints("fingerprints.bin", "TWFP", 1,
+                                           (int)std::max(2u, std::thread::hardware_concurrency()), compute_fingerprint);
+
+// Duplicate scan of the browsed directory tree. The walk and the wait for
+// fingerprints run as one bulk job; the UI reads its progress for the
+// status bar and shows the groups in a popup once it finishes.
+struct DupeScan {
+    std::mutex m;
+    bool running = false;
+    bool ready = false;
+    std::atomic<size_t> done{0};
+    std::atomic<size_t> total{0};
+    fs::path root;
+    std::chrono::steady_clock::time_point started;
+    unsigned long computedBefore = 0, cachedBefore = 0;
+    std::vector<std::vector<std::string>> groups;
+    char summary[128] = "";
+    CancelToken token;   // cancelled at shutdown only
+};
 
-    int midY = plotTop + plotH / 2;
+static DupeScan dupeScan;
+
+// Batch export of the queue, or of the browsed folder when the queue is
+// empty, to 16-bit WAV or FLAC. Each track is a bulk job of its own; at
+// most `slots` run at once and the next starts as one finishes. The UI
+// reads the counters for the status bar and the export popup.
+enum ExportFormat { EXPORT_FLAC, EXPORT_WAV };
+
+struct ExportRun {
+    std::mutex m;
+    bool running = false;
+    ExportFormat format = EXPORT_FLAC;
+    std::vector<QueueItem> items;
+    fs::path dest;
+    int gain = 32768;              // volume when the export started, Q15
+    int slots = 1;
+    size_t next = 0;               // first item not yet started
+    int active = 0;                // jobs started and not finished
+    std::atomic<size_t> done{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> total{0};
+    std::atomic<unsigned long long> audioUs{0};   // audio written, for the speed
+    std::chrono::steady_clock::time_point started;
+    char summary[PATH_BUF_SIZE + 96] = "";   // the last run, or why it could not start
+    CancelToken token;             // replaced per run; cancelled to stop it
+};
 
-    wattron(waveWin, COLOR_PAIR(5));
-    for (int x = plotLeft; x <= plotRight; x++) mvwaddch(waveWin, midY, x, '.');
-    wattroff(waveWin, COLOR_PAIR(5));
+static ExportRun exportRun;
 
-    if (mode == WAVEFORM) {
-        if (!mono.empty()) {
-            for (int x = 0; x < plotW; x++) {
-                int idx = (int)std::round((double)x / (double)std::max(1, plotW - 1) * (double)(mono.size() - 1));
-                idx = clampi(idx, 0, (int)mono.size() - 1);
-                double v = (double)mono[idx] / 32768.0;
-                int yOff = (int)std::round(v * (double)(plotH / 2));
-                int y = clampi(midY - yOff, plotTop, plotBottom);
-                wattron(waveWin, COLOR_PAIR(4) | A_BOLD);
-                mvwaddch(waveWin, y, plotLeft + x, '*');
-                wattroff(waveWin, COLOR_PAIR(4) | A_BOLD);
-            }
-        } else {
-            std::string msg = "No data";
-            wattron(waveWin, COLOR_PAIR(3));
-            mvwaddnstr(waveWin, midY, plotLeft + clampi((plotW - (int)msg.size()) / 2, 0, plotW - 1), msg.c_str(), plotW);
-            wattroff(waveWin, COLOR_PAIR(3));
-        }
-    } else {
-        if (!mags.empty()) {
-            double maxMag = 1e-12;
-            for (double v : mags) if (v > maxMag) maxMag = v;
+// Export speed so far as a multiple of real time; call with m held.
+static double export_speed() {
+    double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - exportRun.started).count();
+    return exportRun.audioUs.load() / 1e6 / std::max(took, 1e-3);
+}
 
-            int bins = (int)mags.size();
-            int bars = plotW;
-            int binsPerBar = std::max(1, bins / std::max(1, bars));
+// Per-track features for radio autoplay (computed with the FFT code): MFCC
+// means and spreads for timbre, loudness and tempo, scaled so that one unit
+// is a comparable step in each.
+#define MFCC_BANDS 26
+#define MFCC_COEFFS 12   // c1..c12; c0 is level, covered by loudness
+#define FEATURE_DIMS (2 * MFCC_COEFFS + 2)
+#define FEATURE_SECONDS 30
+#define MFCC_FLOOR 1e-4f   // mel energies are floored 40 dB below the frame's peak band
+
+struct TrackFeatures {
+    float v[FEATURE_DIMS];
+};
 
-            for (int x = 0; x < bars; x++) {
-                int start = x * binsPerBar;
-                int end = std::min(start + binsPerBar, bins);
-                if (start >= end) break;
+static bool compute_features(const std::string& path, const CancelToken& tok, TrackFeatures& out);
+static TrackJobs<TrackFeatures> trackFeatures("features.bin", "TWFE", 1, 2, compute_features);
 
-                double sum = 0.0;
-                for (int i = start; i < end; i++) sum += mags[i];
-                double avg = sum / (double)(end - start);
+// Radio: when the queue runs dry, the nearest track to the one that just
+// finished is queued. The index lives with the audio code; these are read
+// by the status bar.
+static std::atomic<bool> radioOn{false};
+static std::atomic<size_t> radioIndexed{0};
 
-                double ratio = std::log(avg + 1.0) / std::log(maxMag + 1.0);
-                if (ratio < 0.0) ratio = 0.0;
-                if (ratio > 1.0) ratio = 1.0;
+// Album art. Pictures are decoded by a small baseline JPEG decoder, reduced
+// to the cell grid of the Now Playing panel and cached on disk at that size,
+// so showing a cover again costs one small file read.
 
-                int bh = (int)std::round(ratio * (double)plotH);
-                bh = clampi(bh, 0, plotH);
+// RGBX pixels, four bytes each, rows packed.
+struct ArtImage {
+    int w = 0, h = 0;
+    std::vector<uint8_t> px;
+};
 
-                for (int yy = 0; yy < bh; yy++) {
-                    int y = plotBottom - yy;
-                    wattron(waveWin, COLOR_PAIR(4) | A_BOLD);
-                    mvwaddch(waveWin, y, plotLeft + x, '|');
-                    wattroff(waveWin, COLOR_PAIR(4) | A_BOLD);
+struct JpegHuffman {
+    bool defined = false;
+    uint8_t fastLen[256];     // code length for 8-bit prefixes, 0 if longer
+    uint8_t fastVal[256];
+    int maxcode[18];
+    int mincode[17];
+    int valptr[17];
+    uint8_t vals[256];
+};
+
+struct JpegComponent {
+    int id, h, v, tq;
+    int td = 0, ta = 0;
+    int pred = 0;
+    int bw = 0, bh = 0;       // plane size in blocks
+    std::vector<uint8_t> plane;
+};
+
+// Entropy-coded segment reader. A marker inside the data ends it; the
+// decoder then sees zero bits until it consumes the restart marker.
+struct JpegBits {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t acc = 0;
+    int n = 0;
+    bool marker = false;
+
+    void fill() {
+        while (n <= 24) {
+            uint32_t b = 0;
+            if (!marker && p < end) {
+                b = *p++;
+                if (b == 0xFF) {
+                    uint8_t next = p < end ? *p : 0xD9;
+                    if (next == 0) p++;
+                    else { marker = true; p--; b = 0; }
                 }
             }
-        } else {
-            std::string msg = "No spectrum";
-            wattron(waveWin, COLOR_PAIR(3));
-            mvwaddnstr(waveWin, midY, plotLeft + clampi((plotW - (int)msg.size()) / 2, 0, plotW - 1), msg.c_str(), plotW);
-            wattroff(waveWin, COLOR_PAIR(3));
+            acc |= b << (24 - n);
+            n += 8;
+        }
+    }
+    uint32_t peek(int k) { fill(); return acc >> (32 - k); }
+    void skip(int k) { acc <<= k; n -= k; }
+    int get(int k) {
+        if (k == 0) return 0;
+        int v = (int)peek(k);
+        skip(k);
+        return v;
+    }
+    bool restart() {
+        acc = 0;
+        n = 0;
+        marker = false;
+        if (p + 1 < end && p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7) { p += 2; return true; }
+        return false;
+    }
+};
+
+static bool jpeg_build_huffman(JpegHuffman& t, const uint8_t* counts, const uint8_t* vals, int total) {
+    std::memset(t.fastLen, 0, sizeof(t.fastLen));
+    std::memcpy(t.vals, vals, total);
+    int code = 0, k = 0;
+    for (int l = 1; l <= 16; l++) {
+        // An over-full length would index past the fast tables below.
+        if (code + counts[l - 1] > (1 << l)) return false;
+        t.valptr[l] = k;
+        t.mincode[l] = code;
+        for (int i = 0; i < counts[l - 1]; i++, k++, code++) {
+            if (l > 8) continue;
+            int first = code << (8 - l), span = 1 << (8 - l);
+            for (int x = 0; x < span; x++) {
+                t.fastLen[first + x] = (uint8_t)l;
+                t.fastVal[first + x] = vals[k];
+            }
+        }
+        t.maxcode[l] = counts[l - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    t.maxcode[17] = INT32_MAX;
+    t.defined = true;
+    return true;
+}
+
+static int jpeg_decode_symbol(JpegBits& b, const JpegHuffman& t) {
+    uint32_t look = b.peek(8);
+    if (t.fastLen[look]) {
+        b.skip(t.fastLen[look]);
+        return t.fastVal[look];
+    }
+    uint32_t code16 = b.peek(16);
+    for (int l = 9; l <= 16; l++) {
+        int code = (int)(code16 >> (16 - l));
+        if (t.maxcode[l] >= 0 && code <= t.maxcode[l]) {
+            b.skip(l);
+            return t.vals[t.valptr[l] + code - t.mincode[l]];
+        }
+    }
+    return -1;
+}
+
+static int jpeg_extend(int v, int s) {
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+static const uint8_t jpegZigzag[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Separable float IDCT into an 8x8 block of the plane at stride.
+static void jpeg_idct(const int* coef, uint8_t* out, int stride) {
+    static float basis[8][8];   // basis[x][u] = C(u) / 2 * cos((2x + 1) u pi / 16)
+    static bool ready = false;
+    if (!ready) {
+        for (int x = 0; x < 8; x++) {
+            for (int u = 0; u < 8; u++) basis[x][u] = (float)((u == 0 ? std::sqrt(0.5) : 1.0) * 0.5 * std::cos((2 * x + 1) * u * M_PI / 16.0));
+        }
+        ready = true;
+    }
+    float tmp[64];
+    for (int v = 0; v < 8; v++) {
+        for (int x = 0; x < 8; x++) {
+            float s = 0.0f;
+            for (int u = 0; u < 8; u++) s += basis[x][u] * coef[v * 8 + u];
+            tmp[v * 8 + x] = s;
+        }
+    }
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            float s = 128.0f;
+            for (int v = 0; v < 8; v++) s += basis[y][v] * tmp[v * 8 + x];
+            out[y * stride + x] = (uint8_t)clampi((int)std::lround(s), 0, 255);
+        }
+    }
+}
+
+// Decodes a baseline (sequential, Huffman-coded, 8-bit) JPEG, grey, YCbCr
+// or Adobe RGB, with sampling factors up to 4. When the picture is at least
+// eight times the wanted size, AC coefficients are skipped and each 8x8
+// block becomes one pixel from its DC term: an exact 1/8 box reduction with
+// no IDCT at all. Progressive files are read that way only, from their first
+// DC scan; arithmetic-coded and lossless files are rejected.
+static bool decode_jpeg(const uint8_t* data, size_t size, int wantW, int wantH, ArtImage& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    if (size < 4 || p[0] != 0xFF || p[1] != 0xD8) return false;
+    p += 2;
+
+    uint16_t quant[4][64];
+    bool quantDefined[4] = {};
+    JpegHuffman dc[4], ac[4];
+    std::vector<JpegComponent> comps;
+    int width = 0, height = 0, hmax = 1, vmax = 1, restartInterval = 0;
+    int mcusX = 0, mcusY = 0, adobeTransform = -1;
+    bool dcOnly = false, frame = false, scanned = false, progressive = false;
+
+    while (p + 4 <= end) {
+        if (p[0] != 0xFF) return false;
+        int marker = p[1];
+        if (marker == 0xFF) { p++; continue; }
+        p += 2;
+        if (marker == 0xD9) break;
+        if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0x01) continue;
+        int len = (p[0] << 8) | p[1];
+        if (len < 2 || p + len > end) return false;
+        const uint8_t* seg = p + 2;
+        const uint8_t* segEnd = p + len;
+        p = segEnd;
+
+        if (marker == 0xDB) {                                   // DQT
+            while (seg < segEnd) {
+                int pq = seg[0] >> 4, tq = seg[0] & 15;
+                seg++;
+                if (tq > 3 || seg + 64 * (pq + 1) > segEnd) return false;
+                for (int k = 0; k < 64; k++) quant[tq][k] = pq ? (uint16_t)(seg[2 * k] << 8 | seg[2 * k + 1]) : seg[k];
+                seg += 64 * (pq + 1);
+                quantDefined[tq] = true;
+            }
+        } else if (marker == 0xC4) {                            // DHT
+            while (seg + 17 <= segEnd) {
+                int tc = seg[0] >> 4, th = seg[0] & 15;
+                const uint8_t* counts = seg + 1;
+                int total = 0;
+                for (int i = 0; i < 16; i++) total += counts[i];
+                if (tc > 1 || th > 3 || total > 256 || seg + 17 + total > segEnd) return false;
+                if (!jpeg_build_huffman(tc ? ac[th] : dc[th], counts, seg + 17, total)) return false;
+                seg += 17 + total;
+            }
+        } else if (marker == 0xDD) {                            // DRI
+            if (len < 4) return false;
+            restartInterval = (seg[0] << 8) | seg[1];
+        } else if (marker == 0xEE) {                            // APP14
+            if (len >= 14 && std::memcmp(seg, "Adobe", 5) == 0) adobeTransform = seg[11];
+        } else if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {   // SOF0/1/2
+            if (frame || len < 8 || seg[0] != 8) return false;
+            progressive = marker == 0xC2;
+            height = (seg[1] << 8) | seg[2];
+            width = (seg[3] << 8) | seg[4];
+            int nc = seg[5];
+            if (width <= 0 || height <= 0 || width > 16384 || height > 16384 || (nc != 1 && nc != 3) || len < 8 + 3 * nc) return false;
+            for (int i = 0; i < nc; i++) {
+                JpegComponent c;
+                c.id = seg[6 + 3 * i];
+                c.h = seg[7 + 3 * i] >> 4;
+                c.v = seg[7 + 3 * i] & 15;
+                c.tq = seg[8 + 3 * i];
+                if (c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4 || c.tq > 3) return false;
+                hmax = std::max(hmax, c.h);
+                vmax = std::max(vmax, c.v);
+                comps.push_back(std::move(c));
+            }
+            mcusX = (width + 8 * hmax - 1) / (8 * hmax);
+            mcusY = (height + 8 * vmax - 1) / (8 * vmax);
+            dcOnly = width / 8 >= wantW && height / 8 >= wantH;
+            if (progressive && !dcOnly) return false;
+            int scale = dcOnly ? 1 : 8;
+            for (auto& c : comps) {
+                c.bw = mcusX * c.h;
+                c.bh = mcusY * c.v;
+                c.plane.assign((size_t)c.bw * scale * c.bh * scale, 128);
+            }
+            frame = true;
+        } else if (marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return false;                                       // lossless, hierarchical, arithmetic
+        } else if (marker == 0xDA) {                            // SOS
+            if (!frame || len < 6) return false;
+            int ns = seg[0];
+            if (ns < 1 || ns > (int)comps.size() || len < 6 + 2 * ns) return false;
+            int ss = seg[1 + 2 * ns], ah = seg[3 + 2 * ns] >> 4, al = seg[3 + 2 * ns] & 15;
+            // Continues after the entropy-coded data at the next marker.
+            auto skip_scan = [&](const uint8_t* from) {
+                p = from;
+                while (p + 1 < end && !(p[0] == 0xFF && p[1] != 0 && (p[1] < 0xD0 || p[1] > 0xD7))) p++;
+            };
+            if (progressive && (ss != 0 || ah != 0)) {          // AC or refinement: not needed
+                skip_scan(p);
+                continue;
+            }
+            std::vector<JpegComponent*> scan;
+            for (int i = 0; i < ns; i++) {
+                JpegComponent* c = nullptr;
+                for (auto& x : comps) if (x.id == seg[1 + 2 * i]) c = &x;
+                if (!c) return false;
+                c->td = seg[2 + 2 * i] >> 4;
+                c->ta = seg[2 + 2 * i] & 15;
+                if (c->td > 3 || c->ta > 3 || !dc[c->td].defined || (!progressive && !ac[c->ta].defined) || !quantDefined[c->tq]) return false;
+                c->pred = 0;
+                scan.push_back(c);
+            }
+
+            JpegBits bits{ p, end };
+            int coef[64];
+            // Decodes one block into the plane at block (bx, by).
+            auto block = [&](JpegComponent& c, int bx, int by) {
+                int s = jpeg_decode_symbol(bits, dc[c.td]);
+                if (s < 0 || s > 11) return false;
+                c.pred += s ? jpeg_extend(bits.get(s), s) : 0;
+                const uint16_t* q = quant[c.tq];
+                if (progressive) {
+                    c.plane[(size_t)by * c.bw + bx] = (uint8_t)clampi(128 + ((c.pred << al) * q[0] + 4) / 8, 0, 255);
+                    return true;
+                }
+                if (dcOnly) {
+                    for (int k = 1; k < 64;) {
+                        int rs = jpeg_decode_symbol(bits, ac[c.ta]);
+                        if (rs < 0) return false;
+                        int r = rs >> 4, sz = rs & 15;
+                        if (sz) { k += r + 1; bits.get(sz); }
+                        else if (r == 15) k += 16;
+                        else break;
+                    }
+                    c.plane[(size_t)by * c.bw + bx] = (uint8_t)clampi(128 + (c.pred * q[0] + 4) / 8, 0, 255);
+                    return true;
+                }
+                std::fill(coef, coef + 64, 0);
+                coef[0] = c.pred * q[0];
+                for (int k = 1; k < 64;) {
+                    int rs = jpeg_decode_symbol(bits, ac[c.ta]);
+                    if (rs < 0) return false;
+                    int r = rs >> 4, sz = rs & 15;
+                    if (sz) {
+                        k += r;
+                        if (k > 63) return false;
+                        coef[jpegZigzag[k]] = jpeg_extend(bits.get(sz), sz) * q[k];
+                        k++;
+                    } else if (r == 15) {
+                        k += 16;
+                    } else {
+                        break;
+                    }
+                }
+                size_t stride = (size_t)c.bw * 8;
+                jpeg_idct(coef, &c.plane[(size_t)by * 8 * stride + (size_t)bx * 8], (int)stride);
+                return true;
+            };
+
+            // One component alone is coded block by block over its own
+            // extent; several are interleaved in MCUs.
+            int unitsX = mcusX, unitsY = mcusY;
+            if (ns == 1) {
+                JpegComponent& c = *scan[0];
+                unitsX = ((width * c.h + hmax - 1) / hmax + 7) / 8;
+                unitsY = ((height * c.v + vmax - 1) / vmax + 7) / 8;
+            }
+            int sinceRestart = 0;
+            for (int uy = 0; uy < unitsY; uy++) {
+                for (int ux = 0; ux < unitsX; ux++) {
+                    if (restartInterval && sinceRestart == restartInterval) {
+                        if (!bits.restart()) return false;
+                        for (auto* c : scan) c->pred = 0;
+                        sinceRestart = 0;
+                    }
+                    sinceRestart++;
+                    if (ns == 1) {
+                        if (!block(*scan[0], ux, uy)) return false;
+                        continue;
+                    }
+                    for (auto* c : scan) {
+                        for (int v = 0; v < c->v; v++) {
+                            for (int h = 0; h < c->h; h++) {
+                                if (!block(*c, ux * c->h + h, uy * c->v + v)) return false;
+                            }
+                        }
+                    }
+                }
+            }
+            skip_scan(bits.p);
+            scanned = true;
+        }
+    }
+    if (!scanned) return false;
+    bool rgb = comps.size() == 3 && (adobeTransform == 0 || (comps[0].id == 'R' && comps[1].id == 'G' && comps[2].id == 'B'));
+
+    int scale = dcOnly ? 8 : 1;
+    out.w = (width + scale - 1) / scale;
+    out.h = (height + scale - 1) / scale;
+    out.px.resize((size_t)out.w * out.h * 4);
+    for (int y = 0; y < out.h; y++) {
+        uint8_t* row = &out.px[(size_t)y * out.w * 4];
+        for (int x = 0; x < out.w; x++) {
+            int s[3];
+            for (size_t i = 0; i < comps.size(); i++) {
+                const JpegComponent& c = comps[i];
+                int stride = c.bw * (dcOnly ? 1 : 8);
+                s[i] = c.plane[(size_t)(y * c.v / vmax) * stride + (size_t)(x * c.h / hmax)];
+            }
+            uint8_t* o = row + x * 4;
+            if (comps.size() == 1) {
+                o[0] = o[1] = o[2] = (uint8_t)s[0];
+            } else if (rgb) {
+                o[0] = (uint8_t)s[0];
+                o[1] = (uint8_t)s[1];
+                o[2] = (uint8_t)s[2];
+            } else {
+                float yy = (float)s[0], cb = s[1] - 128.0f, cr = s[2] - 128.0f;
+                o[0] = (uint8_t)clampi((int)std::lround(yy + 1.402f * cr), 0, 255);
+                o[1] = (uint8_t)clampi((int)std::lround(yy - 0.344136f * cb - 0.714136f * cr), 0, 255);
+                o[2] = (uint8_t)clampi((int)std::lround(yy + 1.772f * cb), 0, 255);
+            }
+            o[3] = 255;
+        }
+    }
+    return true;
+}
+
+// Halves an RGBX image both ways by averaging 2x2 blocks; an odd last row
+// or column is dropped. Four output pixels per step with SSE2 or NEON.
+static void halve_rgbx(const uint8_t* src, int w, int h, uint8_t* dst) {
+    int ow = w / 2, oh = h / 2;
+    for (int y = 0; y < oh; y++) {
+        const uint8_t* a = src + (size_t)(2 * y) * w * 4;
+        const uint8_t* b = a + (size_t)w * 4;
+        uint8_t* o = dst + (size_t)y * ow * 4;
+        int x = 0;
+#if TW_HAVE_SSE2
+        for (; x + 4 <= ow; x += 4) {
+            __m128i lo = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x * 8)), _mm_loadu_si128((const __m128i*)(b + x * 8)));
+            __m128i hi = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x * 8 + 16)), _mm_loadu_si128((const __m128i*)(b + x * 8 + 16)));
+            __m128 lf = _mm_castsi128_ps(lo), hf = _mm_castsi128_ps(hi);
+            __m128i even = _mm_castps_si128(_mm_shuffle_ps(lf, hf, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(_mm_shuffle_ps(lf, hf, _MM_SHUFFLE(3, 1, 3, 1)));
+            _mm_storeu_si128((__m128i*)(o + x * 4), _mm_avg_epu8(even, odd));
+        }
+#elif TW_HAVE_NEON
+        for (; x + 4 <= ow; x += 4) {
+            uint32x4x2_t ra = vld2q_u32((const uint32_t*)(a + x * 8));
+            uint32x4x2_t rb = vld2q_u32((const uint32_t*)(b + x * 8));
+            uint8x16_t top = vrhaddq_u8(vreinterpretq_u8_u32(ra.val[0]), vreinterpretq_u8_u32(ra.val[1]));
+            uint8x16_t bottom = vrhaddq_u8(vreinterpretq_u8_u32(rb.val[0]), vreinterpretq_u8_u32(rb.val[1]));
+            vst1q_u8(o + x * 4, vrhaddq_u8(top, bottom));
+        }
+#endif
+        for (; x < ow; x++) {
+            for (int c = 0; c < 4; c++) {
+                o[x * 4 + c] = (uint8_t)((a[x * 8 + c] + a[x * 8 + 4 + c] + b[x * 8 + c] + b[x * 8 + 4 + c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+// Area-averaging resize of RGBX to packed RGB, for the last factor under
+// two after halve_rgbx(). Each output pixel averages the source area it
+// covers, with fractional weights at the edges.
+static void area_resize(const ArtImage& src, int dw, int dh, std::vector<uint8_t>& rgb) {
+    rgb.assign((size_t)dw * dh * 3, 0);
+    double sx = (double)src.w / dw, sy = (double)src.h / dh;
+    for (int y = 0; y < dh; y++) {
+        double y0 = y * sy, y1 = std::min((double)src.h, y0 + std::max(sy, 1.0));
+        for (int x = 0; x < dw; x++) {
+            double x0 = x * sx, x1 = std::min((double)src.w, x0 + std::max(sx, 1.0));
+            double acc[3] = {}, total = 0.0;
+            for (int yy = (int)y0; yy < y1; yy++) {
+                double wy = std::min(y1, yy + 1.0) - std::max(y0, (double)yy);
+                for (int xx = (int)x0; xx < x1; xx++) {
+                    double wgt = wy * (std::min(x1, xx + 1.0) - std::max(x0, (double)xx));
+                    const uint8_t* s = &src.px[((size_t)yy * src.w + xx) * 4];
+                    for (int c = 0; c < 3; c++) acc[c] += wgt * s[c];
+                    total += wgt;
+                }
+            }
+            for (int c = 0; c < 3; c++) rgb[((size_t)y * dw + x) * 3 + c] = (uint8_t)clampi((int)std::lround(acc[c] / std::max(total, 1e-9)), 0, 255);
+        }
+    }
+}
+
+// Fits a decoded picture into boxW x boxH pixels, keeping its aspect.
+static void make_thumbnail(ArtImage& img, int boxW, int boxH, int& w, int& h, std::vector<uint8_t>& rgb) {
+    double scale = std::min((double)boxW / img.w, (double)boxH / img.h);
+    w = clampi((int)std::lround(img.w * scale), 1, boxW);
+    h = clampi((int)std::lround(img.h * scale), 1, boxH);
+    ArtImage half;
+    while (img.w >= 2 * w && img.h >= 2 * h) {
+        half.w = img.w / 2;
+        half.h = img.h / 2;
+        half.px.resize((size_t)half.w * half.h * 4);
+        halve_rgbx(img.px.data(), img.w, img.h, half.px.data());
+        std::swap(img, half);
+    }
+    area_resize(img, w, h, rgb);
+}
+
+// Thumbnails are stored per track and box size as small files named by a
+// hash of path, mtime, size and box: "TWAR", u32 version, u16 width,
+// u16 height, then RGB rows. A new folder.jpg alone does not refresh them.
+#define ART_CACHE_VERSION 1
+
+static fs::path art_cache_file(const std::string& path, int boxW, int boxH) {
+    int64_t mtime = 0;
+    uint64_t fsize = 0;
+    file_stamp(path, mtime, fsize);
+    uint64_t hsh = 1469598103934665603ull;
+    auto mix = [&hsh](const void* d, size_t n) {
+        for (size_t i = 0; i < n; i++) hsh = (hsh ^ ((const uint8_t*)d)[i]) * 1099511628211ull;
+    };
+    mix(path.data(), path.size());
+    mix(&mtime, sizeof(mtime));
+    mix(&fsize, sizeof(fsize));
+    mix(&boxW, sizeof(boxW));
+    mix(&boxH, sizeof(boxH));
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.rgb", (unsigned long long)hsh);
+    return track_cache_path("art") / name;
+}
+
+static bool load_art_cache(const fs::path& file, int& w, int& h, std::vector<uint8_t>& rgb) {
+    std::FILE* f = std::fopen(file.c_str(), "rb");
+    if (!f) return false;
+    char magic[4];
+    uint32_t version = 0;
+    uint16_t dims[2] = {};
+    bool ok = std::fread(magic, 1, 4, f) == 4 && std::memcmp(magic, "TWAR", 4) == 0 &&
+              std::fread(&version, sizeof(version), 1, f) == 1 && version == ART_CACHE_VERSION &&
+              std::fread(dims, sizeof(dims), 1, f) == 1 && dims[0] > 0 && dims[1] > 0;
+    if (ok) {
+        w = dims[0];
+        h = dims[1];
+        rgb.resize((size_t)w * h * 3);
+        ok = std::fread(rgb.data(), 1, rgb.size(), f) == rgb.size();
+    }
+    std::fclose(f);
+    return ok;
+}
+
+static void save_art_cache(const fs::path& file, int w, int h, const std::vector<uint8_t>& rgb) {
+    std::error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    fs::path tmp = file;
+    tmp += ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return;
+    uint32_t version = ART_CACHE_VERSION;
+    uint16_t dims[2] = { (uint16_t)w, (uint16_t)h };
+    bool ok = std::fwrite("TWAR", 1, 4, f) == 4 && std::fwrite(&version, sizeof(version), 1, f) == 1 &&
+              std::fwrite(dims, sizeof(dims), 1, f) == 1 && std::fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (ok) fs::rename(tmp, file, ec);
+    else fs::remove(tmp, ec);
+}
+
+// Cover requests run on the interactive lane like directory listings; only
+// the newest may publish, and an empty result means the track has no art.
+struct ArtSlot {
+    std::mutex m;
+    unsigned id = 0;
+    bool ready = false;
+    std::string path;
+    int boxW = 0, boxH = 0;
+    int w = 0, h = 0;
+    std::vector<uint8_t> rgb;
+    double ms = 0.0;          // time to produce it
+    bool cached = false;
+    CancelToken token;
+};
+
+static ArtSlot artSlot;
+
+static void request_art(const std::string& path, int boxW, int boxH) {
+    std::lock_guard<std::mutex> lk(artSlot.m);
+    artSlot.token.cancel();
+    artSlot.token = CancelToken();
+    artSlot.ready = false;
+    unsigned id = ++artSlot.id;
+    CancelToken tok = artSlot.token;
+    workerPool.submit(LANE_INTERACTIVE, tok, [path, boxW, boxH, id, tok] {
+        auto t0 = std::chrono::steady_clock::now();
+        int w = 0, h = 0;
+        std::vector<uint8_t> rgb;
+        fs::path cacheFile = art_cache_file(path, boxW, boxH);
+        bool cached = load_art_cache(cacheFile, w, h, rgb);
+        if (!cached) {
+            std::vector<unsigned char> jpeg;
+            ArtImage img;
+            if (find_cover(path, jpeg) && !tok.cancelled() && decode_jpeg(jpeg.data(), jpeg.size(), boxW, boxH, img)) {
+                make_thumbnail(img, boxW, boxH, w, h, rgb);
+                save_art_cache(cacheFile, w, h, rgb);
+            } else {
+                w = h = 0;
+                rgb.clear();
+            }
+        }
+        if (tok.cancelled()) return;
+        std::lock_guard<std::mutex> lk(artSlot.m);
+        if (id != artSlot.id) return;
+        artSlot.path = path;
+        artSlot.boxW = boxW;
+        artSlot.boxH = boxH;
+        artSlot.w = w;
+        artSlot.h = h;
+        artSlot.rgb = std::move(rgb);
+        artSlot.cached = cached;
+        artSlot.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        artSlot.ready = true;
+    });
+}
+
+// The thumbnail on screen. Every distinct (top, bottom) colour of its cells
+// gets a pair from ART_PAIR_BASE up, assigned once when the image arrives.
+#define ART_PAIR_BASE 16
+#define ART_MAX_ROWS 12
+#define ART_MIN_TEXT 30
+
+struct ArtView {
+    std::string path;         // track the request was for
+    int boxW = 0, boxH = 0;   // pixel box it was rendered for
+    int w = 0, h = 0;         // thumbnail pixels, h rounded up to cells
+    std::vector<short> pairs; // per cell, 0 when there is nothing to draw
+};
+
+static ArtView artView;
+
+// xterm-256 palette index nearest to an RGB colour: the 6x6x6 cube or the
+// 24-step grey ramp, whichever is closer.
+static int xterm256(int r, int g, int b) {
+    static const int levels[6] = { 0, 95, 135, 175, 215, 255 };
+    auto step = [](int v) { return v < 48 ? 0 : (v < 115 ? 1 : (v - 35) / 40); };
+    int ri = step(r), gi = step(g), bi = step(b);
+    int cr = levels[ri], cg = levels[gi], cb = levels[bi];
+    int grey = clampi(((r + g + b) / 3 - 3) / 10, 0, 23), gv = 8 + 10 * grey;
+    int dc = (r - cr) * (r - cr) + (g - cg) * (g - cg) + (b - cb) * (b - cb);
+    int dg = (r - gv) * (r - gv) + (g - gv) * (g - gv) + (b - gv) * (b - gv);
+    return dg < dc ? 232 + grey : 16 + 36 * ri + 6 * gi + bi;
+}
+
+static int art_color(const uint8_t* rgb) {
+    if (artColors >= (1 << 24)) return (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+    return xterm256(rgb[0], rgb[1], rgb[2]);
+}
+
+// Moves a finished request into artView and sets up its colour pairs. An
+// image that would need more pairs than the terminal has is not shown.
+static bool take_art() {
+    std::lock_guard<std::mutex> lk(artSlot.m);
+    if (!artSlot.ready) return false;
+    artSlot.ready = false;
+    if (artSlot.path != artView.path || artSlot.boxW != artView.boxW || artSlot.boxH != artView.boxH) return false;
+    int cw = artSlot.w, ch = (artSlot.h + 1) / 2;
+    artView.w = cw;
+    artView.h = ch * 2;
+    artView.pairs.assign((size_t)cw * ch, 0);
+    std::unordered_map<int64_t, short> seen;
+    int budget = std::min(COLOR_PAIRS, 32767) - ART_PAIR_BASE;
+    const uint8_t* px = artSlot.rgb.data();
+    for (int y = 0; y < ch; y++) {
+        for (int x = 0; x < cw; x++) {
+            int top = art_color(px + ((size_t)(2 * y) * cw + x) * 3);
+            int bottom = 2 * y + 1 < artSlot.h ? art_color(px + ((size_t)(2 * y + 1) * cw + x) * 3) : -1;
+            int64_t key = ((int64_t)top << 32) | (uint32_t)bottom;
+            auto it = seen.find(key);
+            if (it == seen.end()) {
+                if ((int)seen.size() >= budget) {
+                    artView.pairs.clear();
+                    return true;
+                }
+                short pair = (short)(ART_PAIR_BASE + seen.size());
+#ifdef NCURSES_EXT_COLORS
+                init_extended_pair(pair, top, bottom);
+#else
+                init_pair(pair, (short)top, (short)bottom);
+#endif
+                it = seen.emplace(key, pair).first;
+            }
+            artView.pairs[(size_t)y * cw + x] = it->second;
+        }
+    }
+    return true;
+}
+
+static void format_time(double sec, char* buf, size_t bufsize) {
+    long t = static_cast<long>(sec);
+    if (t < 0) t = 0;
+    long mm = t / 60, ss = t % 60;
+    std::snprintf(buf, bufsize, "%02ld:%02ld", mm, ss);
+}
+
+static void paint_status_bar(StatusBarCache& c, bool playing, bool paused, int w) {
+    c.repaint = false;
+    werase(statusWin);
+
+    wattron(statusWin, A_REVERSE);
+    if (playing) wattron(statusWin, COLOR_PAIR(paused ? 3 : 4));
+    else wattron(statusWin, COLOR_PAIR(5));
+
+    mvwaddnstr(statusWin, 0, 0, c.left, c.lmax);
+    if (c.rlen > 0) {
+        mvwaddnstr(statusWin, 0, w - c.rlen, c.right, c.rlen);
+    }
+
+    wattroff(statusWin, COLOR_PAIR(paused ? 3 : 4));
+    wattroff(statusWin, COLOR_PAIR(5));
+    wattroff(statusWin, A_REVERSE);
+
+    wrefresh(statusWin);
+}
+
+// Followers of this instance's sync group, -1 when it is not leading one.
+static int sync_lead_peers();
+
+static void draw_status_bar(const std::string& dirStr, unsigned dirGen) {
+    if (!statusWin) return;
+
+    int qsz = 0;
+    {
+        std::lock_guard<std::mutex> lk(playlistMutex);
+        qsz = (int)playlist.size();
+    }
+
+    bool playing = isPlaying.load();
+    bool paused = isPaused.load();
+    VisualizationMode m = visMode.load();
+    unsigned long long frameAllocs = uiFrameAllocs.load(std::memory_order_relaxed);
+    int jobs[LANE_COUNT];
+    for (int l = 0; l < LANE_COUNT; l++) jobs[l] = workerPool.stats((JobLane)l).queued.load(std::memory_order_relaxed);
+    bool dupeRunning;
+    {
+        std::lock_guard<std::mutex> lk(dupeScan.m);
+        dupeRunning = dupeScan.running;
+    }
+    size_t dupeDone = dupeScan.done.load(), dupeTotal = dupeScan.total.load();
+    bool exportRunning;
+    int exportSpeed = 0;
+    {
+        std::lock_guard<std::mutex> lk(exportRun.m);
+        exportRunning = exportRun.running;
+        if (exportRunning) exportSpeed = (int)export_speed();
+    }
+    size_t exportDone = exportRun.done.load(), exportTotal = exportRun.total.load();
+    int syncPeers = sync_lead_peers();
+    bool radio = radioOn.load();
+    size_t indexed = radioIndexed.load();
+
+    int h, w;
+    getmaxyx(statusWin, h, w);
+    (void)h;
+
+    StatusBarCache& c = statusCache;
+    if (c.valid && c.qsz == qsz && c.playing == playing && c.paused == paused && c.mode == m &&
+        c.dirGen == dirGen && c.width == w && c.frameAllocs == frameAllocs && c.dupeRunning == dupeRunning &&
+        c.dupeDone == dupeDone && c.dupeTotal == dupeTotal && c.radio == radio && c.radioIndexed == indexed &&
+        c.exportRunning == exportRunning && c.exportDone == exportDone && c.exportTotal == exportTotal &&
+        c.exportSpeed == exportSpeed && c.syncPeers == syncPeers && std::equal(jobs, jobs + LANE_COUNT, c.jobs)) {
+        if (c.repaint) paint_status_bar(c, playing, paused, w);
+        return;
+    }
+    std::copy(jobs, jobs + LANE_COUNT, c.jobs);
+    c.valid = true;
+    c.qsz = qsz;
+    c.playing = playing;
+    c.paused = paused;
+    c.mode = m;
+    c.dirGen = dirGen;
+    c.width = w;
+    c.frameAllocs = frameAllocs;
+    c.dupeRunning = dupeRunning;
+    c.dupeDone = dupeDone;
+    c.dupeTotal = dupeTotal;
+    c.radio = radio;
+    c.radioIndexed = indexed;
+    c.exportRunning = exportRunning;
+    c.exportDone = exportDone;
+    c.exportTotal = exportTotal;
+    c.exportSpeed = exportSpeed;
+    c.syncPeers = syncPeers;
+
+    static const char left[] = " q:quit  Enter:open/add  a:queue mp3  v:preview  b:sort bpm  s:skip  x:stop  p:pause  +/-:volume  1-4:mode  f:fft  o:output  d:dupes  e:export  r:radio  \u2190/\u2192:seek ";
+    static char right[64 + PATH_BUF_SIZE];
+    int rawLen = std::snprintf(right, sizeof(right), "  Dir: %s  Queue: %d  Mode: %s  State: %s  Jobs: %d/%d/%d  Alloc/frame: %llu",
+                               dirStr.c_str(), qsz, (m == WAVEFORM) ? "Wave" : (m == SPECTRUM ? "Spec" : "Gram"),
+                               !playing ? "Idle" : (paused ? "Paused" : "Play"),
+                               jobs[LANE_INTERACTIVE], jobs[LANE_PREFETCH], jobs[LANE_BULK], frameAllocs);
+    rawLen = clampi(rawLen, 0, (int)sizeof(right) - 1);
+    if (dupeRunning) {
+        rawLen += std::snprintf(right + rawLen, sizeof(right) - rawLen, "  Dupes: %zu/%zu", dupeDone, dupeTotal);
+        rawLen = clampi(rawLen, 0, (int)sizeof(right) - 1);
+    }
+    if (exportRunning) {
+        rawLen += std::snprintf(right + rawLen, sizeof(right) - rawLen, "  Export: %zu/%zu %dx", exportDone, exportTotal, exportSpeed);
+        rawLen = clampi(rawLen, 0, (int)sizeof(right) - 1);
+    }
+    if (syncPeers >= 0) {
+        rawLen += std::snprintf(right + rawLen, sizeof(right) - rawLen, "  Sync: %d follower%s", syncPeers, syncPeers == 1 ? "" : "s");
+        rawLen = clampi(rawLen, 0, (int)sizeof(right) - 1);
+    }
+    if (radio) {
+        rawLen += std::snprintf(right + rawLen, sizeof(right) - rawLen, "  Radio: %zu tracks", indexed);
+        rawLen = clampi(rawLen, 0, (int)sizeof(right) - 1);
+    }
+
+    int avail = w;
+    c.rlen = ellipsize_middle_buf(c.right, sizeof(c.right), right, rawLen, clampi(avail / 2, 10, avail));
+    c.lmax = w - c.rlen - 1;
+    if (c.lmax < 0) c.lmax = 0;
+    ellipsize_end_buf(c.left, sizeof(c.left), left, (int)sizeof(left) - 1, c.lmax);
+
+    paint_status_bar(c, playing, paused, w);
+}
+
+// Meter strip scale: bars span METER_RANGE_DB below full scale.
+#define METER_RANGE_DB 60.0f
+
+static inline int meter_x(float db, int width) {
+    return clampi((int)std::lround((db + METER_RANGE_DB) / METER_RANGE_DB * width), 0, width);
+}
+
+// One channel: VU fill coloured by zone, PPM beyond it, a peak-hold tick,
+// then the VU and PPM readings and a latched clip lamp.
+static void draw_level_row(WINDOW* w, int y, int x, int innerW, const char* label, const Meters& m, int c) {
+    char nums[32];
+    std::snprintf(nums, sizeof(nums), " %5.1f %5.1f ", std::max(m.vuDb[c], -METER_RANGE_DB),
+                  std::max(m.ppmDb[c], -METER_RANGE_DB));
+    int barW = innerW - 2 - (int)std::strlen(nums) - 4;
+    if (barW < 8) return;
+
+    wattron(w, COLOR_PAIR(2) | A_BOLD);
+    mvwaddstr(w, y, x, label);
+    wattroff(w, COLOR_PAIR(2) | A_BOLD);
+
+    int vu = meter_x(m.vuDb[c], barW), ppm = meter_x(m.ppmDb[c], barW), hold = meter_x(m.holdDb[c], barW);
+    for (int i = 0; i < barW; i++) {
+        float db = -METER_RANGE_DB + (i + 0.5f) * METER_RANGE_DB / barW;
+        int pair = db > -9.0f ? 6 : (db > -18.0f ? 3 : 4);
+        chtype ch = '.';
+        attr_t attr = COLOR_PAIR(2);
+        if (i < vu) { ch = '#'; attr = COLOR_PAIR(pair) | A_BOLD; }
+        else if (i < ppm) { ch = '='; attr = COLOR_PAIR(pair); }
+        if (hold > 0 && i == hold - 1 && i >= vu) { ch = '|'; attr = COLOR_PAIR(pair) | A_BOLD; }
+        wattron(w, attr);
+        mvwaddch(w, y, x + 2 + i, ch);
+        wattroff(w, attr);
+    }
+    wattron(w, COLOR_PAIR(2));
+    mvwaddstr(w, y, x + 2 + barW, nums);
+    wattroff(w, COLOR_PAIR(2));
+    if (m.clip[c]) {
+        wattron(w, COLOR_PAIR(6) | A_BOLD | A_REVERSE);
+        mvwaddstr(w, y, x + 2 + barW + (int)std::strlen(nums), "CLIP");
+        wattroff(w, COLOR_PAIR(6) | A_BOLD | A_REVERSE);
+    }
+}
+
+// Correlation from -1 (out of phase) through 0 (unrelated) to +1 (mono).
+static void draw_correlation_row(WINDOW* w, int y, int x, int innerW, float corr) {
+    char num[16];
+    std::snprintf(num, sizeof(num), " %+5.2f", corr);
+    int barW = innerW - 2 - 4 - (int)std::strlen(num);
+    if (barW < 8) return;
+    int pos = clampi((int)std::lround((corr + 1.0f) * 0.5f * (barW - 1)), 0, barW - 1);
+    int mid = (barW - 1) / 2;
+
+    wattron(w, COLOR_PAIR(2) | A_BOLD);
+    mvwaddstr(w, y, x, "C -");
+    wattroff(w, COLOR_PAIR(2) | A_BOLD);
+    for (int i = 0; i < barW; i++) {
+        chtype ch = i == mid ? '+' : '.';
+        attr_t attr = COLOR_PAIR(2);
+        if (i == pos) { ch = '*'; attr = COLOR_PAIR(corr < 0.0f ? 6 : 4) | A_BOLD; }
+        wattron(w, attr);
+        mvwaddch(w, y, x + 3 + i, ch);
+        wattroff(w, attr);
+    }
+    wattron(w, COLOR_PAIR(2));
+    mvwaddstr(w, y, x + 3 + barW, "+");
+    mvwaddstr(w, y, x + 4 + barW, num);
+    wattroff(w, COLOR_PAIR(2));
+}
+
+// Pixel box for album art in the Now Playing panel: square, one pixel per
+// column and two per row, on the right of at least ART_MIN_TEXT columns.
+static bool art_box(int& boxW, int& boxH) {
+    boxW = boxH = 0;
+    if (!infoWin || !artColors) return false;
+    int h, w;
+    getmaxyx(infoWin, h, w);
+    int rows = std::min({ h - 2, ART_MAX_ROWS, (w - 4 - ART_MIN_TEXT - 1) / 2 });
+    if (rows < 4) return false;
+    boxW = boxH = 2 * rows;
+    return true;
+}
+
+// Half blocks: foreground is the upper pixel, background the lower one.
+// Without UTF-8 each cell is a space in its upper colour.
+static void draw_art(WINDOW* win, int top, int right, int rows) {
+    if (artView.pairs.empty()) return;
+    int cw = artView.w, ch = artView.h / 2;
+    int x0 = right - cw, y0 = top + (rows - ch) / 2;
+    for (int y = 0; y < ch; y++) {
+        for (int x = 0; x < cw; x++) {
+            short pair = artView.pairs[(size_t)y * cw + x];
+            wattr_set(win, A_NORMAL, pair, nullptr);
+            if (sparkUtf8) mvwaddstr(win, y0 + y, x0 + x, "\u2580");
+            else mvwaddch(win, y0 + y, x0 + x, ' ' | A_REVERSE);
+        }
+    }
+    wattr_set(win, A_NORMAL, 0, nullptr);
+}
+
+static void draw_info(const std::string& filepath, const std::string& title, double currentSec, double totalSec, VisualizationMode mode, bool paused,
+                      const char* device, const BeatClock& beat, const Meters& meters) {
+    if (!infoWin) return;
+
+    werase(infoWin);
+    draw_border(infoWin, 2, false);
+    draw_title(infoWin, "Now Playing", 1);
+
+    int h, w;
+    getmaxyx(infoWin, h, w);
+    int innerW = w - 4;
+    if (innerW < 10 || h < 6) { wrefresh(infoWin); return; }
+    int artW, artH;
+    if (art_box(artW, artH) && !artView.pairs.empty() && artView.path == filepath) {
+        draw_art(infoWin, 1, w - 2, artH / 2);
+        innerW -= artW + 1;
+    }
+
+    // The ellipsized title only changes with the track or the panel width.
+    static std::string cachedFile, cachedTitle;
+    static int cachedW = -1;
+    static char tline[PATH_BUF_SIZE];
+    if (cachedW != innerW || cachedFile != filepath || cachedTitle != title) {
+        cachedFile = filepath;
+        cachedTitle = title;
+        cachedW = innerW;
+        const char* name = "Idle";
+        int len = 4;
+        if (!title.empty()) {
+            name = title.c_str();
+            len = (int)title.size();
+        } else if (!filepath.empty()) {
+            size_t slash = filepath.find_last_of('/');
+            name = filepath.c_str() + ((slash == std::string::npos) ? 0 : slash + 1);
+            len = (int)std::strlen(name);
+        }
+        ellipsize_end_buf(tline, sizeof(tline), name, len, innerW);
+    }
+
+    bool previewOnly = previewActive.load() && !isPlaying.load();
+    const char* state = paused ? "PAUSED" : (isPlaying.load() ? "PLAYING" : (previewOnly ? "PREVIEW" : "IDLE"));
+    int statePair = paused ? 3 : (isPlaying.load() || previewOnly ? 4 : 5);
+
+    wattron(infoWin, COLOR_PAIR(statePair) | A_BOLD);
+    mvwaddnstr(infoWin, 1, 2, state, innerW);
+    wattroff(infoWin, COLOR_PAIR(statePair) | A_BOLD);
+
+    wattron(infoWin, COLOR_PAIR(2) | A_BOLD);
+    mvwaddnstr(infoWin, 2, 2, tline, innerW);
+    wattroff(infoWin, COLOR_PAIR(2) | A_BOLD);
+
+    char cb[24], tb[24], timeLine[96];
+    format_time(currentSec, cb, sizeof(cb));
+    format_time(totalSec, tb, sizeof(tb));
+    int tn = std::snprintf(timeLine, sizeof(timeLine), "%s / %s", cb, tb);
+    if (isPlaying.load()) {
+        if (beat.bpm > 0.0f) std::snprintf(timeLine + tn, sizeof(timeLine) - tn, "   %.1f BPM (analysed at %.0fx)", beat.bpm, beat.speed);
+        else std::snprintf(timeLine + tn, sizeof(timeLine) - tn, "   %s", beat.bpm < 0.0f ? "no steady tempo" : "BPM ...");
+    }
+
+    double progress = (totalSec > 0.0) ? (currentSec / totalSec) : 0.0;
+    if (progress < 0.0) progress = 0.0;
+    if (progress > 1.0) progress = 1.0;
+
+    int barW = innerW;
+    if (barW < 10) barW = 10;
+    int filled = (int)std::round(progress * (double)barW);
+    filled = clampi(filled, 0, barW);
+
+    int barY = 4;
+    if (barY < h - 2) {
+        wattron(infoWin, COLOR_PAIR(3));
+        mvwaddnstr(infoWin, barY - 1, 2, timeLine, innerW);
+        wattroff(infoWin, COLOR_PAIR(3));
+
+        for (int i = 0; i < barW; i++) {
+            if (i < filled) wattron(infoWin, COLOR_PAIR(4) | A_BOLD);
+            else wattron(infoWin, COLOR_PAIR(2));
+            mvwaddch(infoWin, barY, 2 + i, (i < filled) ? '=' : '-');
+            if (i < filled) wattroff(infoWin, COLOR_PAIR(4) | A_BOLD);
+            else wattroff(infoWin, COLOR_PAIR(2));
+        }
+
+        char modeLine[96];
+        std::snprintf(modeLine, sizeof(modeLine), "Visualizer: %s%s",
+                      (mode == WAVEFORM) ? "Waveform" : (mode == SPECTRUM ? "Spectrum" : (mode == SPECTROGRAM ? "Spectrogram" : "Piano Roll")),
+                      !spectrumWanted.load() ? "" : (spectrumBackend.load() == BACKEND_FFTW ? " (FFTW)" : " (fixed-point)"));
+        wattron(infoWin, COLOR_PAIR(5));
+        mvwaddnstr(infoWin, barY + 1, 2, modeLine, innerW);
+        wattroff(infoWin, COLOR_PAIR(5));
+
+        if (barY + 2 < h - 1) {
+            char latLine[96];
+            int n = std::snprintf(latLine, sizeof(latLine), "Cmd latency: %.2f ms (max %.2f ms)",
+                                  cmdLatencyLastUs.load() / 1000.0, cmdLatencyMaxUs.load() / 1000.0);
+            if (unsigned late = commandsCoalesced.load())
+                std::snprintf(latLine + n, sizeof(latLine) - n, "  %u coalesced", late);
+            wattron(infoWin, COLOR_PAIR(2));
+            mvwaddnstr(infoWin, barY + 2, 2, latLine, innerW);
+            wattroff(infoWin, COLOR_PAIR(2));
+        }
+
+        if (barY + 3 < h - 1) {
+            char startLine[128];
+            long ff = firstFrameMs.load(), ar = audioReadyMs.load(), snd = firstSoundUs.load(), pv = previewStartUs.load();
+            int n = std::snprintf(startLine, sizeof(startLine), "Startup: UI %ld ms, audio %s", ff,
+                                  ar < 0 ? "warming up" : "ready");
+            if (ar >= 0) n += std::snprintf(startLine + n, sizeof(startLine) - n, " %ld ms", ar);
+            if (snd >= 0) n += std::snprintf(startLine + n, sizeof(startLine) - n, ", first sound %.1f ms", snd / 1000.0);
+            if (pv >= 0) std::snprintf(startLine + n, sizeof(startLine) - n, ", preview %.1f ms", pv / 1000.0);
+            wattron(infoWin, COLOR_PAIR(2));
+            mvwaddnstr(infoWin, barY + 3, 2, startLine, innerW);
+            wattroff(infoWin, COLOR_PAIR(2));
+        }
+
+        if (barY + 4 < h - 1 && device[0]) {
+            char devLine[128];
+            long gap = deviceSwitchGapUs.load();
+            int n = std::snprintf(devLine, sizeof(devLine), "Output: %s", device);
+            if (volumeDb.load() < 0) n += std::snprintf(devLine + n, sizeof(devLine) - n, "  %d dB", volumeDb.load());
+            if (gap >= 0) std::snprintf(devLine + n, sizeof(devLine) - n, "  (switch gap %.1f ms)", gap / 1000.0);
+            wattron(infoWin, COLOR_PAIR(1));
+            mvwaddnstr(infoWin, barY + 4, 2, devLine, innerW);
+            wattroff(infoWin, COLOR_PAIR(1));
+        }
+
+        if (meters.channels > 0) {
+            int y = barY + 5;
+            if (meters.channels == 1) {
+                if (y < h - 1) draw_level_row(infoWin, y, 2, innerW, "M", meters, 0);
+            } else {
+                if (y < h - 1) draw_level_row(infoWin, y, 2, innerW, "L", meters, 0);
+                if (y + 1 < h - 1) draw_level_row(infoWin, y + 1, 2, innerW, "R", meters, 1);
+                if (y + 2 < h - 1) draw_correlation_row(infoWin, y + 2, 2, innerW, meters.corr);
+            }
+        }
+    }
+
+    wrefresh(infoWin);
+}
+
+static void draw_scrollbar(WINDOW* w, int contentTopY, int contentBottomY, int totalItems, int firstIndex, int visibleItems) {
+    if (!w) return;
+    int h, ww;
+    getmaxyx(w, h, ww);
+    if (ww < 3) return;
+    if (totalItems <= visibleItems || visibleItems <= 0) return;
+
+    int sbX = ww - 2;
+    int sbTop = contentTopY;
+    int sbBottom = contentBottomY;
+    int sbH = sbBottom - sbTop + 1;
+    if (sbH <= 0) return;
+
+    double fracTop = (double)firstIndex / (double)std::max(1, totalItems);
+    double fracVis = (double)visibleItems / (double)std::max(1, totalItems);
+
+    int thumbH = clampi((int)std::round(fracVis * sbH), 1, sbH);
+    int thumbY = sbTop + clampi((int)std::round(fracTop * sbH), 0, sbH - thumbH);
+
+    wattron(w, COLOR_PAIR(2));
+    for (int y = sbTop; y <= sbBottom; y++) mvwaddch(w, y, sbX, ACS_VLINE);
+    wattroff(w, COLOR_PAIR(2));
+
+    wattron(w, COLOR_PAIR(1) | A_BOLD);
+    for (int y = thumbY; y < thumbY + thumbH; y++) mvwaddch(w, y, sbX, ' ');
+    wattroff(w, COLOR_PAIR(1) | A_BOLD);
+}
+
+// Row labels for the current listing, rebuilt only when the listing
+// (tracked by its generation) or the panel width changes.
+struct NavLabelCache {
+    unsigned listGen = 0;
+    int width = -1;
+    std::vector<std::string> labels;
+    std::vector<std::string> mp3Paths;   // empty for rows without a sparkline
+    char dirLine[PATH_BUF_SIZE];
+};
+
+// Columns of the sparkline at the end of each MP3 row, 0 when too narrow.
+// The tempo column sits just before it.
+static int sparkline_cols(int innerW) {
+    return innerW >= 40 ? 16 : 0;
+}
+
+#define BPM_COLS 5
+
+// Browser order, toggled with 'b': by name, or MP3s by analysed tempo.
+static bool browserByBpm = false;
+
+static const char* const sparkGlyphs[9] = { " ", "\u2581", "\u2582", "\u2583", "\u2584", "\u2585", "\u2586", "\u2587", "\u2588" };
+static const char sparkAscii[] = " _.-:=+*#";
+
+// Draws an overview as eighth-block columns, or a dotted placeholder when
+// peaks is null.
+static void draw_sparkline(WINDOW* w, int y, int x, int cols, const uint8_t* peaks) {
+    char buf[16 * 4 + 1];
+    int n = 0;
+    for (int c = 0; c < cols && c < 16; c++) {
+        int lvl = 0;
+        if (peaks) {
+            uint8_t m = 0;
+            for (int p = c * OVERVIEW_POINTS / cols; p < (c + 1) * OVERVIEW_POINTS / cols; p++) m = std::max(m, peaks[p]);
+            lvl = m ? 1 + m * 7 / 255 : 0;
+        }
+        const char* g = peaks ? (sparkUtf8 ? sparkGlyphs[lvl] : nullptr) : (sparkUtf8 ? "\u00b7" : ".");
+        if (g) {
+            size_t len = std::strlen(g);
+            std::memcpy(buf + n, g, len);
+            n += (int)len;
+        } else {
+            buf[n++] = sparkAscii[lvl];
+        }
+    }
+    buf[n] = '\0';
+    int pair = peaks ? 4 : 5;
+    wattron(w, COLOR_PAIR(pair) | (peaks ? 0 : A_DIM));
+    mvwaddstr(w, y, x, buf);
+    wattroff(w, COLOR_PAIR(pair) | (peaks ? 0 : A_DIM));
+}
+
+static NavLabelCache navCache;
+
+static void rebuild_nav_labels(const std::string& dirStr, const std::vector<BrowserEntry>& dirList,
+                               unsigned listGen, int innerW) {
+    NavLabelCache& c = navCache;
+    c.listGen = listGen;
+    c.width = innerW;
+    ellipsize_middle_buf(c.dirLine, sizeof(c.dirLine), dirStr.c_str(), (int)dirStr.size(), innerW);
+
+    int spark = sparkline_cols(innerW);
+    char raw[PATH_BUF_SIZE], line[PATH_BUF_SIZE];
+    c.labels.resize(dirList.size());
+    c.mp3Paths.resize(dirList.size());
+    for (size_t i = 0; i < dirList.size(); i++) {
+        bool isDir = dirList[i].is_directory();
+        bool mp3 = is_mp3_entry(dirList[i]);
+        int n;
+        if (dirList[i].is_cut()) {
+            const CutTrack& t = dirList[i].cut;
+            char len[24] = "";
+            if (t.endSec > t.startSec) {
+                char tb[16];
+                format_time(t.endSec - t.startSec, tb, sizeof(tb));
+                std::snprintf(len, sizeof(len), "  %s", tb);
+            }
+            n = std::snprintf(raw, sizeof(raw), "     %02d %s%s", t.number,
+                              t.title.empty() ? "(untitled)" : t.title.c_str(), len);
+        } else {
+            std::string nm = dirList[i].path().filename().string();
+            n = std::snprintf(raw, sizeof(raw), "%s%s%s", isDir ? " [D] " : " [F] ", nm.c_str(), isDir ? "/" : "");
+        }
+        n = clampi(n, 0, (int)sizeof(raw) - 1);
+        int len = ellipsize_end_buf(line, sizeof(line), raw, n, (mp3 && spark) ? innerW - spark - BPM_COLS - 1 : innerW);
+        c.labels[i].assign(line, (size_t)len);
+        if (mp3) c.mp3Paths[i] = dirList[i].path().string();
+        else c.mp3Paths[i].clear();
+    }
+}
+
+static void draw_navigation(const std::string& dirStr, const std::vector<BrowserEntry>& dirList,
+                            unsigned listGen, int highlight, bool loading) {
+    if (!navWin) return;
+
+    werase(navWin);
+    draw_border(navWin, 2, false);
+    draw_title(navWin, browserByBpm ? "Browser - by BPM" : "Browser", 1);
+
+    int navH, navW;
+    getmaxyx(navWin, navH, navW);
+    int innerH = navH - 2;
+    int innerW = navW - 4;
+    if (innerH <= 0 || innerW <= 0) { wrefresh(navWin); return; }
+
+    if (navCache.listGen != listGen || navCache.width != innerW) rebuild_nav_labels(dirStr, dirList, listGen, innerW);
+
+    int headerY = 1;
+    wattron(navWin, COLOR_PAIR(5));
+    mvwaddnstr(navWin, headerY, 2, navCache.dirLine, innerW);
+    wattroff(navWin, COLOR_PAIR(5));
+
+    int contentTop = 3;
+    int contentBottom = navH - 2;
+    int linesForItems = contentBottom - contentTop + 1;
+    if (linesForItems < 1) { wrefresh(navWin); return; }
+
+    int totalItems = (int)dirList.size() + 1;
+    highlight = clampi(highlight, 0, std::max(0, totalItems - 1));
+
+    if (highlight < listOffset) listOffset = highlight;
+    if (highlight >= listOffset + linesForItems) listOffset = highlight - linesForItems + 1;
+    listOffset = clampi(listOffset, 0, std::max(0, totalItems - linesForItems));
+
+    int nameW = innerW - 6;
+    if (nameW < 8) nameW = innerW;
+
+    // Sparklines are looked up under one short lock; rows still missing
+    // theirs are queued after drawing, visible first.
+    int spark = sparkline_cols(innerW);
+    static std::vector<std::string> missing;
+    missing.clear();
+    std::unique_lock<std::mutex> ovLock(overviews.mutex(), std::defer_lock);
+    std::unique_lock<std::mutex> bpmLock(beatTracks.mutex(), std::defer_lock);
+    if (spark) {
+        ovLock.lock();
+        bpmLock.lock();
+    }
+
+    for (int row = 0; row < linesForItems; row++) {
+        int idx = listOffset + row;
+        if (idx >= totalItems) break;
+
+        int y = contentTop + row;
+        bool selected = (idx == highlight);
+
+        if (selected) wattron(navWin, A_REVERSE | A_BOLD);
+
+        if (idx == 0) {
+            wattron(navWin, COLOR_PAIR(3) | (selected ? A_REVERSE : 0));
+            mvwaddnstr(navWin, y, 2, " ..", innerW);
+            wattroff(navWin, COLOR_PAIR(3) | (selected ? A_REVERSE : 0));
+        } else {
+            int realIndex = idx - 1;
+            bool isDir = dirList[realIndex].is_directory();
+            const std::string& line = navCache.labels[realIndex];
+
+            int pair = isDir ? 1 : (dirList[realIndex].is_cut() ? 5 : 2);
+            wattron(navWin, COLOR_PAIR(pair) | (selected ? A_REVERSE : 0));
+            mvwaddnstr(navWin, y, 2, line.c_str(), innerW);
+            wattroff(navWin, COLOR_PAIR(pair) | (selected ? A_REVERSE : 0));
+
+            const std::string& mp3 = navCache.mp3Paths[realIndex];
+            if (spark && !mp3.empty()) {
+                const TrackResult<OverviewPeaks>* r = overviews.find(mp3);
+                if (!r || (r->state == TJ_QUEUED && !r->promoted)) missing.push_back(mp3);
+                if (!r || r->state != TJ_FAILED)
+                    draw_sparkline(navWin, y, 2 + innerW - spark, spark, (r && r->state == TJ_READY) ? r->value.peaks : nullptr);
+                const TrackResult<BeatGrid>* b = beatTracks.find(mp3);
+                if (b && b->state == TJ_READY && b->value.bpm > 0.0f) {
+                    char bpm[16];
+                    std::snprintf(bpm, sizeof(bpm), "%4.0f", b->value.bpm);
+                    wattron(navWin, COLOR_PAIR(3));
+                    mvwaddnstr(navWin, y, 2 + innerW - spark - BPM_COLS, bpm, BPM_COLS - 1);
+                    wattroff(navWin, COLOR_PAIR(3));
+                }
+            }
+        }
+
+        if (selected) wattroff(navWin, A_REVERSE | A_BOLD);
+    }
+
+    if (loading && contentTop + 1 <= contentBottom) {
+        wattron(navWin, COLOR_PAIR(3));
+        mvwaddnstr(navWin, contentTop + 1, 2, " Loading...", innerW);
+        wattroff(navWin, COLOR_PAIR(3));
+    }
+
+    if (ovLock.owns_lock()) {
+        bpmLock.unlock();
+        ovLock.unlock();
+    }
+    if (!missing.empty()) overviews.want(missing, true);
+
+    draw_scrollbar(navWin, contentTop, contentBottom, totalItems, listOffset, linesForItems);
+
+    wrefresh(navWin);
+}
+
+static inline uint32_t to_q16(double v) {
+    double q = v * 65536.0;
+    return (q >= 4294967295.0) ? 0xFFFFFFFFu : (q <= 0.0 ? 0u : (uint32_t)q);
+}
+
+// log(v + 1) / log(max + 1) with the integer log; maxLog is log2(max + 1) in Q16.
+static inline double log_ratio_q16(double v, uint32_t maxLog) {
+    if (maxLog == 0) return 0.0;
+    uint32_t l = ilog2_q16(to_q16(v + 1.0));
+    l = (l > (16u << 16)) ? l - (16u << 16) : 0;
+    return (double)l / (double)maxLog;
+}
+
+static VisualizationMode pane_mode(PaneKind k, VisualizationMode visM) {
+    if (k == PANE_WAVE) return WAVEFORM;
+    if (k == PANE_SPEC) return SPECTRUM;
+    if (k == PANE_GRAM) return SPECTROGRAM;
+    if (k == PANE_ROLL) return PIANO_ROLL;
+    return visM;
+}
+
+static const char* mode_title(VisualizationMode m) {
+    switch (m) {
+        case WAVEFORM:    return "Visualizer - Waveform";
+        case SPECTRUM:    return "Visualizer - Spectrum";
+        case SPECTROGRAM: return "Visualizer - Spectrogram";
+        case PIANO_ROLL:  return "Visualizer - Piano Roll";
+    }
+    return "Visualizer";
+}
+
+// Returns the next history column to fill, clearing the history first when
+// the plot size or view changed.
+static uint8_t* gram_next_column(VisPane& p, VisualizationMode mode, int plotH, int plotW) {
+    if (p.gramW != plotW || p.gramH != plotH || p.gramMode != mode) {
+        p.gramW = plotW;
+        p.gramH = plotH;
+        p.gramMode = mode;
+        p.gramHead = 0;
+        p.gram.assign((size_t)plotW * plotH, 0);
+    }
+    uint8_t* col = &p.gram[(size_t)p.gramHead * plotH];
+    p.gramHead = (p.gramHead + 1) % plotW;
+    return col;
+}
+
+// Pushes one spectrogram column per new analysis frame. Rows are spaced
+// logarithmically in frequency, lowest at the bottom.
+static void gram_push_column(VisPane& p, const std::vector<double>& mags, int plotH, int plotW) {
+    uint8_t* col = gram_next_column(p, SPECTROGRAM, plotH, plotW);
+    if (mags.empty()) { std::fill(col, col + plotH, 0); return; }
+
+    double maxMag = 1e-12;
+    for (double v : mags) if (v > maxMag) maxMag = v;
+    uint32_t maxLog = ilog2_q16(to_q16(maxMag + 1.0)) - (16u << 16);
+    int bins = (int)mags.size();
+    double logSpan = std::log((double)bins);
+    for (int r = 0; r < plotH; r++) {
+        int b0 = clampi((int)std::exp(logSpan * r / plotH), 1, bins - 1);
+        int b1 = clampi((int)std::exp(logSpan * (r + 1) / plotH), b0 + 1, bins);
+        double peak = 0.0;
+        for (int i = b0; i < b1; i++) peak = std::max(peak, mags[i]);
+        double ratio = std::min(1.0, log_ratio_q16(peak, maxLog));
+        col[r] = (uint8_t)clampi((int)(ratio * 5.0), 0, 4);
+    }
+}
+
+// First note of piano-roll row r; rows split the CQT_NOTES keys evenly,
+// lowest at the bottom.
+static inline int roll_row_note(int r, int plotH) {
+    return r * CQT_NOTES / plotH;
+}
+
+// Pushes one piano-roll column: each row shows the loudest of its keys.
+static void roll_push_column(VisPane& p, const std::vector<float>& notes, int plotH, int plotW) {
+    uint8_t* col = gram_next_column(p, PIANO_ROLL, plotH, plotW);
+    if ((int)notes.size() != CQT_NOTES) { std::fill(col, col + plotH, 0); return; }
+
+    double maxMag = 1e-12;
+    for (float v : notes) if (v > maxMag) maxMag = v;
+    uint32_t maxLog = ilog2_q16(to_q16(maxMag + 1.0)) - (16u << 16);
+    for (int r = 0; r < plotH; r++) {
+        int n0 = roll_row_note(r, plotH);
+        int n1 = std::max(n0 + 1, roll_row_note(r + 1, plotH));
+        double peak = 0.0;
+        for (int n = n0; n < n1; n++) peak = std::max(peak, (double)notes[n]);
+        double ratio = std::min(1.0, log_ratio_q16(peak, maxLog));
+        col[r] = (uint8_t)clampi((int)(ratio * 5.0), 0, 4);
+    }
+}
+
+// True for BEAT_PULSE_MS after each beat of the playing track.
+#define BEAT_PULSE_MS 110
+
+static bool beat_pulse(const BeatClock& b, bool paused) {
+    if (paused || !isPlaying.load() || b.periodNs <= 0) return false;
+    long long d = (steady_ns() - b.anchorNs) % b.periodNs;
+    if (d < 0) d += b.periodNs;
+    return d < BEAT_PULSE_MS * 1000000LL;
+}
+
+static void draw_visualization(VisPane& pane, const RenderState& snap) {
+    WINDOW* win = pane.win;
+    if (!win) return;
+    const std::vector<int16_t>& mono = snap.mono;
+    const std::vector<double>& mags = snap.magnitudes;
+    VisualizationMode mode = pane_mode(pane.kind, snap.mode);
+
+    int h, w;
+    getmaxyx(win, h, w);
+    if (h < 5 || w < 20) {
+        werase(win);
+        draw_border(win, 2, false);
+        draw_title(win, "Visualizer", 1);
+        wrefresh(win);
+        return;
+    }
+
+    werase(win);
+    bool pulse = beat_pulse(snap.beat, snap.paused);
+    draw_border(win, pulse ? 3 : 2, pulse);
+
+    draw_title(win, mode_title(mode), 1);
+
+    int plotTop = 2;
+    int plotBottom = h - 2;
+    int plotLeft = 1;
+    int plotRight = w - 2;
+
+    int plotH = plotBottom - plotTop + 1;
+    int plotW = plotRight - plotLeft + 1;
+    if (plotH <= 0 || plotW <= 0) { wrefresh(win); return; }
+
+    int midY = plotTop + plotH / 2;
+
+    if (mode == SPECTROGRAM || mode == PIANO_ROLL) {
+        if (mode == PIANO_ROLL) {
+            // Octave labels in a left gutter, on the row where each C starts.
+            const int gutter = 3;
+            if (plotW <= gutter) { wrefresh(win); return; }
+            wattron(win, COLOR_PAIR(5));
+            for (int r = 0; r < plotH; r++) {
+                int n0 = roll_row_note(r, plotH);
+                int n1 = std::max(n0 + 1, roll_row_note(r + 1, plotH));
+                int c = (n0 + 11) / 12 * 12;
+                if (c >= n1) continue;
+                char label[8];
+                std::snprintf(label, sizeof(label), "C%d", (CQT_FIRST_NOTE + c) / 12 - 1);
+                mvwaddnstr(win, plotBottom - r, plotLeft, label, gutter - 1);
+            }
+            wattroff(win, COLOR_PAIR(5));
+            plotLeft += gutter;
+            plotW -= gutter;
+        }
+        if (snap.frameSeq != pane.gramSeq || pane.gramW != plotW || pane.gramH != plotH || pane.gramMode != mode) {
+            pane.gramSeq = snap.frameSeq;
+            if (mode == PIANO_ROLL) roll_push_column(pane, snap.notes, plotH, plotW);
+            else gram_push_column(pane, mags, plotH, plotW);
+        }
+        static const char glyph[5] = { ' ', '.', ':', '*', '#' };
+        static const int pair[5] = { 2, 5, 1, 4, 3 };
+        for (int x = 0; x < plotW; x++) {
+            const uint8_t* col = &pane.gram[(size_t)((pane.gramHead + x) % plotW) * plotH];
+            for (int r = 0; r < plotH; r++) {
+                int lv = col[r];
+                if (lv == 0) continue;
+                wattron(win, COLOR_PAIR(pair[lv]) | (lv >= 3 ? A_BOLD : 0));
+                mvwaddch(win, plotBottom - r, plotLeft + x, glyph[lv]);
+                wattroff(win, COLOR_PAIR(pair[lv]) | (lv >= 3 ? A_BOLD : 0));
+            }
+        }
+        wrefresh(win);
+        return;
+    }
+
+    wattron(win, COLOR_PAIR(5));
+    for (int x = plotLeft; x <= plotRight; x++) mvwaddch(win, midY, x, '.');
+    wattroff(win, COLOR_PAIR(5));
+
+    if (mode == WAVEFORM) {
+        if (!mono.empty()) {
+            for (int x = 0; x < plotW; x++) {
+                int idx = (int)std::round((double)x / (double)std::max(1, plotW - 1) * (double)(mono.size() - 1));
+                idx = clampi(idx, 0, (int)mono.size() - 1);
+                double v = (double)mono[idx] / 32768.0;
+                int yOff = (int)std::round(v * (double)(plotH / 2));
+                int y = clampi(midY - yOff, plotTop, plotBottom);
+                wattron(win, COLOR_PAIR(4) | A_BOLD);
+                mvwaddch(win, y, plotLeft + x, '*');
+                wattroff(win, COLOR_PAIR(4) | A_BOLD);
+            }
+        } else {
+            static const char msg[] = "No data";
+            wattron(win, COLOR_PAIR(3));
+            mvwaddnstr(win, midY, plotLeft + clampi((plotW - (int)sizeof(msg) + 1) / 2, 0, plotW - 1), msg, plotW);
+            wattroff(win, COLOR_PAIR(3));
+        }
+    } else {
+        if (!mags.empty()) {
+            double maxMag = 1e-12;
+            for (double v : mags) if (v > maxMag) maxMag = v;
+
+            uint32_t maxLog = ilog2_q16(to_q16(maxMag + 1.0)) - (16u << 16);
+
+            int bins = (int)mags.size();
+            int bars = plotW;
+            int binsPerBar = std::max(1, bins / std::max(1, bars));
+
+            for (int x = 0; x < bars; x++) {
+                int start = x * binsPerBar;
+                int end = std::min(start + binsPerBar, bins);
+                if (start >= end) break;
+
+                double sum = 0.0;
+                for (int i = start; i < end; i++) sum += mags[i];
+                double avg = sum / (double)(end - start);
+
+                double ratio = log_ratio_q16(avg, maxLog);
+                if (ratio < 0.0) ratio = 0.0;
+                if (ratio > 1.0) ratio = 1.0;
+
+                int bh = (int)std::round(ratio * (double)plotH);
+                bh = clampi(bh, 0, plotH);
+
+                for (int yy = 0; yy < bh; yy++) {
+                    int y = plotBottom - yy;
+                    wattron(win, COLOR_PAIR(4) | A_BOLD);
+                    mvwaddch(win, y, plotLeft + x, '|');
+                    wattroff(win, COLOR_PAIR(4) | A_BOLD);
+                }
+            }
+        } else {
+            static const char msg[] = "No spectrum";
+            wattron(win, COLOR_PAIR(3));
+            mvwaddnstr(win, midY, plotLeft + clampi((plotW - (int)sizeof(msg) + 1) / 2, 0, plotW - 1), msg, plotW);
+            wattroff(win, COLOR_PAIR(3));
+        }
+    }
+
+    wrefresh(win);
+}
+
+// Fixed-point FFT for devices where double-precision FFTW is too heavy
+// (cheap ARM phones under Termux) or where FFTW is not linked at all.
+// 1024 = 4^5, so this is a pure radix-4 decimation-in-frequency transform on
+// int32 data with Q31 twiddles. Input is int16 shifted up by FIXED_IN_SHIFT
+// for headroom, and each stage scales by 1/4, so outputs are X[k] / N in
+// the same fixed scale as the input.
+#define FIXED_IN_SHIFT 4
+
+struct FixedFFT {
+    std::vector<int32_t> re, im;
+    std::vector<int32_t> twRe, twIm;   // per stage: W^j, W^2j, W^3j for j < span
+    std::vector<uint16_t> rev;         // base-4 digit reversal
+};
+
+static void fixed_fft_init(FixedFFT& f) {
+    f.re.assign(FFT_SIZE, 0);
+    f.im.assign(FFT_SIZE, 0);
+    f.twRe.clear();
+    f.twIm.clear();
+    f.twRe.reserve(FFT_SIZE);
+    f.twIm.reserve(FFT_SIZE);
+    for (int span = FFT_SIZE / 4; span >= 1; span /= 4) {
+        for (int m = 1; m <= 3; m++) {
+            for (int j = 0; j < span; j++) {
+                double ang = -2.0 * M_PI * (double)(j * m) / (double)(4 * span);
+                f.twRe.push_back((int32_t)std::lround(std::cos(ang) * 2147483647.0));
+                f.twIm.push_back((int32_t)std::lround(std::sin(ang) * 2147483647.0));
+            }
+        }
+    }
+    f.rev.assign(FFT_SIZE, 0);
+    for (int i = 0; i < FFT_SIZE; i++) {
+        int r = 0, v = i;
+        for (int n = 1; n < FFT_SIZE; n *= 4) { r = r * 4 + (v & 3); v >>= 2; }
+        f.rev[i] = (uint16_t)r;
+    }
+}
+
+static inline int32_t q31_mul(int32_t a, int32_t b) {
+    return (int32_t)(((int64_t)a * (int64_t)b + (1LL << 30)) >> 31);
+}
+
+static inline void radix4_butterfly(int32_t* re, int32_t* im, int i, int span,
+                                    int32_t w1r, int32_t w1i, int32_t w2r, int32_t w2i, int32_t w3r, int32_t w3i) {
+    int32_t ar = re[i] >> 2,            ai = im[i] >> 2;
+    int32_t br = re[i + span] >> 2,     bi = im[i + span] >> 2;
+    int32_t cr = re[i + 2 * span] >> 2, ci = im[i + 2 * span] >> 2;
+    int32_t dr = re[i + 3 * span] >> 2, di = im[i + 3 * span] >> 2;
+
+    int32_t t0r = ar + cr, t0i = ai + ci, t1r = ar - cr, t1i = ai - ci;
+    int32_t t2r = br + dr, t2i = bi + di, t3r = br - dr, t3i = bi - di;
+
+    int32_t y1r = t1r + t3i, y1i = t1i - t3r;
+    int32_t y2r = t0r - t2r, y2i = t0i - t2i;
+    int32_t y3r = t1r - t3i, y3i = t1i + t3r;
+
+    re[i] = t0r + t2r;
+    im[i] = t0i + t2i;
+    re[i + span]     = q31_mul(y1r, w1r) - q31_mul(y1i, w1i);
+    im[i + span]     = q31_mul(y1r, w1i) + q31_mul(y1i, w1r);
+    re[i + 2 * span] = q31_mul(y2r, w2r) - q31_mul(y2i, w2i);
+    im[i + 2 * span] = q31_mul(y2r, w2i) + q31_mul(y2i, w2r);
+    re[i + 3 * span] = q31_mul(y3r, w3r) - q31_mul(y3i, w3i);
+    im[i + 3 * span] = q31_mul(y3r, w3i) + q31_mul(y3i, w3r);
+}
+
+#if TW_HAVE_NEON
+static inline void neon_cmul_store(int32_t* re, int32_t* im, int32x4_t yr, int32x4_t yi, int32x4_t wr, int32x4_t wi) {
+    vst1q_s32(re, vsubq_s32(vqrdmulhq_s32(yr, wr), vqrdmulhq_s32(yi, wi)));
+    vst1q_s32(im, vaddq_s32(vqrdmulhq_s32(yr, wi), vqrdmulhq_s32(yi, wr)));
+}
+
+// Four adjacent butterflies of one group; span must be a multiple of 4.
+static inline void radix4_butterfly_neon(int32_t* re, int32_t* im, int i, int span, const int32_t* twr, const int32_t* twi, int j) {
+    int32x4_t ar = vshrq_n_s32(vld1q_s32(re + i), 2),            ai = vshrq_n_s32(vld1q_s32(im + i), 2);
+    int32x4_t br = vshrq_n_s32(vld1q_s32(re + i + span), 2),     bi = vshrq_n_s32(vld1q_s32(im + i + span), 2);
+    int32x4_t cr = vshrq_n_s32(vld1q_s32(re + i + 2 * span), 2), ci = vshrq_n_s32(vld1q_s32(im + i + 2 * span), 2);
+    int32x4_t dr = vshrq_n_s32(vld1q_s32(re + i + 3 * span), 2), di = vshrq_n_s32(vld1q_s32(im + i + 3 * span), 2);
+
+    int32x4_t t0r = vaddq_s32(ar, cr), t0i = vaddq_s32(ai, ci), t1r = vsubq_s32(ar, cr), t1i = vsubq_s32(ai, ci);
+    int32x4_t t2r = vaddq_s32(br, dr), t2i = vaddq_s32(bi, di), t3r = vsubq_s32(br, dr), t3i = vsubq_s32(bi, di);
+
+    vst1q_s32(re + i, vaddq_s32(t0r, t2r));
+    vst1q_s32(im + i, vaddq_s32(t0i, t2i));
+    neon_cmul_store(re + i + span, im + i + span, vaddq_s32(t1r, t3i), vsubq_s32(t1i, t3r),
+                    vld1q_s32(twr + j), vld1q_s32(twi + j));
+    neon_cmul_store(re + i + 2 * span, im + i + 2 * span, vsubq_s32(t0r, t2r), vsubq_s32(t0i, t2i),
+                    vld1q_s32(twr + span + j), vld1q_s32(twi + span + j));
+    neon_cmul_store(re + i + 3 * span, im + i + 3 * span, vsubq_s32(t1r, t3i), vaddq_s32(t1i, t3r),
+                    vld1q_s32(twr + 2 * span + j), vld1q_s32(twi + 2 * span + j));
+}
+#endif
+
+// Forward transform of FFT_SIZE real int16 samples; results land in f.re/f.im
+// in digit-reversed order (use f.rev to index bin k).
+static void fixed_fft_forward(FixedFFT& f, const int16_t* in) {
+    int32_t* re = f.re.data();
+    int32_t* im = f.im.data();
+    int i = 0;
+#if TW_HAVE_NEON
+    for (; i + 8 <= FFT_SIZE; i += 8) {
+        int16x8_t v = vld1q_s16(in + i);
+        vst1q_s32(re + i, vshll_n_s16(vget_low_s16(v), FIXED_IN_SHIFT));
+        vst1q_s32(re + i + 4, vshll_n_s16(vget_high_s16(v), FIXED_IN_SHIFT));
+    }
+#endif
+    for (; i < FFT_SIZE; i++) re[i] = (int32_t)in[i] * (1 << FIXED_IN_SHIFT);
+    std::fill(f.im.begin(), f.im.end(), 0);
+
+    const int32_t* twr = f.twRe.data();
+    const int32_t* twi = f.twIm.data();
+    for (int span = FFT_SIZE / 4; span >= 1; span /= 4) {
+        for (int g = 0; g < FFT_SIZE; g += 4 * span) {
+            int j = 0;
+#if TW_HAVE_NEON
+            for (; span >= 4 && j + 4 <= span; j += 4) radix4_butterfly_neon(re, im, g + j, span, twr, twi, j);
+#endif
+            for (; j < span; j++) {
+                radix4_butterfly(re, im, g + j, span, twr[j], twi[j], twr[span + j], twi[span + j],
+                                 twr[2 * span + j], twi[2 * span + j]);
+            }
+        }
+        twr += 3 * span;
+        twi += 3 * span;
+    }
+}
+
+// |z| ~= 0.96875 * max + 0.40625 * min (alpha-max-beta-min), no sqrt.
+static inline int32_t approx_mag(int32_t re, int32_t im) {
+    int32_t a = re < 0 ? -re : re;
+    int32_t b = im < 0 ? -im : im;
+    int32_t mx = a > b ? a : b, mn = a > b ? b : a;
+    return (mx * 31 + mn * 13) >> 5;
+}
+
+// Sparse constant-Q kernel for one effective sample rate: note n covers
+// bins [start[n], start[n] + len[n]) with conjugated coefficients at
+// re/im[offset[n]...].
+struct CqtKernel {
+    double fs = 0.0;
+    std::vector<int> start, len, offset;
+    std::vector<float> re, im;
+};
+
+struct LevelSums;
+
+// One track's per-block sample stages, instantiated for its decoder format
+// and channel count; see pick_pipeline().
+struct SamplePipeline {
+    int bytes;   // per decoded sample
+    void (*convert)(const unsigned char* in, int16_t* out, int frames, int channels);
+    void (*gain)(int16_t* s, int frames, int channels, int gainQ15);
+    void (*downmix)(const int16_t* s, int frames, int channels, int16_t* mono);
+    void (*levels)(const int16_t* s, int frames, int channels, LevelSums& out);
+};
+
+// Per-track analysis scratch. Everything is sized once in analysis_init() so
+// analyze_block()/publish_block() never touch the heap while a track plays;
+// the note kernel, meters and sample pipeline are set up by
+// analysis_begin_track().
+struct AnalysisFrame {
+    const SamplePipeline* pipe = nullptr;
+    std::vector<int16_t> mono;
+    std::vector<double> mags;
+    std::vector<float> specRe, specIm;   // complex spectrum, bins 0..N/2
+    std::vector<float> notes;
+    bool hasSpectrum = false;
+    bool hasNotes = false;
+    FixedFFT fixed;
+    CqtKernel cqt;
+    Meters meters;
+#if TW_HAVE_FFTW
+    double* fftIn = nullptr;
+    fftw_complex* fftOut = nullptr;
+    fftw_plan plan = nullptr;
+#endif
+};
+
+static void analysis_free(AnalysisFrame& a) {
+#if TW_HAVE_FFTW
+    if (a.plan) { fftw_destroy_plan(a.plan); a.plan = nullptr; }
+    if (a.fftIn) { fftw_free(a.fftIn); a.fftIn = nullptr; }
+    if (a.fftOut) { fftw_free(a.fftOut); a.fftOut = nullptr; }
+#else
+    (void)a;
+#endif
+}
+
+static bool analysis_init(AnalysisFrame& a) {
+    a.mono.assign(FFT_SIZE, 0);
+    a.mags.assign(FFT_SIZE / 2, 0.0);
+    a.specRe.assign(FFT_SIZE / 2 + 1, 0.0f);
+    a.specIm.assign(FFT_SIZE / 2 + 1, 0.0f);
+    a.hasSpectrum = false;
+    a.hasNotes = false;
+    fixed_fft_init(a.fixed);
+
+#if TW_HAVE_FFTW
+    a.fftIn = (double*)fftw_malloc(sizeof(double) * FFT_SIZE);
+    a.fftOut = (fftw_complex*)fftw_malloc(sizeof(fftw_complex) * (FFT_SIZE / 2 + 1));
+    if (!a.fftIn || !a.fftOut) { analysis_free(a); return false; }
+
+    a.plan = fftw_plan_dft_r2c_1d(FFT_SIZE, a.fftIn, a.fftOut, FFTW_MEASURE);
+    if (!a.plan) { analysis_free(a); return false; }
+#endif
+    return true;
+}
+
+static void spectrum_fixed(AnalysisFrame& a) {
+    FixedFFT& f = a.fixed;
+    fixed_fft_forward(f, a.mono.data());
+    // Outputs are X[k] * 2^FIXED_IN_SHIFT / N; rescale to FFTW's |X[k]| for
+    // samples normalised to [-1, 1) so both backends draw identically.
+    const double scale = (double)FFT_SIZE / (double)(1 << FIXED_IN_SHIFT) / 32768.0;
+    for (int k = 0; k < FFT_SIZE / 2; k++) {
+        int r = f.rev[k];
+        a.mags[k] = (double)approx_mag(f.re[r], f.im[r]) * scale;
+        a.specRe[k] = (float)(f.re[r] * scale);
+        a.specIm[k] = (float)(f.im[r] * scale);
+    }
+}
+
+#if TW_HAVE_FFTW
+static void spectrum_fftw(AnalysisFrame& a) {
+    for (int i = 0; i < FFT_SIZE; i++) a.fftIn[i] = (double)a.mono[i] / 32768.0;
+    fftw_execute(a.plan);
+
+    for (int i = 0; i < FFT_SIZE / 2; i++) {
+        double re = a.fftOut[i][0], im = a.fftOut[i][1];
+        a.mags[i] = std::sqrt(re * re + im * im);
+        a.specRe[i] = (float)re;
+        a.specIm[i] = (float)im;
+    }
+}
+#endif
+
+// Constant-Q view: one bin per semitone from C2 up, as in Brown and
+// Puckette's efficient CQT. Each note's temporal kernel (a Hann-windowed
+// complex tone of Q cycles, centred in the frame) is turned into a spectral
+// kernel once, evaluated directly at the few FFT bins around the note where
+// it is not negligible. Per frame the transform is then a sparse
+// matrix-vector product against the complex spectrum. The frame is only
+// FFT_SIZE samples long, so low notes get a shorter kernel than Q asks for
+// and blur into their neighbours.
+
+static void cqt_prepare(AnalysisFrame& a, double fs) {
+    CqtKernel& k = a.cqt;
+    if (k.fs == fs) return;
+    k.fs = fs;
+    k.start.assign(CQT_NOTES, 0);
+    k.len.assign(CQT_NOTES, 0);
+    k.offset.assign(CQT_NOTES, 0);
+    k.re.clear();
+    k.im.clear();
+
+    const int N = FFT_SIZE;
+    const double Q = 1.0 / (std::pow(2.0, 1.0 / 12.0) - 1.0);
+    std::vector<std::complex<double>> row;
+    for (int n = 0; n < CQT_NOTES; n++) {
+        double f = 440.0 * std::pow(2.0, (CQT_FIRST_NOTE + n - 69) / 12.0);
+        k.offset[n] = (int)k.re.size();
+        if (f >= fs / 2.0) continue;
+        int Nk = std::min(N, (int)std::ceil(Q * fs / f));
+        int shift = (N - Nk) / 2;
+        double centre = f * N / fs, half = 2.0 * N / Nk + 2.0;
+        int j0 = std::max(0, (int)std::floor(centre - half));
+        int j1 = std::min(N / 2, (int)std::ceil(centre + half));
+
+        row.assign(j1 - j0 + 1, 0.0);
+        double peak = 0.0;
+        for (int j = j0; j <= j1; j++) {
+            std::complex<double> sum = 0.0;
+            for (int t = 0; t < Nk; t++) {
+                double w = (0.5 - 0.5 * std::cos(2.0 * M_PI * t / Nk)) / Nk;
+                double ph = 2.0 * M_PI * (f * t / fs - (double)j * (t + shift) / N);
+                sum += std::polar(w, ph);
+            }
+            row[j - j0] = sum;
+            peak = std::max(peak, std::abs(sum));
+        }
+        int lo = 0, hi = (int)row.size() - 1;
+        while (lo < hi && std::abs(row[lo]) < 0.01 * peak) lo++;
+        while (hi > lo && std::abs(row[hi]) < 0.01 * peak) hi--;
+        k.start[n] = j0 + lo;
+        k.len[n] = hi - lo + 1;
+        for (int i = lo; i <= hi; i++) {
+            // Conjugated here so the per-frame product is a plain multiply.
+            k.re.push_back((float)row[i].real());
+            k.im.push_back((float)-row[i].imag());
+        }
+    }
+    a.notes.assign(CQT_NOTES, 0.0f);
+}
+
+// |sum_j X[j] conj(K[n][j])| / N for every note.
+static void cqt_apply(AnalysisFrame& a) {
+    const CqtKernel& k = a.cqt;
+    const float* xr = a.specRe.data();
+    const float* xi = a.specIm.data();
+    for (int n = 0; n < CQT_NOTES; n++) {
+        const float* kr = k.re.data() + k.offset[n];
+        const float* ki = k.im.data() + k.offset[n];
+        const int j0 = k.start[n];
+        float sr = 0.0f, si = 0.0f;
+        for (int i = 0; i < k.len[n]; i++) {
+            sr += xr[j0 + i] * kr[i] - xi[j0 + i] * ki[i];
+            si += xr[j0 + i] * ki[i] + xi[j0 + i] * kr[i];
+        }
+        a.notes[n] = std::sqrt(sr * sr + si * si) / FFT_SIZE;
+    }
+}
+
+
+// Notes need the spectrum and a kernel from cqt_prepare().
+static void analyze_block(AnalysisFrame& a, const int16_t* samples, int frames, int channels, bool wantSpectrum,
+                          bool wantNotes = false) {
+    a.pipe->downmix(samples, frames, channels, a.mono.data());
+
+    a.hasSpectrum = wantSpectrum || wantNotes;
+    a.hasNotes = wantNotes && a.cqt.fs > 0.0;
+    if (!a.hasSpectrum) return;
+
+#if TW_HAVE_FFTW
+    if (spectrumBackend.load(std::memory_order_relaxed) == BACKEND_FFTW) spectrum_fftw(a);
+    else spectrum_fixed(a);
+#else
+    spectrum_fixed(a);
+#endif
+    if (a.hasNotes) cqt_apply(a);
+}
+
+// analyze_block() squeezes a whole decoded block into FFT_SIZE samples, so
+// the rate the spectrum sees depends on the block length.
+static double analysis_rate(long rate, int blockFrames) {
+    return (double)rate * (FFT_SIZE - 1) / (double)std::max(1, blockFrames - 1);
+}
+
+// Level metering over every sample of a block. level_sums() is the
+// vectorised part: per-channel sums of squares, the L*R cross sum and the
+// largest magnitude, straight from interleaved int16. It is specialised by
+// channel count like the rest of the sample pipeline below, with the SIMD
+// loop in the stereo case. Channels beyond the first two are not metered;
+// mono is metered as identical L and R.
+struct LevelSums {
+    float ll = 0.0f, rr = 0.0f, lr = 0.0f;
+    int peakL = 0, peakR = 0;
+};
+
+template <int CH>
+static void level_sums(const int16_t* s, int frames, int channels, LevelSums& out) {
+    if (CH > 0) channels = CH;
+    float ll = 0.0f, rr = 0.0f, lr = 0.0f;
+    int peakL = 0, peakR = 0;
+    int i = 0;
+    if (CH == 2) {
+#if TW_HAVE_SSE2
+        __m128 accLL = _mm_setzero_ps(), accRR = _mm_setzero_ps(), accLR = _mm_setzero_ps();
+        const __m128i zero = _mm_setzero_si128();
+        __m128i peak = zero;
+        for (; i + 4 <= frames; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 2 * i));
+            // |v| with -32768 saturating to 32767; lanes alternate L, R.
+            peak = _mm_max_epi16(peak, _mm_max_epi16(v, _mm_subs_epi16(zero, v)));
+            __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+            __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+            __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            accLL = _mm_add_ps(accLL, _mm_mul_ps(l, l));
+            accRR = _mm_add_ps(accRR, _mm_mul_ps(r, r));
+            accLR = _mm_add_ps(accLR, _mm_mul_ps(l, r));
+        }
+        alignas(16) float f[12];
+        alignas(16) int16_t p[8];
+        _mm_store_ps(f, accLL);
+        _mm_store_ps(f + 4, accRR);
+        _mm_store_ps(f + 8, accLR);
+        _mm_store_si128(reinterpret_cast<__m128i*>(p), peak);
+        ll = f[0] + f[1] + f[2] + f[3];
+        rr = f[4] + f[5] + f[6] + f[7];
+        lr = f[8] + f[9] + f[10] + f[11];
+        for (int k = 0; k < 8; k += 2) {
+            peakL = std::max(peakL, (int)p[k]);
+            peakR = std::max(peakR, (int)p[k + 1]);
+        }
+#elif TW_HAVE_NEON
+        float32x4_t accLL = vdupq_n_f32(0.0f), accRR = vdupq_n_f32(0.0f), accLR = vdupq_n_f32(0.0f);
+        int16x8_t pkL = vdupq_n_s16(0), pkR = vdupq_n_s16(0);
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t v = vld2q_s16(s + 2 * i);
+            pkL = vmaxq_s16(pkL, vqabsq_s16(v.val[0]));
+            pkR = vmaxq_s16(pkR, vqabsq_s16(v.val[1]));
+            float32x4_t l0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0])));
+            float32x4_t l1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0])));
+            float32x4_t r0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1])));
+            float32x4_t r1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1])));
+            accLL = vmlaq_f32(vmlaq_f32(accLL, l0, l0), l1, l1);
+            accRR = vmlaq_f32(vmlaq_f32(accRR, r0, r0), r1, r1);
+            accLR = vmlaq_f32(vmlaq_f32(accLR, l0, r0), l1, r1);
+        }
+        alignas(16) float f[12];
+        alignas(16) int16_t p[16];
+        vst1q_f32(f, accLL);
+        vst1q_f32(f + 4, accRR);
+        vst1q_f32(f + 8, accLR);
+        vst1q_s16(p, pkL);
+        vst1q_s16(p + 8, pkR);
+        ll = f[0] + f[1] + f[2] + f[3];
+        rr = f[4] + f[5] + f[6] + f[7];
+        lr = f[8] + f[9] + f[10] + f[11];
+        for (int k = 0; k < 8; k++) {
+            peakL = std::max(peakL, (int)p[k]);
+            peakR = std::max(peakR, (int)p[k + 8]);
+        }
+#endif
+    }
+    for (; i < frames; i++) {
+        int l = s[i * channels];
+        int r = channels > 1 ? s[i * channels + 1] : l;
+        ll += (float)(l * l);
+        rr += (float)(r * r);
+        lr += (float)(l * r);
+        peakL = std::max(peakL, std::min(32767, std::abs(l)));
+        peakR = std::max(peakR, std::min(32767, std::abs(r)));
+    }
+    out.ll = ll;
+    out.rr = rr;
+    out.lr = lr;
+    out.peakL = peakL;
+    out.peakR = peakR;
+}
+
+// The rest of the per-block sample pipeline. A track's decoder format and
+// channel count are fixed, so every stage is instantiated for each format
+// and for mono, stereo and any other count (CH 0), and pick_pipeline()
+// chooses one set per track. Conversion and gain run eight samples at a
+// time in SSE2 or NEON; downmix and levels use the fixed stride. Everything
+// after convert is interleaved int16, which is what the stream, history and
+// replay carry.
+struct SampleS16 {
+    static constexpr int bytes = 2;
+    static int16_t to_s16(const unsigned char* p) {
+        int16_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+struct SampleS24 {
+    static constexpr int bytes = 3;
+    static int16_t to_s16(const unsigned char* p) {
+        int32_t v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+        return (int16_t)std::min(32767, (v + 128) >> 8);
+    }
+};
+
+// Rounds half up; the offset keeps the truncating cast on positive values.
+struct SampleF32 {
+    static constexpr int bytes = 4;
+    static int16_t to_s16(const unsigned char* p) {
+        float f;
+        std::memcpy(&f, p, sizeof(f));
+        float v = std::max(-32768.0f, std::min(32767.0f, f * 32768.0f));
+        return (int16_t)((int)(v + 32768.5f) - 32768);
+    }
+};
+
+// Eight float samples at a time, rounded like SampleF32::to_s16(). The
+// compiler leaves that loop scalar: under the default -ftrapping-math its
+// float clamps count as control flow.
+#if TW_HAVE_SSE2 || TW_HAVE_NEON
+static inline void f32_to_s16_x8(const unsigned char* in, int16_t* out) {
+#if TW_HAVE_SSE2
+    const __m128 scale = _mm_set1_ps(32768.0f), lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+    const __m128 bias = _mm_set1_ps(32768.5f);
+    __m128 a = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float*>(in)), scale)));
+    __m128 b = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float*>(in) + 4), scale)));
+    const __m128i off = _mm_set1_epi32(32768);
+    __m128i ia = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(a, bias)), off);
+    __m128i ib = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(b, bias)), off);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packs_epi32(ia, ib));
+#else
+    const float32x4_t lo = vdupq_n_f32(-32768.0f), hi = vdupq_n_f32(32767.0f), bias = vdupq_n_f32(32768.5f);
+    float32x4_t a = vmaxq_f32(lo, vminq_f32(hi, vmulq_n_f32(vld1q_f32(reinterpret_cast<const float*>(in)), 32768.0f)));
+    float32x4_t b = vmaxq_f32(lo, vminq_f32(hi, vmulq_n_f32(vld1q_f32(reinterpret_cast<const float*>(in) + 4), 32768.0f)));
+    const int32x4_t off = vdupq_n_s32(32768);
+    int32x4_t ia = vsubq_s32(vcvtq_s32_f32(vaddq_f32(a, bias)), off);
+    int32x4_t ib = vsubq_s32(vcvtq_s32_f32(vaddq_f32(b, bias)), off);
+    vst1q_s16(out, vcombine_s16(vqmovn_s32(ia), vqmovn_s32(ib)));
+#endif
+}
+
+// Eight packed int24 samples (24 bytes) at a time, rounded like
+// SampleS24::to_s16(): the top two bytes, plus one when the low byte is
+// 128 or more, saturated.
+static inline void s24_to_s16_x8(const unsigned char* in, int16_t* out) {
+#if TW_HAVE_SSE2
+    // SSE2 has no byte shuffle. Sample k of a 12-byte group starts at byte
+    // 3k, which a whole-register shift left by k bytes moves to the start
+    // of 32-bit lane k; one mask per lane picks it out.
+    const __m128i m0 = _mm_set_epi32(0, 0, 0, -1), m1 = _mm_set_epi32(0, 0, -1, 0);
+    const __m128i m2 = _mm_set_epi32(0, -1, 0, 0), m3 = _mm_set_epi32(-1, 0, 0, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    auto four = [&](__m128i x) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_and_si128(x, m0), _mm_and_si128(_mm_slli_si128(x, 1), m1)),
+                                 _mm_or_si128(_mm_and_si128(_mm_slli_si128(x, 2), m2), _mm_and_si128(_mm_slli_si128(x, 3), m3)));
+        v = _mm_srai_epi32(_mm_slli_epi32(v, 8), 8);
+        return _mm_srai_epi32(_mm_add_epi32(v, round), 8);
+    };
+    __m128i a = four(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)));
+    // Bytes 8..23, so nothing past the 24 is read.
+    __m128i b = four(_mm_srli_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8)), 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packs_epi32(a, b));
+#else
+    uint8x8x3_t v = vld3_u8(in);
+    int16x8_t top = vreinterpretq_s16_u16(vorrq_u16(vmovl_u8(v.val[1]), vshll_n_u8(v.val[2], 8)));
+    int16x8_t up = vreinterpretq_s16_u16(vmovl_u8(vshr_n_u8(v.val[0], 7)));
+    vst1q_s16(out, vqaddq_s16(top, up));
+#endif
+}
+
+// Eight samples at a time, times gainQ15 and shifted down like the scalar
+// tail of gain_block(). The 16x16 product is rebuilt from its low and high
+// halves, so the result is exact.
+static inline void gain_s16_x8(int16_t* s, int gainQ15) {
+#if TW_HAVE_SSE2
+    const __m128i g = _mm_set1_epi16((int16_t)gainQ15);
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    __m128i lo = _mm_mullo_epi16(v, g), hi = _mm_mulhi_epi16(v, g);
+    __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+    __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s), _mm_packs_epi32(a, b));
+#else
+    const int16x4_t g = vdup_n_s16((int16_t)gainQ15);
+    int16x8_t v = vld1q_s16(s);
+    int32x4_t a = vshrq_n_s32(vmull_s16(vget_low_s16(v), g), 15);
+    int32x4_t b = vshrq_n_s32(vmull_s16(vget_high_s16(v), g), 15);
+    vst1q_s16(s, vcombine_s16(vmovn_s32(a), vmovn_s32(b)));
+#endif
+}
+#endif
+
+// Conversion and gain treat the block as one run of interleaved samples, so
+// they are the same for every channel count; only downmix and levels use CH.
+template <class Fmt, int CH>
+static void convert_block(const unsigned char* __restrict in, int16_t* __restrict out, int frames, int channels) {
+    const int n = frames * (CH > 0 ? CH : channels);
+    if (std::is_same<Fmt, SampleS16>::value) {
+        std::memcpy(out, in, (size_t)n * sizeof(int16_t));
+        return;
+    }
+    int i = 0;
+#if TW_HAVE_SSE2 || TW_HAVE_NEON
+    if (std::is_same<Fmt, SampleF32>::value)
+        for (; i + 8 <= n; i += 8) f32_to_s16_x8(in + (size_t)i * 4, out + i);
+    if (std::is_same<Fmt, SampleS24>::value)
+        for (; i + 8 <= n; i += 8) s24_to_s16_x8(in + (size_t)i * 3, out + i);
+#endif
+    for (; i < n; i++) out[i] = Fmt::to_s16(in + (size_t)i * Fmt::bytes);
+}
+
+// gainQ15 is below 32768 (unity is never applied), so nothing here can clip.
+template <int CH>
+static void gain_block(int16_t* s, int frames, int channels, int gainQ15) {
+    const int n = frames * (CH > 0 ? CH : channels);
+    int i = 0;
+#if TW_HAVE_SSE2 || TW_HAVE_NEON
+    for (; i + 8 <= n; i += 8) gain_s16_x8(s + i, gainQ15);
+#endif
+    for (; i < n; i++) s[i] = (int16_t)(((int)s[i] * gainQ15) >> 15);
+}
+
+// Squeezes the block into FFT_SIZE mono samples for analyze_block(),
+// taking the nearest frame and averaging its channels.
+template <int CH>
+static void downmix_block(const int16_t* s, int frames, int channels, int16_t* mono) {
+    if (CH > 0) channels = CH;
+    const long long last = std::max(0, frames - 1);
+    for (int i = 0; i < FFT_SIZE; i++) {
+        const int16_t* f = s + (size_t)((i * last * 2 + (FFT_SIZE - 1)) / (2 * (FFT_SIZE - 1))) * channels;
+        if (CH == 1) {
+            mono[i] = f[0];
+        } else if (CH == 2) {
+            mono[i] = (int16_t)(((int)f[0] + f[1]) >> 1);
+        } else {
+            int sum = 0;
+            for (int c = 0; c < channels; c++) sum += f[c];
+            mono[i] = (int16_t)(sum / channels);
+        }
+    }
+}
+
+template <class Fmt, int CH>
+static constexpr SamplePipeline make_pipeline() {
+    return { Fmt::bytes, convert_block<Fmt, CH>, gain_block<CH>, downmix_block<CH>, level_sums<CH> };
+}
+
+static const SamplePipeline PIPELINES[3][3] = {
+    { make_pipeline<SampleS16, 1>(), make_pipeline<SampleS16, 2>(), make_pipeline<SampleS16, 0>() },
+    { make_pipeline<SampleS24, 1>(), make_pipeline<SampleS24, 2>(), make_pipeline<SampleS24, 0>() },
+    { make_pipeline<SampleF32, 1>(), make_pipeline<SampleF32, 2>(), make_pipeline<SampleF32, 0>() },
+};
+
+// Decoder encodings the pipeline converts from; others are decoded as int16.
+static bool pipeline_encoding(int encoding) {
+    return encoding == MPG123_ENC_SIGNED_16 || encoding == MPG123_ENC_SIGNED_24 || encoding == MPG123_ENC_FLOAT_32;
+}
+
+static const SamplePipeline* pick_pipeline(int encoding, int channels) {
+    int f = encoding == MPG123_ENC_SIGNED_24 ? 1 : (encoding == MPG123_ENC_FLOAT_32 ? 2 : 0);
+    return &PIPELINES[f][channels == 1 ? 0 : (channels == 2 ? 1 : 2)];
+}
+
+static int volume_gain_q15() {
+    int db = volumeDb.load(std::memory_order_relaxed);
+    return db >= 0 ? 32768 : (int)std::lround(32768.0 * std::pow(10.0, db / 20.0));
+}
+
+// Meter ballistics, advanced once per block. VU is the RMS level through a
+// one-pole that settles in 300 ms like a VU needle; PPM rises at once and
+// falls 20 dB in 1.7 s (IEC 60268-10 type I). Peak hold and the clip lamp
+// latch for a few seconds; the correlation meter smooths over 300 ms.
+#define METER_FLOOR_DB -90.0f
+#define VU_TAU_S 0.065
+#define PPM_FALL_DB_PER_S (20.0 / 1.7)
+#define PEAK_HOLD_S 2.0
+#define CLIP_HOLD_S 3.0
+#define CORR_TAU_S 0.3
+
+static inline float level_db(double power) {
+    return power > 1e-9 ? (float)(10.0 * std::log10(power)) : METER_FLOOR_DB;
+}
+
+static void meter_reset(Meters& m, int channels) {
+    m = Meters();
+    m.channels = std::min(channels, 2);
+    for (int c = 0; c < 2; c++) m.vuDb[c] = m.ppmDb[c] = m.holdDb[c] = METER_FLOOR_DB;
+}
+
+static void meter_block(AnalysisFrame& a, const int16_t* samples, int frames, int channels, long rate) {
+    if (frames <= 0 || rate <= 0) return;
+    Meters& m = a.meters;
+    LevelSums s;
+    a.pipe->levels(samples, frames, channels, s);
+
+    const double dt = (double)frames / (double)rate;
+    const double full = 32768.0 * 32768.0;
+    const double vuK = 1.0 - std::exp(-dt / VU_TAU_S);
+    const double corrK = 1.0 - std::exp(-dt / CORR_TAU_S);
+    const double ms[2] = { s.ll / frames / full, s.rr / frames / full };
+    const int peak[2] = { s.peakL, s.peakR };
+    for (int c = 0; c < 2; c++) {
+        m.vuMs[c] += (ms[c] - m.vuMs[c]) * vuK;
+        m.vuDb[c] = level_db(m.vuMs[c]);
+
+        float pk = level_db((double)peak[c] * peak[c] / full);
+        m.ppmDb[c] = std::max(pk, std::max(METER_FLOOR_DB, m.ppmDb[c] - (float)(PPM_FALL_DB_PER_S * dt)));
+
+        m.holdLeft[c] -= dt;
+        if (m.ppmDb[c] >= m.holdDb[c] || m.holdLeft[c] <= 0.0) {
+            m.holdDb[c] = m.ppmDb[c];
+            m.holdLeft[c] = PEAK_HOLD_S;
+        }
+
+        m.clipLeft[c] = peak[c] >= 32767 ? CLIP_HOLD_S : std::max(0.0, m.clipLeft[c] - dt);
+        m.clip[c] = m.clipLeft[c] > 0.0;
+    }
+
+    const double cross[3] = { s.ll / full, s.rr / full, s.lr / full };
+    for (int k = 0; k < 3; k++) m.cross[k] += (cross[k] - m.cross[k]) * corrK;
+    double denom = std::sqrt(m.cross[0] * m.cross[1]);
+    m.corr = denom > 1e-12 ? (float)std::max(-1.0, std::min(1.0, m.cross[2] / denom)) : 0.0f;
+    m.channels = std::min(channels, 2);
+}
+
+// Shared-memory analysis tap (--tap). Every analysed block is published as a
+// fixed-layout frame into a POSIX shared-memory ring, so LED drivers and
+// external visualizers can follow playback without a socket. Each slot is
+// guarded by its own sequence counter (a seqlock): the writer makes it odd,
+// fills the slot, then makes it even again, and a reader retries when the
+// counter was odd or changed while it copied. The writer never waits for
+// readers. The layout is versioned and documented in the README; any change
+// to TapHeader or TapFrame must bump TAP_VERSION.
+#define TAP_VERSION 1
+#define TAP_SLOTS 16
+#define TAP_BANDS 32
+#define TAP_ENV_POINTS 64
+#define TAP_BAND_LOW_HZ 40.0f
+#define TAP_BAND_HIGH_HZ 10000.0f
+#define TAP_DEFAULT_NAME "/terminalwave"
+
+enum TapFlags : uint32_t {
+    TAP_BEAT = 1u << 0,          // a beat is heard during this frame
+    TAP_TRACK_START = 1u << 1,   // first frame of a track
+    TAP_PREVIEW = 1u << 2,       // a preview playing on its own
+};
+
+struct TapHeader {
+    char magic[4];                        // "TWTP"
+    uint32_t version;                     // TAP_VERSION
+    uint32_t headerSize;                  // sizeof(TapHeader)
+    uint32_t frameSize;                   // sizeof(TapFrame)
+    uint32_t slots;                       // ring length
+    uint32_t bands;                       // TAP_BANDS
+    uint32_t envPoints;                   // TAP_ENV_POINTS
+    uint32_t writerPid;
+    std::atomic<uint64_t> published;      // frames written; newest is published - 1
+    float bandLowHz, bandHighHz;          // band edges are log-spaced between these
+    uint8_t reserved[16];
+};
+
+struct TapFrame {
+    std::atomic<uint32_t> seq;            // odd while the writer is in the slot
+    uint32_t flags;                       // TapFlags
+    uint64_t index;                       // frame number; lives in slot index % slots
+    int64_t writtenNs;                    // CLOCK_MONOTONIC when published
+    int64_t presentNs;                    // CLOCK_MONOTONIC when its first sample is heard
+    double positionSec;                   // track position at the end of the frame
+    float bpm;                            // 0 when unknown
+    float beatPhase;                      // 0..1 through the beat at presentNs
+    uint32_t rate;                        // sample rate
+    uint32_t frames;                      // sample frames covered
+    float vuDb[2];                        // meter levels, dBFS
+    float bands[TAP_BANDS];               // peak magnitude per band, 1.0 = full-scale sine
+    float envelope[TAP_ENV_POINTS];       // peak |sample| per slice of the frame, 0..1
+};
+
+static_assert(sizeof(TapHeader) == 64, "tap header layout");
+static_assert(sizeof(TapFrame) == 448, "tap frame layout");
+static_assert(offsetof(TapFrame, bands) == 64, "tap frame layout");
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "tap counters must be lock-free to live in shared memory");
+
+struct AnalysisTap {
+    std::string name;
+    TapHeader* header = nullptr;
+    TapFrame* slots = nullptr;
+    size_t size = 0;
+    uint32_t pendingFlags = 0;
+    double bandFs = 0.0;
+    int bandEdge[TAP_BANDS + 1] = {};
+};
+
+static AnalysisTap tap;
+
+static size_t tap_size() {
+    return sizeof(TapHeader) + (size_t)TAP_SLOTS * sizeof(TapFrame);
+}
+
+static bool tap_open(const std::string& name, std::string& err) {
+#if TW_HAVE_SHM
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) { err = std::strerror(errno); return false; }
+    size_t size = tap_size();
+    if (ftruncate(fd, (off_t)size) != 0) {
+        err = std::strerror(errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        err = std::strerror(errno);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    std::memset(mem, 0, size);
+    tap.name = name;
+    tap.size = size;
+    tap.header = static_cast<TapHeader*>(mem);
+    tap.slots = reinterpret_cast<TapFrame*>(static_cast<char*>(mem) + sizeof(TapHeader));
+
+    TapHeader& h = *tap.header;
+    h.version = TAP_VERSION;
+    h.headerSize = sizeof(TapHeader);
+    h.frameSize = sizeof(TapFrame);
+    h.slots = TAP_SLOTS;
+    h.bands = TAP_BANDS;
+    h.envPoints = TAP_ENV_POINTS;
+    h.writerPid = (uint32_t)getpid();
+    h.bandLowHz = TAP_BAND_LOW_HZ;
+    h.bandHighHz = TAP_BAND_HIGH_HZ;
+    // Readers check the magic, written last, so they never see a half-built
+    // header.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(h.magic, "TWTP", 4);
+    return true;
+#else
+    (void)name;
+    err = "shared memory is not available on this platform";
+    return false;
+#endif
+}
+
+static void tap_close() {
+#if TW_HAVE_SHM
+    if (!tap.header) return;
+    munmap(tap.header, tap.size);
+    shm_unlink(tap.name.c_str());
+    tap.header = nullptr;
+    tap.slots = nullptr;
+#endif
+}
+
+// FFT bin edges of the tap bands for the spectrum's effective rate.
+static void tap_band_edges(double fs) {
+    tap.bandFs = fs;
+    const int maxBin = FFT_SIZE / 2;
+    for (int b = 0; b <= TAP_BANDS; b++) {
+        double hz = TAP_BAND_LOW_HZ * std::pow(TAP_BAND_HIGH_HZ / TAP_BAND_LOW_HZ, (double)b / TAP_BANDS);
+        tap.bandEdge[b] = clampi((int)std::lround(hz * FFT_SIZE / fs), 1, maxBin);
+    }
+}
+
+// Publishes one analysed block. presentNs is derived from the stream's
+// output latency, the same way the beat clock is anchored, and can lie in
+// the past when the device buffers less than a block.
+static void tap_publish(const AnalysisFrame& a, const int16_t* samples, int frames, int channels, long rate,
+                        double positionSec, double latencySec, const BeatClock& beat, uint32_t flags) {
+    if (!tap.header || frames <= 0) return;
+    TapHeader& h = *tap.header;
+    uint64_t index = h.published.load(std::memory_order_relaxed);
+    TapFrame& f = tap.slots[index % TAP_SLOTS];
+
+    uint32_t seq = f.seq.load(std::memory_order_relaxed);
+    f.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    long long now = steady_ns();
+    double dur = (double)frames / (double)rate;
+    f.flags = flags | tap.pendingFlags;
+    tap.pendingFlags = 0;
+    f.index = index;
+    f.writtenNs = now;
+    f.presentNs = now + (long long)((latencySec - dur) * 1e9);
+    f.positionSec = positionSec;
+    f.rate = (uint32_t)rate;
+    f.frames = (uint32_t)frames;
+    f.bpm = beat.bpm > 0.0f ? beat.bpm : 0.0f;
+    f.beatPhase = 0.0f;
+    if (beat.periodNs > 0) {
+        long long since = f.presentNs - beat.anchorNs;
+        long long into = ((since % beat.periodNs) + beat.periodNs) % beat.periodNs;
+        f.beatPhase = (float)((double)into / (double)beat.periodNs);
+        if (into == 0 || beat.periodNs - into < (long long)(dur * 1e9)) f.flags |= TAP_BEAT;
+    }
+    f.vuDb[0] = a.meters.vuDb[0];
+    f.vuDb[1] = a.meters.vuDb[1];
+
+    if (a.hasSpectrum) {
+        if (a.cqt.fs != tap.bandFs) tap_band_edges(a.cqt.fs);
+        for (int b = 0; b < TAP_BANDS; b++) {
+            double peak = 0.0;
+            int hi = std::max(tap.bandEdge[b] + 1, tap.bandEdge[b + 1]);
+            for (int k = tap.bandEdge[b]; k < hi && k < FFT_SIZE / 2; k++) peak = std::max(peak, a.mags[k]);
+            f.bands[b] = (float)(peak / (FFT_SIZE / 2));
+        }
+    } else {
+        std::fill(f.bands, f.bands + TAP_BANDS, 0.0f);
+    }
+
+    const int values = frames * channels;
+    for (int p = 0; p < TAP_ENV_POINTS; p++) {
+        int i0 = (int)((long long)values * p / TAP_ENV_POINTS);
+        int i1 = (int)((long long)values * (p + 1) / TAP_ENV_POINTS);
+        int peak = 0;
+        for (int i = i0; i < i1; i++) peak = std::max(peak, std::abs((int)samples[i]));
+        f.envelope[p] = (float)std::min(peak, 32767) / 32767.0f;
+    }
+
+    f.seq.store(seq + 2, std::memory_order_release);
+    h.published.store(index + 1, std::memory_order_release);
+}
+
+// Reference reader for the tap (--tap-dump): attaches read-only and prints
+// a line per new frame until interrupted.
+static int run_tap_dump(const std::string& name) {
+#if TW_HAVE_SHM
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        std::cerr << "tap-dump: cannot open " << name << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    void* mem = mmap(nullptr, tap_size(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        std::cerr << "tap-dump: mmap failed: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    const TapHeader* h = static_cast<const TapHeader*>(mem);
+    if (std::memcmp(h->magic, "TWTP", 4) != 0 || h->version != TAP_VERSION || h->frameSize != sizeof(TapFrame)) {
+        std::cerr << "tap-dump: " << name << " is not a version " << TAP_VERSION << " tap\n";
+        munmap(mem, tap_size());
+        return 1;
+    }
+    const TapFrame* slots = reinterpret_cast<const TapFrame*>(static_cast<const char*>(mem) + h->headerSize);
+
+    uint64_t next = h->published.load(std::memory_order_acquire);
+    while (!shouldQuit.load()) {
+        uint64_t published = h->published.load(std::memory_order_acquire);
+        if (published == next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            continue;
+        }
+        if (published - next > TAP_SLOTS) next = published - TAP_SLOTS;   // fell behind
+        const TapFrame& slot = slots[next % TAP_SLOTS];
+        TapFrame f;
+        uint32_t s0, s1;
+        do {
+            s0 = slot.seq.load(std::memory_order_acquire);
+            std::memcpy(static_cast<void*>(&f), static_cast<const void*>(&slot), sizeof(f));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = slot.seq.load(std::memory_order_relaxed);
+        } while ((s0 & 1) || s0 != s1);
+        if (f.index != next) { next = published; continue; }   // overwritten while we looked
+        next++;
+
+        int loudest = 0;
+        for (int b = 1; b < TAP_BANDS; b++) if (f.bands[b] > f.bands[loudest]) loudest = b;
+        double hz = TAP_BAND_LOW_HZ * std::pow(TAP_BAND_HIGH_HZ / TAP_BAND_LOW_HZ, (loudest + 0.5) / TAP_BANDS);
+        std::printf("#%llu %8.3fs  %5.1f BPM phase %.2f%s  VU %6.1f %6.1f  peak band %2d (~%.0f Hz)%s%s\n",
+                    (unsigned long long)f.index, f.positionSec, f.bpm, f.beatPhase, (f.flags & TAP_BEAT) ? " BEAT" : "     ",
+                    f.vuDb[0], f.vuDb[1], loudest, hz, (f.flags & TAP_TRACK_START) ? "  [track]" : "",
+                    (f.flags & TAP_PREVIEW) ? "  [preview]" : "");
+        std::fflush(stdout);
+    }
+    munmap(mem, tap_size());
+    return 0;
+#else
+    (void)name;
+    std::cerr << "tap-dump: shared memory is not available on this platform\n";
+    return 1;
+#endif
+}
+
+// The tap publishes spectrum bands even when no pane shows a spectrum.
+static inline bool spectrum_needed() {
+    return spectrumWanted.load(std::memory_order_relaxed) || tap.header;
+}
+
+// Per-track analysis setup: the note kernel for this rate, fresh meters,
+// and a track-start mark on the next tap frame.
+static void analysis_begin_track(AnalysisFrame& a, long rate, int channels, int blockFrames) {
+    cqt_prepare(a, analysis_rate(rate, blockFrames));
+    meter_reset(a.meters, channels);
+    a.pipe = pick_pipeline(MPG123_ENC_SIGNED_16, channels);
+    tap.pendingFlags = TAP_TRACK_START;
+}
+
+// Offline tempo analysis. Half-rate mono is framed every ONSET_HOP samples,
+// Hann-windowed and run through the fixed-point FFT; spectral flux (the
+// summed rise of log magnitude per bin) is the onset envelope.
+#define ONSET_HOP (FFT_SIZE / 4)
+#define BPM_MIN 60
+#define BPM_MAX 200
+
+// Tempo from the autocorrelation of the onset envelope, weighted towards
+// 120 BPM with a one-octave log-Gaussian so half and double tempo lose
+// ties. The beat grid phase is the offset whose comb collects the most
+// onset strength.
+static void estimate_tempo(const std::vector<float>& flux, long rate, BeatGrid& g) {
+    g.bpm = g.firstBeat = g.period = g.confidence = 0.0f;
+    const double fr = (double)rate / ONSET_HOP;
+    const int n = (int)flux.size();
+    const int lagMin = std::max(2, (int)std::floor(60.0 * fr / BPM_MAX));
+    const int lagMax = (int)std::ceil(60.0 * fr / BPM_MIN);
+    if (n < 4 * lagMax) return;
+
+    // Onset strength: flux above its local mean (about half a second).
+    const int w = std::max(1, (int)(fr / 4));
+    std::vector<double> prefix(n + 1, 0.0);
+    for (int i = 0; i < n; i++) prefix[i + 1] = prefix[i] + flux[i];
+    std::vector<float> onset(n);
+    for (int i = 0; i < n; i++) {
+        int a = std::max(0, i - w), b = std::min(n, i + w + 1);
+        double mean = (prefix[b] - prefix[a]) / (b - a);
+        onset[i] = (float)std::max(0.0, flux[i] - mean);
+    }
+
+    std::vector<double> ac(lagMax + 2, 0.0);
+    for (int lag = 0; lag <= lagMax + 1; lag++) {
+        if (lag != 0 && lag < lagMin - 1) continue;
+        double s = 0.0;
+        for (int i = 0; i + lag < n; i++) s += (double)onset[i] * onset[i + lag];
+        ac[lag] = s / (n - lag);
+    }
+    if (ac[0] <= 0.0) return;
+
+    int best = lagMin;
+    double bestScore = -1.0;
+    for (int lag = lagMin; lag <= lagMax; lag++) {
+        double oct = std::log2(60.0 * fr / lag / 120.0);
+        double score = ac[lag] * std::exp(-0.5 * oct * oct);
+        if (score > bestScore) { bestScore = score; best = lag; }
+    }
+    double y0 = ac[best - 1], y1 = ac[best], y2 = ac[best + 1];
+    double den = y0 - 2.0 * y1 + y2;
+    double period = best + ((den < 0.0) ? 0.5 * (y0 - y2) / den : 0.0);
+
+    // The lag is only good to a fraction of a frame, which drifts by whole
+    // beats over a track; refine period and phase together on the comb.
+    double bestPhase = 0.0, bestPeriod = period, combScore = -1.0;
+    for (double p = period - 1.0; p <= period + 1.0; p += 0.02) {
+        for (int ph = 0; ph < (int)p; ph++) {
+            double s = 0.0;
+            for (double t = ph + 0.5; t < n; t += p) s += onset[(int)t];
+            if (s > combScore) { combScore = s; bestPhase = ph; bestPeriod = p; }
+        }
+    }
+    period = bestPeriod;
+
+    // Flux index i compares frame i + 1 with frame i; frames are centred
+    // half a window after their start.
+    g.period = (float)(period / fr);
+    g.firstBeat = (float)(((bestPhase + 1.0) * ONSET_HOP + FFT_SIZE / 2) / (double)rate);
+    if (g.firstBeat >= g.period) g.firstBeat = std::fmod(g.firstBeat, g.period);
+    g.bpm = (float)(60.0 / g.period);
+    g.confidence = (float)std::min(1.0, y1 / ac[0]);
+}
+
+static bool compute_beats(const std::string& path, const CancelToken& tok, BeatGrid& out) {
+    auto t0 = std::chrono::steady_clock::now();
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_FORCE_MONO | MPG123_QUIET, 0.0);
+    mpg123_param(mh, MPG123_DOWN_SAMPLE, 1, 0.0);
+
+    long rate;
+    int channels, encoding;
+    bool ok = mpg123_open(mh, path.c_str()) == MPG123_OK && mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK;
+    std::vector<float> flux;
+    if (ok) {
+        mpg123_format_none(mh);
+        mpg123_format(mh, rate, MPG123_MONO, MPG123_ENC_SIGNED_16);
+
+        FixedFFT fft;
+        fixed_fft_init(fft);
+        int16_t hann[FFT_SIZE], frame[FFT_SIZE];
+        for (int i = 0; i < FFT_SIZE; i++) hann[i] = (int16_t)std::lround(32767.0 * (0.5 - 0.5 * std::cos(2.0 * M_PI * i / FFT_SIZE)));
+        std::vector<uint32_t> prevLog(FFT_SIZE / 2, 0);
+        std::vector<int16_t> pcm(FFT_SIZE + BUFFER_SIZE);
+        size_t fill = 0;
+        bool first = true;
+
+        while (!tok.cancelled()) {
+            size_t done = 0;
+            int ret = mpg123_read(mh, reinterpret_cast<unsigned char*>(pcm.data() + fill), (pcm.size() - fill) * sizeof(int16_t), &done);
+            fill += done / sizeof(int16_t);
+            size_t pos = 0;
+            for (; fill - pos >= FFT_SIZE; pos += ONSET_HOP) {
+                for (int i = 0; i < FFT_SIZE; i++) frame[i] = (int16_t)(((int32_t)pcm[pos + i] * hann[i]) >> 15);
+                fixed_fft_forward(fft, frame);
+                uint64_t rise = 0;
+                for (int k = 1; k < FFT_SIZE / 2; k++) {
+                    int r = fft.rev[k];
+                    uint32_t l = ilog2_q16((uint32_t)approx_mag(fft.re[r], fft.im[r]) + 1);
+                    if (l > prevLog[k]) rise += l - prevLog[k];
+                    prevLog[k] = l;
+                }
+                if (!first) flux.push_back((float)rise / 65536.0f);
+                first = false;
+            }
+            std::memmove(pcm.data(), pcm.data() + pos, (fill - pos) * sizeof(int16_t));
+            fill -= pos;
+            if (ret != MPG123_OK && ret != MPG123_NEW_FORMAT) break;
+        }
+        ok = !tok.cancelled();
+    }
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    if (!ok) return false;
+
+    estimate_tempo(flux, rate, out);
+    double secs = (double)flux.size() * ONSET_HOP / (double)rate;
+    double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    out.speed = (float)(secs / std::max(took, 1e-6));
+    return true;
+}
+
+// Decodes the first FP_SECONDS of a track as quarter-rate mono (plenty for
+// 300-3000 Hz) and folds FixedFFT frames into FP_SEGMENTS + 1 time segments
+// of FP_BANDS log-spaced band energies. Only the excerpt is decoded, so a
+// fingerprint costs a small fraction of a full analysis pass.
+static bool compute_fingerprint(const std::string& path, const CancelToken& tok, Fingerprint& out) {
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_FORCE_MONO | MPG123_QUIET, 0.0);
+    mpg123_param(mh, MPG123_DOWN_SAMPLE, 2, 0.0);
+
+    long rate;
+    int channels, encoding;
+    bool ok = mpg123_open(mh, path.c_str()) == MPG123_OK && mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK;
+    std::vector<float> bands;   // FP_BANDS per frame
+    if (ok) {
+        mpg123_format_none(mh);
+        mpg123_format(mh, rate, MPG123_MONO, MPG123_ENC_SIGNED_16);
+        off_t len = mpg123_length(mh);
+        out.seconds = len > 0 ? (float)((double)len / rate) : 0.0f;
+
+        int edge[FP_BANDS + 1];
+        for (int b = 0; b <= FP_BANDS; b++) {
+            double hz = 300.0 * std::pow(10.0, (double)b / FP_BANDS);
+            edge[b] = clampi((int)std::lround(hz * FFT_SIZE / rate), 1, FFT_SIZE / 2);
+            if (b > 0 && edge[b] <= edge[b - 1]) edge[b] = std::min(edge[b - 1] + 1, FFT_SIZE / 2);
+        }
+
+        FixedFFT fft;
+        fixed_fft_init(fft);
+        int16_t hann[FFT_SIZE], frame[FFT_SIZE];
+        for (int i = 0; i < FFT_SIZE; i++) hann[i] = (int16_t)std::lround(32767.0 * (0.5 - 0.5 * std::cos(2.0 * M_PI * i / FFT_SIZE)));
+        std::vector<int16_t> pcm(FFT_SIZE + BUFFER_SIZE);
+        size_t fill = 0, decoded = 0, limit = (size_t)rate * FP_SECONDS;
+
+        while (!tok.cancelled() && decoded < limit) {
+            size_t done = 0;
+            int ret = mpg123_read(mh, reinterpret_cast<unsigned char*>(pcm.data() + fill), (pcm.size() - fill) * sizeof(int16_t), &done);
+            fill += done / sizeof(int16_t);
+            decoded += done / sizeof(int16_t);
+            size_t pos = 0;
+            for (; fill - pos >= FFT_SIZE; pos += FFT_SIZE / 2) {
+                for (int i = 0; i < FFT_SIZE; i++) frame[i] = (int16_t)(((int32_t)pcm[pos + i] * hann[i]) >> 15);
+                fixed_fft_forward(fft, frame);
+                for (int b = 0; b < FP_BANDS; b++) {
+                    float e = 0.0f;
+                    for (int k = edge[b]; k < edge[b + 1]; k++) {
+                        float m = (float)approx_mag(fft.re[fft.rev[k]], fft.im[fft.rev[k]]);
+                        e += m * m;
+                    }
+                    bands.push_back(e);
+                }
+            }
+            std::memmove(pcm.data(), pcm.data() + pos, (fill - pos) * sizeof(int16_t));
+            fill -= pos;
+            if (ret != MPG123_OK && ret != MPG123_NEW_FORMAT) break;
+        }
+        ok = !tok.cancelled();
+    }
+    mpg123_close(mh);
+    mpg123_delete(mh);
+
+    size_t frames = bands.size() / FP_BANDS;
+    if (!ok || frames < FP_SEGMENTS + 1) return false;
+
+    double energy[FP_SEGMENTS + 1][FP_BANDS] = {};
+    for (size_t f = 0; f < frames; f++) {
+        size_t s = f * (FP_SEGMENTS + 1) / frames;
+        for (int b = 0; b < FP_BANDS; b++) energy[s][b] += bands[f * FP_BANDS + b];
+    }
+    for (int s = 0; s <= FP_SEGMENTS; s++) {
+        double floor = 0.0;
+        for (int b = 0; b < FP_BANDS; b++) floor += energy[s][b];
+        floor = floor * FP_FLOOR / FP_BANDS + 1.0;
+        for (int b = 0; b < FP_BANDS; b++) energy[s][b] = std::log(energy[s][b] + floor);
+    }
+    std::fill(out.bits, out.bits + FP_WORDS, 0u);
+    for (int s = 0; s < FP_SEGMENTS; s++) {
+        for (int b = 0; b < FP_BANDS - 1; b++) {
+            double d = (energy[s + 1][b] - energy[s + 1][b + 1]) - (energy[s][b] - energy[s][b + 1]);
+            int bit = s * (FP_BANDS - 1) + b;
+            if (d > 0.0) out.bits[bit / 32] |= 1u << (bit % 32);
+        }
+    }
+    return true;
+}
+
+// Near-duplicate search over fingerprints. Unrelated tracks differ in about
+// half their bits; re-encodes of one recording in well under a quarter.
+#define FP_MATCH_BITS (FP_WORDS * 32 / 4)
+#define FP_LENGTH_SLACK 0.02   // fraction of the longer track
+#define LSH_TABLES 32
+#define LSH_KEY_BITS 12
+
+static int fingerprint_distance(const Fingerprint& a, const Fingerprint& b) {
+    int d = 0;
+    for (int w = 0; w < FP_WORDS; w++) d += __builtin_popcount(a.bits[w] ^ b.bits[w]);
+    return d;
+}
+
+static size_t uf_find(std::vector<size_t>& parent, size_t i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+// Groups of indices into fps that are copies of the same recording, each
+// sorted, largest group first. Bit-sampling LSH keeps this near linear: each
+// table keys every track on LSH_KEY_BITS fixed random bit positions, so two
+// fingerprints differing in a fraction p of bits share a bucket with
+// probability (1 - p)^LSH_KEY_BITS per table, about 0.9 over all tables for
+// p = 0.2 and under 1% for unrelated tracks. Bucket mates are confirmed by
+// full Hamming distance and length. Near-constant fingerprints (silence,
+// test tones) carry no identity and are left out.
+static std::vector<std::vector<size_t>> find_duplicates(const std::vector<Fingerprint>& fps) {
+    size_t n = fps.size();
+    std::vector<bool> usable(n);
+    for (size_t i = 0; i < n; i++) {
+        int ones = 0;
+        for (int w = 0; w < FP_WORDS; w++) ones += __builtin_popcount(fps[i].bits[w]);
+        usable[i] = ones >= FP_WORDS * 32 / 16 && ones <= FP_WORDS * 32 * 15 / 16;
+    }
+
+    std::vector<size_t> parent(n);
+    for (size_t i = 0; i < n; i++) parent[i] = i;
+    std::mt19937 rng(0x7766f9u);   // fixed, so results are repeatable
+    std::uniform_int_distribution<int> pick(0, FP_WORDS * 32 - 1);
+    std::vector<std::pair<uint32_t, uint32_t>> keyed;
+    keyed.reserve(n);
+    for (int t = 0; t < LSH_TABLES; t++) {
+        int sample[LSH_KEY_BITS];
+        for (int k = 0; k < LSH_KEY_BITS; k++) sample[k] = pick(rng);
+        keyed.clear();
+        for (size_t i = 0; i < n; i++) {
+            if (!usable[i]) continue;
+            uint32_t key = 0;
+            for (int k = 0; k < LSH_KEY_BITS; k++) key = (key << 1) | ((fps[i].bits[sample[k] / 32] >> (sample[k] % 32)) & 1u);
+            keyed.push_back({ key, (uint32_t)i });
+        }
+        std::sort(keyed.begin(), keyed.end());
+        for (size_t a = 0; a < keyed.size();) {
+            size_t b = a + 1;
+            while (b < keyed.size() && keyed[b].first == keyed[a].first) b++;
+            for (size_t x = a; x < b; x++) {
+                for (size_t y = x + 1; y < b; y++) {
+                    size_t i = keyed[x].second, j = keyed[y].second;
+                    if (uf_find(parent, i) == uf_find(parent, j)) continue;
+                    double li = fps[i].seconds, lj = fps[j].seconds;
+                    if (std::fabs(li - lj) > std::max(1.0, FP_LENGTH_SLACK * std::max(li, lj))) continue;
+                    if (fingerprint_distance(fps[i], fps[j]) > FP_MATCH_BITS) continue;
+                    parent[uf_find(parent, i)] = uf_find(parent, j);
+                }
+            }
+            a = b;
+        }
+    }
+
+    std::unordered_map<size_t, std::vector<size_t>> byRoot;
+    for (size_t i = 0; i < n; i++) if (usable[i]) byRoot[uf_find(parent, i)].push_back(i);
+    std::vector<std::vector<size_t>> groups;
+    for (auto& kv : byRoot) if (kv.second.size() > 1) groups.push_back(std::move(kv.second));
+    std::sort(groups.begin(), groups.end(), [](const std::vector<size_t>& a, const std::vector<size_t>& b) {
+        return a.size() != b.size() ? a.size() > b.size() : a[0] < b[0];
+    });
+    return groups;
+}
+
+// Every mp3 below root, sorted; unreadable directories are skipped.
+static std::vector<std::string> library_mp3s(const fs::path& root, const CancelToken& tok) {
+    std::vector<std::string> out;
+    std::error_code ec;
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end;
+    for (; !ec && it != end && !tok.cancelled(); it.increment(ec)) {
+        if (!it->is_directory(ec) && is_mp3_path(it->path())) out.push_back(it->path().string());
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+// Fingerprints and groups a list of paths. Waits for the bulk lane, so call
+// it from a job or a headless mode, never from the UI loop.
+static std::vector<std::vector<std::string>> group_duplicates(const std::vector<std::string>& paths,
+                                                              const CancelToken& tok,
+                                                              std::function<void(size_t, size_t)> progress) {
+    fingerprints.want(paths, false);
+    std::vector<Fingerprint> fps;
+    std::vector<size_t> index;
+    while (!tok.cancelled()) {
+        size_t settled = 0;
+        fps.clear();
+        index.clear();
+        {
+            std::lock_guard<std::mutex> lk(fingerprints.mutex());
+            for (size_t i = 0; i < paths.size(); i++) {
+                const TrackResult<Fingerprint>* r = fingerprints.find(paths[i]);
+                if (!r || r->state == TJ_FAILED) { settled++; continue; }
+                if (r->state != TJ_READY) continue;
+                settled++;
+                fps.push_back(r->value);
+                index.push_back(i);
+            }
+        }
+        if (progress) progress(settled, paths.size());
+        if (settled == paths.size()) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    std::vector<std::vector<std::string>> groups;
+    if (tok.cancelled()) return groups;
+    for (auto& g : find_duplicates(fps)) {
+        groups.emplace_back();
+        for (size_t k : g) groups.back().push_back(paths[index[k]]);
+    }
+    return groups;
+}
+
+// Radio features from a FEATURE_SECONDS excerpt of quarter-rate mono, taken
+// 30% in when the track is long enough to skip its intro. MFCCs use an
+// orthonormal DCT of log mel energies, so each coefficient is on a similar
+// scale, and the floor keeps hiss in empty bands from flattening them;
+// loudness is mean frame level in 6 dB steps and tempo is in
+// quarter octaves from 120 BPM.
+static bool compute_features(const std::string& path, const CancelToken& tok, TrackFeatures& out) {
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_FORCE_MONO | MPG123_QUIET, 0.0);
+    mpg123_param(mh, MPG123_DOWN_SAMPLE, 2, 0.0);
+
+    long rate;
+    int channels, encoding;
+    bool ok = mpg123_open(mh, path.c_str()) == MPG123_OK && mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK;
+    double sum[MFCC_COEFFS] = {}, sumSq[MFCC_COEFFS] = {}, levelDb = 0.0;
+    size_t frames = 0;
+    std::vector<float> flux;
+    if (ok) {
+        mpg123_format_none(mh);
+        mpg123_format(mh, rate, MPG123_MONO, MPG123_ENC_SIGNED_16);
+        off_t len = mpg123_length(mh);
+        if (len > (off_t)rate * FEATURE_SECONDS * 3) mpg123_seek(mh, len * 3 / 10, SEEK_SET);
+
+        // Triangular mel filters from 60 Hz to 5 kHz, stored as bin ranges.
+        auto mel = [](double hz) { return 2595.0 * std::log10(1.0 + hz / 700.0); };
+        auto hz = [](double m) { return 700.0 * (std::pow(10.0, m / 2595.0) - 1.0); };
+        double top = std::min(5000.0, 0.45 * rate);
+        double edge[MFCC_BANDS + 2];
+        for (int b = 0; b < MFCC_BANDS + 2; b++) {
+            edge[b] = hz(mel(60.0) + (mel(top) - mel(60.0)) * b / (MFCC_BANDS + 1)) * FFT_SIZE / rate;
+        }
+        int first[MFCC_BANDS], count[MFCC_BANDS];
+        std::vector<float> weight;
+        for (int b = 0; b < MFCC_BANDS; b++) {
+            first[b] = std::max(1, (int)std::ceil(edge[b]));
+            int last = std::min(FFT_SIZE / 2 - 1, (int)std::floor(edge[b + 2]));
+            count[b] = std::max(0, last - first[b] + 1);
+            for (int k = first[b]; k < first[b] + count[b]; k++) {
+                double w = k < edge[b + 1] ? (k - edge[b]) / (edge[b + 1] - edge[b]) : (edge[b + 2] - k) / (edge[b + 2] - edge[b + 1]);
+                weight.push_back((float)std::max(0.0, w));
+            }
+        }
+        float dct[MFCC_COEFFS][MFCC_BANDS];
+        for (int c = 0; c < MFCC_COEFFS; c++) {
+            for (int b = 0; b < MFCC_BANDS; b++) {
+                dct[c][b] = (float)(std::sqrt(2.0 / MFCC_BANDS) * std::cos(M_PI * (c + 1) * (b + 0.5) / MFCC_BANDS));
+            }
+        }
+
+        FixedFFT fft;
+        fixed_fft_init(fft);
+        int16_t hann[FFT_SIZE], frame[FFT_SIZE];
+        for (int i = 0; i < FFT_SIZE; i++) hann[i] = (int16_t)std::lround(32767.0 * (0.5 - 0.5 * std::cos(2.0 * M_PI * i / FFT_SIZE)));
+        std::vector<uint32_t> prevLog(FFT_SIZE / 2, 0);
+        std::vector<int16_t> pcm(FFT_SIZE + BUFFER_SIZE);
+        float power[FFT_SIZE / 2], logMel[MFCC_BANDS];
+        size_t fill = 0, decoded = 0, limit = (size_t)rate * FEATURE_SECONDS;
+
+        while (!tok.cancelled() && decoded < limit) {
+            size_t done = 0;
+            int ret = mpg123_read(mh, reinterpret_cast<unsigned char*>(pcm.data() + fill), (pcm.size() - fill) * sizeof(int16_t), &done);
+            fill += done / sizeof(int16_t);
+            decoded += done / sizeof(int16_t);
+            size_t pos = 0;
+            for (; fill - pos >= FFT_SIZE; pos += ONSET_HOP) {
+                double ms = 0.0;
+                for (int i = 0; i < FFT_SIZE; i++) {
+                    ms += (double)pcm[pos + i] * pcm[pos + i];
+                    frame[i] = (int16_t)(((int32_t)pcm[pos + i] * hann[i]) >> 15);
+                }
+                levelDb += 10.0 * std::log10(ms / FFT_SIZE / (32768.0 * 32768.0) + 1e-9);
+                fixed_fft_forward(fft, frame);
+
+                uint64_t rise = 0;
+                for (int k = 1; k < FFT_SIZE / 2; k++) {
+                    int r = fft.rev[k];
+                    uint32_t m = (uint32_t)approx_mag(fft.re[r], fft.im[r]);
+                    uint32_t l = ilog2_q16(m + 1);
+                    if (l > prevLog[k]) rise += l - prevLog[k];
+                    prevLog[k] = l;
+                    power[k] = (float)m * (float)m;
+                }
+                if (frames > 0) flux.push_back((float)rise / 65536.0f);
+
+                const float* w = weight.data();
+                float peak = 0.0f;
+                for (int b = 0; b < MFCC_BANDS; b++) {
+                    float e = 0.0f;
+                    for (int k = 0; k < count[b]; k++) e += w[k] * power[first[b] + k];
+                    w += count[b];
+                    logMel[b] = e;
+                    peak = std::max(peak, e);
+                }
+                for (int b = 0; b < MFCC_BANDS; b++) logMel[b] = std::log(logMel[b] + MFCC_FLOOR * peak + 1.0f);
+                for (int c = 0; c < MFCC_COEFFS; c++) {
+                    float v = 0.0f;
+                    for (int b = 0; b < MFCC_BANDS; b++) v += dct[c][b] * logMel[b];
+                    sum[c] += v;
+                    sumSq[c] += (double)v * v;
+                }
+                frames++;
+            }
+            std::memmove(pcm.data(), pcm.data() + pos, (fill - pos) * sizeof(int16_t));
+            fill -= pos;
+            if (ret != MPG123_OK && ret != MPG123_NEW_FORMAT) break;
+        }
+        ok = !tok.cancelled();
+    }
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    if (!ok || frames < 2) return false;
+
+    for (int c = 0; c < MFCC_COEFFS; c++) {
+        double mean = sum[c] / frames;
+        out.v[c] = (float)mean;
+        out.v[MFCC_COEFFS + c] = (float)std::sqrt(std::max(0.0, sumSq[c] / frames - mean * mean));
+    }
+    BeatGrid g;
+    estimate_tempo(flux, rate, g);
+    out.v[2 * MFCC_COEFFS] = (float)(levelDb / frames / 6.0);
+    out.v[2 * MFCC_COEFFS + 1] = g.bpm > 0.0f ? (float)(4.0 * std::log2(g.bpm / 120.0)) : 0.0f;
+    return true;
+}
+
+// Approximate nearest neighbours over TrackFeatures vectors: a hierarchical
+// navigable small world graph (Malkov and Yashunin). Each node gets a random
+// level with P(level >= l) = M^-l; a search descends greedily through the
+// sparse upper layers and widens to a beam of ef candidates on the bottom
+// layer, so a query visits O(log n) nodes. Not thread-safe.
+class FeatureIndex {
+public:
+    using Hit = std::pair<float, uint32_t>;   // squared distance, id
+
+    explicit FeatureIndex(uint32_t seed = 1) : rng_(seed) {}
+
+    size_t size() const { return levels_.size(); }
+    const float* vector(uint32_t id) const { return &data_[(size_t)id * D]; }
+
+    uint32_t add(const float* v) {
+        uint32_t id = (uint32_t)levels_.size();
+        std::uniform_real_distribution<double> u(1e-12, 1.0);
+        int level = std::min(MAX_LEVEL, (int)(-std::log(u(rng_)) / std::log((double)M)));
+        data_.insert(data_.end(), v, v + D);
+        levels_.push_back((uint8_t)level);
+        links0_.resize(links0_.size() + M0 + 1, 0);
+        upper_.emplace_back((size_t)level * (M + 1), 0);
+        visited_.push_back(0);
+        if (id == 0) {
+            entry_ = 0;
+            maxLevel_ = level;
+            return id;
+        }
+
+        uint32_t ep = entry_;
+        for (int l = maxLevel_; l > level; l--) ep = greedy(v, ep, l);
+        std::vector<Hit> found;
+        std::vector<uint32_t> chosen;
+        for (int l = std::min(level, maxLevel_); l >= 0; l--) {
+            search_layer(v, ep, EF_BUILD, l, found);
+            select(found, l == 0 ? M0 : M, chosen);
+            set_links(id, l, chosen);
+            for (uint32_t n : chosen) link_back(n, id, l);
+            ep = found[0].second;
+        }
+        if (level > maxLevel_) {
+            maxLevel_ = level;
+            entry_ = id;
+        }
+        return id;
+    }
+
+    // Up to k nearest ids, closest first, from a beam of max(ef, k).
+    void search(const float* q, int k, int ef, std::vector<Hit>& out) {
+        out.clear();
+        if (levels_.empty()) return;
+        uint32_t ep = entry_;
+        for (int l = maxLevel_; l > 0; l--) ep = greedy(q, ep, l);
+        search_layer(q, ep, std::max(ef, k), 0, out);
+        if ((int)out.size() > k) out.resize(k);
+    }
+
+    // Nearly every cycle of a search or an insert is spent here. A plain
+    // float sum stays scalar without -ffast-math, so it is split across
+    // vector lanes by hand.
+    float distance(const float* a, const float* b) const {
+        float d = 0.0f;
+        int i = 0;
+#if TW_HAVE_SSE2
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        for (; i + 8 <= D; i += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+        }
+        alignas(16) float f[4];
+        _mm_store_ps(f, _mm_add_ps(acc0, acc1));
+        d = (f[0] + f[1]) + (f[2] + f[3]);
+#elif TW_HAVE_NEON
+        float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+        for (; i + 8 <= D; i += 8) {
+            float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+            float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+            acc0 = vmlaq_f32(acc0, d0, d0);
+            acc1 = vmlaq_f32(acc1, d1, d1);
+        }
+        alignas(16) float f[4];
+        vst1q_f32(f, vaddq_f32(acc0, acc1));
+        d = (f[0] + f[1]) + (f[2] + f[3]);
+#endif
+        for (; i < D; i++) d += (a[i] - b[i]) * (a[i] - b[i]);
+        return d;
+    }
+
+private:
+    static constexpr int D = FEATURE_DIMS;
+    static constexpr int M = 12;         // links per node on upper layers
+    static constexpr int M0 = 2 * M;     // and on the bottom layer
+    static constexpr int EF_BUILD = 80;
+    static constexpr int MAX_LEVEL = 12;
+
+    // Link lists are a count followed by up to M0 (bottom) or M ids.
+    uint32_t* links(uint32_t id, int level) {
+        return level == 0 ? &links0_[(size_t)id * (M0 + 1)] : &upper_[id][(size_t)(level - 1) * (M + 1)];
+    }
+
+    uint32_t greedy(const float* q, uint32_t ep, int level) {
+        float best = distance(q, vector(ep));
+        for (bool moved = true; moved;) {
+            moved = false;
+            const uint32_t* l = links(ep, level);
+            for (uint32_t i = 1; i <= l[0]; i++) {
+                float d = distance(q, vector(l[i]));
+                if (d < best) { best = d; ep = l[i]; moved = true; }
+            }
+        }
+        return ep;
+    }
+
+    // Beam search on one layer; found is sorted closest first.
+    void search_layer(const float* q, uint32_t ep, int ef, int level, std::vector<Hit>& found) {
+        if (++epoch_ == 0) {
+            std::fill(visited_.begin(), visited_.end(), 0);
+            epoch_ = 1;
+        }
+        // Heaps kept in members so a search reuses their storage: frontier_
+        // is nearest first, best_ farthest first.
+        std::vector<Hit>& frontier = frontier_;
+        std::vector<Hit>& best = best_;
+        frontier.clear();
+        best.clear();
+        float d0 = distance(q, vector(ep));
+        frontier.push_back({ d0, ep });
+        best.push_back({ d0, ep });
+        visited_[ep] = epoch_;
+        while (!frontier.empty()) {
+            Hit c = frontier.front();
+            if (c.first > best.front().first && (int)best.size() >= ef) break;
+            std::pop_heap(frontier.begin(), frontier.end(), std::greater<Hit>());
+            frontier.pop_back();
+            const uint32_t* l = links(c.second, level);
+            for (uint32_t i = 1; i <= l[0]; i++) {
+                uint32_t n = l[i];
+                if (visited_[n] == epoch_) continue;
+                visited_[n] = epoch_;
+                float d = distance(q, vector(n));
+                if ((int)best.size() < ef || d < best.front().first) {
+                    frontier.push_back({ d, n });
+                    std::push_heap(frontier.begin(), frontier.end(), std::greater<Hit>());
+                    best.push_back({ d, n });
+                    std::push_heap(best.begin(), best.end());
+                    if ((int)best.size() > ef) {
+                        std::pop_heap(best.begin(), best.end());
+                        best.pop_back();
+                    }
+                }
+            }
+        }
+        found.assign(best.begin(), best.end());
+        std::sort(found.begin(), found.end());
+    }
+
+    // Neighbour heuristic: a candidate is kept unless it is closer to an
+    // already kept one than to q, which spreads links across directions;
+    // the rest top up the list so sparse regions stay connected.
+    void select(const std::vector<Hit>& cands, int m, std::vector<uint32_t>& out) {
+        out.clear();
+        std::vector<uint32_t> pruned;
+        for (const Hit& c : cands) {
+            if ((int)out.size() >= m) break;
+            bool keep = true;
+            for (uint32_t r : out) {
+                if (distance(vector(c.second), vector(r)) < c.first) { keep = false; break; }
+            }
+            (keep ? out : pruned).push_back(c.second);
+        }
+        for (size_t i = 0; i < pruned.size() && (int)out.size() < m; i++) out.push_back(pruned[i]);
+    }
+
+    void set_links(uint32_t id, int level, const std::vector<uint32_t>& to) {
+        uint32_t* l = links(id, level);
+        l[0] = (uint32_t)to.size();
+        std::copy(to.begin(), to.end(), l + 1);
+    }
+
+    void link_back(uint32_t n, uint32_t id, int level) {
+        uint32_t* l = links(n, level);
+        int cap = level == 0 ? M0 : M;
+        if ((int)l[0] < cap) {
+            l[++l[0]] = id;
+            return;
+        }
+        std::vector<Hit> cands;
+        cands.push_back({ distance(vector(n), vector(id)), id });
+        for (uint32_t i = 1; i <= l[0]; i++) cands.push_back({ distance(vector(n), vector(l[i])), l[i] });
+        std::sort(cands.begin(), cands.end());
+        std::vector<uint32_t> keep;
+        select(cands, cap, keep);
+        set_links(n, level, keep);
+    }
+
+    std::mt19937 rng_;
+    std::vector<float> data_;
+    std::vector<uint8_t> levels_;
+    std::vector<uint32_t> links0_;
+    std::vector<std::vector<uint32_t>> upper_;
+    std::vector<uint32_t> visited_;
+    std::vector<Hit> frontier_, best_;
+    uint32_t epoch_ = 0;
+    uint32_t entry_ = 0;
+    int maxLevel_ = 0;
+};
+
+// Radio library: tracks with features, indexed as they land, and the
+// recently played paths that picks avoid.
+#define RADIO_HISTORY 50
+#define RADIO_EF 64             // beam of a pick's one search, and all it returns
+#define RADIO_SPREAD 3          // pick among this many nearest eligible tracks
+#define RADIO_SAME_DIST 0.05f   // squared distance under which a track is a copy of the seed
+
+struct RadioLibrary {
+    std::mutex m;
+    FeatureIndex index;
+    std::vector<std::string> paths;   // by index id
+    std::unordered_map<std::string, uint32_t> ids;
+    std::deque<std::string> recent;   // newest last
+    std::mt19937 rng{ 0x52414449u };
+    CancelToken token;   // cancelled at shutdown only
+};
+
+static RadioLibrary radioLib;
+
+static void radio_add(const std::string& path, const TrackFeatures& f) {
+    std::lock_guard<std::mutex> lk(radioLib.m);
+    if (radioLib.ids.count(path)) return;
+    radioLib.ids[path] = radioLib.index.add(f.v);
+    radioLib.paths.push_back(path);
+    radioIndexed.store(radioLib.paths.size());
+}
+
+static void radio_played(const std::string& path) {
+    std::lock_guard<std::mutex> lk(radioLib.m);
+    radioLib.recent.push_back(path);
+    if (radioLib.recent.size() > RADIO_HISTORY) radioLib.recent.pop_front();
+}
+
+// Indexes every mp3 below root on the bulk lane.
+static void radio_scan(const fs::path& root) {
+    CancelToken tok = radioLib.token;
+    workerPool.submit(LANE_BULK, tok, [root, tok] {
+        std::vector<std::string> paths = library_mp3s(root, tok);
+        if (!tok.cancelled()) trackFeatures.want(paths, false);
+    });
+}
+
+// Up to RADIO_SPREAD ids nearest seed that skip(hit) lets through, closest
+// first. There is one search, and the whole RADIO_EF beam is kept rather
+// than the few a pick needs. The beam is wider than the history, so recent
+// plays alone can never use it up, and a pick never has to search again
+// with a wider one. Its cost is one beam search whatever the history.
+static_assert(RADIO_EF >= RADIO_HISTORY + RADIO_SPREAD + 1, "the radio beam must outnumber the history");
+
+template <class Skip>
+static void radio_candidates(FeatureIndex& index, uint32_t seed, Skip skip, std::vector<FeatureIndex::Hit>& hits,
+                             std::vector<uint32_t>& out) {
+    index.search(index.vector(seed), RADIO_EF, RADIO_EF, hits);
+    out.clear();
+    for (const FeatureIndex::Hit& h : hits) {
+        if (h.second == seed || skip(h)) continue;
+        out.push_back(h.second);
+        if (out.size() == RADIO_SPREAD) break;
+    }
+}
+
+// The track to follow seed: one of radio_candidates(), skipping the last
+// RADIO_HISTORY played and copies of the seed. A seed without features
+// yet, or one whose whole neighbourhood was played, gets a random eligible
+// track.
+static bool radio_pick(const std::string& seed, std::string& out) {
+    std::lock_guard<std::mutex> lk(radioLib.m);
+    size_t n = radioLib.paths.size();
+    if (n == 0) return false;
+    auto recent = [](const std::string& p) {
+        return std::find(radioLib.recent.begin(), radioLib.recent.end(), p) != radioLib.recent.end();
+    };
+
+    auto it = radioLib.ids.find(seed);
+    if (it != radioLib.ids.end()) {
+        std::vector<FeatureIndex::Hit> hits;
+        std::vector<uint32_t> eligible;
+        radio_candidates(radioLib.index, it->second, [&](const FeatureIndex::Hit& h) {
+            return h.first < RADIO_SAME_DIST || recent(radioLib.paths[h.second]);
+        }, hits, eligible);
+        if (!eligible.empty()) {
+            out = radioLib.paths[eligible[radioLib.rng() % eligible.size()]];
+            return true;
+        }
+    }
+    for (int tries = 0; tries < 32; tries++) {
+        const std::string& p = radioLib.paths[radioLib.rng() % n];
+        if (p != seed && !recent(p)) { out = p; return true; }
+    }
+    return false;
+}
+
+static void clear_render_track() {
+    {
+        std::lock_guard<std::mutex> lk(renderMutex);
+        renderState.curSec = 0.0;
+        renderState.totalSec = 0.0;
+        renderState.paused = false;
+        renderState.mono.clear();
+        renderState.magnitudes.clear();
+        renderState.notes.clear();
+        renderState.beat = BeatClock();
+        renderState.meters = Meters();
+    }
+    renderDirty.store(true, std::memory_order_release);
+}
+
+// Resets the shared render state for a new track and reserves its buffers so
+// later publish_block() calls only copy into existing capacity.
+static void begin_render_track(const std::string& path, double totalSec, const std::string& title = std::string()) {
+    std::lock_guard<std::mutex> lk(renderMutex);
+    renderState.file = path;
+    renderState.title = title;
+    renderState.curSec = 0.0;
+    renderState.totalSec = totalSec;
+    renderState.mode = visMode.load();
+    renderState.paused = false;
+    renderState.mono.assign(FFT_SIZE, 0);
+    renderState.magnitudes.reserve(FFT_SIZE / 2);
+    renderState.magnitudes.clear();
+    renderState.notes.reserve(CQT_NOTES);
+    renderState.notes.clear();
+    renderState.beat = BeatClock();
+    renderState.meters = Meters();
+}
+
+static void publish_block(const AnalysisFrame& a, double curSec, VisualizationMode mode, const BeatClock* beat = nullptr) {
+    {
+        std::lock_guard<std::mutex> lk(renderMutex);
+        renderState.curSec = curSec;
+        renderState.beat = beat ? *beat : BeatClock();
+        renderState.mode = mode;
+        renderState.paused = isPaused.load();
+        renderState.frameSeq++;
+        renderState.mono.assign(a.mono.begin(), a.mono.end());
+        if (a.hasSpectrum) renderState.magnitudes.assign(a.mags.begin(), a.mags.end());
+        else renderState.magnitudes.clear();
+        if (a.hasNotes) renderState.notes.assign(a.notes.begin(), a.notes.end());
+        else renderState.notes.clear();
+        renderState.meters = a.meters;
+    }
+    renderDirty.store(true, std::memory_order_release);
+}
+
+// Process-lifetime audio backend. PortAudio initialisation, device
+// enumeration, FFT planning and a default-format output stream are prepared
+// on a background thread at startup, so the UI comes up at once and the
+// first Enter on a track does not pay for them.
+struct OutputDeviceInfo {
+    PaDeviceIndex index = paNoDevice;
+    std::string name;
+    double lowLatency = 0.0;
+    double highLatency = 0.0;
+    double defaultRate = 0.0;
+};
+
+struct AudioBackend {
+    std::mutex m;
+    std::condition_variable cv;
+    bool ready = false;
+    bool ok = false;
+    std::vector<OutputDeviceInfo> devices;
+    PaDeviceIndex device = paNoDevice;
+    AnalysisFrame analysis;
+    // Only the audio thread touches the stream once warm-up has finished.
+    PaStream* stream = nullptr;
+    PaDeviceIndex streamDevice = paNoDevice;
+    long streamRate = 0;
+    int streamChannels = 0;
+};
+
+static AudioBackend audio;
+
+// The engine writes through these instead of calling PortAudio directly, so
+// --stress and --sync-test can run against a discard sink: no device, just
+// output paced in real time with DISCARD_LATENCY seconds of pretend
+// buffering. An underrun on either sink is counted as an xrun and does not
+// count as a write error.
+#define DISCARD_LATENCY 0.05
+
+static bool discardOutput = false;
+static double discardSpeed = 1.0;   // the sink's clock against the system's; --sync-test skews it
+std::atomic<unsigned> outputXruns(0);
+std::atomic<unsigned long long> outputFrames(0);
+
+struct DiscardStream {
+    double rate = 0.0;     // frames consumed per second of system time
+    bool running = false;
+    std::chrono::steady_clock::time_point t0;
+    double queued = 0.0;   // frames written since t0
+};
+
+// Set while this instance leads a sync group; see the sync section.
+static bool syncLeading = false;
+static void sync_lead_restart();
+static PaError sync_lead_write(PaStream* s, const int16_t* pcm, unsigned long frames);
+
+static const OutputDeviceInfo* find_device(PaDeviceIndex dev) {
+    for (auto& d : audio.devices) if (d.index == dev) return &d;
+    return nullptr;
+}
+
+static PaError out_open(PaStream** s, PaDeviceIndex dev, int channels, long rate) {
+    if (discardOutput) {
+        DiscardStream* d = new DiscardStream;
+        d->rate = (double)rate * discardSpeed;
+        *s = d;
+        return paNoError;
+    }
+    PaStreamParameters out;
+    out.device = dev;
+    out.channelCount = channels;
+    out.sampleFormat = paInt16;
+    out.suggestedLatency = find_device(dev)->lowLatency;
+    out.hostApiSpecificStreamInfo = nullptr;
+    return Pa_OpenStream(s, nullptr, &out, rate, FRAMES_PER_BUFFER, paClipOff, nullptr, nullptr);
+}
+
+static void out_close(PaStream* s) {
+    if (discardOutput) delete static_cast<DiscardStream*>(s);
+    else Pa_CloseStream(s);
+}
+
+static PaError out_start(PaStream* s) {
+    if (syncLeading) sync_lead_restart();
+    if (!discardOutput) return Pa_StartStream(s);
+    DiscardStream* d = static_cast<DiscardStream*>(s);
+    d->running = true;
+    d->t0 = std::chrono::steady_clock::now();
+    d->queued = 0.0;
+    return paNoError;
+}
+
+static void out_stop(PaStream* s) {
+    if (discardOutput) static_cast<DiscardStream*>(s)->running = false;
+    else Pa_StopStream(s);
+}
+
+static void out_abort(PaStream* s) {
+    if (discardOutput) static_cast<DiscardStream*>(s)->running = false;
+    else Pa_AbortStream(s);
+}
+
+static bool out_stopped(PaStream* s) {
+    if (discardOutput) return !static_cast<DiscardStream*>(s)->running;
+    return Pa_IsStreamStopped(s) == 1;
+}
+
+static double out_latency(PaStream* s) {
+    if (discardOutput) return DISCARD_LATENCY;
+    const PaStreamInfo* si = Pa_GetStreamInfo(s);
+    return si ? si->outputLatency : 0.0;
+}
+
+// CLOCK_MONOTONIC time at which the next frame written will be heard:
+// exact for the discard sink, the stream's reported latency otherwise.
+static long long out_next_heard_ns(PaStream* s) {
+    long long now = steady_ns();
+    if (!discardOutput) return now + (long long)(out_latency(s) * 1e9);
+    DiscardStream* d = static_cast<DiscardStream*>(s);
+    long long t0 = std::chrono::duration_cast<std::chrono::nanoseconds>(d->t0.time_since_epoch()).count();
+    return std::max(now, t0 + (long long)(d->queued / d->rate * 1e9));
+}
+
+static PaError out_write_now(PaStream* s, const void* pcm, unsigned long frames) {
+    PaError err = paNoError;
+    if (!discardOutput) {
+        err = Pa_WriteStream(s, pcm, frames);
+    } else {
+        DiscardStream* d = static_cast<DiscardStream*>(s);
+        if (!d->running) return paStreamIsStopped;
+        auto now = std::chrono::steady_clock::now();
+        double played = std::chrono::duration<double>(now - d->t0).count() * d->rate;
+        if (d->queued < played) {
+            if (d->queued > 0.0) err = paOutputUnderflowed;
+            d->t0 = now;
+            d->queued = 0.0;
+        }
+        d->queued += (double)frames;
+        std::this_thread::sleep_until(d->t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(d->queued / d->rate - DISCARD_LATENCY)));
+    }
+    if (err == paOutputUnderflowed) {
+        outputXruns.fetch_add(1, std::memory_order_relaxed);
+        err = paNoError;
+    }
+    if (err == paNoError) outputFrames.fetch_add(frames, std::memory_order_relaxed);
+    return err;
+}
+
+// A sync leader sends everything it plays to its followers and plays it
+// itself SYNC_DELAY_MS later; see sync_lead_write().
+static PaError out_write(PaStream* s, const void* pcm, unsigned long frames) {
+    if (syncLeading) return sync_lead_write(s, static_cast<const int16_t*>(pcm), frames);
+    return out_write_now(s, pcm, frames);
+}
+
+// Lossless block codec for decoded PCM kept in memory. Every block decodes
+// on its own, so any part of a long buffer is one block away. Per channel
+// a block is either a constant or one of FLAC's fixed polynomial
+// predictors (order 0-4) after a few verbatim warm-up samples. Residuals
+// are Rice-coded in partitions of PCM_PARTITION samples, each with its own
+// parameter, or stored raw when that is smaller. Stereo blocks code the
+// cheapest of left/right, left/side, side/right and mid/side.
+#define PCM_BLOCK_FRAMES 4096
+#define PCM_PARTITION 256
+#define PCM_MAX_ORDER 4
+#define PCM_RICE_ESCAPE 31
+#define PCM_SAMPLE_BITS 17            // side = left - right needs one more bit
+
+enum PcmStereo { PCM_LEFT_RIGHT, PCM_LEFT_SIDE, PCM_SIDE_RIGHT, PCM_MID_SIDE };
+
+struct PcmCodecOptions {
+    int maxOrder = PCM_MAX_ORDER;
+    bool stereo = true;               // try the side and mid/side pairs
+};
+
+struct PcmBitWriter {
+    uint8_t* p;
+    uint64_t acc = 0;
+    int n = 0;
+
+    void put(uint32_t v, int bits) {
+        if (bits == 0) return;
+        acc = (acc << bits) | (v & (uint32_t)((1ull << bits) - 1));
+        n += bits;
+        while (n >= 8) {
+            n -= 8;
+            *p++ = (uint8_t)(acc >> n);
+        }
+    }
+    void unary(uint32_t q) {
+        for (; q >= 32; q -= 32) put(0, 32);
+        put(1, (int)q + 1);
+    }
+    void flush() {
+        if (n > 0) *p++ = (uint8_t)(acc << (8 - n));
+        n = 0;
+    }
+};
+
+// Bits are kept left-aligned in acc; reads past the end see zeros, and a
+// run of zeros longer than any valid code marks the block bad.
+struct PcmBitReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint64_t acc = 0;
+    int n = 0;
+    bool bad = false;
+
+    void refill() {
+        while (n <= 56) {
+            uint64_t b = p < end ? *p++ : 0;
+            acc |= b << (56 - n);
+            n += 8;
+        }
+    }
+    uint32_t get(int bits) {
+        if (bits == 0) return 0;
+        if (n < bits) refill();
+        uint32_t v = (uint32_t)(acc >> (64 - bits));
+        acc <<= bits;
+        n -= bits;
+        return v;
+    }
+    uint32_t unary() {
+        uint32_t q = 0;
+        for (;;) {
+            if (n < 8) refill();
+            if (acc == 0) {
+                q += (uint32_t)n;
+                n = 0;
+                if (q > (1u << 24)) { bad = true; return 0; }
+                continue;
+            }
+            int z = __builtin_clzll(acc);
+            acc = z == 63 ? 0 : acc << (z + 1);
+            n -= z + 1;
+            return q + (uint32_t)z;
+        }
+    }
+};
+
+static inline uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+static inline int32_t unzigzag(uint32_t u) { return (int32_t)(u >> 1) ^ -(int32_t)(u & 1); }
+static inline int32_t sign_extend(uint32_t v, int bits) { return (int32_t)(v << (32 - bits)) >> (32 - bits); }
+
+// Worst-case encoded size: raw escapes cost up to 23 bits a sample.
+static size_t pcm_block_bound(int frames, int channels) {
+    int parts = (frames + PCM_PARTITION - 1) / PCM_PARTITION;
+    return 1 + (size_t)channels * ((size_t)frames * 23 + (size_t)parts * 10 + 3 + PCM_MAX_ORDER * PCM_SAMPLE_BITS) / 8 + 8;
+}
+
+// Sum of |residual| for each predictor order, the usual cheap proxy for
+// the coded size; returns the best order and its sum.
+static int pcm_pick_order(const int32_t* x, int n, int maxOrder, uint64_t& best) {
+    uint64_t sum[PCM_MAX_ORDER + 1] = {};
+    for (int i = PCM_MAX_ORDER; i < n; i++) {
+        int32_t e0 = x[i];
+        int32_t e1 = e0 - x[i - 1];
+        int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        int32_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+        sum[0] += (uint32_t)std::abs(e0);
+        sum[1] += (uint32_t)std::abs(e1);
+        sum[2] += (uint32_t)std::abs(e2);
+        sum[3] += (uint32_t)std::abs(e3);
+        sum[4] += (uint32_t)std::abs(e4);
+    }
+    int order = 0;
+    for (int o = 1; o <= maxOrder && n > PCM_MAX_ORDER; o++) if (sum[o] < sum[order]) order = o;
+    best = sum[order];
+    return order;
+}
+
+static inline int32_t pcm_predict(const int32_t* x, int i, int order) {
+    switch (order) {
+        case 1: return x[i - 1];
+        case 2: return 2 * x[i - 1] - x[i - 2];
+        case 3: return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+        case 4: return 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+        default: return 0;
+    }
+}
+
+// Rice parameter for u[a, b) with the fewest bits, tried around the one the
+// mean suggests, or -1 when storing them raw in width bits is smaller.
+static int rice_pick(const uint32_t* u, int a, int b, uint64_t sum, int width, int maxK) {
+    int cnt = b - a;
+    int k = sum > (uint64_t)cnt ? 63 - __builtin_clzll(sum / cnt) : 0;
+    int bestK = -1;
+    uint64_t bestBits = 5 + (uint64_t)cnt * width;
+    for (int t = std::max(0, k - 1); t <= std::min(maxK, k + 1); t++) {
+        uint64_t bits = (uint64_t)cnt * (t + 1);
+        for (int i = a; i < b; i++) bits += u[i] >> t;
+        if (bits < bestBits) {
+            bestBits = bits;
+            bestK = t;
+        }
+    }
+    return bestK;
+}
+
+static void pcm_encode_channel(PcmBitWriter& bw, const int32_t* x, int n, int order, uint32_t* u) {
+    bool constant = true;
+    for (int i = 1; i < n && constant; i++) constant = x[i] == x[0];
+    if (constant) {
+        bw.put(7, 3);
+        bw.put((uint32_t)x[0], PCM_SAMPLE_BITS);
+        return;
+    }
+    order = std::min(order, n);
+    bw.put((uint32_t)order, 3);
+    for (int i = 0; i < order; i++) bw.put((uint32_t)x[i], PCM_SAMPLE_BITS);
+    for (int i = order; i < n; i++) u[i] = zigzag(x[i] - pcm_predict(x, i, order));
+
+    for (int p0 = 0; p0 < n; p0 += PCM_PARTITION) {
+        int a = std::max(p0, order), b = std::min(n, p0 + PCM_PARTITION), cnt = b - a;
+        if (cnt <= 0) continue;
+        uint64_t sum = 0;
+        uint32_t top = 0;
+        for (int i = a; i < b; i++) {
+            sum += u[i];
+            top |= u[i];
+        }
+        int width = top ? 32 - __builtin_clz(top) : 0;
+        int bestK = rice_pick(u, a, b, sum, width, PCM_RICE_ESCAPE - 1);
+        if (bestK < 0) bestK = PCM_RICE_ESCAPE;
+        bw.put((uint32_t)bestK, 5);
+        if (bestK == PCM_RICE_ESCAPE) {
+            bw.put((uint32_t)width, 5);
+            for (int i = a; i < b; i++) bw.put(u[i], width);
+        } else {
+            for (int i = a; i < b; i++) {
+                bw.unary(u[i] >> bestK);
+                bw.put(u[i], bestK);
+            }
+        }
+    }
+}
+
+static bool pcm_decode_channel(PcmBitReader& br, int32_t* x, int n) {
+    int type = (int)br.get(3);
+    if (type == 7) {
+        int32_t v = sign_extend(br.get(PCM_SAMPLE_BITS), PCM_SAMPLE_BITS);
+        for (int i = 0; i < n; i++) x[i] = v;
+        return true;
+    }
+    int order = type;
+    if (order > PCM_MAX_ORDER || order > n) return false;
+    for (int i = 0; i < order; i++) x[i] = sign_extend(br.get(PCM_SAMPLE_BITS), PCM_SAMPLE_BITS);
+    for (int p0 = 0; p0 < n; p0 += PCM_PARTITION) {
+        int a = std::max(p0, order), b = std::min(n, p0 + PCM_PARTITION);
+        if (a >= b) continue;
+        int k = (int)br.get(5);
+        if (k == PCM_RICE_ESCAPE) {
+            int width = (int)br.get(5);
+            for (int i = a; i < b; i++) x[i] = unzigzag(br.get(width)) + pcm_predict(x, i, order);
+        } else {
+            for (int i = a; i < b; i++) {
+                uint32_t q = br.unary();
+                x[i] = unzigzag((q << k) | br.get(k)) + pcm_predict(x, i, order);
+            }
+        }
+        if (br.bad) return false;
+    }
+    return true;
+}
+
+// Scratch for one block; sized once so encoding and decoding never allocate.
+struct PcmCodec {
+    PcmCodecOptions opt;
+    std::vector<int32_t> sig[4];      // left, right, side, mid (or the mono channel)
+    std::vector<uint32_t> u;
+
+    explicit PcmCodec(int maxFrames = PCM_BLOCK_FRAMES, PcmCodecOptions o = PcmCodecOptions()) : opt(o) {
+        for (auto& s : sig) s.resize((size_t)maxFrames);
+        u.resize((size_t)maxFrames);
+    }
+
+    // Encodes interleaved frames into out (pcm_block_bound bytes); returns
+    // the size.
+    size_t encode(const int16_t* pcm, int frames, int channels, uint8_t* out) {
+        PcmBitWriter bw{ out };
+        if (channels != 2) {
+            for (int c = 0; c < channels; c++) {
+                int32_t* x = sig[0].data();
+                for (int i = 0; i < frames; i++) x[i] = pcm[(size_t)i * channels + c];
+                uint64_t cost;
+                pcm_encode_channel(bw, x, frames, pcm_pick_order(x, frames, opt.maxOrder, cost), u.data());
+            }
+            bw.flush();
+            return (size_t)(bw.p - out);
+        }
+        int32_t *l = sig[0].data(), *r = sig[1].data(), *s = sig[2].data(), *m = sig[3].data();
+        for (int i = 0; i < frames; i++) {
+            l[i] = pcm[2 * i];
+            r[i] = pcm[2 * i + 1];
+            s[i] = l[i] - r[i];
+            m[i] = (l[i] + r[i]) >> 1;
+        }
+        uint64_t cost[4] = {};
+        int order[4];
+        int tried = opt.stereo ? 4 : 2;
+        for (int c = 0; c < tried; c++) order[c] = pcm_pick_order(sig[c].data(), frames, opt.maxOrder, cost[c]);
+        static const int pairs[4][2] = { { 0, 1 }, { 0, 2 }, { 2, 1 }, { 3, 2 } };
+        int mode = PCM_LEFT_RIGHT;
+        for (int md = 1; md < tried; md++) {
+            if (cost[pairs[md][0]] + cost[pairs[md][1]] < cost[pairs[mode][0]] + cost[pairs[mode][1]]) mode = md;
+        }
+        bw.put((uint32_t)mode, 2);
+        for (int k = 0; k < 2; k++) {
+            int c = pairs[mode][k];
+            pcm_encode_channel(bw, sig[c].data(), frames, order[c], u.data());
+        }
+        bw.flush();
+        return (size_t)(bw.p - out);
+    }
+
+    bool decode(const uint8_t* in, size_t bytes, int frames, int channels, int16_t* pcm) {
+        PcmBitReader br{ in, in + bytes };
+        if (channels != 2) {
+            int32_t* x = sig[0].data();
+            for (int c = 0; c < channels; c++) {
+                if (!pcm_decode_channel(br, x, frames)) return false;
+                for (int i = 0; i < frames; i++) pcm[(size_t)i * channels + c] = (int16_t)x[i];
+            }
+            return true;
+        }
+        int mode = (int)br.get(2);
+        int32_t *a = sig[0].data(), *b = sig[1].data();
+        if (!pcm_decode_channel(br, a, frames) || !pcm_decode_channel(br, b, frames)) return false;
+        for (int i = 0; i < frames; i++) {
+            int32_t l, r;
+            switch (mode) {
+                case PCM_LEFT_SIDE:  l = a[i]; r = l - b[i]; break;
+                case PCM_SIDE_RIGHT: r = b[i]; l = a[i] + r; break;
+                case PCM_MID_SIDE: {
+                    int32_t mid = (int32_t)((uint32_t)a[i] << 1) | (b[i] & 1);
+                    l = (mid + b[i]) >> 1;
+                    r = (mid - b[i]) >> 1;
+                    break;
+                }
+                default: l = a[i]; r = b[i]; break;
+            }
+            pcm[2 * i] = (int16_t)l;
+            pcm[2 * i + 1] = (int16_t)r;
+        }
+        return true;
+    }
+};
+
+// FLAC stream writer for export, built on the block codec's predictors and
+// Rice coder: fixed-size frames of 16-bit samples, each channel a constant
+// or a FIXED subframe with partitioned Rice residuals (raw partitions where
+// those are smaller), and stereo frames in whichever of the four channel
+// pairings is cheapest. STREAMINFO is rewritten with the sample count and
+// frame sizes when the stream ends; its MD5 is left unset.
+#define FLAC_BLOCK_FRAMES 4096
+#define FLAC_MAX_PARTITION_ORDER 4
+#define FLAC_RICE_ESCAPE 15
+
+static uint8_t flac_crc8(const uint8_t* p, size_t n) {
+    uint8_t crc = 0;
+    while (n--) {
+        crc ^= *p++;
+        for (int b = 0; b < 8; b++) crc = (uint8_t)((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    return crc;
+}
+
+static uint16_t flac_crc16(const uint8_t* p, size_t n) {
+    static const std::vector<uint16_t> table = [] {
+        std::vector<uint16_t> t(256);
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = (uint16_t)(i << 8);
+            for (int b = 0; b < 8; b++) crc = (uint16_t)((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+            t[i] = crc;
+        }
+        return t;
+    }();
+    uint16_t crc = 0;
+    while (n--) crc = (uint16_t)((crc << 8) ^ table[(crc >> 8) ^ *p++]);
+    return crc;
+}
+
+// Frame numbers are coded like UTF-8, extended to 36 bits.
+static int flac_utf8(uint8_t* p, uint64_t v) {
+    if (v < 0x80) {
+        p[0] = (uint8_t)v;
+        return 1;
+    }
+    int n = 2;
+    while (v >> (5 * n + 1)) n++;
+    p[0] = (uint8_t)((0xFF00 >> n) & 0xFF) | (uint8_t)(v >> (6 * (n - 1)));
+    for (int i = 1; i < n; i++) p[i] = (uint8_t)(0x80 | ((v >> (6 * (n - 1 - i))) & 0x3F));
+    return n;
+}
+
+static void flac_encode_subframe(PcmBitWriter& bw, const int32_t* x, int n, int order, int bits, uint32_t* u) {
+    bool constant = true;
+    for (int i = 1; i < n && constant; i++) constant = x[i] == x[0];
+    if (constant) {
+        bw.put(0, 8);
+        bw.put((uint32_t)x[0], bits);
+        return;
+    }
+    order = std::min(order, n);
+    bw.put((uint32_t)(0x08 | order) << 1, 8);   // padding bit, FIXED type, no wasted bits
+    for (int i = 0; i < order; i++) bw.put((uint32_t)x[i], bits);
+    for (int i = order; i < n; i++) u[i] = zigzag(x[i] - pcm_predict(x, i, order));
+
+    // Partitions split the block evenly, the first one short by the warm-up.
+    int porder = FLAC_MAX_PARTITION_ORDER;
+    while (porder > 0 && ((n & ((1 << porder) - 1)) || (n >> porder) <= order)) porder--;
+    bw.put(0, 2);   // 4-bit Rice parameters
+    bw.put((uint32_t)porder, 4);
+    int part = n >> porder;
+    for (int a = 0; a < n; a += part) {
+        int lo = std::max(a, order), hi = a + part;
+        uint64_t sum = 0;
+        uint32_t top = 0;
+        for (int i = lo; i < hi; i++) {
+            sum += u[i];
+            top |= u[i];
+        }
+        int width = top ? 32 - __builtin_clz(top) : 0;
+        int k = lo < hi ? rice_pick(u, lo, hi, sum, width, FLAC_RICE_ESCAPE - 1) : 0;
+        if (k < 0) {
+            bw.put(FLAC_RICE_ESCAPE, 4);
+            bw.put((uint32_t)width, 5);
+            for (int i = lo; i < hi; i++) bw.put((uint32_t)unzigzag(u[i]), width);
+        } else {
+            bw.put((uint32_t)k, 4);
+            for (int i = lo; i < hi; i++) {
+                bw.unary(u[i] >> k);
+                bw.put(u[i], k);
+            }
+        }
+    }
+}
+
+class FlacWriter {
+public:
+    // Writes the stream header; totals are filled in by finish().
+    bool begin(FILE* f, long rate, int channels) {
+        f_ = f;
+        rate_ = rate;
+        channels_ = channels;
+        frameNo_ = 0;
+        samples_ = 0;
+        minFrame_ = UINT32_MAX;
+        maxFrame_ = 0;
+        fill_ = 0;
+        for (auto& s : sig_) s.resize(FLAC_BLOCK_FRAMES);
+        u_.resize(FLAC_BLOCK_FRAMES);
+        pending_.resize((size_t)FLAC_BLOCK_FRAMES * channels);
+        frame_.resize(18 + (size_t)channels * ((size_t)FLAC_BLOCK_FRAMES * 23 + 1024) / 8);
+        return std::fwrite("fLaC", 1, 4, f_) == 4 && write_streaminfo();
+    }
+
+    bool write(const int16_t* pcm, int frames) {
+        while (frames > 0) {
+            int n = std::min(frames, FLAC_BLOCK_FRAMES - fill_);
+            std::memcpy(&pending_[(size_t)fill_ * channels_], pcm, (size_t)n * channels_ * sizeof(int16_t));
+            fill_ += n;
+            pcm += (size_t)n * channels_;
+            frames -= n;
+            if (fill_ == FLAC_BLOCK_FRAMES && !flush_frame()) return false;
+        }
+        return true;
+    }
+
+    bool finish() {
+        if (fill_ > 0 && !flush_frame()) return false;
+        if (std::fseek(f_, 4, SEEK_SET) != 0 || !write_streaminfo()) return false;
+        return std::fseek(f_, 0, SEEK_END) == 0;
+    }
+
+private:
+    bool write_streaminfo() {
+        uint8_t b[38] = {};
+        PcmBitWriter bw{ b };
+        bw.put(0x80, 8);                          // last metadata block, STREAMINFO
+        bw.put(34, 24);
+        bw.put(FLAC_BLOCK_FRAMES, 16);
+        bw.put(FLAC_BLOCK_FRAMES, 16);
+        bw.put(maxFrame_ ? minFrame_ : 0, 24);
+        bw.put(maxFrame_, 24);
+        bw.put((uint32_t)rate_, 20);
+        bw.put((uint32_t)channels_ - 1, 3);
+        bw.put(15, 5);                            // 16 bits per sample
+        bw.put((uint32_t)(samples_ >> 32), 4);
+        bw.put((uint32_t)samples_, 32);
+        return std::fwrite(b, 1, sizeof(b), f_) == sizeof(b);   // MD5 left zero
+    }
+
+    bool flush_frame() {
+        int n = fill_;
+        const int16_t* pcm = pending_.data();
+        int32_t *l = sig_[0].data(), *r = sig_[1].data(), *s = sig_[2].data(), *m = sig_[3].data();
+        int order[4];
+        int assign = channels_ - 1;               // independent channels
+        int pair[2] = { 0, 1 };
+        if (channels_ == 2) {
+            for (int i = 0; i < n; i++) {
+                l[i] = pcm[2 * i];
+                r[i] = pcm[2 * i + 1];
+                s[i] = l[i] - r[i];
+                m[i] = (l[i] + r[i]) >> 1;
+            }
+            uint64_t cost[4];
+            for (int c = 0; c < 4; c++) order[c] = pcm_pick_order(sig_[c].data(), n, PCM_MAX_ORDER, cost[c]);
+            static const int pairs[4][2] = { { 0, 1 }, { 0, 2 }, { 2, 1 }, { 3, 2 } };
+            int mode = PCM_LEFT_RIGHT;
+            for (int md = 1; md < 4; md++) {
+                if (cost[pairs[md][0]] + cost[pairs[md][1]] < cost[pairs[mode][0]] + cost[pairs[mode][1]]) mode = md;
+            }
+            if (mode != PCM_LEFT_RIGHT) assign = 7 + mode;   // 8 left/side, 9 side/right, 10 mid/side
+            pair[0] = pairs[mode][0];
+            pair[1] = pairs[mode][1];
+        }
+
+        uint8_t* out = frame_.data();
+        uint8_t* p = out;
+        *p++ = 0xFF;
+        *p++ = 0xF8;                              // sync, fixed block size
+        *p++ = (uint8_t)((n == FLAC_BLOCK_FRAMES ? 12 : 7) << 4);   // sample rate from STREAMINFO
+        *p++ = (uint8_t)(assign << 4 | 4 << 1);  // 16-bit samples
+        p += flac_utf8(p, frameNo_);
+        if (n != FLAC_BLOCK_FRAMES) {
+            *p++ = (uint8_t)((n - 1) >> 8);
+            *p++ = (uint8_t)(n - 1);
+        }
+        *p = flac_crc8(out, (size_t)(p - out));
+        p++;
+
+        PcmBitWriter bw{ p };
+        if (channels_ == 2) {
+            for (int k = 0; k < 2; k++) {
+                int c = pair[k];
+                flac_encode_subframe(bw, sig_[c].data(), n, order[c], c == 2 ? 17 : 16, u_.data());
+            }
+        } else {
+            for (int c = 0; c < channels_; c++) {
+                for (int i = 0; i < n; i++) l[i] = pcm[(size_t)i * channels_ + c];
+                uint64_t cost;
+                flac_encode_subframe(bw, l, n, pcm_pick_order(l, n, PCM_MAX_ORDER, cost), 16, u_.data());
+            }
+        }
+        bw.flush();
+        uint16_t crc = flac_crc16(out, (size_t)(bw.p - out));
+        *bw.p++ = (uint8_t)(crc >> 8);
+        *bw.p++ = (uint8_t)crc;
+
+        size_t bytes = (size_t)(bw.p - out);
+        minFrame_ = std::min(minFrame_, (uint32_t)bytes);
+        maxFrame_ = std::max(maxFrame_, (uint32_t)bytes);
+        samples_ += (uint64_t)n;
+        frameNo_++;
+        fill_ = 0;
+        return std::fwrite(out, 1, bytes, f_) == bytes;
+    }
+
+    FILE* f_ = nullptr;
+    long rate_ = 0;
+    int channels_ = 0;
+    uint64_t frameNo_ = 0, samples_ = 0;
+    uint32_t minFrame_ = 0, maxFrame_ = 0;
+    int fill_ = 0;
+    std::vector<int16_t> pending_;
+    std::vector<int32_t> sig_[4];             // left, right, side, mid (or one channel)
+    std::vector<uint32_t> u_;
+    std::vector<uint8_t> frame_;
+};
+
+// Decoded audio of the playing file, compressed a block at a time as it is
+// decoded, so a seek back plays it again without touching the decoder. It
+// covers one contiguous run of frames [first(), end()); the newest partial
+// block stays raw until it fills. Blocks live in one preallocated byte
+// ring, and the oldest go when it or the block table is full.
+class PcmReplay {
+public:
+    // Sizes the buffers for a track; reallocates only when they change.
+    // The arena is left uninitialised so its pages are only committed as
+    // blocks fill them.
+    void reset(int channels, size_t maxBytes, size_t maxBlocks) {
+        if (channels != channels_ || arenaSize_ != maxBytes || ring_.size() != maxBlocks) {
+            channels_ = channels;
+            arena_.reset(new uint8_t[maxBytes]);
+            arenaSize_ = maxBytes;
+            ring_.assign(maxBlocks, Block());
+            pending_.assign((size_t)PCM_BLOCK_FRAMES * channels, 0);
+            decoded_.assign((size_t)PCM_BLOCK_FRAMES * channels, 0);
+        }
+        restart(0);
+    }
+
+    // Forgets everything; the next append starts at frame pos.
+    void restart(off_t pos) {
+        first_ = pos;
+        oldest_ = count_ = 0;
+        tail_ = 0;
+        pendingFrames_ = 0;
+        decodedAt_ = -1;
+    }
+
+    off_t first() const { return first_; }
+    off_t end() const { return first_ + (off_t)count_ * PCM_BLOCK_FRAMES + pendingFrames_; }
+    bool contains(off_t pos) const { return pos >= first_ && pos <= end(); }
+    size_t bytes() const {
+        size_t n = (size_t)pendingFrames_ * channels_ * sizeof(int16_t);
+        for (size_t i = 0; i < count_; i++) n += ring_[(oldest_ + i) % ring_.size()].bytes;
+        return n;
+    }
+
+    void append(const int16_t* pcm, int frames) {
+        if (ring_.empty()) return;
+        while (frames > 0) {
+            int n = std::min(frames, PCM_BLOCK_FRAMES - pendingFrames_);
+            std::memcpy(&pending_[(size_t)pendingFrames_ * channels_], pcm, (size_t)n * channels_ * sizeof(int16_t));
+            pendingFrames_ += n;
+            pcm += (size_t)n * channels_;
+            frames -= n;
+            if (pendingFrames_ == PCM_BLOCK_FRAMES) seal();
+        }
+    }
+
+    // Copies up to frames frames from pos, which must lie in [first(), end()).
+    int read(off_t pos, int16_t* out, int frames) {
+        int got = 0;
+        off_t sealedEnd = first_ + (off_t)count_ * PCM_BLOCK_FRAMES;
+        while (got < frames && pos >= first_ && pos < end()) {
+            const int16_t* src;
+            off_t blockAt;
+            int avail;
+            if (pos >= sealedEnd) {
+                src = pending_.data();
+                blockAt = sealedEnd;
+                avail = pendingFrames_;
+            } else {
+                size_t b = (size_t)((pos - first_) / PCM_BLOCK_FRAMES);
+                blockAt = first_ + (off_t)b * PCM_BLOCK_FRAMES;
+                if (decodedAt_ != blockAt) {
+                    const Block& blk = ring_[(oldest_ + b) % ring_.size()];
+                    if (!codec_.decode(&arena_[blk.at], blk.bytes, PCM_BLOCK_FRAMES, channels_, decoded_.data())) return got;
+                    decodedAt_ = blockAt;
+                }
+                src = decoded_.data();
+                avail = PCM_BLOCK_FRAMES;
+            }
+            int from = (int)(pos - blockAt);
+            int n = std::min(frames - got, avail - from);
+            std::memcpy(out + (size_t)got * channels_, src + (size_t)from * channels_, (size_t)n * channels_ * sizeof(int16_t));
+            got += n;
+            pos += n;
+        }
+        return got;
+    }
+
+private:
+    struct Block {
+        size_t at = 0;
+        uint32_t bytes = 0;
+    };
+
+    void drop_oldest() {
+        if (decodedAt_ == first_) decodedAt_ = -1;
+        oldest_ = (oldest_ + 1) % ring_.size();
+        count_--;
+        first_ += PCM_BLOCK_FRAMES;
+    }
+
+    // Compresses the full pending block into the ring.
+    void seal() {
+        size_t need = pcm_block_bound(PCM_BLOCK_FRAMES, channels_);
+        pendingFrames_ = 0;
+        if (need > arenaSize_) {
+            // Too small to hold a block: keep nothing before the next one.
+            restart(end() + PCM_BLOCK_FRAMES);
+            return;
+        }
+        while (count_ == ring_.size()) drop_oldest();
+        // Live bytes run from the oldest block to tail_, possibly wrapping;
+        // the new block goes in the free gap after tail_ or at the start.
+        size_t at = 0;
+        while (count_ > 0) {
+            size_t head = ring_[oldest_].at;
+            if (head < tail_) {
+                if (tail_ + need <= arenaSize_) { at = tail_; break; }
+                if (need <= head) break;
+            } else if (tail_ + need <= head) {
+                at = tail_;
+                break;
+            }
+            drop_oldest();
+        }
+        Block& b = ring_[(oldest_ + count_) % ring_.size()];
+        b.at = at;
+        b.bytes = (uint32_t)codec_.encode(pending_.data(), PCM_BLOCK_FRAMES, channels_, &arena_[at]);
+        tail_ = at + b.bytes;
+        count_++;
+    }
+
+    int channels_ = 0;
+    std::unique_ptr<uint8_t[]> arena_;
+    size_t arenaSize_ = 0;
+    std::vector<Block> ring_;
+    size_t oldest_ = 0, count_ = 0, tail_ = 0;
+    off_t first_ = 0;
+    std::vector<int16_t> pending_;
+    int pendingFrames_ = 0;
+    std::vector<int16_t> decoded_;
+    off_t decodedAt_ = -1;
+    PcmCodec codec_;
+};
+
+// Ring of the most recently written output frames. On a device switch the
+// frames the old device had buffered but not yet played are written again to
+// the new one, so playback resumes where the listener was without seeking
+// the decoder.
+struct PcmHistory {
+    std::vector<int16_t> buf;
+    int channels = 2;
+    size_t capFrames = 0;
+    size_t head = 0;
+    size_t filled = 0;
+
+    void reset(long rate, int ch) {
+        channels = ch;
+        capFrames = (size_t)rate;
+        buf.assign(capFrames * (size_t)ch, 0);
+        head = 0;
+        filled = 0;
+    }
+
+    void push(const int16_t* p, size_t frames) {
+        if (capFrames == 0) return;
+        if (frames > capFrames) { p += (frames - capFrames) * channels; frames = capFrames; }
+        size_t first = std::min(frames, capFrames - head);
+        std::memcpy(&buf[head * channels], p, first * channels * sizeof(int16_t));
+        std::memcpy(&buf[0], p + first * channels, (frames - first) * channels * sizeof(int16_t));
+        head = (head + frames) % capFrames;
+        filled = std::min(capFrames, filled + frames);
+    }
+
+    // Writes the newest n frames, oldest first, to the stream.
+    bool replay_tail(PaStream* s, size_t n) const {
+        n = std::min(n, filled);
+        if (n == 0) return true;
+        size_t start = (head + capFrames - n) % capFrames;
+        size_t first = std::min(n, capFrames - start);
+        if (out_write(s, &buf[start * channels], (unsigned long)first) != paNoError) return false;
+        if (n > first && out_write(s, &buf[0], (unsigned long)(n - first)) != paNoError) return false;
+        return true;
+    }
+};
+
+static PcmHistory outputHistory;
+
+// Seeking back within the last two minutes of the playing track replays
+// compressed PCM instead of seeking and re-decoding the MP3. That is 21 MB
+// raw at 44.1 kHz stereo; the byte budget caps material that barely
+// compresses.
+#define REPLAY_SECONDS 120
+#define REPLAY_BYTES (16u << 20)
+
+static PcmReplay trackReplay;
+
+static void publish_device_name() {
+    const char* name = "?";
+    for (auto& d : audio.devices) if (d.index == audio.device) name = d.name.c_str();
+    activeDevice.store(audio.device);
+    std::lock_guard<std::mutex> lk(renderMutex);
+    std::snprintf(renderState.device, sizeof(renderState.device), "%s", name);
+}
+
+static bool open_output_stream(long rate, int channels) {
+    if (audio.stream) {
+        if (audio.streamRate == rate && audio.streamChannels == channels && audio.streamDevice == audio.device) return true;
+        out_close(audio.stream);
+        audio.stream = nullptr;
+    }
+
+    if (out_open(&audio.stream, audio.device, channels, rate) != paNoError) {
+        audio.stream = nullptr;
+        return false;
+    }
+    audio.streamDevice = audio.device;
+    audio.streamRate = rate;
+    audio.streamChannels = channels;
+    return true;
+}
+
+// Moves the open stream to another device. A running stream is aborted
+// (not drained) and the frames it still held are replayed from history on
+// the new device; the time from abort to resumed output is the switch gap.
+// Falls back to the previous device if the new one cannot be opened.
+static bool switch_output_device(PaDeviceIndex dev, const PcmHistory& history, bool running) {
+    if (!audio.stream || dev == audio.device || !find_device(dev)) return audio.stream != nullptr;
+    auto t0 = std::chrono::steady_clock::now();
+    long rate = audio.streamRate;
+    int channels = audio.streamChannels;
+
+    size_t unplayed = 0;
+    if (running) {
+        unplayed = (size_t)(out_latency(audio.stream) * (double)rate);
+        out_abort(audio.stream);
+    }
+    out_close(audio.stream);
+    audio.stream = nullptr;
+
+    PaDeviceIndex old = audio.device;
+    audio.device = dev;
+    if (!open_output_stream(rate, channels)) {
+        audio.device = old;
+        if (!open_output_stream(rate, channels)) return false;
+    }
+    publish_device_name();
+
+    if (running) {
+        if (out_start(audio.stream) != paNoError) return false;
+        history.replay_tail(audio.stream, unplayed);
+    }
+    deviceSwitchGapUs.store((long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+    renderDirty.store(true);
+    return true;
+}
+
+static void audio_warm_up() {
+    std::freopen("/dev/null", "w", stderr);
+
+    bool ok = mpg123_init() == MPG123_OK;
+    if (ok && discardOutput) {
+        // Two sinks, so device switches have somewhere to go.
+        const char* names[] = { "Discard", "Discard (alt)" };
+        for (int i = 0; i < 2; i++) {
+            OutputDeviceInfo d;
+            d.index = i;
+            d.name = names[i];
+            d.lowLatency = d.highLatency = DISCARD_LATENCY;
+            d.defaultRate = 44100.0;
+            audio.devices.push_back(std::move(d));
+        }
+        audio.device = 0;
+    } else if (ok && (ok = Pa_Initialize() == paNoError)) {
+        PaDeviceIndex n = Pa_GetDeviceCount();
+        for (PaDeviceIndex i = 0; i < n; i++) {
+            const PaDeviceInfo* di = Pa_GetDeviceInfo(i);
+            if (!di || di->maxOutputChannels <= 0) continue;
+            OutputDeviceInfo d;
+            d.index = i;
+            d.name = di->name ? di->name : "?";
+            d.lowLatency = di->defaultLowOutputLatency;
+            d.highLatency = di->defaultHighOutputLatency;
+            d.defaultRate = di->defaultSampleRate;
+            audio.devices.push_back(std::move(d));
+        }
+        audio.device = Pa_GetDefaultOutputDevice();
+    }
+    ok = ok && audio.device != paNoDevice && analysis_init(audio.analysis);
+    // Most MP3s are 44.1 kHz stereo; have that stream ready up front.
+    if (ok) {
+        open_output_stream(44100, 2);
+        publish_device_name();
+    }
+
+    audioReadyMs.store((long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - processStart).count());
+    {
+        std::lock_guard<std::mutex> lk(audio.m);
+        audio.ready = true;
+        audio.ok = ok;
+    }
+    audio.cv.notify_all();
+    renderDirty.store(true);
+}
+
+static bool wait_audio_ready() {
+    std::unique_lock<std::mutex> lk(audio.m);
+    audio.cv.wait(lk, [] { return audio.ready || shouldQuit.load(); });
+    return audio.ready && audio.ok;
+}
+
+static void audio_shutdown() {
+    std::lock_guard<std::mutex> lk(audio.m);
+    if (!audio.ready) return;
+    if (audio.stream) {
+        out_stop(audio.stream);
+        out_close(audio.stream);
+        audio.stream = nullptr;
+    }
+    if (audio.ok) {
+        analysis_free(audio.analysis);
+        if (!discardOutput) Pa_Terminate();
+        mpg123_exit();
+    }
+}
+
+static bool audio_ready_now() {
+    std::lock_guard<std::mutex> lk(audio.m);
+    return audio.ready && audio.ok;
+}
+
+// Multi-room sync. A leader (--sync-lead) sends everything it plays over
+// UDP to the followers that ping it. Each packet carries its place in one
+// continuous stream of frames and the time, on the leader's
+// CLOCK_MONOTONIC, at which the leader will play it. The leader plays
+// SYNC_DELAY_MS late so packets arrive with time to spare.
+//
+// A follower (--sync-follow) estimates the leader's clock from NTP-style
+// pings: offset and drift, from a line fitted through the fastest round
+// trips. It then works out which frame its own output should be playing
+// and steers a fine resampler with a PI loop to hold it there. An error
+// beyond SYNC_RESYNC_MS is jumped instead, as is one beyond SYNC_SETTLE_MS
+// in the first second after that, while the output's buffer fills.
+// Packets are little-endian, the native order on every platform we build
+// for.
+#define SYNC_PORT 48860
+#define SYNC_VERSION 1
+#define SYNC_DELAY_MS 150
+#define SYNC_PACKET_BYTES 1200             // stays under a typical MTU
+#define SYNC_MAX_PEERS 16
+#define SYNC_PEER_TIMEOUT_MS 3000
+#define SYNC_PING_MS 100
+#define SYNC_CLOCK_SAMPLES 256             // about 25 s of pings
+#define SYNC_RING_FRAMES (1 << 17)         // about 3 s at 44.1 kHz
+#define SYNC_BLOCK_FRAMES 256
+#define SYNC_RESYNC_MS 20
+#define SYNC_SETTLE_MS 2
+#define SYNC_MAX_SLEW_PPM 2000
+#define SYNC_LOOP_KP 1.0                   // per second: a 1 ms error slews 1000 ppm
+#define SYNC_LOOP_KI (SYNC_LOOP_KP * SYNC_LOOP_KP / 4)   // critically damped
+
+enum SyncType { SYNC_AUDIO = 1, SYNC_PING = 2, SYNC_PONG = 3 };
+
+struct SyncAudioHeader {
+    char magic[4];                         // "TWSY"
+    uint8_t version;
+    uint8_t type;                          // SYNC_AUDIO
+    uint8_t channels;
+    uint8_t reserved;
+    uint32_t rate;
+    uint32_t frames;                       // int16 frames after the header
+    uint32_t epoch;                        // bumped when the format changes
+    uint32_t seq;                          // packet number, for loss counts
+    uint64_t index;                        // stream frame of the first one
+    int64_t heardNs;                       // leader's clock when the leader plays it
+};
+
+struct SyncPing {
+    char magic[4];
+    uint8_t version;
+    uint8_t type;                          // SYNC_PING, answered with SYNC_PONG
+    uint8_t reserved[2];
+    int64_t t0;                            // follower's clock when sent
+    int64_t t1;                            // leader's clock when received
+    int64_t t2;                            // leader's clock when answered
+};
+
+static_assert(sizeof(SyncAudioHeader) == 40 && sizeof(SyncPing) == 32, "sync packet layout");
+
+static bool sync_packet_ok(const uint8_t* p, ssize_t n, int type, size_t size) {
+    return n >= (ssize_t)size && std::memcmp(p, "TWSY", 4) == 0 && p[4] == SYNC_VERSION && p[5] == type;
+}
+
+// A UDP socket bound to host:port (any address when host is null).
+static int sync_bind(const char* host, int port, std::string& err) {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        err = std::strerror(errno);
+        return -1;
+    }
+    sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)port);
+    a.sin_addr.s_addr = host ? inet_addr(host) : htonl(INADDR_ANY);
+    if (::bind(fd, (sockaddr*)&a, sizeof(a)) != 0) {
+        err = std::strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct SyncLeader {
+    int fd = -1;
+    std::thread thread;                    // answers pings, keeps the peer list
+    std::atomic<bool> stop{false};
+    std::mutex m;                          // peers
+    struct Peer { sockaddr_in addr; long long seenNs; };
+    std::vector<Peer> peers;
+    std::atomic<int> peerCount{0};
+
+    // Audio thread only.
+    long rate = 0;
+    int channels = 0;
+    uint32_t epoch = 0, seq = 0;
+    uint64_t index = 0;                    // next stream frame to send
+    std::vector<int16_t> delay;            // the last SYNC_DELAY_MS sent, a ring
+    size_t delayFrames = 0, delayPos = 0;
+    size_t silent = 0;                     // leading ring frames that were never sent
+    uint64_t playIndex = 0;                // stream frame of the first sent one
+    std::vector<int16_t> out;
+    std::vector<uint8_t> packet;
+    FILE* log = nullptr;                   // --sync-test: when each frame is played here
+};
+
+static SyncLeader syncLead;
+
+static int sync_lead_peers() { return syncLeading ? syncLead.peerCount.load() : -1; }
+
+static void sync_lead_main() {
+    SyncLeader& L = syncLead;
+    while (!L.stop.load()) {
+        pollfd pfd{ L.fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, 200) > 0) {
+            SyncPing ping;
+            sockaddr_in from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(L.fd, &ping, sizeof(ping), 0, (sockaddr*)&from, &len);
+            long long t1 = steady_ns();
+            if (sync_packet_ok(reinterpret_cast<uint8_t*>(&ping), n, SYNC_PING, sizeof(ping))) {
+                ping.type = SYNC_PONG;
+                ping.t1 = t1;
+                ping.t2 = steady_ns();
+                ::sendto(L.fd, &ping, sizeof(ping), 0, (sockaddr*)&from, len);
+                std::lock_guard<std::mutex> lk(L.m);
+                auto it = std::find_if(L.peers.begin(), L.peers.end(), [&](const SyncLeader::Peer& p) {
+                    return p.addr.sin_addr.s_addr == from.sin_addr.s_addr && p.addr.sin_port == from.sin_port;
+                });
+                if (it != L.peers.end()) it->seenNs = t1;
+                else if (L.peers.size() < SYNC_MAX_PEERS) L.peers.push_back({ from, t1 });
+            }
+        }
+        std::lock_guard<std::mutex> lk(L.m);
+        long long now = steady_ns();
+        L.peers.erase(std::remove_if(L.peers.begin(), L.peers.end(), [now](const SyncLeader::Peer& p) {
+            return now - p.seenNs > SYNC_PEER_TIMEOUT_MS * 1000000LL;
+        }), L.peers.end());
+        L.peerCount.store((int)L.peers.size());
+    }
+}
+
+static void sync_lead_start(int fd) {
+    syncLead.fd = fd;
+    syncLead.stop.store(false);
+    syncLeading = true;
+    syncLead.thread = std::thread(sync_lead_main);
+}
+
+static void sync_lead_stop() {
+    if (syncLead.fd < 0) return;
+    syncLead.stop.store(true);
+    if (syncLead.thread.joinable()) syncLead.thread.join();
+    ::close(syncLead.fd);
+    syncLead.fd = -1;
+    syncLeading = false;
+}
+
+// A stream (re)start plays out a ring of silence: what was in it when the
+// stream stopped has been played by the followers but is dropped here.
+static void sync_lead_restart() {
+    SyncLeader& L = syncLead;
+    std::fill(L.delay.begin(), L.delay.end(), 0);
+    L.silent = L.delayFrames;
+    L.playIndex = L.index;
+}
+
+static void sync_lead_send(const int16_t* pcm, size_t frames, long long heardNs) {
+    SyncLeader& L = syncLead;
+    sockaddr_in to[SYNC_MAX_PEERS];
+    int peers = 0;
+    {
+        std::lock_guard<std::mutex> lk(L.m);
+        for (auto& p : L.peers) to[peers++] = p.addr;
+    }
+    size_t per = (SYNC_PACKET_BYTES - sizeof(SyncAudioHeader)) / (sizeof(int16_t) * L.channels);
+    for (size_t off = 0; off < frames; off += per) {
+        size_t n = std::min(per, frames - off);
+        SyncAudioHeader h{};
+        std::memcpy(h.magic, "TWSY", 4);
+        h.version = SYNC_VERSION;
+        h.type = SYNC_AUDIO;
+        h.channels = (uint8_t)L.channels;
+        h.rate = (uint32_t)L.rate;
+        h.frames = (uint32_t)n;
+        h.epoch = L.epoch;
+        h.seq = L.seq++;
+        h.index = L.index;
+        h.heardNs = heardNs + (long long)((double)off * 1e9 / L.rate);
+        size_t bytes = n * L.channels * sizeof(int16_t);
+        std::memcpy(L.packet.data(), &h, sizeof(h));
+        std::memcpy(L.packet.data() + sizeof(h), pcm + off * L.channels, bytes);
+        for (int k = 0; k < peers; k++) {
+            ::sendto(L.fd, L.packet.data(), sizeof(h) + bytes, MSG_DONTWAIT, (sockaddr*)&to[k], sizeof(to[k]));
+        }
+        L.index += n;
+    }
+}
+
+// Plays the oldest SYNC_DELAY_MS of what it has been given and sends the
+// new frames, stamped with when they will come out here.
+static PaError sync_lead_write(PaStream* s, const int16_t* pcm, unsigned long frames) {
+    SyncLeader& L = syncLead;
+    long rate = audio.streamRate;
+    int ch = audio.streamChannels;
+    if (rate != L.rate || ch != L.channels) {
+        L.rate = rate;
+        L.channels = ch;
+        L.epoch++;
+        L.delayFrames = (size_t)(rate * SYNC_DELAY_MS / 1000);
+        L.delay.assign(L.delayFrames * ch, 0);
+        L.delayPos = 0;
+        L.out.resize(BUFFER_SIZE / sizeof(int16_t));
+        L.packet.resize(SYNC_PACKET_BYTES);
+        sync_lead_restart();
+    }
+    size_t chunk = L.out.size() / ch;
+    for (unsigned long off = 0; off < frames;) {
+        size_t n = std::min<size_t>(frames - off, chunk);
+        const int16_t* in = pcm + off * ch;
+        for (size_t i = 0; i < n; i++) {
+            int16_t* slot = &L.delay[L.delayPos * ch];
+            for (int c = 0; c < ch; c++) {
+                L.out[i * ch + c] = slot[c];
+                slot[c] = in[i * ch + c];
+            }
+            if (++L.delayPos == L.delayFrames) L.delayPos = 0;
+        }
+        PaError err = out_write_now(s, L.out.data(), n);
+        if (err != paNoError) return err;
+
+        // What was just written ends where the next write starts; the new
+        // frames come out a ring's length after that.
+        long long next = out_next_heard_ns(s);
+        size_t skip = std::min(n, L.silent);
+        L.silent -= skip;
+        if (L.log && skip < n) {
+            std::fprintf(L.log, "%lld %llu %zu\n", next - (long long)((double)(n - skip) * 1e9 / rate),
+                         (unsigned long long)L.playIndex, n - skip);
+        }
+        L.playIndex += n - skip;
+        sync_lead_send(in, n, next + (long long)((double)(L.delayFrames - n) * 1e9 / rate));
+        off += n;
+    }
+    return paNoError;
+}
+
+// Ping results: when, on the follower's clock, and what they said.
+struct SyncClockSample {
+    long long at;                          // midpoint of the round trip
+    double offsetNs;                       // leader's clock minus ours
+    double rttNs;
+};
+
+struct SyncFollower {
+    int fd = -1;                           // connected to the leader
+    std::thread thread;                    // pings and receives
+    std::atomic<bool> stop{false};
+    std::mutex m;                          // everything below
+
+    long rate = 0;
+    int channels = 0;
+    uint32_t epoch = 0;
+    unsigned formatGen = 0;                // bumped on a new format
+    std::vector<int16_t> ring;             // SYNC_RING_FRAMES, by stream frame
+    uint64_t end = 0;                      // one past the newest frame received
+    uint32_t nextSeq = 0;
+    unsigned long received = 0, lost = 0;
+
+    // The leader plays anchorIndex at anchorNs on its clock, and the frames
+    // after it at the stream rate. Frames before floor belong to a stretch
+    // the leader has since jumped away from (a pause or a seek).
+    bool anchored = false;
+    uint64_t anchorIndex = 0, floor = 0;
+    double anchorNs = 0.0;
+
+    std::deque<SyncClockSample> samples;
+    bool clockOk = false;
+    double offsetNs = 0.0, slope = 0.0;    // leader minus ours, at fitAt, and its rate of change
+    long long fitAt = 0;
+
+    // --sync-test: a skewed clock and packet loss.
+    long long simOffsetNs = 0, simBase = 0;
+    double simPpm = 0.0, simLoss = 0.0;
+    std::mt19937 rng{ 1 };
+};
+
+static SyncFollower syncFollow;
+
+// The follower's clock: the system's, skewed under --sync-test.
+static long long sync_local_ns(long long realNs) {
+    const SyncFollower& F = syncFollow;
+    return realNs + F.simOffsetNs + (long long)((double)(realNs - F.simBase) * F.simPpm * 1e-6);
+}
+
+// Fits offset against time through the pings whose round trip was close to
+// the fastest, which are the ones least skewed by queueing. Needs m held.
+static void sync_fit_clock(SyncFollower& F) {
+    double fastest = 1e18;
+    for (auto& s : F.samples) fastest = std::min(fastest, s.rttNs);
+    double limit = fastest * 2 + 100e3;
+    long long ref = F.samples.back().at;
+    double n = 0, st = 0, so = 0, stt = 0, sto = 0;
+    for (auto& s : F.samples) {
+        if (s.rttNs > limit) continue;
+        double t = (double)(s.at - ref);
+        n++;
+        st += t;
+        so += s.offsetNs;
+        stt += t * t;
+        sto += t * s.offsetNs;
+    }
+    double var = stt - st * st / n;
+    bool fit = n >= 8 && F.samples.back().at - F.samples.front().at >= 2000000000LL && var > 0;
+    F.slope = fit ? (sto - st * so / n) / var : 0.0;
+    F.offsetNs = so / n - F.slope * st / n;
+    F.fitAt = ref;
+    F.clockOk = true;
+}
+
+static double sync_leader_ns(const SyncFollower& F, double localNs) {
+    return localNs + F.offsetNs + F.slope * (localNs - (double)F.fitAt);
+}
+
+// Files one audio packet; needs m held.
+static void sync_follow_receive(SyncFollower& F, const SyncAudioHeader& h, const int16_t* pcm) {
+    if (F.ring.empty() || h.epoch != F.epoch || (long)h.rate != F.rate || h.channels != F.channels) {
+        F.rate = (long)h.rate;
+        F.channels = h.channels;
+        F.epoch = h.epoch;
+        F.ring.assign((size_t)SYNC_RING_FRAMES * h.channels, 0);
+        F.end = F.floor = h.index;
+        F.nextSeq = h.seq;
+        F.anchored = false;
+        F.formatGen++;
+    }
+    if ((int32_t)(h.seq - F.nextSeq) >= 0) {
+        F.lost += h.seq - F.nextSeq;
+        F.nextSeq = h.seq + 1;
+    }
+    F.received++;
+    if (h.index + h.frames + SYNC_RING_FRAMES <= F.end) return;
+
+    // Lost packets leave silence behind.
+    int ch = F.channels;
+    if (h.index > F.end + SYNC_RING_FRAMES) F.end = h.index - SYNC_RING_FRAMES;
+    for (uint64_t i = F.end; i < h.index; i++) std::memset(&F.ring[(i % SYNC_RING_FRAMES) * ch], 0, ch * sizeof(int16_t));
+    for (uint32_t i = 0; i < h.frames; i++) {
+        std::memcpy(&F.ring[((h.index + i) % SYNC_RING_FRAMES) * ch], pcm + (size_t)i * ch, ch * sizeof(int16_t));
+    }
+    F.end = std::max<uint64_t>(F.end, h.index + h.frames);
+
+    // The leader's play times are smoothed a little; a jump means it
+    // paused, seeked or switched device, and starts a new stretch.
+    double predicted = F.anchorNs + (double)((int64_t)(h.index - F.anchorIndex)) * 1e9 / F.rate;
+    double r = (double)h.heardNs - predicted;
+    if (!F.anchored || std::fabs(r) > SYNC_RESYNC_MS * 1e6) {
+        F.anchored = true;
+        F.floor = h.index;
+        F.anchorNs = (double)h.heardNs;
+    } else {
+        F.anchorNs = predicted + 0.05 * r;
+    }
+    F.anchorIndex = h.index;
+}
+
+static void sync_follow_main() {
+    SyncFollower& F = syncFollow;
+    std::vector<uint8_t> buf(SYNC_PACKET_BYTES);
+    long long nextPing = 0;
+    while (!F.stop.load()) {
+        long long now = steady_ns();
+        if (now >= nextPing) {
+            SyncPing ping{};
+            std::memcpy(ping.magic, "TWSY", 4);
+            ping.version = SYNC_VERSION;
+            ping.type = SYNC_PING;
+            ping.t0 = sync_local_ns(now);
+            ::send(F.fd, &ping, sizeof(ping), 0);
+            nextPing = now + SYNC_PING_MS * 1000000LL;
+        }
+        pollfd pfd{ F.fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, (int)std::max(1LL, (nextPing - now) / 1000000)) <= 0) continue;
+        ssize_t n = ::recv(F.fd, buf.data(), buf.size(), 0);
+        long long t3 = sync_local_ns(steady_ns());
+
+        if (sync_packet_ok(buf.data(), n, SYNC_PONG, sizeof(SyncPing))) {
+            SyncPing pong;
+            std::memcpy(&pong, buf.data(), sizeof(pong));
+            SyncClockSample s;
+            s.at = pong.t0 + (t3 - pong.t0) / 2;
+            s.offsetNs = ((double)(pong.t1 - pong.t0) + (double)(pong.t2 - t3)) / 2;
+            s.rttNs = (double)((t3 - pong.t0) - (pong.t2 - pong.t1));
+            std::lock_guard<std::mutex> lk(F.m);
+            F.samples.push_back(s);
+            if (F.samples.size() > SYNC_CLOCK_SAMPLES) F.samples.pop_front();
+            sync_fit_clock(F);
+        } else if (sync_packet_ok(buf.data(), n, SYNC_AUDIO, sizeof(SyncAudioHeader))) {
+            SyncAudioHeader h;
+            std::memcpy(&h, buf.data(), sizeof(h));
+            if (h.channels < 1 || h.channels > 2 || h.rate < 8000 || h.rate > 192000 ||
+                (size_t)n != sizeof(h) + (size_t)h.frames * h.channels * sizeof(int16_t)) continue;
+            if (F.simLoss > 0 && std::uniform_real_distribution<double>(0, 1)(F.rng) < F.simLoss) continue;
+            std::lock_guard<std::mutex> lk(F.m);
+            sync_follow_receive(F, h, reinterpret_cast<const int16_t*>(buf.data() + sizeof(h)));
+        }
+    }
+}
+
+static bool sync_follow_start(const char* host, int port, std::string& err) {
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    int rc = ::getaddrinfo(host, std::to_string(port).c_str(), &hints, &res);
+    if (rc != 0) {
+        err = gai_strerror(rc);
+        return false;
+    }
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || ::connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        err = std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        ::freeaddrinfo(res);
+        return false;
+    }
+    ::freeaddrinfo(res);
+    syncFollow.fd = fd;
+    syncFollow.stop.store(false);
+    syncFollow.thread = std::thread(sync_follow_main);
+    return true;
+}
+
+static void sync_follow_stop() {
+    if (syncFollow.fd < 0) return;
+    syncFollow.stop.store(true);
+    if (syncFollow.thread.joinable()) syncFollow.thread.join();
+    ::close(syncFollow.fd);
+    syncFollow.fd = -1;
+}
+
+// What a follower reports: its clock and output drift against the
+// leader's, and how far it was off when it last looked.
+struct SyncStatus {
+    double clockPpm = 0.0, outputPpm = 0.0, errorMs = 0.0;
+    unsigned relocks = 0;
+};
+
+// Plays the leader's stream until shouldQuit, or until stopNs when that is
+// set. With a log, each block's play time and stream position are written
+// to it, with 1 when the whole block was the leader's audio.
+static SyncStatus sync_follow_play(long long stopNs, FILE* log, std::function<void(const SyncStatus&)> report) {
+    SyncFollower& F = syncFollow;
+    SyncStatus st;
+    unsigned gen = 0;
+    long rate = 0;
+    int ch = 0;
+    PaStream* stream = nullptr;
+    std::vector<int16_t> block;
+    double pos = 0.0;                      // stream frame going out next
+    bool locked = false;
+    long long settleUntil = 0;
+    double drift = 0.0;                    // the loop's integral: our output clock against the leader's
+    long long nextReport = steady_ns() + 1000000000LL;
+
+    // The output's rate is measured directly rather than read off the loop,
+    // whose integral lags on short runs: a line through when each block is
+    // heard against frames written. It starts a second after the stream
+    // does, once the device's buffer has filled, and restarts on an xrun.
+    struct { double n, mx, my, cxy, cxx; } fit{};
+    long long fitFrom = 0, fitBase = 0;
+    double written = 0.0;
+    unsigned xruns = outputXruns.load();
+
+    while (!shouldQuit.load() && (stopNs == 0 || steady_ns() < stopNs)) {
+        if (report && steady_ns() >= nextReport) {
+            report(st);
+            nextReport += 1000000000LL;
+        }
+        {
+            std::lock_guard<std::mutex> lk(F.m);
+            if (F.formatGen != gen) {
+                gen = F.formatGen;
+                rate = F.rate;
+                ch = F.channels;
+                stream = nullptr;
+            }
+        }
+        if (rate == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        if (!stream) {
+            if (!open_output_stream(rate, ch)) break;
+            stream = audio.stream;
+            if (out_stopped(stream) && out_start(stream) != paNoError) break;
+            block.assign((size_t)SYNC_BLOCK_FRAMES * ch, 0);
+            locked = false;
+            fitFrom = 0;
+        }
+
+        long long heardReal = out_next_heard_ns(stream);
+        long long heardLocal = sync_local_ns(heardReal);
+        double heard = (double)heardLocal;
+        if (fitFrom == 0 || outputXruns.load() != xruns) {
+            xruns = outputXruns.load();
+            fitFrom = heardLocal + 1000000000LL;
+            fit = {};
+        } else if (heardLocal >= fitFrom) {
+            if (fit.n == 0) {
+                fitBase = heardLocal;
+                written = 0.0;
+            }
+            double x = written, y = (double)(heardLocal - fitBase);
+            fit.n++;
+            double dx = x - fit.mx;
+            fit.mx += dx / fit.n;
+            fit.my += (y - fit.my) / fit.n;
+            fit.cxy += dx * (y - fit.my);
+            fit.cxx += dx * (x - fit.mx);
+        }
+        written += SYNC_BLOCK_FRAMES;
+        double ratio = 1.0, start = pos;
+        int valid = 0;
+        {
+            std::lock_guard<std::mutex> lk(F.m);
+            if (F.clockOk && F.anchored) {
+                // The frame the leader plays at the moment our next frame is
+                // heard.
+                double aligned = (double)F.anchorIndex + (sync_leader_ns(F, heard) - F.anchorNs) * rate / 1e9;
+                double late = (aligned - pos) / rate;
+                bool coarse = !locked || std::fabs(late) * 1000 > SYNC_RESYNC_MS;
+                if (coarse || (heardReal < settleUntil && std::fabs(late) * 1000 > SYNC_SETTLE_MS)) {
+                    if (coarse) settleUntil = heardReal + 1000000000LL;
+                    pos = aligned;
+                    locked = true;
+                    st.relocks++;
+                } else {
+                    // The integral stops while the slew is at its limit.
+                    const double limit = SYNC_MAX_SLEW_PPM * 1e-6;
+                    double dt = (double)SYNC_BLOCK_FRAMES / rate;
+                    double slew = drift + SYNC_LOOP_KP * late;
+                    if (std::fabs(slew) < limit) drift += SYNC_LOOP_KI * late * dt;
+                    ratio = 1.0 + std::max(-limit, std::min(limit, slew));
+                }
+                st.errorMs = late * 1000;
+                start = pos;
+
+                // Four-point Hermite interpolation; frames outside what
+                // the ring holds for this stretch play as silence.
+                auto have = [&F](int64_t i) {
+                    return i >= (int64_t)F.floor && i < (int64_t)F.end && i + SYNC_RING_FRAMES > (int64_t)F.end;
+                };
+                for (int j = 0; j < SYNC_BLOCK_FRAMES; j++) {
+                    double src = pos + j * ratio;
+                    int64_t i = (int64_t)std::floor(src);
+                    float t = (float)(src - (double)i);
+                    int16_t* o = &block[(size_t)j * ch];
+                    if (!have(i - 1) || !have(i + 2)) {
+                        for (int c = 0; c < ch; c++) o[c] = have(i) ? F.ring[(i % SYNC_RING_FRAMES) * ch + c] : 0;
+                        continue;
+                    }
+                    valid++;
+                    for (int c = 0; c < ch; c++) {
+                        float y0 = F.ring[((i - 1) % SYNC_RING_FRAMES) * ch + c], y1 = F.ring[(i % SYNC_RING_FRAMES) * ch + c];
+                        float y2 = F.ring[((i + 1) % SYNC_RING_FRAMES) * ch + c], y3 = F.ring[((i + 2) % SYNC_RING_FRAMES) * ch + c];
+                        float a = 0.5f * (y3 - y0) + 1.5f * (y1 - y2), b = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+                        float v = ((a * t + b) * t + 0.5f * (y2 - y0)) * t + y1;
+                        o[c] = (int16_t)clampi((int)std::lround(v), -32768, 32767);
+                    }
+                }
+                pos += SYNC_BLOCK_FRAMES * ratio;
+                st.clockPpm = -F.slope * 1e6;
+            } else {
+                std::fill(block.begin(), block.end(), 0);
+            }
+        }
+        if (fit.n * SYNC_BLOCK_FRAMES >= 2.0 * rate && fit.cxx > 0) {
+            double nsPerFrame = fit.cxy / fit.cxx;
+            double leaderSlope;
+            {
+                std::lock_guard<std::mutex> lk(F.m);
+                leaderSlope = F.slope;
+            }
+            st.outputPpm = (1e9 / (rate * nsPerFrame * (1.0 + leaderSlope)) - 1.0) * 1e6;
+        } else {
+            st.outputPpm = (1.0 / (1.0 + drift) - 1.0) * 1e6;
+        }
+        if (out_write(stream, block.data(), SYNC_BLOCK_FRAMES) != paNoError) break;
+        if (log) std::fprintf(log, "%lld %.3f %d\n", heardReal, start, valid == SYNC_BLOCK_FRAMES ? 1 : 0);
+    }
+    if (stream) out_stop(stream);
+    return st;
+}
+
+// Hover preview. A second decoder plays a short snippet of the highlighted
+// file, starting PREVIEW_START_PERCENT into it, mixed over the playing track
+// (ducked meanwhile) or on its own when nothing plays. The decoder is opened,
+// seeked and primed in the pool once the cursor has rested on a file for
+// PREVIEW_DWELL_MS, so the key press only hands a ready voice to the engine.
+#define PREVIEW_SECONDS 10
+#define PREVIEW_START_PERCENT 30
+#define PREVIEW_DWELL_MS 150
+#define PREVIEW_PRIME_FRAMES 4096
+
+struct PreviewVoice {
+    std::string path;
+    mpg123_handle* mh = nullptr;
+    long rate = 0;
+    int channels = 0;
+    std::vector<int16_t> primed;    // decoded ahead while the cursor rested
+    size_t primedPos = 0;
+    std::vector<int16_t> scratch;   // one engine block
+    long framesLeft = 0;
+    long framesPlayed = 0;
+
+    PreviewVoice() = default;
+    PreviewVoice(const PreviewVoice&) = delete;
+    PreviewVoice& operator=(const PreviewVoice&) = delete;
+    ~PreviewVoice() {
+        if (mh) {
+            mpg123_close(mh);
+            mpg123_delete(mh);
+        }
+    }
+
+    // Up to `frames` frames of the snippet into dst; returns how many.
+    int read(int16_t* dst, int frames) {
+        size_t want = (size_t)std::min<long>(frames, framesLeft) * channels;
+        size_t have = std::min(want, primed.size() - primedPos);
+        std::memcpy(dst, primed.data() + primedPos, have * sizeof(int16_t));
+        primedPos += have;
+        while (have < want) {
+            size_t done = 0;
+            int ret = mpg123_read(mh, reinterpret_cast<unsigned char*>(dst + have), (want - have) * sizeof(int16_t), &done);
+            have += done / sizeof(int16_t);
+            if (ret != MPG123_OK || done == 0) break;
+        }
+        int got = (int)(have / channels);
+        framesLeft = (have < want) ? 0 : framesLeft - got;
+        return got;
+    }
+};
+
+// Opens path for preview. A rate of 0 keeps the file's own format;
+// otherwise the decoder is held to rate/channels to match the engine.
+static std::unique_ptr<PreviewVoice> open_preview_voice(const std::string& path, long rate, int channels, const CancelToken& tok) {
+    std::unique_ptr<PreviewVoice> v(new PreviewVoice);
+    v->path = path;
+    v->mh = mpg123_new(nullptr, nullptr);
+    if (!v->mh) return nullptr;
+    if (rate > 0) {
+        mpg123_format_none(v->mh);
+        if (mpg123_format(v->mh, rate, channels, MPG123_ENC_SIGNED_16) != MPG123_OK) return nullptr;
+    }
+    if (mpg123_open(v->mh, path.c_str()) != MPG123_OK) return nullptr;
+
+    int encoding;
+    if (mpg123_getformat(v->mh, &v->rate, &v->channels, &encoding) != MPG123_OK) return nullptr;
+    if (rate > 0 && (v->rate != rate || v->channels != channels)) return nullptr;
+    if (encoding != MPG123_ENC_SIGNED_16) {
+        mpg123_format_none(v->mh);
+        mpg123_format(v->mh, v->rate, v->channels, MPG123_ENC_SIGNED_16);
+    }
+    if (v->channels < 1 || v->channels > 2) return nullptr;
+
+    off_t length = mpg123_length(v->mh);
+    if (length > 0) mpg123_seek(v->mh, length / 100 * PREVIEW_START_PERCENT, SEEK_SET);
+    if (tok.cancelled()) return nullptr;
+
+    v->framesLeft = v->rate * PREVIEW_SECONDS;
+    v->scratch.resize(BUFFER_SIZE / sizeof(int16_t));
+    std::vector<int16_t> prime((size_t)PREVIEW_PRIME_FRAMES * v->channels);
+    int got = v->read(prime.data(), PREVIEW_PRIME_FRAMES);
+    prime.resize((size_t)got * v->channels);
+    v->primed.swap(prime);
+    v->framesLeft = v->rate * PREVIEW_SECONDS;
+    if (got == 0) return nullptr;
+    return v;
+}
+
+// The voice being prepared or ready for one file. Moving the cursor
+// cancels a pending open and closes an unused voice.
+struct PreviewSlot {
+    std::mutex m;
+    unsigned id = 0;
+    std::string path;
+    long rate = 0;
+    int channels = 0;
+    bool pending = false;
+    bool startWhenReady = false;
+    std::unique_ptr<PreviewVoice> voice;
+    CancelToken token;
+};
+
+static PreviewSlot previewSlot;
+
+// Hand-off to the audio thread, which owns a voice once it takes it.
+static std::atomic<PreviewVoice*> previewIncoming(nullptr);
+
+static void hand_off_preview(std::unique_ptr<PreviewVoice> v) {
+    delete previewIncoming.exchange(v.release());
+    { std::lock_guard<std::mutex> lk(playlistMutex); }
+    playlistCV.notify_all();
+    { std::lock_guard<std::mutex> lk(commandMutex); }
+    commandCV.notify_all();
+}
+
+// Speculative prepares go to the prefetch lane; with start set the voice is
+// wanted now, so it goes to the interactive lane and is handed off as soon
+// as it is ready. A prepare that already matches is reused.
+static void prepare_preview(const std::string& path, bool start) {
+    long rate = engineRate.load();
+    int channels = engineChannels.load();
+    std::lock_guard<std::mutex> lk(previewSlot.m);
+    if (previewSlot.path == path && previewSlot.rate == rate && previewSlot.channels == channels &&
+        (previewSlot.voice || previewSlot.pending)) {
+        if (!start) return;
+        if (previewSlot.pending) {
+            previewSlot.startWhenReady = true;
+            return;
+        }
+        previewSlot.path.clear();
+        hand_off_preview(std::move(previewSlot.voice));
+        return;
+    }
+
+    previewSlot.token.cancel();
+    previewSlot.token = CancelToken();
+    previewSlot.voice.reset();
+    previewSlot.path = path;
+    previewSlot.rate = rate;
+    previewSlot.channels = channels;
+    previewSlot.pending = true;
+    previewSlot.startWhenReady = start;
+    unsigned id = ++previewSlot.id;
+    CancelToken tok = previewSlot.token;
+    workerPool.submit(start ? LANE_INTERACTIVE : LANE_PREFETCH, tok, [path, rate, channels, id, tok] {
+        std::unique_ptr<PreviewVoice> v;
+        if (audio_ready_now()) v = open_preview_voice(path, rate, channels, tok);
+        std::lock_guard<std::mutex> lk(previewSlot.m);
+        if (id != previewSlot.id) return;
+        previewSlot.pending = false;
+        if (!v) {
+            previewSlot.path.clear();
+        } else if (previewSlot.startWhenReady) {
+            previewSlot.path.clear();
+            hand_off_preview(std::move(v));
+        } else {
+            previewSlot.voice = std::move(v);
+        }
+    });
+}
+
+// Takes a voice handed over by the UI. One decoded for another format (the
+// track changed while it was being prepared) is dropped; rate 0 accepts any.
+static bool take_preview(std::unique_ptr<PreviewVoice>& cur, long rate, int channels) {
+    PreviewVoice* v = previewIncoming.exchange(nullptr);
+    if (!v) return false;
+    cur.reset(v);
+    if (rate > 0 && (v->rate != rate || v->channels != channels)) cur.reset();
+    previewActive.store(cur != nullptr);
+    renderDirty.store(true);
+    return cur != nullptr;
+}
+
+static void end_preview(std::unique_ptr<PreviewVoice>& cur) {
+    cur.reset();
+    previewActive.store(false);
+    renderDirty.store(true);
+}
+
+// Mixes the next frames of the snippet over out, ducking what is already
+// there by about 10 dB, with a 10 ms fade at both ends of the snippet.
+// Returns false once the snippet is over.
+static bool mix_preview(PreviewVoice& v, int16_t* out, int frames) {
+    int got = v.read(v.scratch.data(), frames);
+    const long total = v.rate * PREVIEW_SECONDS;
+    const long fade = std::max(1L, v.rate / 100);
+    for (int f = 0; f < got; f++) {
+        long pos = v.framesPlayed + f;
+        long g = std::min(std::min(pos, total - pos), fade) * 32768 / fade;
+        for (int c = 0; c < v.channels; c++) {
+            int16_t& o = out[f * v.channels + c];
+            int s = ((int)o * 5 >> 4) + (int)(((long)v.scratch[f * v.channels + c] * g) >> 15);
+            o = (int16_t)clampi(s, -32768, 32767);
+        }
+    }
+    v.framesPlayed += got;
+
+    long long requested = previewRequestNs.exchange(0, std::memory_order_relaxed);
+    if (requested != 0) previewStartUs.store((long)((steady_ns() - requested) / 1000));
+    return got == frames && v.framesLeft > 0;
+}
+
+// Takes the queue head when it carries on in the playing file exactly where
+// the current track stops, so it plays on from the same decoder with no gap.
+static bool take_contiguous(QueueItem& item, unsigned epoch, long rate, off_t end) {
+    std::lock_guard<std::mutex> lk(playlistMutex);
+    if (playlistEpoch != epoch || playlist.empty()) return false;
+    const QueueItem& next = playlist.front();
+    if (next.path != item.path || (off_t)std::llround(next.startSec * rate) != end) return false;
+    item = next;
+    playlist.pop_front();
+    engineTrack.fetch_add(1);
+    return true;
+}
+
+// Sample-frame bounds of a queue item; end is -1 when the length is unknown.
+static void item_bounds(const QueueItem& item, long rate, off_t length, off_t& start, off_t& end) {
+    start = std::max<off_t>(0, (off_t)std::llround(item.startSec * rate));
+    end = item.endSec >= 0.0 ? (off_t)std::llround(item.endSec * rate) : (length > 0 ? length : -1);
+    if (length > 0) {
+        start = std::min(start, length);
+        if (end > length) end = length;
+    }
+}
+
+// Plays one queue item, and the items after it for as long as they continue
+// the same file (virtual tracks). epoch is the playlist epoch the item was
+// taken under.
+static bool play_file(QueueItem item, unsigned epoch) {
+    if (!wait_audio_ready()) return false;
+
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    const std::string path = item.path;
+
+    // A growing frame index keeps seeks into long files exact and cheap.
+    mpg123_param(mh, MPG123_INDEX_SIZE, -1000, 0.0);
+    if (mpg123_open(mh, path.c_str()) != MPG123_OK) {
+        mpg123_delete(mh);
+        return false;
+    }
+
+    long rate;
+    int channels, encoding;
+    if (mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
+        mpg123_close(mh);
+        mpg123_delete(mh);
+        return false;
+    }
+
+    // The decoder keeps its own format when the pipeline converts from it.
+    if (!pipeline_encoding(encoding)) encoding = MPG123_ENC_SIGNED_16;
+    mpg123_format_none(mh);
+    mpg123_format(mh, rate, channels, encoding);
+    const SamplePipeline* pipe = pick_pipeline(encoding, channels);
+
+    // Virtual tracks need the exact length and a full index to seek by sample.
+    bool cut = item.startSec > 0.0 || item.endSec >= 0.0;
+    if (cut) mpg123_scan(mh);
+    off_t length = mpg123_length(mh);
+    off_t start = 0, end = -1;
+    item_bounds(item, rate, length, start, end);
+    if (start > 0) mpg123_seek(mh, start, SEEK_SET);
+    off_t decodePos = start;
+    double totalSec = (end > start) ? ((double)(end - start) / (double)rate) : 0.0;
+
+    if (!open_output_stream(rate, channels)) {
+        mpg123_close(mh);
+        mpg123_delete(mh);
+        return false;
+    }
+    PaStream* stream = audio.stream;
+
+    if (out_stopped(stream) && out_start(stream) != paNoError) {
+        mpg123_close(mh);
+        mpg123_delete(mh);
+        return false;
+    }
+
+    isPlaying.store(true);
+    isPaused.store(false);
+    engineRate.store(rate);
+    engineChannels.store(channels);
+
+    AnalysisFrame& analysis = audio.analysis;
+    analysis_begin_track(analysis, rate, channels, BUFFER_SIZE / (channels * (int)sizeof(int16_t)));
+    outputHistory.reset(rate, channels);
+    // The decoder always sits at trackReplay.end(); decodePos runs behind
+    // it while a seek back is being replayed.
+    trackReplay.reset(channels, REPLAY_BYTES, (size_t)(REPLAY_SECONDS * rate / PCM_BLOCK_FRAMES) + 1);
+    trackReplay.restart(decodePos);
+    std::unique_ptr<PreviewVoice> preview;
+    bool stopped = false;
+
+    // Tempo comes from the background analysis once it lands; until then
+    // beat.bpm stays 0 and the visualizer does not pulse.
+    beatTracks.want({ path }, true);
+    unsigned beatGen = beatTracks.generation() - 1;
+    BeatGrid grid{};
+    BeatClock beat;
+
+    begin_render_track(path, totalSec, item.title);
+    renderDirty.store(true, std::memory_order_release);
+
+    unsigned char buffer[BUFFER_SIZE];
+    unsigned char raw[BUFFER_SIZE * 2];   // decoder output awaiting conversion
+    double currentSec = 0.0;
+    int carried = 0;   // frames at the front of buffer that belong to the next virtual track
+
+    // Moves on to the next queued virtual track of this file, if it starts
+    // where the current one ends.
+    auto continue_track = [&]() {
+        if (!take_contiguous(item, epoch, rate, end)) return false;
+        item_bounds(item, rate, length, start, end);
+        totalSec = (end > start) ? ((double)(end - start) / (double)rate) : 0.0;
+        begin_render_track(path, totalSec, item.title);
+        tap.pendingFlags = TAP_TRACK_START;
+        return true;
+    };
+
+    while (!shouldQuit.load()) {
+        CommandBatch cmds = drain_commands();
+        if (cmds.stop) {
+            stopped = true;
+            break;
+        }
+        if (cmds.stopPreview && preview) end_preview(preview);
+
+        if (cmds.togglePause) {
+            bool paused = !isPaused.load();
+            isPaused.store(paused);
+            if (paused && !preview) out_stop(stream);
+            else if (out_stopped(stream)) out_start(stream);
+            {
+                std::lock_guard<std::mutex> lk(renderMutex);
+                renderState.paused = paused;
+            }
+            renderDirty.store(true, std::memory_order_release);
+        }
+
+        if (cmds.device >= 0) {
+            if (!switch_output_device(cmds.device, outputHistory, !isPaused.load())) break;
+            stream = audio.stream;
+        }
+
+        if (cmds.seekSec != 0) {
+            off_t newPos = decodePos + (off_t)cmds.seekSec * (off_t)rate;
+            if (newPos < start) newPos = start;
+            if (end > 0 && newPos > end) newPos = end;
+
+            if (trackReplay.contains(newPos)) {
+                decodePos = newPos;
+            } else {
+                off_t at = mpg123_seek(mh, newPos, SEEK_SET);
+                decodePos = at >= 0 ? at : newPos;
+                trackReplay.restart(decodePos);
+            }
+            carried = 0;
+        }
+
+        if (take_preview(preview, rate, channels) && out_stopped(stream)) out_start(stream);
+
+        // While paused a preview still plays, over silence.
+        if (isPaused.load()) {
+            if (!preview) {
+                std::unique_lock<std::mutex> lock(commandMutex);
+                commandCV.wait(lock, [] { return shouldQuit.load() || commands_waiting() || previewIncoming.load(); });
+                continue;
+            }
+            int frames = BUFFER_SIZE / (channels * (int)sizeof(int16_t));
+            std::memset(buffer, 0, sizeof(buffer));
+            if (!mix_preview(*preview, reinterpret_cast<int16_t*>(buffer), frames)) end_preview(preview);
+            int gain = volume_gain_q15();
+            if (gain < 32768) pipe->gain(reinterpret_cast<int16_t*>(buffer), frames, channels, gain);
+            if (out_write(stream, buffer, frames) != paNoError) break;
+            if (!preview) out_stop(stream);
+            continue;
+        }
+
+        size_t done = 0;
+        const size_t frameBytes = (size_t)channels * sizeof(int16_t);
+        if (carried > 0) {
+            done = (size_t)carried * frameBytes;
+            carried = 0;
+        } else if (decodePos < trackReplay.end()) {
+            int want = (int)std::min<off_t>(BUFFER_SIZE / frameBytes, trackReplay.end() - decodePos);
+            done = (size_t)trackReplay.read(decodePos, reinterpret_cast<int16_t*>(buffer), want) * frameBytes;
+            if (done == 0) break;
+        } else {
+            // int16 is decoded in place; other formats are converted into buffer.
+            unsigned char* in = pipe->bytes == (int)sizeof(int16_t) ? buffer : raw;
+            size_t got = 0;
+            int ret = mpg123_read(mh, in, BUFFER_SIZE / frameBytes * channels * pipe->bytes, &got);
+            if (ret == MPG123_DONE || ret != MPG123_OK) break;
+            int n = (int)(got / ((size_t)channels * pipe->bytes));
+            if (n == 0) continue;
+            if (in == raw) pipe->convert(raw, reinterpret_cast<int16_t*>(buffer), n, channels);
+            done = (size_t)n * frameBytes;
+            trackReplay.append(reinterpret_cast<int16_t*>(buffer), n);
+        }
+
+        int frames = (int)(done / (channels * (int)sizeof(int16_t)));
+        if (frames <= 0) continue;
+
+        // A virtual track stops on its exact end sample; the rest of the
+        // block is kept for the next track if that continues the file.
+        bool trackEnd = false;
+        if (item.endSec >= 0.0 && end > 0 && decodePos + frames >= end) {
+            int keep = (int)std::max<off_t>(0, end - decodePos);
+            carried = frames - keep;
+            frames = keep;
+            trackEnd = true;
+        }
+        decodePos += frames;
+        if (frames == 0) {
+            if (!continue_track()) break;
+            continue;
+        }
+
+        // Written in FRAMES_PER_BUFFER slices so a preview handed over while
+        // a block is being written joins at the next slice.
+        int16_t* pcm = reinterpret_cast<int16_t*>(buffer);
+        int gain = volume_gain_q15();
+        bool written = true;
+        for (int off = 0; off < frames && written; off += FRAMES_PER_BUFFER) {
+            int n = std::min(FRAMES_PER_BUFFER, frames - off);
+            take_preview(preview, rate, channels);
+            if (preview && !mix_preview(*preview, pcm + off * channels, n)) end_preview(preview);
+            if (gain < 32768) pipe->gain(pcm + off * channels, n, channels, gain);
+            written = out_write(stream, pcm + off * channels, n) == paNoError;
+        }
+        if (!written) break;
+        outputHistory.push(reinterpret_cast<int16_t*>(buffer), (size_t)frames);
+
+        long long requested = playRequestNs.exchange(0, std::memory_order_relaxed);
+        if (requested != 0) firstSoundUs.store((long)((steady_ns() - requested) / 1000));
+
+        double fileSec = (double)decodePos / (double)rate;
+        currentSec = (double)(decodePos - start) / (double)rate;
+
+        if (beatTracks.generation() != beatGen) {
+            beatGen = beatTracks.generation();
+            std::lock_guard<std::mutex> lk(beatTracks.mutex());
+            const TrackResult<BeatGrid>* r = beatTracks.find(path);
+            if (r && r->state == TJ_READY) grid = r->value;
+            if (r && (r->state == TJ_READY || r->state == TJ_FAILED)) {
+                beat.bpm = grid.bpm > 0.0f ? grid.bpm : -1.0f;
+                beat.speed = grid.speed;
+            }
+        }
+        // Anchor the next beat the listener will hear, allowing for what the
+        // device still has buffered.
+        double latency = out_latency(stream);
+        if (grid.bpm > 0.0f) {
+            double heard = fileSec - latency;
+            double next = grid.firstBeat + std::ceil((heard - grid.firstBeat) / grid.period) * grid.period;
+            beat.anchorNs = steady_ns() + (long long)((next - heard) * 1e9);
+            beat.periodNs = (long long)(grid.period * 1e9);
+        }
+
+        VisualizationMode modeLocal = visMode.load();
+        meter_block(analysis, pcm, frames, channels, rate);
+        analyze_block(analysis, pcm, frames, channels, spectrum_needed(), notesWanted.load(std::memory_order_relaxed));
+        publish_block(analysis, currentSec, modeLocal, &beat);
+        tap_publish(analysis, pcm, frames, channels, rate, currentSec, latency, beat, 0);
+        engineAllocCount.store(threadAllocCount, std::memory_order_relaxed);
+
+        if (trackEnd) {
+            if (carried > 0) {
+                std::memmove(buffer, buffer + (size_t)frames * frameBytes, (size_t)carried * frameBytes);
+            }
+            if (!continue_track()) break;
+        }
+    }
+
+    out_stop(stream);
+
+    mpg123_close(mh);
+    mpg123_delete(mh);
+
+    isPlaying.store(false);
+    engineRate.store(0);
+    engineChannels.store(0);
+
+    // A preview outlives a track that ends on its own; the audio thread
+    // carries it on into the next track or plays the rest alone.
+    PreviewVoice* none = nullptr;
+    if (preview && !stopped && !shouldQuit.load() && previewIncoming.compare_exchange_strong(none, preview.get())) preview.release();
+    else if (preview) end_preview(preview);
+
+    clear_render_track();
+    return true;
+}
+
+// Plays a handed-over preview with nothing else sounding. It ends with the
+// snippet, on stop, or when a track is queued, which then carries it on.
+static void play_preview_alone() {
+    std::unique_ptr<PreviewVoice> preview;
+    if (!wait_audio_ready() || !take_preview(preview, 0, 0)) return;
+    long rate = preview->rate;
+    int channels = preview->channels;
+    if (!open_output_stream(rate, channels)) {
+        end_preview(preview);
+        return;
+    }
+    PaStream* stream = audio.stream;
+    if (out_stopped(stream) && out_start(stream) != paNoError) {
+        end_preview(preview);
+        return;
+    }
+
+    const int frames = BUFFER_SIZE / (channels * (int)sizeof(int16_t));
+    outputHistory.reset(rate, channels);
+    analysis_begin_track(audio.analysis, rate, channels, frames);
+    begin_render_track(preview->path + " [preview]", PREVIEW_SECONDS);
+    renderDirty.store(true, std::memory_order_release);
+
+    unsigned char buffer[BUFFER_SIZE];
+    bool handOver = false;
+
+    while (!shouldQuit.load()) {
+        CommandBatch cmds = drain_commands();
+        if (cmds.stop || cmds.stopPreview || previewIncoming.load()) break;
+        if (cmds.device >= 0) {
+            if (!switch_output_device(cmds.device, outputHistory, true)) break;
+            stream = audio.stream;
+        }
+        {
+            std::lock_guard<std::mutex> lk(playlistMutex);
+            handOver = !playlist.empty();
+        }
+        if (handOver) break;
+
+        std::memset(buffer, 0, sizeof(buffer));
+        bool more = mix_preview(*preview, reinterpret_cast<int16_t*>(buffer), frames);
+        int gain = volume_gain_q15();
+        if (gain < 32768) audio.analysis.pipe->gain(reinterpret_cast<int16_t*>(buffer), frames, channels, gain);
+        if (out_write(stream, buffer, frames) != paNoError) break;
+        outputHistory.push(reinterpret_cast<int16_t*>(buffer), (size_t)frames);
+
+        const int16_t* pcm = reinterpret_cast<int16_t*>(buffer);
+        double pos = (double)preview->framesPlayed / (double)rate;
+        meter_block(audio.analysis, pcm, frames, channels, rate);
+        analyze_block(audio.analysis, pcm, frames, channels, spectrum_needed(), notesWanted.load(std::memory_order_relaxed));
+        publish_block(audio.analysis, pos, visMode.load());
+        tap_publish(audio.analysis, pcm, frames, channels, rate, pos, out_latency(stream), BeatClock(), TAP_PREVIEW);
+        if (!more) break;
+    }
+
+    out_stop(stream);
+    PreviewVoice* none = nullptr;
+    if (handOver && previewIncoming.compare_exchange_strong(none, preview.get())) preview.release();
+    else end_preview(preview);
+    clear_render_track();
+}
+
+// Output device picker, drawn as a popup over the panes while open. The
+// device list is copied from the warmed-up backend when the picker opens.
+struct DevicePicker {
+    bool open = false;
+    int sel = 0;
+    std::vector<OutputDeviceInfo> list;
+    WINDOW* win = nullptr;
+};
+
+static DevicePicker picker;
+
+static void open_device_picker() {
+    {
+        std::lock_guard<std::mutex> lk(audio.m);
+        if (!audio.ready) return;
+        picker.list = audio.devices;
+    }
+    picker.sel = 0;
+    for (size_t i = 0; i < picker.list.size(); i++) if (picker.list[i].index == activeDevice.load()) picker.sel = (int)i;
+
+    int h = clampi((int)picker.list.size() + 4, 5, std::max(5, currentLayout.termH - 2));
+    int w = clampi(currentLayout.termW - 8, 20, 90);
+    picker.win = newwin(h, w, (currentLayout.termH - h) / 2, (currentLayout.termW - w) / 2);
+    picker.open = picker.win != nullptr;
+}
+
+static void close_device_picker() {
+    if (picker.win) { delwin(picker.win); picker.win = nullptr; }
+    picker.open = false;
+}
+
+static void draw_device_picker() {
+    WINDOW* w = picker.win;
+    if (!w) return;
+    int h, ww;
+    getmaxyx(w, h, ww);
+    werase(w);
+    draw_border(w, 1, true);
+    draw_title(w, "Output Device  Enter:switch  o/Esc:close", 1);
+
+    int rows = h - 3;
+    int first = clampi(picker.sel - rows + 1, 0, std::max(0, (int)picker.list.size() - rows));
+    for (int r = 0; r < rows && first + r < (int)picker.list.size(); r++) {
+        const OutputDeviceInfo& d = picker.list[first + r];
+        char line[160];
+        std::snprintf(line, sizeof(line), "%c %-28.28s  %5.1f-%6.1f ms  %6.0f Hz",
+                      d.index == activeDevice.load() ? '*' : ' ', d.name.c_str(),
+                      d.lowLatency * 1000.0, d.highLatency * 1000.0, d.defaultRate);
+        bool selected = (first + r == picker.sel);
+        if (selected) wattron(w, A_REVERSE | A_BOLD);
+        mvwaddnstr(w, 2 + r, 2, line, ww - 4);
+        if (selected) wattroff(w, A_REVERSE | A_BOLD);
+    }
+    if (picker.list.empty()) mvwaddnstr(w, 2, 2, "No output devices", ww - 4);
+    wrefresh(w);
+}
+
+static void start_dupe_scan(const fs::path& root) {
+    std::lock_guard<std::mutex> lk(dupeScan.m);
+    if (dupeScan.running) return;
+    dupeScan.running = true;
+    dupeScan.ready = false;
+    dupeScan.done.store(0);
+    dupeScan.total.store(0);
+    dupeScan.root = root;
+    dupeScan.started = std::chrono::steady_clock::now();
+    TrackJobs<Fingerprint>::Counts c = fingerprints.counts();
+    dupeScan.computedBefore = c.computed;
+    dupeScan.cachedBefore = c.cached;
+    CancelToken tok = dupeScan.token;
+    workerPool.submit(LANE_BULK, tok, [root, tok] {
+        std::vector<std::string> paths = library_mp3s(root, tok);
+        dupeScan.total.store(paths.size());
+        auto groups = group_duplicates(paths, tok, [](size_t done, size_t) { dupeScan.done.store(done); });
+        if (tok.cancelled()) return;
+
+        std::lock_guard<std::mutex> lk(dupeScan.m);
+        double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - dupeScan.started).count();
+        TrackJobs<Fingerprint>::Counts c = fingerprints.counts();
+        std::snprintf(dupeScan.summary, sizeof(dupeScan.summary), "%zu tracks in %.1f s (%.0f/s, %lu fingerprinted, %lu cached)",
+                      paths.size(), took, paths.size() / std::max(took, 1e-3),
+                      c.computed - dupeScan.computedBefore, c.cached - dupeScan.cachedBefore);
+        dupeScan.groups = std::move(groups);
+        dupeScan.running = false;
+        dupeScan.ready = true;
+    });
+}
+
+// Duplicate groups, one header line per group and one line per copy,
+// scrolled as a whole.
+struct DupeView {
+    bool open = false;
+    int top = 0;
+    std::string summary;
+    std::vector<std::string> lines;
+    WINDOW* win = nullptr;
+};
+
+static DupeView dupeView;
+
+// Opens the popup when a finished scan is waiting.
+static bool open_dupe_view() {
+    std::lock_guard<std::mutex> lk(dupeScan.m);
+    if (!dupeScan.ready) return false;
+    dupeScan.ready = false;
+    dupeView.summary = dupeScan.summary;
+    dupeView.lines.clear();
+    dupeView.top = 0;
+    for (size_t g = 0; g < dupeScan.groups.size(); g++) {
+        dupeView.lines.push_back(std::to_string(dupeScan.groups[g].size()) + " copies");
+        for (auto& p : dupeScan.groups[g]) {
+            std::error_code ec;
+            fs::path rel = fs::relative(p, dupeScan.root, ec);
+            dupeView.lines.push_back("  " + (ec || rel.empty() ? p : rel.string()));
+        }
+    }
+    dupeScan.groups.clear();
+
+    int h = clampi((int)dupeView.lines.size() + 5, 6, std::max(6, currentLayout.termH - 2));
+    int w = clampi(currentLayout.termW - 8, 20, 110);
+    dupeView.win = newwin(h, w, (currentLayout.termH - h) / 2, (currentLayout.termW - w) / 2);
+    dupeView.open = dupeView.win != nullptr;
+    return dupeView.open;
+}
+
+static void close_dupe_view() {
+    if (dupeView.win) { delwin(dupeView.win); dupeView.win = nullptr; }
+    dupeView.open = false;
+    dupeView.lines.clear();
+}
+
+static int dupe_view_rows() {
+    int h, w;
+    getmaxyx(dupeView.win, h, w);
+    (void)w;
+    return std::max(1, h - 4);
+}
+
+static void draw_dupe_view() {
+    WINDOW* w = dupeView.win;
+    if (!w) return;
+    int h, ww;
+    getmaxyx(w, h, ww);
+    werase(w);
+    draw_border(w, 1, true);
+    draw_title(w, "Duplicates  Up/Down/PgUp/PgDn:scroll  d/Esc:close", 1);
+    mvwaddnstr(w, 1, 2, dupeView.summary.c_str(), ww - 4);
+
+    int rows = h - 4;
+    for (int r = 0; r < rows && dupeView.top + r < (int)dupeView.lines.size(); r++) {
+        const std::string& line = dupeView.lines[dupeView.top + r];
+        bool header = line[0] != ' ';
+        if (header) wattron(w, A_BOLD);
+        mvwaddnstr(w, 3 + r, 2, line.c_str(), ww - 4);
+        if (header) wattroff(w, A_BOLD);
+    }
+    if (dupeView.lines.empty()) mvwaddnstr(w, 3, 2, "No duplicates found", ww - 4);
+    wrefresh(w);
+}
+
+// The mp3 under the browser cursor, if any. Virtual tracks are not
+// previewed; the file's own row is.
+static bool preview_target(const std::vector<BrowserEntry>& list, int highlight, std::string& out) {
+    int i = highlight - 1;
+    if (i < 0 || i >= (int)list.size() || !is_mp3_entry(list[i])) return false;
+    out = list[i].path().string();
+    return true;
+}
+
+// The queue entry for a browser row. A virtual track is titled after its
+// file and number, plus its own title when it has one.
+static QueueItem queue_item(const BrowserEntry& e) {
+    QueueItem q;
+    q.path = e.path().string();
+    if (!e.is_cut()) return q;
+    char num[16];
+    std::snprintf(num, sizeof(num), " - %02d", e.cut.number);
+    q.title = e.path().stem().string() + num + (e.cut.title.empty() ? "" : " " + e.cut.title);
+    q.startSec = e.cut.startSec;
+    q.endSec = e.cut.endSec;
+    return q;
+}
+
+// The queue entries for a folder, as `a` queues them: split files give
+// their virtual tracks instead of the whole file.
+static std::vector<QueueItem> folder_items(const std::vector<BrowserEntry>& list) {
+    std::vector<QueueItem> items;
+    for (size_t i = 0; i < list.size(); i++) {
+        const BrowserEntry& e = list[i];
+        bool split = i + 1 < list.size() && list[i + 1].is_cut() && list[i + 1].path() == e.path();
+        if (e.is_cut() || (is_mp3_entry(e) && !split)) items.push_back(queue_item(e));
+    }
+    return items;
+}
+
+// 16-bit PCM WAV; the sizes are patched in by finish(). Samples go out as
+// they are, which is little-endian on every platform we build for.
+class WavWriter {
+public:
+    bool begin(FILE* f, long rate, int channels) {
+        f_ = f;
+        rate_ = rate;
+        channels_ = channels;
+        bytes_ = 0;
+        return write_header();
+    }
+
+    bool write(const int16_t* pcm, int frames) {
+        size_t n = (size_t)frames * channels_;
+        bytes_ += n * sizeof(int16_t);
+        return std::fwrite(pcm, sizeof(int16_t), n, f_) == n;
+    }
+
+    bool finish() {
+        return std::fseek(f_, 0, SEEK_SET) == 0 && write_header() && std::fseek(f_, 0, SEEK_END) == 0;
+    }
+
+private:
+    bool write_header() {
+        uint8_t h[44];
+        auto le = [&h](int at, uint32_t v, int n) {
+            for (int i = 0; i < n; i++) h[at + i] = (uint8_t)(v >> (8 * i));
+        };
+        uint32_t data = (uint32_t)std::min<uint64_t>(bytes_, 0xFFFFFFFFu - 36);
+        std::memcpy(h, "RIFF", 4);
+        le(4, 36 + data, 4);
+        std::memcpy(h + 8, "WAVEfmt ", 8);
+        le(16, 16, 4);
+        le(20, 1, 2);                                   // PCM
+        le(22, (uint32_t)channels_, 2);
+        le(24, (uint32_t)rate_, 4);
+        le(28, (uint32_t)(rate_ * channels_ * 2), 4);
+        le(32, (uint32_t)channels_ * 2, 2);
+        le(34, 16, 2);
+        std::memcpy(h + 36, "data", 4);
+        le(40, data, 4);
+        return std::fwrite(h, 1, sizeof(h), f_) == sizeof(h);
+    }
+
+    FILE* f_ = nullptr;
+    long rate_ = 0;
+    int channels_ = 0;
+    uint64_t bytes_ = 0;
+};
+
+// Decodes one queue item through the playback chain (the decoder's own
+// format, the pipeline's conversion, then the volume gain) and streams it to
+// out a block at a time. A file cut short by a decode error, a failed
+// write or a cancel is removed.
+static bool export_track(const QueueItem& item, const std::string& out, ExportFormat format, int gain,
+                         const CancelToken& tok) {
+    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+    if (!mh) return false;
+    long rate;
+    int channels, encoding;
+    if (mpg123_open(mh, item.path.c_str()) != MPG123_OK || mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
+        mpg123_delete(mh);
+        return false;
+    }
+    if (!pipeline_encoding(encoding)) encoding = MPG123_ENC_SIGNED_16;
+    mpg123_format_none(mh);
+    mpg123_format(mh, rate, channels, encoding);
+    const SamplePipeline* pipe = pick_pipeline(encoding, channels);
+
+    if (item.startSec > 0.0 || item.endSec >= 0.0) mpg123_scan(mh);
+    off_t start = 0, end = -1;
+    item_bounds(item, rate, mpg123_length(mh), start, end);
+    if (start > 0) mpg123_seek(mh, start, SEEK_SET);
+
+    FILE* f = std::fopen(out.c_str(), "wb");
+    bool ok = f != nullptr;
+    FlacWriter flac;
+    WavWriter wav;
+    if (ok) ok = format == EXPORT_FLAC ? flac.begin(f, rate, channels) : wav.begin(f, rate, channels);
+
+    const int blockFrames = BUFFER_SIZE / (channels * (int)sizeof(int16_t));
+    std::vector<unsigned char> raw((size_t)blockFrames * channels * pipe->bytes);
+    std::vector<int16_t> pcm((size_t)blockFrames * channels);
+    off_t pos = start;
+    while (ok && !tok.cancelled() && (end < 0 || pos < end)) {
+        unsigned char* in = pipe->bytes == (int)sizeof(int16_t) ? reinterpret_cast<unsigned char*>(pcm.data()) : raw.data();
+        size_t got = 0;
+        int ret = mpg123_read(mh, in, raw.size(), &got);
+        int n = (int)(got / ((size_t)channels * pipe->bytes));
+        if (end >= 0) n = (int)std::min<off_t>(n, end - pos);
+        if (n > 0) {
+            if (in == raw.data()) pipe->convert(in, pcm.data(), n, channels);
+            if (gain < 32768) pipe->gain(pcm.data(), n, channels, gain);
+            ok = format == EXPORT_FLAC ? flac.write(pcm.data(), n) : wav.write(pcm.data(), n);
+            pos += n;
+            exportRun.audioUs.fetch_add((unsigned long long)n * 1000000 / rate, std::memory_order_relaxed);
+        }
+        // Only the end of the stream ends the track; a decode error part
+        // way through fails it rather than leaving a short file.
+        if (ret == MPG123_DONE) break;
+        if (ret != MPG123_OK && ret != MPG123_NEW_FORMAT) ok = false;
+    }
+    if (ok && !tok.cancelled()) ok = format == EXPORT_FLAC ? flac.finish() : wav.finish();
+    else ok = false;
+    if (f && std::fclose(f) != 0) ok = false;
+    if (!ok) std::remove(out.c_str());
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    return ok;
+}
+
+// "07 - Title.flac": numbered in batch order, named after the virtual
+// track's title or else the file.
+static std::string export_name(size_t i, size_t count, const QueueItem& item, ExportFormat format) {
+    std::string name = item.title.empty() ? fs::path(item.path).stem().string() : item.title;
+    std::replace(name.begin(), name.end(), '/', '_');
+    char num[24];
+    std::snprintf(num, sizeof(num), "%0*zu - ", count >= 100 ? (count >= 1000 ? 4 : 3) : 2, i + 1);
+    return num + name + (format == EXPORT_FLAC ? ".flac" : ".wav");
+}
+
+// Starts queued items while there are free slots; call with m held. Jobs go
+// on the bulk lane under a token of their own, so one skipped because the
+// run was cancelled still counts itself out.
+static void export_fill_slots() {
+    ExportRun& r = exportRun;
+    while (r.active < r.slots && r.next < r.items.size()) {
+        size_t i = r.next++;
+        r.active++;
+        CancelToken tok = r.token;
+        std::string out = (r.dest / export_name(i, r.items.size(), r.items[i], r.format)).string();
+        workerPool.submit(LANE_BULK, CancelToken(), [i, out, tok] {
+            ExportRun& r = exportRun;
+            bool ok = !tok.cancelled() && export_track(r.items[i], out, r.format, r.gain, tok);
+            if (ok) r.done.fetch_add(1);
+            else if (!tok.cancelled()) r.failed.fetch_add(1);
+
+            std::lock_guard<std::mutex> lk(r.m);
+            r.active--;
+            if (tok.cancelled()) r.next = r.items.size();
+            export_fill_slots();
+            if (r.active > 0) return;
+            double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.started).count();
+            std::snprintf(r.summary, sizeof(r.summary), "%s%zu of %zu tracks in %.1f s (%.0fx real time, %zu failed)",
+                          tok.cancelled() ? "Cancelled: " : "", r.done.load(), r.items.size(), took, export_speed(),
+                          r.failed.load());
+            r.running = false;
+        });
+    }
+}
+
+static fs::path export_root() {
+    const char* home = std::getenv("HOME");
+    return fs::path(home ? home : ".") / "Music" / "TerminalWave";
+}
+
+// A new folder for each export, named after the time it started.
+static fs::path export_dest() {
+    char stamp[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(stamp, sizeof(stamp), "export-%Y%m%d-%H%M%S", std::localtime(&now));
+    return export_root() / stamp;
+}
+
+static bool start_export(std::vector<QueueItem> items, ExportFormat format, unsigned slots) {
+    std::lock_guard<std::mutex> lk(exportRun.m);
+    ExportRun& r = exportRun;
+    if (r.running || items.empty()) return false;
+    fs::path base = export_dest(), dest = base;
+    std::error_code ec;
+    for (int n = 2; fs::exists(dest, ec); n++) dest = base.string() + "-" + std::to_string(n);
+    fs::create_directories(dest, ec);
+    if (ec) {
+        std::snprintf(r.summary, sizeof(r.summary), "Cannot create %s: %s", dest.c_str(), ec.message().c_str());
+        r.dest.clear();
+        return false;
+    }
+    r.running = true;
+    r.format = format;
+    r.items = std::move(items);
+    r.dest = dest;
+    r.gain = volume_gain_q15();
+    r.slots = (int)std::max(1u, slots);
+    r.next = 0;
+    r.active = 0;
+    r.done.store(0);
+    r.failed.store(0);
+    r.total.store(r.items.size());
+    r.audioUs.store(0);
+    r.started = std::chrono::steady_clock::now();
+    r.summary[0] = '\0';
+    r.token = CancelToken();
+    export_fill_slots();
+    return true;
+}
+
+// Export popup: while idle it shows what `e` would export and where, and
+// the last run's summary; while running, its progress.
+struct ExportView {
+    bool open = false;
+    ExportFormat format = EXPORT_FLAC;
+    std::vector<QueueItem> items;
+    bool fromQueue = false;
+    WINDOW* win = nullptr;
+};
+
+static ExportView exportView;
+
+static void open_export_view(const std::vector<BrowserEntry>& dirList) {
+    {
+        std::lock_guard<std::mutex> lk(playlistMutex);
+        exportView.items.assign(playlist.begin(), playlist.end());
+    }
+    exportView.fromQueue = !exportView.items.empty();
+    if (!exportView.fromQueue) exportView.items = folder_items(dirList);
+    int h = 9;
+    int w = clampi(currentLayout.termW - 8, 20, 100);
+    exportView.win = newwin(h, w, (currentLayout.termH - h) / 2, (currentLayout.termW - w) / 2);
+    exportView.open = exportView.win != nullptr;
+}
+
+static void close_export_view() {
+    if (exportView.win) { delwin(exportView.win); exportView.win = nullptr; }
+    exportView.open = false;
+    exportView.items.clear();
+}
+
+static void draw_export_view() {
+    WINDOW* w = exportView.win;
+    if (!w) return;
+    int h, ww;
+    getmaxyx(w, h, ww);
+    (void)h;
+    werase(w);
+    draw_border(w, 1, true);
+
+    char line[PATH_BUF_SIZE + 128];
+    std::lock_guard<std::mutex> lk(exportRun.m);
+    const ExportRun& r = exportRun;
+    if (r.running) {
+        draw_title(w, "Export  Enter:cancel  e/Esc:close", 1);
+        std::snprintf(line, sizeof(line), "%s: %zu of %zu tracks, %zu failed, %.0fx real time",
+                      r.format == EXPORT_FLAC ? "FLAC" : "WAV", r.done.load(), r.items.size(), r.failed.load(),
+                      export_speed());
+        mvwaddnstr(w, 2, 2, line, ww - 4);
+        std::snprintf(line, sizeof(line), "To %s", r.dest.c_str());
+        mvwaddnstr(w, 3, 2, line, ww - 4);
+        int barW = ww - 4;
+        int fill = r.items.empty() ? 0 : (int)((r.done.load() + r.failed.load()) * barW / r.items.size());
+        wattron(w, COLOR_PAIR(4) | A_BOLD);
+        for (int i = 0; i < fill; i++) mvwaddch(w, 5, 2 + i, '#');
+        wattroff(w, COLOR_PAIR(4) | A_BOLD);
+        for (int i = fill; i < barW; i++) mvwaddch(w, 5, 2 + i, '.');
+    } else {
+        draw_title(w, "Export  Up/Down:format  Enter:start  e/Esc:close", 1);
+        std::snprintf(line, sizeof(line), "%zu tracks from the %s", exportView.items.size(),
+                      exportView.fromQueue ? "queue" : "current folder");
+        mvwaddnstr(w, 2, 2, line, ww - 4);
+        std::snprintf(line, sizeof(line), "To a new folder in %s", export_root().c_str());
+        mvwaddnstr(w, 3, 2, line, ww - 4);
+        for (int f = 0; f < 2; f++) {
+            bool selected = exportView.format == (ExportFormat)f;
+            if (selected) wattron(w, A_REVERSE | A_BOLD);
+            mvwaddstr(w, 5, 4 + f * 10, f == EXPORT_FLAC ? " FLAC " : " WAV ");
+            if (selected) wattroff(w, A_REVERSE | A_BOLD);
+        }
+        mvwaddnstr(w, 5, 24, "16-bit, at the current volume", std::max(0, ww - 26));
+        if (r.summary[0]) {
+            wattron(w, A_BOLD);
+            mvwaddnstr(w, 6, 2, r.summary, ww - 4);
+            wattroff(w, A_BOLD);
+            if (!r.dest.empty()) mvwaddnstr(w, 7, 2, r.dest.c_str(), ww - 4);
+        }
+    }
+    wrefresh(w);
+}
+
+// Browser order with browserByBpm: directories, then MP3s by tempo
+// (slowest first, unanalysed last), then other files, each by name.
+static void sort_listing(std::vector<BrowserEntry>& list) {
+    if (!browserByBpm) {
+        std::sort(list.begin(), list.end(), entry_name_less);
+        return;
+    }
+    std::vector<std::pair<float, size_t>> keys(list.size());
+    {
+        std::lock_guard<std::mutex> lk(beatTracks.mutex());
+        for (size_t i = 0; i < list.size(); i++) {
+            float k = 2e6f;
+            if (list[i].is_directory()) {
+                k = -1.0f;
+            } else if (!list[i].is_directory() && is_mp3_path(list[i].path())) {
+                const TrackResult<BeatGrid>* r = beatTracks.find(list[i].path().string());
+                k = (r && r->state == TJ_READY && r->value.bpm > 0.0f) ? std::round(r->value.bpm * 10.0f) / 10.0f : 1e6f;
+            }
+            keys[i] = { k, i };
+        }
+    }
+    std::sort(keys.begin(), keys.end(), [&](const std::pair<float, size_t>& a, const std::pair<float, size_t>& b) {
+        if (a.first != b.first) return a.first < b.first;
+        return entry_name_less(list[a.second], list[b.second]);
+    });
+    std::vector<BrowserEntry> sorted;
+    sorted.reserve(list.size());
+    for (auto& k : keys) sorted.push_back(list[k.second]);
+    list.swap(sorted);
+}
+
+static void resort_keeping_highlight(std::vector<BrowserEntry>& list, int& highlight) {
+    fs::path keep = (highlight > 0 && highlight <= (int)list.size()) ? list[highlight - 1].path() : fs::path();
+    int keepCut = keep.empty() ? 0 : list[highlight - 1].cut.number;
+    sort_listing(list);
+    for (size_t i = 0; i < list.size(); i++)
+        if (!keep.empty() && list[i].path() == keep && list[i].cut.number == keepCut) highlight = (int)i + 1;
+}
+
+// Clears out commands that arrived with nothing playing. A device choice
+// moves the idle stream, so the next track starts on the new device.
+static void drain_idle() {
+    CommandBatch cmds = drain_commands();
+    if (cmds.device >= 0 && audio_ready_now() && audio.stream) switch_output_device(cmds.device, outputHistory, false);
+}
+
+static void audio_thread() {
+    while (!shouldQuit.load()) {
+        QueueItem next;
+        unsigned epoch;
+        {
+            std::unique_lock<std::mutex> lock(playlistMutex);
+            playlistCV.wait(lock, [] {
+                return shouldQuit.load() || !playlist.empty() || previewIncoming.load() || commands_waiting();
+            });
+            if (shouldQuit.load()) break;
+            if (playlist.empty()) {
+                engineTrack.fetch_add(1);
+                lock.unlock();
+                if (previewIncoming.load()) play_preview_alone();
+                else drain_idle();
+                continue;
+            }
+            next = playlist.front();
+            playlist.pop_front();
+            epoch = playlistEpoch;
+            engineTrack.fetch_add(1);
+        }
+
+        radio_played(next.path);
+        if (radioOn.load()) trackFeatures.want({ next.path }, true);
+        play_file(next, epoch);
+
+        if (shouldQuit.load()) break;
+
+        // Stop ('x') bumps the epoch; only a track that ran out or was
+        // skipped hands over to the radio.
+        std::string pick;
+        if (radioOn.load() && radio_pick(next.path, pick)) {
+            std::lock_guard<std::mutex> lock(playlistMutex);
+            if (playlist.empty() && epoch == playlistEpoch) {
+                QueueItem q;
+                q.path = pick;
+                playlist.push_back(q);
+            }
+        }
+    }
+    isPlaying.store(false);
+}
+
+// Feeds the cover decoder Huffman tables that claim more codes than fit
+// at some length, and DHT segments that run past their end. Each has to
+// be rejected before anything is written; valid complete tables must
+// still build.
+static int run_jpeg_check() {
+    struct Case { const char* name; std::vector<std::pair<int, int>> counts; bool valid; };
+    const Case cases[] = {
+        { "200 codes of length 1", { { 1, 200 } }, false },
+        { "3 codes of length 1", { { 1, 3 } }, false },
+        { "255 codes of length 8 after one of length 1", { { 1, 1 }, { 8, 255 } }, false },
+        { "300 codes of length 3", { { 3, 255 }, { 3, 45 } }, false },
+        { "2 codes of length 1", { { 1, 2 } }, true },
+        { "4 codes of length 2", { { 2, 4 } }, true },
+        { "one code of each length", { { 1, 1 }, { 2, 1 }, { 3, 1 }, { 4, 1 }, { 5, 1 }, { 6, 1 }, { 7, 1 }, { 8, 1 },
+                                       { 9, 1 }, { 10, 1 }, { 11, 1 }, { 12, 1 }, { 13, 1 }, { 14, 1 }, { 15, 1 }, { 16, 1 } }, true },
+    };
+    int wrong = 0;
+    for (const Case& c : cases) {
+        uint8_t counts[16] = {};
+        int total = 0;
+        for (auto& lc : c.counts) {
+            int n = std::min(lc.second, 255 - counts[lc.first - 1]);
+            counts[lc.first - 1] = (uint8_t)(counts[lc.first - 1] + n);
+            total += n;
+        }
+        total = std::min(total, 256);
+        std::vector<uint8_t> vals(256);
+        for (int i = 0; i < 256; i++) vals[i] = (uint8_t)i;
+        JpegHuffman t;
+        bool built = jpeg_build_huffman(t, counts, vals.data(), total);
+
+        // The same table as a DHT segment in an otherwise empty JPEG, and
+        // again with the segment cut short.
+        std::vector<uint8_t> jpeg = { 0xFF, 0xD8, 0xFF, 0xC4, 0, 0, 0x00 };
+        jpeg.insert(jpeg.end(), counts, counts + 16);
+        jpeg.insert(jpeg.end(), vals.begin(), vals.begin() + total);
+        size_t len = jpeg.size() - 4;
+        jpeg[4] = (uint8_t)(len >> 8);
+        jpeg[5] = (uint8_t)len;
+        jpeg.insert(jpeg.end(), { 0xFF, 0xD9 });
+        ArtImage img;
+        bool decoded = decode_jpeg(jpeg.data(), jpeg.size(), 64, 64, img);
+        jpeg.resize(jpeg.size() - 2 - total / 2);
+        bool truncated = decode_jpeg(jpeg.data(), jpeg.size(), 64, 64, img);
+
+        bool ok = built == c.valid && !decoded && !truncated;
+        std::printf("check-jpeg: %-45s %s\n", c.name, ok ? (c.valid ? "built" : "rejected") : "WRONG");
+        if (!ok) wrong++;
+    }
+    std::printf("check-jpeg: %s\n", wrong ? "FAIL" : "PASS");
+    return wrong ? 1 : 0;
+}
+
+// Seconds of real playback --check-alloc watches after its warm-up second.
+#define CHECK_ALLOC_SECONDS 4
+
+// Two runs. First, synthetic decoded blocks go through the analysis and
+// publish path in every mode and on each FFT backend; after one warm-up
+// block per mode, any C++ heap allocation fails the check. Then mp3 plays
+// through play_file() itself, from the decoder to the discard sink, while
+// the visualizer mode cycles and seeks and pauses arrive as they would from
+// the keyboard. After the first second, any allocation on the engine
+// thread fails the check.
+static int run_alloc_check(const std::string& mp3) {
+    const int blocks = 2000;
+    const int channels = 2;
+    const int frames = BUFFER_SIZE / (channels * (int)sizeof(int16_t));
+
+    std::vector<int16_t> pcm((size_t)frames * channels);
+    for (int i = 0; i < frames; i++) {
+        int16_t v = (int16_t)(std::sin((double)i * 0.05) * 20000.0);
+        pcm[(size_t)i * channels] = v;
+        pcm[(size_t)i * channels + 1] = (int16_t)-v;
+    }
+
+    AnalysisFrame analysis;
+    if (!analysis_init(analysis)) {
+        std::cerr << "check-alloc: FFT setup failed\n";
+        return 1;
+    }
+    analysis_begin_track(analysis, 44100, channels, frames);
+    begin_render_track("check-alloc", 60.0);
+
+    analyze_block(analysis, pcm.data(), frames, channels, false);
+    publish_block(analysis, 0.0, WAVEFORM);
+    analyze_block(analysis, pcm.data(), frames, channels, true);
+    publish_block(analysis, 0.0, SPECTRUM);
+    analyze_block(analysis, pcm.data(), frames, channels, true, true);
+    publish_block(analysis, 0.0, PIANO_ROLL);
+
+    SpectrumBackend userBackend = spectrumBackend.load();
+    unsigned long long before = allocCount.load();
+    for (int b = 0; b < blocks; b++) {
+        static const VisualizationMode cycle[] = {WAVEFORM, SPECTRUM, PIANO_ROLL};
+        VisualizationMode m = cycle[(b / 32) % 3];
+        if (TW_HAVE_FFTW) spectrumBackend.store((b % 256 < 128) ? BACKEND_FFTW : BACKEND_FIXED);
+        meter_block(analysis, pcm.data(), frames, channels, 44100);
+        analyze_block(analysis, pcm.data(), frames, channels, m != WAVEFORM, m == PIANO_ROLL);
+        publish_block(analysis, (double)b * frames / 44100.0, m);
+        tap_publish(analysis, pcm.data(), frames, channels, 44100, (double)b * frames / 44100.0, 0.0, BeatClock(), 0);
+    }
+    unsigned long long allocs = allocCount.load() - before;
+    spectrumBackend.store(userBackend);
+
+    analysis_free(analysis);
+
+    std::printf("check-alloc: %d synthetic blocks, %llu allocations\n", blocks, allocs);
+
+    discardOutput = true;
+    workerPool.start(1, 1);
+    audio_warm_up();
+    if (!audio_ready_now()) {
+        std::printf("check-alloc: no audio output\n");
+        workerPool.stop();
+        return 1;
+    }
+    std::atomic<bool> ended{false};
+    std::thread engine([&] {
+        QueueItem item;
+        item.path = mp3;
+        play_file(item, 0);
+        ended.store(true);
+    });
+
+    auto waitUntil = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    unsigned long long frames0 = outputFrames.load();
+    while (!ended.load() && std::chrono::steady_clock::now() < waitUntil &&
+           (engineRate.load() == 0 || outputFrames.load() - frames0 < (unsigned long long)engineRate.load()))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    long rate = std::max(1L, engineRate.load());
+
+    unsigned long long base = engineAllocCount.load(), played = outputFrames.load();
+    for (int step = 0; step < CHECK_ALLOC_SECONDS * 20 && !ended.load(); step++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        static const VisualizationMode cycle[] = {WAVEFORM, SPECTRUM, PIANO_ROLL};
+        VisualizationMode m = cycle[(step / 4) % 3];
+        visMode.store(m);
+        spectrumWanted.store(m != WAVEFORM);
+        notesWanted.store(m == PIANO_ROLL);
+        if (TW_HAVE_FFTW) spectrumBackend.store((step / 10) % 2 ? BACKEND_FFTW : BACKEND_FIXED);
+        // Back into what was just played (the replay buffer), then ahead
+        // of the decoder; a pause is always undone 100 ms later.
+        if (step % 10 == 3) send_command(CMD_SEEK, step % 20 == 3 ? -1 : 2);
+        if (step % 20 == 7 || step % 20 == 9) send_command(CMD_TOGGLE_PAUSE);
+    }
+    unsigned long long engineAllocs = engineAllocCount.load() - base;
+    played = outputFrames.load() - played;
+    bool cut = ended.load();
+    send_command(CMD_STOP);
+    engine.join();
+    beatTracks.shutdown();
+    workerPool.stop();
+    audio_shutdown();
+    spectrumBackend.store(userBackend);
+
+    std::printf("check-alloc: %s: %.1f s played with seeks and pauses, %llu allocations\n", mp3.c_str(),
+                (double)played / rate, engineAllocs);
+    if (cut) std::printf("check-alloc: playback ended before the check did; use a longer track\n");
+    return allocs == 0 && engineAllocs == 0 && played > 0 && !cut ? 0 : 1;
+}
+
+// The per-sample loops over a runtime channel count that convert_block()
+// and gain_block() replaced; --bench-analysis times against them and checks
+// the pipeline matches them exactly.
+template <class Fmt>
+static void convert_scalar(const unsigned char* in, int16_t* out, int frames, int channels) {
+    for (int i = 0; i < frames; i++)
+        for (int c = 0; c < channels; c++) out[i * channels + c] = Fmt::to_s16(in + ((size_t)i * channels + c) * Fmt::bytes);
+}
+
+static void gain_scalar(int16_t* s, int frames, int channels, int gainQ15) {
+    for (int i = 0; i < frames; i++)
+        for (int c = 0; c < channels; c++) s[i * channels + c] = (int16_t)(((int)s[i * channels + c] * gainQ15) >> 15);
+}
+
+// Times the analysis stages on the same synthetic blocks: the spectrum and
+// the constant-Q product for each available backend, the level meters over
+// every sample, and the sample pipeline.
+static int run_analysis_bench() {
+    const int blocks = 4000;
+    const int channels = 2;
+    const int frames = BUFFER_SIZE / (channels * (int)sizeof(int16_t));
+
+    std::vector<int16_t> pcm((size_t)frames * channels);
+    for (int i = 0; i < frames; i++) {
+        int16_t v = (int16_t)(std::sin((double)i * 0.05) * 12000.0 + std::sin((double)i * 0.31) * 8000.0);
+        pcm[(size_t)i * channels] = v;
+        pcm[(size_t)i * channels + 1] = v;
+    }
+
+    AnalysisFrame analysis;
+    if (!analysis_init(analysis)) {
+        std::cerr << "bench-analysis: FFT setup failed\n";
+        return 1;
+    }
+    analysis_begin_track(analysis, 44100, channels, frames);
+    std::printf("bench-analysis: %d notes, %zu kernel coefficients (dense would be %d)\n", CQT_NOTES,
+                analysis.cqt.re.size(), CQT_NOTES * (FFT_SIZE / 2 + 1));
+
+    // Median over rounds of the per-frame cost, after a warm-up call. The
+    // note product is timed on its own over the spectrum it was last given,
+    // so its cost is not lost in the noise of the spectrum around it.
+    auto median_us = [&](const std::function<void()>& fn) {
+        const int rounds = 9;
+        double us[rounds];
+        fn();
+        for (int r = 0; r < rounds; r++) {
+            auto t0 = std::chrono::steady_clock::now();
+            for (int b = 0; b < blocks / rounds; b++) fn();
+            auto t1 = std::chrono::steady_clock::now();
+            us[r] = std::chrono::duration<double, std::micro>(t1 - t0).count() / (blocks / rounds);
+        }
+        std::nth_element(us, us + rounds / 2, us + rounds);
+        return us[rounds / 2];
+    };
+
+    SpectrumBackend userBackend = spectrumBackend.load();
+    for (int b = 0; b < 2; b++) {
+        SpectrumBackend backend = b == 0 ? BACKEND_FIXED : BACKEND_FFTW;
+        if (backend == BACKEND_FFTW && !TW_HAVE_FFTW) continue;
+        spectrumBackend.store(backend);
+        double spectrum = median_us([&] { analyze_block(analysis, pcm.data(), frames, channels, true); });
+        analyze_block(analysis, pcm.data(), frames, channels, true, true);
+        double cqt = median_us([&] { cqt_apply(analysis); });
+        std::printf("bench-analysis: %-5s spectrum %.2f us/frame, cqt product %.2f us/frame (%.0f%% of the spectrum)\n",
+                    backend == BACKEND_FFTW ? "fftw" : "fixed", spectrum, cqt, 100.0 * cqt / std::max(spectrum, 1e-9));
+    }
+    spectrumBackend.store(userBackend);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int b = 0; b < blocks; b++) meter_block(analysis, pcm.data(), frames, channels, 44100);
+    auto t1 = std::chrono::steady_clock::now();
+    std::printf("bench-analysis: meters %.2f us/frame over %d samples (%s)\n",
+                std::chrono::duration<double, std::micro>(t1 - t0).count() / blocks, frames * channels,
+                TW_HAVE_SSE2 ? "SSE2" : (TW_HAVE_NEON ? "NEON" : "scalar"));
+
+    // Sample pipeline stages as a stereo track runs them, against plain
+    // scalar loops over a runtime channel count like the ones they replaced.
+    // The reference loops are also what the results must match exactly.
+    // int16 conversion is a plain copy, so it is checked but given no ratio.
+    auto stage_us = [&](const std::function<void()>& fn) {
+        fn();
+        auto a = std::chrono::steady_clock::now();
+        for (int b = 0; b < blocks; b++) fn();
+        auto z = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::micro>(z - a).count() / blocks;
+    };
+    const int n = frames * channels;
+    std::vector<unsigned char> raw((size_t)n * 4);
+    std::vector<int16_t> out(n), ref(n);
+    std::mt19937 rng(7);
+    static const char* formats[3] = { "s16", "s24", "f32" };
+    bool exact = true;
+    for (int f = 0; f < 3; f++) {
+        const SamplePipeline& stereo = PIPELINES[f][1];
+        const int bytes = stereo.bytes;
+        // Real audio first, then random words that reach the clamps and
+        // every rounding case.
+        for (int i = 0; i < n; i++) {
+            unsigned char* d = &raw[(size_t)i * bytes];
+            bool noise = i >= n / 2;
+            if (f == 0) {
+                int16_t v = noise ? (int16_t)rng() : pcm[i];
+                std::memcpy(d, &v, 2);
+            } else if (f == 1) {
+                uint32_t v = noise ? rng() : (uint32_t)(uint16_t)pcm[i] << 8;
+                d[0] = (unsigned char)v;
+                d[1] = (unsigned char)(v >> 8);
+                d[2] = (unsigned char)(v >> 16);
+            } else {
+                float v = noise ? std::uniform_real_distribution<float>(-1.1f, 1.1f)(rng) : pcm[i] / 32768.0f;
+                std::memcpy(d, &v, 4);
+            }
+        }
+        auto scalar = f == 0 ? convert_scalar<SampleS16> : (f == 1 ? convert_scalar<SampleS24> : convert_scalar<SampleF32>);
+        double a = stage_us([&] { stereo.convert(raw.data(), out.data(), frames, channels); });
+        scalar(raw.data(), ref.data(), frames, channels);
+        if (out != ref) {
+            std::printf("bench-analysis: %s conversion differs from the scalar one\n", formats[f]);
+            exact = false;
+        }
+        if (f == 0) {
+            std::printf("bench-analysis: convert %s %.2f us/frame (copy)\n", formats[f], a);
+            continue;
+        }
+        double b = stage_us([&] { scalar(raw.data(), ref.data(), frames, channels); });
+        std::printf("bench-analysis: convert %s %.2f us/frame (scalar %.2f us, %.1fx)\n", formats[f], a, b, b / std::max(a, 1e-9));
+    }
+    const SamplePipeline& stereo = PIPELINES[0][1];
+    const SamplePipeline& any = PIPELINES[0][2];
+    for (int i = 0; i < n; i++) ref[i] = (int16_t)rng();
+    for (int g : { 0, 1, 23198, 32767 }) {
+        out = ref;
+        gain_scalar(out.data(), frames, channels, g);
+        std::vector<int16_t> got(ref);
+        stereo.gain(got.data(), frames, channels, g);
+        if (got != out) {
+            std::printf("bench-analysis: gain %d differs from the scalar one\n", g);
+            exact = false;
+        }
+    }
+    // Both sides copy the block first so the gain does not decay it to zero.
+    std::vector<int16_t> work(n);
+    double ga = stage_us([&] {
+        std::memcpy(work.data(), ref.data(), n * sizeof(int16_t));
+        stereo.gain(work.data(), frames, channels, 23198);
+    });
+    double gb = stage_us([&] {
+        std::memcpy(work.data(), ref.data(), n * sizeof(int16_t));
+        gain_scalar(work.data(), frames, channels, 23198);
+    });
+    std::printf("bench-analysis: gain %.2f us/frame (scalar %.2f us, %.1fx)\n", ga, gb, gb / std::max(ga, 1e-9));
+    double da = stage_us([&] { stereo.downmix(pcm.data(), frames, channels, analysis.mono.data()); });
+    double db = stage_us([&] { any.downmix(pcm.data(), frames, channels, analysis.mono.data()); });
+    std::printf("bench-analysis: downmix %.2f us/frame (any channel count %.2f us)\n", da, db);
+    if (!exact) {
+        analysis_free(analysis);
+        return 1;
+    }
+
+    analysis_free(analysis);
+    return 0;
+}
+
+// Fingerprints every mp3 below dir on all cores and prints the duplicate
+// groups. Tracks already in the cache are only looked up; run it twice to
+// see the cached rate.
+static int run_find_dupes(const std::string& dir) {
+    unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    workerPool.start(1, hw);
+
+    CancelToken tok;
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::string> paths = library_mp3s(dir, tok);
+    auto t1 = std::chrono::steady_clock::now();
+    bool tty = ::isatty(STDERR_FILENO);
+    auto groups = group_duplicates(paths, tok, [tty](size_t done, size_t total) {
+        if (tty) std::fprintf(stderr, "\rfind-dupes: %zu/%zu", done, total);
+    });
+    auto t2 = std::chrono::steady_clock::now();
+    if (tty) std::fprintf(stderr, "\n");
+    TrackJobs<Fingerprint>::Counts c = fingerprints.counts();
+    fingerprints.shutdown();
+    workerPool.stop();
+
+    double walk = std::chrono::duration<double>(t1 - t0).count();
+    double took = std::chrono::duration<double>(t2 - t1).count();
+    std::printf("find-dupes: %zu tracks (listed in %.2f s), %lu fingerprinted, %lu cached, %lu failed\n",
+                paths.size(), walk, c.computed, c.cached, c.failed);
+    std::printf("find-dupes: %.2f s on %u workers, %.1f tracks/s", took, hw, paths.size() / std::max(took, 1e-3));
+    if (c.computed > 0) std::printf(" (%.1f fingerprinted/s)", c.computed / std::max(took, 1e-3));
+    std::printf("\n");
+    for (size_t g = 0; g < groups.size(); g++) {
+        std::printf("\n%zu copies\n", groups[g].size());
+        for (auto& p : groups[g]) std::printf("  %s\n", p.c_str());
+    }
+    std::printf("\nfind-dupes: %zu groups\n", groups.size());
+    return 0;
+}
+
+// Exports the current folder as `e` would with an empty queue, on all
+// cores, and prints the speed.
+static int run_export(ExportFormat format) {
+    unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    workerPool.start(1, hw);
+    std::vector<QueueItem> items = folder_items(list_directory("."));
+    if (!start_export(items, format, hw)) {
+        workerPool.stop();
+        std::fprintf(stderr, "export: %s\n", exportRun.summary[0] ? exportRun.summary : "no MP3s in the current directory");
+        return 1;
+    }
+    bool tty = ::isatty(STDERR_FILENO);
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lk(exportRun.m);
+            if (!exportRun.running) break;
+            if (tty) std::fprintf(stderr, "\rexport: %zu/%zu, %.0fx real time", exportRun.done.load() + exportRun.failed.load(),
+                                  items.size(), export_speed());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (tty) std::fprintf(stderr, "\n");
+    workerPool.stop();
+    std::printf("export: %s\nexport: written to %s\n", exportRun.summary, exportRun.dest.c_str());
+    return exportRun.failed.load() > 0 ? 1 : 0;
+}
+
+// Follows a --sync-lead instance until Ctrl-C, reporting once a second.
+static int run_sync_follow(const std::string& target) {
+    std::string host = target;
+    int port = SYNC_PORT;
+    size_t colon = target.rfind(':');
+    if (colon != std::string::npos) {
+        host = target.substr(0, colon);
+        port = std::atoi(target.c_str() + colon + 1);
+    }
+    audio_warm_up();
+    if (!audio_ready_now()) {
+        std::printf("sync: no audio output\n");
+        return 1;
+    }
+    std::string err;
+    if (!sync_follow_start(host.c_str(), port, err)) {
+        std::printf("sync: cannot reach %s: %s\n", target.c_str(), err.c_str());
+        return 1;
+    }
+    std::printf("sync: following %s:%d, Ctrl-C to stop\n", host.c_str(), port);
+    std::fflush(stdout);
+    sync_follow_play(0, nullptr, [](const SyncStatus& st) {
+        unsigned long lost, received;
+        {
+            std::lock_guard<std::mutex> lk(syncFollow.m);
+            lost = syncFollow.lost;
+            received = syncFollow.received;
+        }
+        std::printf("sync: off by %+.2f ms, clock %+.1f ppm, output %+.1f ppm, %u relocks, %lu/%lu packets lost\n",
+                    st.errorMs, st.clockPpm, st.outputPpm, st.relocks, lost, lost + received);
+        std::fflush(stdout);
+    });
+    sync_follow_stop();
+    audio_shutdown();
+    return 0;
+}
+
+// One leader and two followers on loopback, all on discard sinks. Each
+// follower has its own skewed clock, a sink running fast or slow, and
+// loses a percent of the audio packets; the leader pauses for a second
+// part way through. The leader logs when it plays each stretch of the
+// stream and the followers log what they played when, so the parent can
+// measure how far apart they were.
+static int run_sync_test(long seconds) {
+    struct Follower { double clockOffsetS, clockPpm, outputPpm; };
+    const Follower followers[] = { { 3.2, 80.0, 250.0 }, { -1.7, -120.0, -300.0 } };
+    const int nf = (int)(sizeof(followers) / sizeof(followers[0]));
+    const long rate = 44100;
+    const double settleS = 5.0;
+
+    fs::path dir = fs::temp_directory_path() / ("terminalwave-sync-test-" + std::to_string(getpid()));
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::string err;
+    int fd = sync_bind("127.0.0.1", 0, err);
+    sockaddr_in bound{};
+    socklen_t len = sizeof(bound);
+    if (fd < 0 || ::getsockname(fd, (sockaddr*)&bound, &len) != 0) {
+        std::printf("sync-test: cannot bind: %s\n", err.c_str());
+        return 1;
+    }
+    int port = ntohs(bound.sin_port);
+    discardOutput = true;
+    long long start = steady_ns();
+
+    std::vector<pid_t> kids;
+    pid_t pid = fork();
+    if (pid == 0) {
+        syncLead.log = std::fopen((dir / "leader.log").c_str(), "w");
+        sync_lead_start(fd);
+        if (!syncLead.log || !open_output_stream(rate, 2) || out_start(audio.stream) != paNoError) _exit(2);
+        // A tone that wanders in pitch, outlasting the followers.
+        std::vector<int16_t> pcm(FRAMES_PER_BUFFER * 2);
+        double phase = 0.0;
+        long long pauseAt = start + (long long)(seconds * 0.45e9), stopAt = start + (seconds + 1) * 1000000000LL;
+        while (steady_ns() < stopAt) {
+            if (pauseAt && steady_ns() >= pauseAt) {
+                out_stop(audio.stream);
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                if (out_start(audio.stream) != paNoError) _exit(2);
+                pauseAt = 0;
+            }
+            for (int i = 0; i < FRAMES_PER_BUFFER; i++) {
+                phase += 2 * M_PI * (440.0 + 220.0 * std::sin(phase * 1e-4)) / rate;
+                pcm[i * 2] = pcm[i * 2 + 1] = (int16_t)(12000 * std::sin(phase));
+            }
+            if (out_write(audio.stream, pcm.data(), FRAMES_PER_BUFFER) != paNoError) _exit(2);
         }
+        out_stop(audio.stream);
+        sync_lead_stop();
+        std::fclose(syncLead.log);
+        _exit(0);
+    }
+    if (pid > 0) kids.push_back(pid);
+    ::close(fd);
+    for (int k = 0; pid > 0 && k < nf; k++) {
+        pid = fork();
+        if (pid > 0) kids.push_back(pid);
+        if (pid != 0) continue;
+        const Follower& f = followers[k];
+        discardSpeed = 1.0 + f.outputPpm * 1e-6;
+        syncFollow.simOffsetNs = (long long)(f.clockOffsetS * 1e9);
+        syncFollow.simBase = steady_ns();
+        syncFollow.simPpm = f.clockPpm;
+        syncFollow.simLoss = 0.01;
+        syncFollow.rng.seed(k + 1);
+        FILE* log = std::fopen((dir / ("follower" + std::to_string(k) + ".log")).c_str(), "w");
+        if (!log || !sync_follow_start("127.0.0.1", port, err)) _exit(2);
+        SyncStatus st = sync_follow_play(start + seconds * 1000000000LL, log, nullptr);
+        sync_follow_stop();
+        std::fprintf(log, "# %.3f %.3f %u %lu %lu\n", st.clockPpm, st.outputPpm, st.relocks, syncFollow.lost, syncFollow.received);
+        std::fclose(log);
+        _exit(0);
+    }
+    if (pid < 0) std::printf("sync-test: fork failed: %s\n", std::strerror(errno));
+    bool ok = kids.size() == (size_t)nf + 1;
+    for (pid_t k : kids) {
+        int status = 0;
+        if (waitpid(k, &status, 0) != k || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
     }
 
-    wrefresh(waveWin);
+    // The leader's log: stream frame `index` and the `frames` after it
+    // were played from `heard` on.
+    struct Played { long long heard; unsigned long long index; size_t frames; };
+    std::vector<Played> lead;
+    if (FILE* f = std::fopen((dir / "leader.log").c_str(), "r")) {
+        Played p;
+        while (std::fscanf(f, "%lld %llu %zu", &p.heard, &p.index, &p.frames) == 3) lead.push_back(p);
+        std::fclose(f);
+    }
+    std::printf("sync-test: %ld s, %d followers, leader played %zu blocks\n", seconds, nf, lead.size());
+    if (lead.empty()) ok = false;
+
+    for (int k = 0; k < nf; k++) {
+        FILE* f = std::fopen((dir / ("follower" + std::to_string(k) + ".log")).c_str(), "r");
+        std::vector<double> errMs;
+        size_t blocks = 0;
+        double clockPpm = 0, outputPpm = 0;
+        unsigned relocks = 0;
+        unsigned long lost = 0, received = 0;
+        bool summary = false;
+        char line[256];
+        while (f && std::fgets(line, sizeof(line), f)) {
+            if (line[0] == '#') {
+                summary = std::sscanf(line + 1, "%lf %lf %u %lu %lu", &clockPpm, &outputPpm, &relocks, &lost, &received) == 5;
+                continue;
+            }
+            long long heard;
+            double pos;
+            int full;
+            if (std::sscanf(line, "%lld %lf %d", &heard, &pos, &full) != 3) continue;
+            blocks++;
+            if (!full || heard < start + (long long)(settleS * 1e9)) continue;
+            auto it = std::upper_bound(lead.begin(), lead.end(), heard, [](long long t, const Played& p) { return t < p.heard; });
+            if (it == lead.begin()) continue;
+            --it;
+            double into = (double)(heard - it->heard) * rate / 1e9;
+            if (into > it->frames) continue;   // the leader was paused
+            errMs.push_back((pos - ((double)it->index + into)) * 1000.0 / rate);
+        }
+        if (f) std::fclose(f);
+        std::vector<double> mag(errMs.size());
+        for (size_t i = 0; i < errMs.size(); i++) mag[i] = std::fabs(errMs[i]);
+        std::sort(mag.begin(), mag.end());
+        double p50 = mag.empty() ? 0 : mag[mag.size() / 2], p99 = mag.empty() ? 0 : mag[mag.size() * 99 / 100];
+        double worst = mag.empty() ? 0 : mag.back();
+        const Follower& want = followers[k];
+        bool pass = summary && mag.size() > blocks / 4 && worst <= 5.0 &&
+                    std::fabs(clockPpm - want.clockPpm) <= 10.0 && std::fabs(outputPpm - want.outputPpm) <= 20.0;
+        std::printf("sync-test: follower %d: %zu blocks compared, error %.2f ms median, %.2f ms p99, %.2f ms max\n",
+                    k, mag.size(), p50, p99, worst);
+        std::printf("sync-test: follower %d: clock %+.1f ppm (simulated %+.1f), output %+.1f ppm (simulated %+.1f), "
+                    "%u relocks, %lu/%lu packets lost\n",
+                    k, clockPpm, want.clockPpm, outputPpm, want.outputPpm, relocks, lost, lost + received);
+        if (!pass) ok = false;
+    }
+    fs::remove_all(dir, ec);
+    std::printf("sync-test: %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
 }
 
-static bool play_file(const std::string& path) {
-    std::freopen("/dev/null", "w", stderr);
-
-    if (mpg123_init() != MPG123_OK) return false;
-
-    mpg123_handle* mh = mpg123_new(nullptr, nullptr);
-    if (!mh) { mpg123_exit(); return false; }
-
-    if (mpg123_open(mh, path.c_str()) != MPG123_OK) {
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+// Builds a radio index over n synthetic tracks (clusters of similar
+// vectors, like albums and genres), then times picks and checks them
+// against an exhaustive search. The picks follow each other like a radio
+// run, so the history keeps landing in the neighbourhood being searched.
+static int run_radio_bench(size_t n) {
+    std::mt19937 rng(7);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+    const int clusters = 256;
+    std::vector<float> centres((size_t)clusters * FEATURE_DIMS);
+    for (float& c : centres) c = 3.0f * gauss(rng);
+    std::vector<float> data(n * FEATURE_DIMS);
+    for (size_t i = 0; i < n; i++) {
+        const float* c = &centres[(rng() % clusters) * FEATURE_DIMS];
+        for (int d = 0; d < FEATURE_DIMS; d++) data[i * FEATURE_DIMS + d] = c[d] + gauss(rng);
     }
 
-    long rate;
-    int channels, encoding;
-    if (mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+    FeatureIndex index;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) index.add(&data[i * FEATURE_DIMS]);
+    auto t1 = std::chrono::steady_clock::now();
+    std::printf("bench-radio: indexed %zu tracks in %.2f s\n", n, std::chrono::duration<double>(t1 - t0).count());
+
+    const int queries = 10000, checked = 300;
+    std::vector<FeatureIndex::Hit> hits;
+    std::vector<uint32_t> eligible;
+    std::deque<uint32_t> recent;
+    std::vector<double> us(queries);
+    size_t found = 0, wanted = 0, restarts = 0;
+    uint32_t seed = (uint32_t)(rng() % n);
+    for (int q = 0; q < queries; q++) {
+        auto a = std::chrono::steady_clock::now();
+        radio_candidates(index, seed, [&](const FeatureIndex::Hit& h) {
+            return h.first < RADIO_SAME_DIST || std::find(recent.begin(), recent.end(), h.second) != recent.end();
+        }, hits, eligible);
+        auto b = std::chrono::steady_clock::now();
+        us[q] = std::chrono::duration<double, std::micro>(b - a).count();
+
+        if (q < checked) {
+            // Recall of the RADIO_SPREAD + 1 nearest, which is what a pick
+            // uses when nothing nearby was played.
+            const float* v = index.vector(seed);
+            std::vector<FeatureIndex::Hit> exact(n);
+            for (size_t i = 0; i < n; i++) exact[i] = { index.distance(v, &data[i * FEATURE_DIMS]), (uint32_t)i };
+            std::partial_sort(exact.begin(), exact.begin() + RADIO_SPREAD + 1, exact.end());
+            for (int e = 0; e < RADIO_SPREAD + 1; e++) {
+                wanted++;
+                for (auto& h : hits) if (h.second == exact[e].second) { found++; break; }
+            }
+        }
+        recent.push_back(seed);
+        if (recent.size() > RADIO_HISTORY) recent.pop_front();
+        if (eligible.empty()) restarts++;
+        seed = eligible.empty() ? (uint32_t)(rng() % n) : eligible[rng() % eligible.size()];
     }
+    std::sort(us.begin(), us.end());
+    std::printf("bench-radio: %d picks %.1f us median, %.1f us p99, %.1f us max, recall %.3f, %zu random restarts\n",
+                queries, us[queries / 2], us[queries * 99 / 100], us.back(), (double)found / wanted, restarts);
+    return 0;
+}
 
-    mpg123_format_none(mh);
-    mpg123_format(mh, rate, channels, encoding);
-
-    off_t length = mpg123_length(mh);
-    double totalSec = (length > 0) ? ((double)length / (double)rate) : 0.0;
-
-    if (Pa_Initialize() != paNoError) {
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+// Several processes fill one shared index at once, each reading the
+// others' records as it goes and then restamping a tenth of its own. The
+// parent then checks every record and times lookups.
+static int run_index_check() {
+    struct Value { uint64_t v[4]; };
+    const int writers = 4, perWriter = 25000, restamped = perWriter / 10;
+    fs::path p = fs::temp_directory_path() / ("terminalwave-index-check-" + std::to_string(getpid()));
+    auto key = [](int w, int i) { return "/music/writer" + std::to_string(w) + "/track" + std::to_string(i) + ".mp3"; };
+    auto value_of = [](const std::string& k, int64_t stamp) {
+        Value v;
+        uint64_t h = std::hash<std::string>{}(k);
+        for (int j = 0; j < 4; j++) v.v[j] = h * (j + 1) + (uint64_t)stamp;
+        return v;
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<pid_t> kids;
+    for (int w = 0; w < writers; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "check-index: fork failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        if (pid > 0) {
+            kids.push_back(pid);
+            continue;
+        }
+        SharedTrackIndex idx("TWCK", 1, sizeof(Value));
+        if (!idx.open(p)) _exit(2);
+        std::mt19937 rng(w);
+        int bad = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < (pass ? restamped : perWriter); i++) {
+                std::string k = key(w, i);
+                Value v = value_of(k, i + pass);
+                if (!idx.put(k, i + pass, 1, &v)) bad++;
+                int ow = (int)(rng() % writers), oi = (int)(rng() % perWriter);
+                std::string o = key(ow, oi);
+                int64_t stamp = oi;
+                Value got;
+                if (idx.find(o, stamp, 1, &got) || idx.find(o, ++stamp, 1, &got)) {
+                    Value want = value_of(o, stamp);
+                    if (std::memcmp(&got, &want, sizeof(Value)) != 0) bad++;
+                }
+            }
+        }
+        _exit(bad ? 1 : 0);
     }
-
-    PaStreamParameters out;
-    out.device = Pa_GetDefaultOutputDevice();
-    if (out.device == paNoDevice) {
-        Pa_Terminate();
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+    int failedWriters = 0;
+    for (pid_t k : kids) {
+        int status = 0;
+        if (waitpid(k, &status, 0) != k || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failedWriters++;
     }
-
-    out.channelCount = channels;
-    out.sampleFormat = paInt16;
-    out.suggestedLatency = Pa_GetDeviceInfo(out.device)->defaultLowOutputLatency;
-    out.hostApiSpecificStreamInfo = nullptr;
-
-    PaStream* stream = nullptr;
-    if (Pa_OpenStream(&stream, nullptr, &out, rate, FRAMES_PER_BUFFER, paClipOff, nullptr, nullptr) != paNoError) {
-        Pa_Terminate();
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+    double fillSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    SharedTrackIndex idx("TWCK", 1, sizeof(Value));
+    int wrong = 0;
+    std::vector<std::string> keys;
+    if (idx.open(p)) {
+        for (int w = 0; w < writers; w++) {
+            for (int i = 0; i < perWriter; i++) keys.push_back(key(w, i));
+        }
     }
-
-    if (Pa_StartStream(stream) != paNoError) {
-        Pa_CloseStream(stream);
-        Pa_Terminate();
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        return false;
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < keys.size(); n++) {
+        int i = (int)(n % perWriter);
+        int64_t stamp = i < restamped ? i + 1 : i;
+        Value got, want = value_of(keys[n], stamp);
+        if (!idx.find(keys[n], stamp, 1, &got) || std::memcmp(&got, &want, sizeof(Value)) != 0) wrong++;
     }
+    double lookupNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t1).count() / std::max<size_t>(keys.size(), 1);
+
+    std::printf("check-index: %zu writers x %d records in %.2f s, %llu generations, %.1f MB mapped\n",
+                kids.size(), perWriter, fillSec, (unsigned long long)idx.generation(), idx.mapped() / 1048576.0);
+    std::printf("check-index: %u live, %d missing or wrong, %d writers failed, lookup %.0f ns\n",
+                idx.live(), wrong, failedWriters, lookupNs);
+    bool ok = kids.size() == (size_t)writers && !failedWriters && !wrong && idx.live() == keys.size();
+    idx.close();
+    std::error_code ec;
+    fs::remove(p, ec);
+    return ok ? 0 : 1;
+}
 
-    isPlaying.store(true);
-    isPaused.store(false);
-    seekCommand.store(0);
-
-    double* fftIn = (double*)fftw_malloc(sizeof(double) * FFT_SIZE);
-    fftw_complex* fftOut = (fftw_complex*)fftw_malloc(sizeof(fftw_complex) * (FFT_SIZE / 2 + 1));
-    if (!fftIn || !fftOut) {
-        if (fftIn) fftw_free(fftIn);
-        if (fftOut) fftw_free(fftOut);
-        Pa_StopStream(stream);
-        Pa_CloseStream(stream);
-        Pa_Terminate();
+// Compresses decoded PCM with a range of codec settings and reports the
+// size against the time to encode and decode. The source is an MP3 (first
+// ten minutes) or, without one, a synthetic stereo mix.
+static int run_pcm_bench(const std::string& file) {
+    long rate = 44100;
+    int channels = 2;
+    std::vector<int16_t> pcm;
+    if (!file.empty()) {
+        mpg123_handle* mh = mpg123_new(nullptr, nullptr);
+        int encoding = 0;
+        if (!mh || mpg123_open(mh, file.c_str()) != MPG123_OK || mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
+            std::cerr << "bench-pcm: cannot open " << file << "\n";
+            if (mh) mpg123_delete(mh);
+            return 1;
+        }
+        mpg123_format_none(mh);
+        mpg123_format(mh, rate, channels, MPG123_ENC_SIGNED_16);
+        unsigned char buf[BUFFER_SIZE];
+        size_t done = 0;
+        size_t limit = (size_t)rate * 600 * channels;
+        while (pcm.size() < limit && mpg123_read(mh, buf, sizeof(buf), &done) == MPG123_OK) {
+            const int16_t* s = reinterpret_cast<const int16_t*>(buf);
+            pcm.insert(pcm.end(), s, s + done / sizeof(int16_t));
+        }
         mpg123_close(mh);
         mpg123_delete(mh);
-        mpg123_exit();
-        isPlaying.store(false);
-        return false;
+    } else {
+        // Decaying plucked notes over a quiet noise floor, panned apart.
+        std::mt19937 rng(5);
+        std::normal_distribution<double> noise(0.0, 30.0);
+        size_t frames = (size_t)rate * 60;
+        pcm.resize(frames * 2);
+        double f = 220.0, phase = 0.0, env = 0.0, pan = 0.5;
+        for (size_t i = 0; i < frames; i++) {
+            if (i % (size_t)(rate / 4) == 0) {
+                f = 110.0 * std::pow(2.0, (rng() % 36) / 12.0);
+                pan = (rng() % 100) / 100.0;
+                env = 1.0;
+            }
+            env *= 0.99985;
+            phase += 2.0 * M_PI * f / rate;
+            double v = 9000.0 * env * (std::sin(phase) + 0.4 * std::sin(2.0 * phase) + 0.2 * std::sin(3.0 * phase));
+            pcm[2 * i] = (int16_t)clampi((int)(v * (1.0 - 0.5 * pan) + noise(rng)), -32768, 32767);
+            pcm[2 * i + 1] = (int16_t)clampi((int)(v * (0.5 + 0.5 * pan) + noise(rng)), -32768, 32767);
+        }
     }
-
-    fftw_plan fftPlan = fftw_plan_dft_r2c_1d(FFT_SIZE, fftIn, fftOut, FFTW_MEASURE);
-    if (!fftPlan) {
-        fftw_free(fftIn);
-        fftw_free(fftOut);
-        Pa_StopStream(stream);
-        Pa_CloseStream(stream);
-        Pa_Terminate();
-        mpg123_close(mh);
-        mpg123_delete(mh);
-        mpg123_exit();
-        isPlaying.store(false);
-        return false;
+    size_t frames = pcm.size() / channels;
+    if (frames < 16384) {
+        std::cerr << "bench-pcm: need at least 16384 frames\n";
+        return 1;
     }
+    double seconds = (double)frames / rate;
+    std::printf("bench-pcm: %s, %.1f s, %ld Hz, %d ch, raw %.2f MB/min\n", file.empty() ? "synthetic" : file.c_str(), seconds,
+                rate, channels, rate * channels * 2 * 60 / 1e6);
+    std::printf("bench-pcm: block  orders  stereo   size  MB/min   encode   decode  block read\n");
+
+    struct Setting { int block, maxOrder; bool stereo; };
+    const Setting settings[] = { { 4096, 0, false }, { 4096, 1, false }, { 4096, 2, false }, { 4096, 4, false },
+                                 { 4096, 4, true }, { 1024, 4, true }, { 16384, 4, true } };
+    std::mt19937 rng(9);
+    std::vector<int16_t> back(pcm.size());
+    bool lossless = true;
+    for (const Setting& st : settings) {
+        PcmCodecOptions opt;
+        opt.maxOrder = st.maxOrder;
+        opt.stereo = st.stereo;
+        PcmCodec codec(st.block, opt);
+        size_t blocks = (frames + st.block - 1) / st.block;
+        std::vector<uint8_t> out(blocks * pcm_block_bound(st.block, channels));
+        std::vector<size_t> at(blocks + 1, 0);
+
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t b = 0; b < blocks; b++) {
+            int n = (int)std::min<size_t>(st.block, frames - b * st.block);
+            at[b + 1] = at[b] + codec.encode(&pcm[b * st.block * channels], n, channels, &out[at[b]]);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (size_t b = 0; b < blocks; b++) {
+            int n = (int)std::min<size_t>(st.block, frames - b * st.block);
+            if (!codec.decode(&out[at[b]], at[b + 1] - at[b], n, channels, &back[b * st.block * channels])) lossless = false;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        if (back != pcm) lossless = false;
+        const int reads = 1000;
+        for (int q = 0; q < reads; q++) {
+            size_t b = rng() % (blocks - 1);
+            codec.decode(&out[at[b]], at[b + 1] - at[b], st.block, channels, back.data());
+        }
+        auto t3 = std::chrono::steady_clock::now();
 
-    {
-        std::lock_guard<std::mutex> lk(renderMutex);
-        renderState.file = path;
-        renderState.curSec = 0.0;
-        renderState.totalSec = totalSec;
-        renderState.mode = visMode.load();
-        renderState.paused = false;
-        renderState.mono.assign(FFT_SIZE, 0);
-        renderState.magnitudes.clear();
+        double enc = std::chrono::duration<double>(t1 - t0).count(), dec = std::chrono::duration<double>(t2 - t1).count();
+        double ratio = (double)at[blocks] / (pcm.size() * sizeof(int16_t));
+        std::printf("bench-pcm: %5d  0-%d     %-5s  %5.1f%%  %6.2f  %6.0fx  %6.0fx  %7.1f us\n", st.block, st.maxOrder,
+                    st.stereo ? "yes" : "no", 100.0 * ratio, ratio * rate * channels * 2 * 60 / 1e6, seconds / std::max(enc, 1e-9),
+                    seconds / std::max(dec, 1e-9), std::chrono::duration<double, std::micro>(t3 - t2).count() / reads);
     }
-    renderDirty.store(true, std::memory_order_release);
-
-    unsigned char buffer[BUFFER_SIZE];
-    bool wasPaused = false;
-    double currentSec = 0.0;
-
-    while (!shouldQuit.load() && !stopTrack.load()) {
-        if (isPaused.load()) {
-            if (!wasPaused) { Pa_StopStream(stream); wasPaused = true; }
-            {
-                std::lock_guard<std::mutex> lk(renderMutex);
-                renderState.paused = true;
-            }
-            renderDirty.store(true, std::memory_order_release);
+    if (!lossless) {
+        std::printf("bench-pcm: decoded PCM differs from the input\n");
+        return 1;
+    }
+    return 0;
+}
 
-            std::unique_lock<std::mutex> lock(pauseMutex);
-            pauseCV.wait(lock, [] { return !isPaused.load() || shouldQuit.load() || stopTrack.load(); });
+static void on_resize(int) {
+    needResize.store(true);
+}
 
-            if (!isPaused.load() && Pa_IsStreamStopped(stream) == 1) Pa_StartStream(stream);
-            wasPaused = false;
+// SIGWINCH arrives in bursts while a terminal edge is dragged; the layout is
+// only reapplied once the size has been quiet for this long.
+#define RESIZE_DEBOUNCE_MS 60
 
-            {
-                std::lock_guard<std::mutex> lk(renderMutex);
-                renderState.paused = false;
-            }
-            renderDirty.store(true, std::memory_order_release);
+static void handle_sigint(int) {
+    shouldQuit.store(true);
+    playlistCV.notify_all();
+    commandCV.notify_all();
+}
 
-            if (shouldQuit.load() || stopTrack.load()) break;
-        }
+// --stress: a soak run. The UI loop takes its keys from a random driver
+// instead of the keyboard, the engine plays into the discard sink, and a
+// monitor thread samples the process until time is up. The run fails if
+// nothing was played, no command was applied or the output ran dry, if fds
+// or threads grow after warm-up, or if RSS keeps climbing after warm-up
+// faster than STRESS_RSS_MB_PER_HOUR. It is aborted if the UI loop or a
+// playing engine makes no progress for STRESS_STALL_SECONDS.
+#define STRESS_STALL_SECONDS 10
+#define STRESS_RSS_MB_PER_HOUR 4.0
+#define STRESS_RSS_NOISE_MB 2.0
+#define STRESS_FD_SLACK 4
+#define STRESS_THREAD_SLACK 4
+#define STRESS_MAX_QUEUE 20000
+#define STRESS_KEYS_PER_SEC 300
+
+struct StressSample {
+    double sec = 0.0;
+    long rssKb = 0;
+    int fds = 0;
+    int threads = 0;
+};
 
-        int cmdSec = seekCommand.exchange(0);
-        if (cmdSec != 0) {
-            off_t curPos = mpg123_tell(mh);
-            if (curPos < 0) curPos = 0;
+// Keys the driver sends and how often, relative to each other.
+static const struct { int key; int weight; } STRESS_KEYS[] = {
+    { KEY_LEFT, 12 }, { KEY_RIGHT, 12 }, { 'p', 8 }, { 's', 6 },
+    { KEY_UP, 10 }, { KEY_DOWN, 14 }, { '\n', 6 }, { 'v', 3 },
+    { '1', 3 }, { '2', 3 }, { '3', 3 }, { '4', 3 }, { 'f', 2 },
+    { 'o', 2 }, { '+', 1 }, { '-', 1 }, { 'a', 1 }, { 'x', 1 }, { 'b', 1 },
+};
 
-            off_t newPos = curPos + (off_t)cmdSec * (off_t)rate;
-            if (newPos < 0) newPos = 0;
-            if (length > 0 && newPos > length) newPos = length;
+struct StressRun {
+    long seconds = 0;
+    fs::path root;
+    std::vector<std::string> tracks;
+    std::mt19937 rng;
+    FILE* log = nullptr;
+    bool logLines = false;   // per-interval lines; off when they would land on the screen
+    int maxH = 0, maxW = 0;
+    std::chrono::steady_clock::time_point start, nextKey, nextEnqueue, nextResize;
+    std::atomic<unsigned long long> uiLoops{0};
+    std::atomic<unsigned long long> keys{0};
+    std::atomic<bool> done{false};
+    std::thread monitor;
+    // Owned by the monitor until it is joined.
+    std::vector<StressSample> samples;
+    unsigned long long hist[LATENCY_BUCKETS] = {};
+};
 
-            mpg123_seek(mh, newPos, SEEK_SET);
-        }
+static bool stressOn = false;
+static StressRun stress;
 
-        size_t done = 0;
-        int ret = mpg123_read(mh, buffer, BUFFER_SIZE, &done);
-        if (ret == MPG123_DONE || ret != MPG123_OK) break;
-        if (done == 0) continue;
+static void stress_sample(StressSample& s) {
+    s.sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - stress.start).count();
+    long pages = 0, resident = 0;
+    if (FILE* f = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        std::fclose(f);
+    }
+    s.rssKb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+    std::error_code ec;
+    s.fds = 0;
+    for (fs::directory_iterator it("/proc/self/fd", ec), end; !ec && it != end; it.increment(ec)) s.fds++;
+    s.threads = 0;
+    for (fs::directory_iterator it("/proc/self/task", ec), end; !ec && it != end; it.increment(ec)) s.threads++;
+}
 
-        int frames = (int)(done / (channels * (int)sizeof(int16_t)));
-        if (frames <= 0) continue;
+static long stress_percentile(const unsigned long long* hist, double q) {
+    unsigned long long total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) total += hist[b];
+    if (total == 0) return -1;
+    unsigned long long want = (unsigned long long)std::ceil(q * (double)total), seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want) return latency_bucket_floor(b);
+    }
+    return latency_bucket_floor(LATENCY_BUCKETS - 1);
+}
 
-        if (Pa_WriteStream(stream, buffer, frames) != paNoError) break;
+static const char* stress_us(long us, char* buf, size_t n) {
+    if (us < 0) std::snprintf(buf, n, "-");
+    else if (us < 1000) std::snprintf(buf, n, "%ldus", us);
+    else std::snprintf(buf, n, "%.1fms", us / 1000.0);
+    return buf;
+}
 
-        off_t curSamp = mpg123_tell(mh);
-        if (curSamp >= 0) currentSec = (double)curSamp / (double)rate;
+[[noreturn]] static void stress_stalled(const char* what) {
+    endwin();
+    std::fprintf(stress.log, "stress: FAIL: %s made no progress for %d s\n", what, STRESS_STALL_SECONDS);
+    std::fflush(stress.log);
+    std::_Exit(2);
+}
 
-        int16_t* samples = reinterpret_cast<int16_t*>(buffer);
-        int totalFramesInChunk = (int)(done / (channels * (int)sizeof(int16_t)));
+static int stress_interval() {
+    return clampi((int)(stress.seconds / 30), 1, 10);
+}
 
-        std::vector<int16_t> monoLocal(FFT_SIZE);
-        for (int i = 0; i < FFT_SIZE; i++) {
-            int src = (int)std::round((double)i / (double)(FFT_SIZE - 1) * (double)std::max(0, totalFramesInChunk - 1));
-            src = clampi(src, 0, std::max(0, totalFramesInChunk - 1));
-            monoLocal[i] = samples[src * channels];
+static void stress_monitor() {
+    using clock = std::chrono::steady_clock;
+    auto interval = std::chrono::seconds(stress_interval());
+    auto nextSample = clock::now() + interval;
+    auto lastUi = clock::now(), lastAudio = lastUi, quitAt = lastUi;
+    unsigned long long ui = stress.uiLoops.load(), frames = outputFrames.load();
+    bool quitting = false;
+    while (!stress.done.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        auto now = clock::now();
+        if (stress.uiLoops.load() != ui) {
+            ui = stress.uiLoops.load();
+            lastUi = now;
         }
-
-        VisualizationMode modeLocal = visMode.load();
-        std::vector<double> magsLocal;
-
-        if (modeLocal == SPECTRUM) {
-            for (int i = 0; i < FFT_SIZE; i++) fftIn[i] = (double)monoLocal[i] / 32768.0;
-            fftw_execute(fftPlan);
-
-            magsLocal.assign(FFT_SIZE / 2, 0.0);
-            for (int i = 0; i < FFT_SIZE / 2; i++) {
-                double re = fftOut[i][0], im = fftOut[i][1];
-                magsLocal[i] = std::sqrt(re * re + im * im);
-            }
+        if (outputFrames.load() != frames || !isPlaying.load() || isPaused.load()) {
+            frames = outputFrames.load();
+            lastAudio = now;
         }
-
-        {
-            std::lock_guard<std::mutex> lk(renderMutex);
-            renderState.file = path;
-            renderState.curSec = currentSec;
-            renderState.totalSec = totalSec;
-            renderState.mode = modeLocal;
-            renderState.paused = isPaused.load();
-            renderState.mono = std::move(monoLocal);
-            renderState.magnitudes = std::move(magsLocal);
+        auto stall = std::chrono::seconds(STRESS_STALL_SECONDS);
+        if (shouldQuit.load()) {
+            if (!quitting) quitAt = now;
+            quitting = true;
+            if (now - quitAt > stall) stress_stalled("shutdown");
+            continue;
+        }
+        if (now - lastUi > stall) stress_stalled("the UI loop");
+        if (now - lastAudio > stall) stress_stalled("the audio engine");
+        if (now < nextSample) continue;
+        nextSample += interval;
+
+        StressSample s;
+        stress_sample(s);
+        stress.samples.push_back(s);
+        unsigned long long hist[LATENCY_BUCKETS];
+        unsigned long long cmds = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            hist[b] = cmdLatencyHist[b].exchange(0, std::memory_order_relaxed);
+            stress.hist[b] += hist[b];
+            cmds += hist[b];
         }
-        renderDirty.store(true, std::memory_order_release);
+        if (!stress.logLines) continue;
+        char p50[16], p99[16];
+        std::fprintf(stress.log, "stress: %6.0f s  rss %7.1f MB  fds %3d  threads %3d  keys %8llu  cmds %6llu  p50 %7s  p99 %7s  xruns %u\n",
+                     s.sec, s.rssKb / 1024.0, s.fds, s.threads, stress.keys.load(), cmds,
+                     stress_us(stress_percentile(hist, 0.50), p50, sizeof(p50)),
+                     stress_us(stress_percentile(hist, 0.99), p99, sizeof(p99)), outputXruns.load());
     }
+}
 
-    fftw_destroy_plan(fftPlan);
-    fftw_free(fftIn);
-    fftw_free(fftOut);
-
-    Pa_StopStream(stream);
-    Pa_CloseStream(stream);
-    Pa_Terminate();
-
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
-
-    isPlaying.store(false);
-
+// Tops the playlist up with a few thousand random tracks.
+static void stress_enqueue() {
+    int n = std::uniform_int_distribution<int>(1000, 4000)(stress.rng);
     {
-        std::lock_guard<std::mutex> lk(renderMutex);
-        renderState.curSec = 0.0;
-        renderState.totalSec = 0.0;
-        renderState.paused = false;
-        renderState.mono.clear();
-        renderState.magnitudes.clear();
+        std::lock_guard<std::mutex> lk(playlistMutex);
+        if (playlist.size() >= STRESS_MAX_QUEUE) return;
+        for (int i = 0; i < n; i++) {
+            QueueItem q;
+            q.path = stress.tracks[stress.rng() % stress.tracks.size()];
+            playlist.push_back(q);
+        }
     }
-    renderDirty.store(true, std::memory_order_release);
+    playlistCV.notify_one();
+}
 
-    return true;
+// Stands in for getch(). A real 'q' still ends the run early.
+static int stress_key() {
+    int c = getch();
+    if (c == 'q' || c == 'Q') return c;
+    auto now = std::chrono::steady_clock::now();
+    if (now - stress.start >= std::chrono::seconds(stress.seconds)) {
+        handle_sigint(0);
+        return ERR;
+    }
+    if (now >= stress.nextEnqueue) {
+        stress_enqueue();
+        stress.nextEnqueue = now + std::chrono::milliseconds(std::uniform_int_distribution<int>(2000, 8000)(stress.rng));
+    }
+    if (now >= stress.nextResize) {
+        forcedRows = std::uniform_int_distribution<int>(12, stress.maxH)(stress.rng);
+        forcedCols = std::uniform_int_distribution<int>(30, stress.maxW)(stress.rng);
+        needResize.store(true);
+        stress.nextResize = now + std::chrono::milliseconds(std::uniform_int_distribution<int>(100, 2000)(stress.rng));
+    }
+    // Keys arrive at random like a Poisson process, so they bunch into
+    // bursts now and then.
+    if (now < stress.nextKey) {
+        std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(stress.nextKey - now, std::chrono::milliseconds(2)));
+        return ERR;
+    }
+    double gap = std::exponential_distribution<double>(STRESS_KEYS_PER_SEC)(stress.rng);
+    stress.nextKey = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(gap));
+    int total = 0;
+    for (auto& k : STRESS_KEYS) total += k.weight;
+    int r = (int)(stress.rng() % (unsigned)total);
+    stress.keys.fetch_add(1, std::memory_order_relaxed);
+    for (auto& k : STRESS_KEYS) {
+        if (r < k.weight) return k.key;
+        r -= k.weight;
+    }
+    return ERR;
 }
 
-static void audio_thread() {
-    while (!shouldQuit.load()) {
-        std::string nextPath;
-        {
-            std::unique_lock<std::mutex> lock(playlistMutex);
-            playlistCV.wait(lock, [] { return shouldQuit.load() || !playlist.empty(); });
-            if (shouldQuit.load()) break;
-            if (!playlist.empty()) {
-                nextPath = playlist.front();
-                playlist.pop_front();
-            } else {
-                continue;
-            }
-        }
+// Before the UI starts: finds the tracks and keeps a handle on stderr,
+// which audio warm-up sends to /dev/null.
+static bool stress_begin(long seconds) {
+    stress.seconds = seconds;
+    stress.root = fs::current_path();
+    stress.tracks = library_mp3s(stress.root, CancelToken());
+    if (stress.tracks.empty()) {
+        std::cerr << "Error: --stress found no MP3s under " << stress.root.string() << "\n";
+        return false;
+    }
+    int fd = ::dup(STDERR_FILENO);
+    stress.log = fd >= 0 ? ::fdopen(fd, "w") : nullptr;
+    if (!stress.log) return false;
+    std::setvbuf(stress.log, nullptr, _IOLBF, 0);
+    unsigned seed = std::random_device()();
+    stress.rng.seed(seed);
+    std::fprintf(stress.log, "stress: %zu tracks under %s for %ld s, seed %u\n", stress.tracks.size(), stress.root.c_str(), seconds, seed);
+    discardOutput = true;
+    stressOn = true;
+    return true;
+}
 
-        stopTrack.store(false);
-        play_file(nextPath);
+// Once the screen is up: resizes stay within the real terminal, and the
+// UI loop polls often enough to keep up with the key rate.
+static void stress_start(bool headless) {
+    stress.logLines = headless || !::isatty(::fileno(stress.log));
+    query_terminal_size(stress.maxH, stress.maxW);
+    if (headless) {
+        stress.maxH = 60;
+        stress.maxW = 200;
+    }
+    stress.maxH = std::max(stress.maxH, 12);
+    stress.maxW = std::max(stress.maxW, 30);
+    timeout(2);
+    stress.start = std::chrono::steady_clock::now();
+    stress.nextKey = stress.nextEnqueue = stress.nextResize = stress.start;
+    stress.monitor = std::thread(stress_monitor);
+}
 
-        if (shouldQuit.load()) break;
+// Least-squares slope of RSS against time over the samples from `from` on,
+// in MB per hour.
+static double stress_rss_slope(size_t from) {
+    double n = 0.0, mx = 0.0, my = 0.0, cxy = 0.0, cxx = 0.0;
+    for (size_t i = from; i < stress.samples.size(); i++) {
+        double x = stress.samples[i].sec / 3600.0, y = stress.samples[i].rssKb / 1024.0;
+        n += 1.0;
+        double dx = x - mx;
+        mx += dx / n;
+        my += (y - my) / n;
+        cxy += dx * (y - my);
+        cxx += dx * (x - mx);
     }
-    isPlaying.store(false);
+    return cxx > 0.0 ? cxy / cxx : 0.0;
 }
 
-static void on_resize(int) {
-    needResize.store(true);
+// Once the monitor is joined and the screen is closed: checks that the
+// engine did its work, then judges growth over the samples taken after
+// warm-up. RSS is judged by its trend rather than its last value, so a
+// slow leak still shows over a long soak and one late allocation spike
+// does not fail a short one.
+static int stress_finish() {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) stress.hist[b] += cmdLatencyHist[b].exchange(0);
+    unsigned long long cmds = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) cmds += stress.hist[b];
+    unsigned long long frames = outputFrames.load();
+    unsigned coalesced = commandsCoalesced.load(), xruns = outputXruns.load();
+    char p50[16], p99[16], p999[16], mx[16];
+    std::fprintf(stress.log, "stress: %llu keys, %llu engine commands (%u sent while the queue was full), %llu frames played, %u xruns\n",
+                 stress.keys.load(), cmds, coalesced, frames, xruns);
+    std::fprintf(stress.log, "stress: command latency p50 %s  p99 %s  p99.9 %s  max %s\n",
+                 stress_us(stress_percentile(stress.hist, 0.50), p50, sizeof(p50)),
+                 stress_us(stress_percentile(stress.hist, 0.99), p99, sizeof(p99)),
+                 stress_us(stress_percentile(stress.hist, 0.999), p999, sizeof(p999)),
+                 stress_us(cmds ? cmdLatencyMaxUs.load() : -1, mx, sizeof(mx)));
+
+    int rc = 0;
+    if (frames == 0) {
+        std::fprintf(stress.log, "stress: FAIL: no audio was played\n");
+        rc = 1;
+    }
+    if (cmds == 0) {
+        std::fprintf(stress.log, "stress: FAIL: the engine applied no commands\n");
+        rc = 1;
+    }
+    if (xruns) {
+        std::fprintf(stress.log, "stress: FAIL: %u xruns\n", xruns);
+        rc = 1;
+    }
+
+    double warm = std::max((double)stress_interval(), stress.seconds / 10.0);
+    size_t from = 0;
+    while (from < stress.samples.size() && stress.samples[from].sec < warm) from++;
+    if (stress.samples.size() - from < 3) {
+        std::fprintf(stress.log, "stress: FAIL: run too short to judge growth\n");
+        return 1;
+    }
+    const StressSample& base = stress.samples[from];
+    const StressSample& last = stress.samples.back();
+    double slope = stress_rss_slope(from), hours = (last.sec - base.sec) / 3600.0;
+    std::fprintf(stress.log, "stress: from %.0f s to %.0f s: rss %.1f -> %.1f MB (%+.1f MB/h), fds %d -> %d, threads %d -> %d\n",
+                 base.sec, last.sec, base.rssKb / 1024.0, last.rssKb / 1024.0, slope, base.fds, last.fds, base.threads,
+                 last.threads);
+    if (slope > STRESS_RSS_MB_PER_HOUR && slope * hours > STRESS_RSS_NOISE_MB) {
+        std::fprintf(stress.log, "stress: FAIL: rss grows by %.1f MB an hour\n", slope);
+        rc = 1;
+    }
+    if (last.fds - base.fds > STRESS_FD_SLACK) {
+        std::fprintf(stress.log, "stress: FAIL: %d more open fds\n", last.fds - base.fds);
+        rc = 1;
+    }
+    if (last.threads - base.threads > STRESS_THREAD_SLACK) {
+        std::fprintf(stress.log, "stress: FAIL: %d more threads\n", last.threads - base.threads);
+        rc = 1;
+    }
+    if (rc == 0) std::fprintf(stress.log, "stress: PASS\n");
+    return rc;
 }
 
-static void handle_sigint(int) {
-    shouldQuit.store(true);
-    playlistCV.notify_all();
-    pauseCV.notify_all();
+static void print_usage(const char* argv0) {
+    std::fprintf(stderr, "usage: %s [--layout=auto|SPEC] [--fft=fftw|fixed] [--tap[=NAME]] [--tap-dump[=NAME]]\n"
+                         "       [--check-alloc[=MP3]] [--check-index] [--check-jpeg] [--bench-analysis]\n"
+                         "       [--bench-pcm[=MP3]] [--bench-radio[=N]] [--find-dupes[=DIR]] [--export=flac|wav]\n"
+                         "       [--stress[=SECONDS]] [--sync-lead[=PORT]] [--sync-follow=HOST[:PORT]]\n"
+                         "       [--sync-test[=SECONDS]]\n", argv0);
 }
 
-int main() {
+int main(int argc, char** argv) {
+    bool checkAlloc = false;
+    bool checkIndex = false;
+    bool checkJpeg = false;
+    bool benchAnalysis = false;
+    size_t radioBench = 0;
+    std::string tapName, tapDumpName, dupesDir, pcmBenchFile, allocCheckFile;
+    bool benchPcm = false;
+    long stressSeconds = 0;
+    int exportFormat = -1;
+    int syncPort = 0;
+    std::string syncTarget;
+    long syncTestSeconds = 0;
+    if (const char* envLayout = std::getenv("TERMINALWAVE_LAYOUT")) layoutSpec = envLayout;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--check-alloc" || arg.compare(0, 14, "--check-alloc=") == 0) {
+            checkAlloc = true;
+            if (arg.size() > 14) allocCheckFile = arg.substr(14);
+        } else if (arg == "--check-index") {
+            checkIndex = true;
+        } else if (arg == "--check-jpeg") {
+            checkJpeg = true;
+        } else if (arg == "--bench-analysis") {
+            benchAnalysis = true;
+        } else if (arg == "--bench-pcm" || arg.compare(0, 12, "--bench-pcm=") == 0) {
+            benchPcm = true;
+            if (arg.size() > 12) pcmBenchFile = arg.substr(12);
+        } else if (arg == "--bench-radio" || arg.compare(0, 14, "--bench-radio=") == 0) {
+            radioBench = arg.size() > 14 ? std::strtoul(arg.c_str() + 14, nullptr, 10) : 500000;
+            if (radioBench < 100) {
+                std::cerr << "Error: --bench-radio needs at least 100 tracks\n";
+                return 1;
+            }
+        } else if (arg == "--find-dupes" || arg.compare(0, 13, "--find-dupes=") == 0) {
+            dupesDir = arg.size() > 13 ? arg.substr(13) : ".";
+        } else if (arg == "--export=flac") {
+            exportFormat = EXPORT_FLAC;
+        } else if (arg == "--export=wav") {
+            exportFormat = EXPORT_WAV;
+        } else if (arg == "--stress" || arg.compare(0, 9, "--stress=") == 0) {
+            stressSeconds = arg.size() > 9 ? std::strtol(arg.c_str() + 9, nullptr, 10) : 3600;
+            if (stressSeconds < 10) {
+                std::cerr << "Error: --stress needs at least 10 seconds\n";
+                return 1;
+            }
+        } else if (arg == "--sync-lead" || arg.compare(0, 12, "--sync-lead=") == 0) {
+            syncPort = arg.size() > 12 ? std::atoi(arg.c_str() + 12) : SYNC_PORT;
+            if (syncPort <= 0 || syncPort > 65535) {
+                std::cerr << "Error: bad --sync-lead port\n";
+                return 1;
+            }
+        } else if (arg.compare(0, 14, "--sync-follow=") == 0 && arg.size() > 14) {
+            syncTarget = arg.substr(14);
+        } else if (arg == "--sync-test" || arg.compare(0, 12, "--sync-test=") == 0) {
+            syncTestSeconds = arg.size() > 12 ? std::strtol(arg.c_str() + 12, nullptr, 10) : 30;
+            if (syncTestSeconds < 10) {
+                std::cerr << "Error: --sync-test needs at least 10 seconds\n";
+                return 1;
+            }
+        } else if (arg == "--tap" || arg.compare(0, 6, "--tap=") == 0) {
+            tapName = arg.size() > 6 ? arg.substr(6) : TAP_DEFAULT_NAME;
+        } else if (arg == "--tap-dump" || arg.compare(0, 11, "--tap-dump=") == 0) {
+            tapDumpName = arg.size() > 11 ? arg.substr(11) : TAP_DEFAULT_NAME;
+        } else if (arg.compare(0, 9, "--layout=") == 0) {
+            layoutSpec = arg.substr(9);
+            LayoutNode probe;
+            std::string err;
+            if (layoutSpec != "auto" && !parse_layout(layoutSpec, probe, err)) {
+                std::cerr << "Error: bad --layout: " << err << "\n";
+                return 1;
+            }
+        } else if (arg == "--fft=fixed") {
+            spectrumBackend.store(BACKEND_FIXED);
+        } else if (arg == "--fft=fftw") {
+            if (!TW_HAVE_FFTW) {
+                std::cerr << "Error: built without FFTW.\n";
+                return 1;
+            }
+            spectrumBackend.store(BACKEND_FFTW);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (checkIndex) return run_index_check();
+    if (checkJpeg) return run_jpeg_check();
+    if (benchPcm) return run_pcm_bench(pcmBenchFile);
+    if (radioBench) return run_radio_bench(radioBench);
+    if (!dupesDir.empty()) return run_find_dupes(dupesDir);
+    if (exportFormat >= 0) return run_export((ExportFormat)exportFormat);
+    if (syncTestSeconds) return run_sync_test(syncTestSeconds);
+    if (!syncTarget.empty()) {
+        std::signal(SIGINT, handle_sigint);
+        return run_sync_follow(syncTarget);
+    }
+    if (!tapDumpName.empty()) {
+        std::signal(SIGINT, handle_sigint);
+        return run_tap_dump(tapDumpName[0] == '/' ? tapDumpName : "/" + tapDumpName);
+    }
+    if (!tapName.empty()) {
+        std::string err;
+        if (!tap_open(tapName[0] == '/' ? tapName : "/" + tapName, err)) {
+            std::cerr << "Error: cannot open --tap: " << err << "\n";
+            return 1;
+        }
+    }
+    if (checkAlloc && allocCheckFile.empty()) {
+        std::vector<std::string> found = library_mp3s(fs::current_path(), CancelToken());
+        if (found.empty()) {
+            std::cerr << "Error: --check-alloc found no MP3s under " << fs::current_path().string() << "\n";
+            return 1;
+        }
+        allocCheckFile = found.front();
+    }
+    if (checkAlloc || benchAnalysis) {
+        int rc = checkAlloc ? run_alloc_check(allocCheckFile) : run_analysis_bench();
+        tap_close();
+        return rc;
+    }
+
+    if (stressSeconds > 0 && !stress_begin(stressSeconds)) return 1;
+    if (syncPort) {
+        std::string err;
+        int fd = sync_bind(nullptr, syncPort, err);
+        if (fd < 0) {
+            std::cerr << "Error: cannot listen on port " << syncPort << ": " << err << "\n";
+            return 1;
+        }
+        sync_lead_start(fd);
+    }
+    bool headless = stressOn && !::isatty(STDOUT_FILENO);
+
     std::signal(SIGWINCH, on_resize);
     std::signal(SIGINT, handle_sigint);
 
-    init_tui();
+    init_tui(headless);
+    if (stressOn) stress_start(headless);
+
+    std::thread warmUp(audio_warm_up);
+
+    unsigned hw = std::max(2u, std::thread::hardware_concurrency());
+    workerPool.start(clampi((int)hw / 4, 1, 4), hw);
+    trackFeatures.on_ready(radio_add);
 
     const char* homeEnv = std::getenv("HOME");
-    fs::path currentDir = homeEnv ? fs::path(homeEnv) : fs::current_path();
-    auto dirList = list_directory(currentDir);
+    fs::path currentDir = stressOn ? stress.root : homeEnv ? fs::path(homeEnv) : fs::current_path();
+    std::vector<BrowserEntry> dirList;
+    std::string currentDirStr = currentDir.string();
+    unsigned listGen = 1;
+    bool listing = true;
+    request_listing(currentDir);
 
     int highlight = 0;
     bool redrawNav = true;
@@ -867,49 +9316,181 @@ int main() {
     std::thread at(audio_thread);
 
     auto lastRender = std::chrono::steady_clock::now();
+    auto lastResizeSignal = lastRender;
+    bool resizePending = false;
+    RenderState snap;
+    int hoverItem = -1;
+    unsigned hoverGen = 0;
+    auto hoverSince = lastRender;
+    bool hoverArmed = false;
+    std::string previewPath;
+    unsigned seenOverviewGen = 0;
+    unsigned seenBeatGen = 0;
 
     while (!shouldQuit.load()) {
-        if (needResize.load()) {
-            needResize.store(false);
-            handle_resize();
+        unsigned long long frameAllocStart = threadAllocCount;
+        if (stressOn) stress.uiLoops.fetch_add(1, std::memory_order_relaxed);
+
+        if (needResize.exchange(false)) {
+            resizePending = true;
+            lastResizeSignal = std::chrono::steady_clock::now();
+        }
+        if (resizePending && std::chrono::steady_clock::now() - lastResizeSignal >= std::chrono::milliseconds(RESIZE_DEBOUNCE_MS)) {
+            resizePending = false;
+            if (apply_layout()) {
+                redrawNav = true;
+                renderDirty.store(true);
+            }
+        }
+
+        if (!navWin || !infoWin || visPanes.empty() || !statusWin) continue;
+
+        if (listing && take_listing(dirList)) {
+            listing = false;
+            listGen++;
+            redrawNav = true;
+            std::vector<std::string> mp3s;
+            for (auto& e : dirList) if (is_mp3_entry(e)) mp3s.push_back(e.path().string());
+            overviews.want(mp3s, false);
+            if (browserByBpm) {
+                beatTracks.want(mp3s, false);
+                sort_listing(dirList);
+            }
+        }
+        if (beatTracks.generation() != seenBeatGen) {
+            seenBeatGen = beatTracks.generation();
+            if (browserByBpm && !listing) {
+                resort_keeping_highlight(dirList, highlight);
+                listGen++;
+            }
             redrawNav = true;
         }
+        if (overviews.generation() != seenOverviewGen) {
+            seenOverviewGen = overviews.generation();
+            redrawNav = true;
+        }
+
+        if (!picker.open && !dupeView.open && !exportView.open && open_dupe_view()) statusCache.valid = false;
+        if (dupeView.open) {
+            draw_dupe_view();
+            draw_status_bar(currentDirStr, listGen);
+            int c = stressOn ? stress_key() : getch();
+            int last = std::max(0, (int)dupeView.lines.size() - dupe_view_rows());
+            if (c == KEY_UP && dupeView.top > 0) dupeView.top--;
+            else if (c == KEY_DOWN && dupeView.top < last) dupeView.top++;
+            else if (c == KEY_PPAGE) dupeView.top = std::max(0, dupeView.top - dupe_view_rows());
+            else if (c == KEY_NPAGE) dupeView.top = std::min(last, dupeView.top + dupe_view_rows());
+            else if (c == 'd' || c == 'D' || c == 27 || c == '\n') {
+                close_dupe_view();
+                paint_frames();
+                redrawNav = true;
+                renderDirty.store(true);
+            }
+            continue;
+        }
+
+        if (exportView.open) {
+            draw_export_view();
+            draw_status_bar(currentDirStr, listGen);
+            int c = stressOn ? stress_key() : getch();
+            bool running;
+            {
+                std::lock_guard<std::mutex> lk(exportRun.m);
+                running = exportRun.running;
+                if (running && c == '\n') exportRun.token.cancel();
+            }
+            if (!running && (c == KEY_UP || c == KEY_DOWN || c == KEY_LEFT || c == KEY_RIGHT)) {
+                exportView.format = exportView.format == EXPORT_FLAC ? EXPORT_WAV : EXPORT_FLAC;
+            } else if (!running && c == '\n') {
+                start_export(exportView.items, exportView.format, hw);
+            } else if (c == 'e' || c == 'E' || c == 27) {
+                close_export_view();
+                paint_frames();
+                redrawNav = true;
+                renderDirty.store(true);
+            }
+            continue;
+        }
+
+        if (picker.open) {
+            draw_device_picker();
+            draw_status_bar(currentDirStr, listGen);
+            int c = stressOn ? stress_key() : getch();
+            if (c == KEY_UP && picker.sel > 0) picker.sel--;
+            else if (c == KEY_DOWN && picker.sel + 1 < (int)picker.list.size()) picker.sel++;
+            else if (c == '\n' || c == 'o' || c == 'O' || c == 27) {
+                if (c == '\n' && !picker.list.empty()) send_command(CMD_SET_DEVICE, picker.list[picker.sel].index);
+                close_device_picker();
+                paint_frames();
+                redrawNav = true;
+                renderDirty.store(true);
+            }
+            continue;
+        }
 
-        if (!navWin || !infoWin || !waveWin || !statusWin) continue;
+        // Prime a preview decoder for the file under a cursor that has
+        // stopped moving.
+        if (highlight != hoverItem || listGen != hoverGen) {
+            hoverItem = highlight;
+            hoverGen = listGen;
+            hoverSince = std::chrono::steady_clock::now();
+            hoverArmed = true;
+        } else if (hoverArmed && std::chrono::steady_clock::now() - hoverSince >= std::chrono::milliseconds(PREVIEW_DWELL_MS)) {
+            hoverArmed = false;
+            std::string p;
+            if (preview_target(dirList, highlight, p)) prepare_preview(p, false);
+        }
 
         if (redrawNav) {
-            draw_navigation(currentDir, dirList, highlight);
+            draw_navigation(currentDirStr, dirList, listGen, highlight, listing);
             redrawNav = false;
         }
 
+        if (take_art()) renderDirty.store(true);
+
         bool shouldRenderNow = false;
         if (renderDirty.exchange(false, std::memory_order_acq_rel)) {
             shouldRenderNow = true;
         } else {
             auto now = std::chrono::steady_clock::now();
             auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastRender).count();
-            if (isPlaying.load() && ms >= 50) shouldRenderNow = true;
+            if ((isPlaying.load() || previewActive.load()) && ms >= 50) shouldRenderNow = true;
         }
 
         if (shouldRenderNow) {
-            RenderState snap;
             {
                 std::lock_guard<std::mutex> lk(renderMutex);
                 snap = renderState;
             }
-            draw_info(snap.file, snap.curSec, snap.totalSec, snap.mode, snap.paused);
-            draw_visualization(snap.mono, snap.magnitudes, snap.mode);
+            int artW, artH;
+            art_box(artW, artH);
+            if (snap.file != artView.path || artW != artView.boxW || artH != artView.boxH) {
+                artView.path = snap.file;
+                artView.boxW = artW;
+                artView.boxH = artH;
+                artView.pairs.clear();
+                if (!snap.file.empty() && artW > 0) request_art(snap.file, artW, artH);
+            }
+            draw_info(snap.file, snap.title, snap.curSec, snap.totalSec, snap.mode, snap.paused, snap.device, snap.beat, snap.meters);
+            for (auto& p : visPanes) draw_visualization(p, snap);
             lastRender = std::chrono::steady_clock::now();
         }
 
-        draw_status_bar(currentDir);
+        draw_status_bar(currentDirStr, listGen);
+        if (firstFrameMs.load() < 0) {
+            firstFrameMs.store((long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - processStart).count());
+            renderDirty.store(true);
+        }
+        uiFrameAllocs.store(threadAllocCount - frameAllocStart, std::memory_order_relaxed);
 
-        int c = getch();
+        int c = stressOn ? stress_key() : getch();
+        // The driver stays inside the directory it was started in.
+        if (stressOn && c == '\n' && highlight == 0 && currentDir == stress.root) c = ERR;
         if (c == ERR) {
         } else if (c == 'q' || c == 'Q') {
             shouldQuit.store(true);
             playlistCV.notify_all();
-            pauseCV.notify_all();
+            commandCV.notify_all();
             break;
         } else if (c == KEY_UP) {
             if (highlight > 0) { highlight--; redrawNav = true; }
@@ -917,24 +9498,80 @@ int main() {
             int totalItems = (int)dirList.size() + 1;
             if (highlight < totalItems - 1) { highlight++; redrawNav = true; }
         } else if (c == KEY_LEFT) {
-            seekCommand.store(-5);
+            if (isPlaying.load()) send_command(CMD_SEEK, -5);
         } else if (c == KEY_RIGHT) {
-            seekCommand.store(5);
+            if (isPlaying.load()) send_command(CMD_SEEK, 5);
         } else if (c == 'p' || c == 'P') {
-            bool newPaused = !isPaused.load();
-            isPaused.store(newPaused);
-            if (!newPaused) pauseCV.notify_one();
-        } else if (c == '1') {
-            visMode.store(WAVEFORM);
+            if (isPlaying.load()) send_command(CMD_TOGGLE_PAUSE);
+        } else if (c >= '1' && c <= '4') {
+            visMode.store((VisualizationMode)(c - '0'));
+            update_spectrum_wanted();
             renderDirty.store(true);
-        } else if (c == '2') {
-            visMode.store(SPECTRUM);
+        } else if (c == 'o' || c == 'O') {
+            open_device_picker();
+        } else if (c == 'd' || c == 'D') {
+            start_dupe_scan(currentDir);
+        } else if (c == 'e' || c == 'E') {
+            open_export_view(dirList);
+        } else if (c == 'r' || c == 'R') {
+            // Radio indexes the tree below the browsed directory. Started
+            // while idle, it plays the MP3 under the cursor first.
+            bool on = !radioOn.load();
+            radioOn.store(on);
+            if (!on) {
+                trackFeatures.drop_queued();
+            } else {
+                radio_scan(currentDir);
+                std::string first;
+                if (!isPlaying.load() && preview_target(dirList, highlight, first)) {
+                    std::lock_guard<std::mutex> lk(playlistMutex);
+                    if (playlist.empty()) {
+                        QueueItem q;
+                        q.path = first;
+                        playlist.push_back(q);
+                        playlistCV.notify_one();
+                    }
+                }
+            }
+        } else if (c == 'b' || c == 'B') {
+            browserByBpm = !browserByBpm;
+            if (browserByBpm) {
+                std::vector<std::string> mp3s;
+                for (auto& e : dirList) if (is_mp3_entry(e)) mp3s.push_back(e.path().string());
+                beatTracks.want(mp3s, false);
+            }
+            resort_keeping_highlight(dirList, highlight);
+            listGen++;
+            redrawNav = true;
+        } else if (c == 'v' || c == 'V') {
+            std::string p;
+            bool onFile = preview_target(dirList, highlight, p);
+            if (previewActive.load() && (!onFile || p == previewPath)) {
+                send_command(CMD_STOP_PREVIEW);
+            } else if (onFile) {
+                previewPath = p;
+                previewRequestNs.store(steady_ns());
+                prepare_preview(p, true);
+            }
+        } else if (c == '+' || c == '=' || c == '-') {
+            int db = volumeDb.load() + (c == '-' ? -VOLUME_STEP_DB : VOLUME_STEP_DB);
+            volumeDb.store(clampi(db, VOLUME_MIN_DB, 0));
             renderDirty.store(true);
+        } else if (c == 'f' || c == 'F') {
+            if (TW_HAVE_FFTW) {
+                spectrumBackend.store(spectrumBackend.load() == BACKEND_FFTW ? BACKEND_FIXED : BACKEND_FFTW);
+                renderDirty.store(true);
+            }
         } else if (c == '\n') {
             if (highlight == 0) {
                 if (currentDir.has_parent_path()) {
                     currentDir = currentDir.parent_path();
-                    dirList = list_directory(currentDir);
+                    dirList.clear();
+                    currentDirStr = currentDir.string();
+                    listGen++;
+                    listing = true;
+                    overviews.drop_queued();
+                    request_listing(currentDir);
                     highlight = 0;
                     listOffset = 0;
                     redrawNav = true;
@@ -942,59 +9579,89 @@ int main() {
             } else {
                 int realIndex = highlight - 1;
                 if (realIndex >= 0 && realIndex < (int)dirList.size()) {
-                    fs::directory_entry sel = dirList[realIndex];
+                    const BrowserEntry sel = dirList[realIndex];
                     if (sel.is_directory()) {
                         currentDir = sel.path();
-                        dirList = list_directory(currentDir);
+                        dirList.clear();
+                        currentDirStr = currentDir.string();
+                        listGen++;
+                        listing = true;
+                        overviews.drop_queued();
+                        request_listing(currentDir);
                         highlight = 0;
                         listOffset = 0;
                         redrawNav = true;
-                    } else {
-                        std::string ext = sel.path().extension().string();
-                        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                        if (ext == ".mp3") {
-                            {
-                                std::lock_guard<std::mutex> lk(playlistMutex);
-                                playlist.clear();
-                                playlist.push_back(sel.path().string());
+                    } else if (is_mp3_entry(sel) || sel.is_cut()) {
+                        // A virtual track plays on through the rest of its file.
+                        unsigned current;
+                        {
+                            std::lock_guard<std::mutex> lk(playlistMutex);
+                            current = engineTrack.load();
+                            playlist.clear();
+                            playlistEpoch++;
+                            playlist.push_back(queue_item(sel));
+                            for (int i = realIndex + 1; sel.is_cut() && i < (int)dirList.size(); i++) {
+                                if (!dirList[i].is_cut() || dirList[i].path() != sel.path()) break;
+                                playlist.push_back(queue_item(dirList[i]));
                             }
-                            stopTrack.store(true);
-                            isPaused.store(false);
-                            pauseCV.notify_all();
-                            playlistCV.notify_one();
                         }
+                        playRequestNs.store(steady_ns());
+                        send_command(CMD_STOP, 0, current);
+                        playlistCV.notify_one();
                     }
                 }
             }
         } else if (c == 'a' || c == 'A') {
             {
+                std::vector<QueueItem> items = folder_items(dirList);
                 std::lock_guard<std::mutex> lk(playlistMutex);
-                for (auto& e : dirList) {
-                    if (!e.is_directory()) {
-                        std::string ex = e.path().extension().string();
-                        std::transform(ex.begin(), ex.end(), ex.begin(), ::tolower);
-                        if (ex == ".mp3") playlist.push_back(e.path().string());
-                    }
-                }
+                playlist.insert(playlist.end(), items.begin(), items.end());
             }
             playlistCV.notify_one();
             redrawNav = true;
         } else if (c == 's' || c == 'S') {
-            stopTrack.store(true);
-            isPaused.store(false);
-            pauseCV.notify_all();
+            send_command(CMD_STOP);
         } else if (c == 'x' || c == 'X') {
+            unsigned current;
             {
                 std::lock_guard<std::mutex> lk(playlistMutex);
+                current = engineTrack.load();
                 playlist.clear();
+                playlistEpoch++;
             }
-            stopTrack.store(true);
-            isPaused.store(false);
-            pauseCV.notify_all();
+            send_command(CMD_STOP, 0, current);
         }
     }
 
     if (at.joinable()) at.join();
+    if (warmUp.joinable()) warmUp.join();
+    sync_lead_stop();
+    dupeScan.token.cancel();
+    {
+        std::lock_guard<std::mutex> lk(exportRun.m);
+        exportRun.token.cancel();
+    }
+    radioLib.token.cancel();
+    artSlot.token.cancel();
+    overviews.shutdown();
+    beatTracks.shutdown();
+    fingerprints.shutdown();
+    trackFeatures.shutdown();
+    workerPool.stop();
+    delete previewIncoming.exchange(nullptr);
+    previewSlot.voice.reset();
+    audio_shutdown();
+    tap_close();
+    close_device_picker();
+    close_dupe_view();
+    close_export_view();
+    if (stressOn) {
+        // Joined before endwin so a stalled shutdown is still caught.
+        stress.done.store(true);
+        if (stress.monitor.joinable()) stress.monitor.join();
+        close_tui();
+        return stress_finish();
+    }
     close_tui();
     return 0;
 }